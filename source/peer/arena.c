@@ -0,0 +1,153 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+struct peer_arena_block {
+  peer_arena_block_t *next;
+  ptrdiff_t           size;
+  ptrdiff_t           capacity;
+};
+
+enum { ARENA_ALIGN = 16 };
+
+static ptrdiff_t align_size(ptrdiff_t const size) {
+  return (size + (ARENA_ALIGN - 1)) & ~(ptrdiff_t) (ARENA_ALIGN - 1);
+}
+
+static ptrdiff_t header_size(void) {
+  return align_size((ptrdiff_t) sizeof(peer_arena_block_t));
+}
+
+static uint8_t *block_data(peer_arena_block_t *const block) {
+  return ((uint8_t *) block) + header_size();
+}
+
+static peer_arena_block_t *block_create(
+    peer_arena_t *const arena, ptrdiff_t const capacity) {
+  if (arena->alloc.allocate == NULL)
+    return NULL;
+
+  peer_arena_block_t *const block = (peer_arena_block_t *)
+      arena->alloc.allocate(arena->alloc.state,
+                            header_size() + capacity);
+
+  if (block == NULL)
+    return NULL;
+
+  block->next     = arena->blocks;
+  block->size     = 0;
+  block->capacity = capacity;
+  arena->blocks   = block;
+
+  return block;
+}
+
+static void blocks_destroy(peer_arena_t *const arena) {
+  while (arena->blocks != NULL) {
+    peer_arena_block_t *const next = arena->blocks->next;
+    if (arena->alloc.deallocate != NULL)
+      arena->alloc.deallocate(arena->alloc.state, arena->blocks);
+    arena->blocks = next;
+  }
+}
+
+static void *arena_allocate(void *const state, ptrdiff_t const size) {
+  peer_arena_t *const arena = (peer_arena_t *) state;
+
+  assert(arena != NULL);
+  assert(size >= 0);
+
+  if (arena == NULL || size < 0)
+    return NULL;
+
+  ptrdiff_t const     aligned = align_size(size);
+  peer_arena_block_t *block   = arena->blocks;
+
+  if (block == NULL || block->capacity - block->size < aligned) {
+    ptrdiff_t capacity = PEER_ARENA_BLOCK_SIZE;
+    if (capacity < aligned)
+      capacity = aligned;
+
+    block = block_create(arena, capacity);
+    if (block == NULL)
+      return NULL;
+  }
+
+  void *const p = block_data(block) + block->size;
+  block->size += aligned;
+
+  arena->used += aligned;
+  if (arena->peak < arena->used)
+    arena->peak = arena->used;
+
+  return p;
+}
+
+static void arena_deallocate(void *const state, void *const pointer) {
+  /*  Memory is released on reset.
+   */
+  (void) state;
+  (void) pointer;
+}
+
+void peer_arena_init(peer_arena_t *const  arena,
+                     kit_allocator_t const alloc) {
+  assert(arena != NULL);
+
+  if (arena == NULL)
+    return;
+
+  arena->alloc  = alloc;
+  arena->blocks = NULL;
+  arena->used   = 0;
+  arena->peak   = 0;
+}
+
+void peer_arena_reset(peer_arena_t *const arena) {
+  assert(arena != NULL);
+
+  if (arena == NULL)
+    return;
+
+  arena->used = 0;
+
+  if (arena->blocks == NULL)
+    return;
+
+  if (arena->blocks->next == NULL) {
+    arena->blocks->size = 0;
+    return;
+  }
+
+  /*  Coalesce all blocks into one.
+   */
+
+  blocks_destroy(arena);
+
+  ptrdiff_t const capacity = (arena->peak +
+                              (PEER_ARENA_BLOCK_SIZE - 1)) /
+                             PEER_ARENA_BLOCK_SIZE *
+                             PEER_ARENA_BLOCK_SIZE;
+
+  (void) block_create(arena, capacity);
+}
+
+void peer_arena_destroy(peer_arena_t *const arena) {
+  assert(arena != NULL);
+
+  if (arena == NULL)
+    return;
+
+  blocks_destroy(arena);
+
+  arena->used = 0;
+  arena->peak = 0;
+}
+
+kit_allocator_t peer_arena_allocator(peer_arena_t *const arena) {
+  kit_allocator_t const alloc = { .state      = arena,
+                                  .allocate   = arena_allocate,
+                                  .deallocate = arena_deallocate };
+  return alloc;
+}
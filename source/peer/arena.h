@@ -0,0 +1,42 @@
+#ifndef PEER_ARENA_H
+#define PEER_ARENA_H
+
+#include <kit/allocator.h>
+#include <kit/status.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum { PEER_ARENA_BLOCK_SIZE = 4096 };
+
+typedef struct peer_arena_block peer_arena_block_t;
+
+/*  Bump allocator for memory that lives until the next reset.
+ *  Deallocation is a no-op. If the memory used between resets
+ *  doesn't fit into one block, the next reset replaces all blocks
+ *  with a single larger one, so steady usage doesn't call the
+ *  backing allocator.
+ */
+typedef struct {
+  kit_allocator_t     alloc;  /*  Backing allocator. */
+  peer_arena_block_t *blocks; /*  Current block first. */
+  ptrdiff_t           used;   /*  Bytes used since the last reset. */
+  ptrdiff_t           peak;   /*  Max bytes used between resets. */
+} peer_arena_t;
+
+void peer_arena_init(peer_arena_t *arena, kit_allocator_t alloc);
+void peer_arena_reset(peer_arena_t *arena);
+void peer_arena_destroy(peer_arena_t *arena);
+
+/*  Allocator that uses the arena. The arena should not be moved while
+ *  the allocator is in use.
+ */
+kit_allocator_t peer_arena_allocator(peer_arena_t *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
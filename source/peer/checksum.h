@@ -0,0 +1,27 @@
+#ifndef PEER_CHECKSUM_H
+#define PEER_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  CRC32C (Castagnoli). Pass 0 to start, or the previous result to
+ *  continue over the next bytes. Uses SSE4.2 instructions if the CPU
+ *  supports them.
+ */
+uint32_t peer_crc32c(uint32_t crc, uint8_t const *data,
+                     ptrdiff_t size);
+
+/*  Same as peer_crc32c, but never uses hardware acceleration.
+ */
+uint32_t peer_crc32c_portable(uint32_t crc, uint8_t const *data,
+                              ptrdiff_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
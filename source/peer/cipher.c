@@ -1,10 +1,366 @@
 #include "cipher.h"
 
+#include "serial.h"
 #include <assert.h>
 #include <string.h>
 
-kit_status_t peer_cipher_init(peer_cipher_t *cipher,
-                              uint8_t const *key) {
+#if defined(__GNUC__) && defined(__x86_64__)
+#  define PEER_CHACHA20_SIMD
+#  include <immintrin.h>
+#endif
+
+enum { CHACHA20_BLOCK_SIZE = 64, CHACHA20_MAX_BLOCKS = 8 };
+
+static void chacha20_state(uint32_t *const     state,
+                           uint8_t const *const key,
+                           uint64_t const       nonce,
+                           uint64_t const       block) {
+  /*  Original ChaCha20 layout with 64-bit block counter and 64-bit
+   *  nonce.
+   */
+
+  state[0] = 0x61707865;
+  state[1] = 0x3320646e;
+  state[2] = 0x79622d32;
+  state[3] = 0x6b206574;
+
+  for (ptrdiff_t i = 0; i < 8; i++)
+    state[4 + i] = peer_read_u32(key + i * 4);
+
+  state[12] = (uint32_t) block;
+  state[13] = (uint32_t) (block >> 32);
+  state[14] = (uint32_t) nonce;
+  state[15] = (uint32_t) (nonce >> 32);
+}
+
+static void chacha20_advance(uint32_t *const state,
+                             ptrdiff_t const blocks) {
+  uint64_t const block = ((uint64_t) state[12] |
+                          ((uint64_t) state[13] << 32)) +
+                         (uint64_t) blocks;
+
+  state[12] = (uint32_t) block;
+  state[13] = (uint32_t) (block >> 32);
+}
+
+static void xor_bytes(uint8_t *const       data,
+                      uint8_t const *const stream,
+                      ptrdiff_t const      size) {
+  ptrdiff_t i = 0;
+
+  for (; i + 8 <= size; i += 8) {
+    uint64_t x, y;
+    memcpy(&x, data + i, 8);
+    memcpy(&y, stream + i, 8);
+    x ^= y;
+    memcpy(data + i, &x, 8);
+  }
+
+  for (; i < size; i++) data[i] ^= stream[i];
+}
+
+#define CHACHA20_ROTL(x_, n_) (((x_) << (n_)) | ((x_) >> (32 - (n_))))
+
+#define CHACHA20_QR(a_, b_, c_, d_) \
+  do {                              \
+    a_ += b_;                       \
+    d_ ^= a_;                       \
+    d_ = CHACHA20_ROTL(d_, 16);     \
+    c_ += d_;                       \
+    b_ ^= c_;                       \
+    b_ = CHACHA20_ROTL(b_, 12);     \
+    a_ += b_;                       \
+    d_ ^= a_;                       \
+    d_ = CHACHA20_ROTL(d_, 8);      \
+    c_ += d_;                       \
+    b_ ^= c_;                       \
+    b_ = CHACHA20_ROTL(b_, 7);      \
+  } while (0)
+
+static void chacha20_block(uint32_t const *const state,
+                           uint8_t *const        out) {
+  uint32_t x[16];
+  memcpy(x, state, sizeof x);
+
+  for (ptrdiff_t i = 0; i < 10; i++) {
+    CHACHA20_QR(x[0], x[4], x[8], x[12]);
+    CHACHA20_QR(x[1], x[5], x[9], x[13]);
+    CHACHA20_QR(x[2], x[6], x[10], x[14]);
+    CHACHA20_QR(x[3], x[7], x[11], x[15]);
+    CHACHA20_QR(x[0], x[5], x[10], x[15]);
+    CHACHA20_QR(x[1], x[6], x[11], x[12]);
+    CHACHA20_QR(x[2], x[7], x[8], x[13]);
+    CHACHA20_QR(x[3], x[4], x[9], x[14]);
+  }
+
+  for (ptrdiff_t i = 0; i < 16; i++)
+    peer_write_u32(out + i * 4, x[i] + state[i]);
+}
+
+void peer_chacha20_xor_portable(uint8_t const *const key,
+                                uint64_t const       nonce,
+                                uint64_t const       block,
+                                uint8_t             *data,
+                                ptrdiff_t            size) {
+  assert(key != NULL);
+  assert(size >= 0);
+  assert(size == 0 || data != NULL);
+
+  uint32_t state[16];
+  uint8_t  stream[CHACHA20_BLOCK_SIZE];
+
+  chacha20_state(state, key, nonce, block);
+
+  while (size > 0) {
+    ptrdiff_t const n = size < CHACHA20_BLOCK_SIZE
+                            ? size
+                            : CHACHA20_BLOCK_SIZE;
+
+    chacha20_block(state, stream);
+    chacha20_advance(state, 1);
+    xor_bytes(data, stream, n);
+
+    data += n;
+    size -= n;
+  }
+}
+
+#ifdef PEER_CHACHA20_SIMD
+/*  Several blocks at once. Vector x[i] holds word i of each block,
+ *  so the rounds are the same as for one block. Then the words are
+ *  transposed back into blocks.
+ */
+
+#  define CHACHA20_SSE_ROTL(v_, n_)                 \
+    _mm_or_si128(_mm_slli_epi32((v_), (n_)), \
+                 _mm_srli_epi32((v_), 32 - (n_)))
+
+#  define CHACHA20_SSE_QR(a_, b_, c_, d_) \
+    do {                                  \
+      a_ = _mm_add_epi32(a_, b_);         \
+      d_ = _mm_xor_si128(d_, a_);         \
+      d_ = CHACHA20_SSE_ROTL(d_, 16);     \
+      c_ = _mm_add_epi32(c_, d_);         \
+      b_ = _mm_xor_si128(b_, c_);         \
+      b_ = CHACHA20_SSE_ROTL(b_, 12);     \
+      a_ = _mm_add_epi32(a_, b_);         \
+      d_ = _mm_xor_si128(d_, a_);         \
+      d_ = CHACHA20_SSE_ROTL(d_, 8);      \
+      c_ = _mm_add_epi32(c_, d_);         \
+      b_ = _mm_xor_si128(b_, c_);         \
+      b_ = CHACHA20_SSE_ROTL(b_, 7);      \
+    } while (0)
+
+static void chacha20_blocks_sse2(uint32_t const *const state,
+                                 uint8_t *const        out) {
+  /*  4 blocks. SSE2 is always available on x86-64.
+   */
+
+  __m128i s[16], x[16];
+
+  for (ptrdiff_t i = 0; i < 16; i++)
+    s[i] = _mm_set1_epi32((int) state[i]);
+
+  uint32_t lo[4], hi[4];
+
+  for (ptrdiff_t j = 0; j < 4; j++) {
+    lo[j] = state[12] + (uint32_t) j;
+    hi[j] = state[13] + (lo[j] < state[12] ? 1 : 0);
+  }
+
+  s[12] = _mm_setr_epi32((int) lo[0], (int) lo[1], (int) lo[2],
+                         (int) lo[3]);
+  s[13] = _mm_setr_epi32((int) hi[0], (int) hi[1], (int) hi[2],
+                         (int) hi[3]);
+
+  memcpy(x, s, sizeof x);
+
+  for (ptrdiff_t i = 0; i < 10; i++) {
+    CHACHA20_SSE_QR(x[0], x[4], x[8], x[12]);
+    CHACHA20_SSE_QR(x[1], x[5], x[9], x[13]);
+    CHACHA20_SSE_QR(x[2], x[6], x[10], x[14]);
+    CHACHA20_SSE_QR(x[3], x[7], x[11], x[15]);
+    CHACHA20_SSE_QR(x[0], x[5], x[10], x[15]);
+    CHACHA20_SSE_QR(x[1], x[6], x[11], x[12]);
+    CHACHA20_SSE_QR(x[2], x[7], x[8], x[13]);
+    CHACHA20_SSE_QR(x[3], x[4], x[9], x[14]);
+  }
+
+  for (ptrdiff_t i = 0; i < 16; i++)
+    x[i] = _mm_add_epi32(x[i], s[i]);
+
+  for (ptrdiff_t g = 0; g < 4; g++) {
+    __m128i const t0 = _mm_unpacklo_epi32(x[g * 4], x[g * 4 + 1]);
+    __m128i const t1 = _mm_unpacklo_epi32(x[g * 4 + 2],
+                                          x[g * 4 + 3]);
+    __m128i const t2 = _mm_unpackhi_epi32(x[g * 4], x[g * 4 + 1]);
+    __m128i const t3 = _mm_unpackhi_epi32(x[g * 4 + 2],
+                                          x[g * 4 + 3]);
+
+    uint8_t *const p = out + g * 16;
+
+    _mm_storeu_si128((__m128i *) p, _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *) (p + 64),
+                     _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *) (p + 128),
+                     _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i *) (p + 192),
+                     _mm_unpackhi_epi64(t2, t3));
+  }
+}
+
+#  define CHACHA20_AVX_ROTL(v_, n_)                    \
+    _mm256_or_si256(_mm256_slli_epi32((v_), (n_)), \
+                    _mm256_srli_epi32((v_), 32 - (n_)))
+
+#  define CHACHA20_AVX_QR(a_, b_, c_, d_)    \
+    do {                                     \
+      a_ = _mm256_add_epi32(a_, b_);         \
+      d_ = _mm256_xor_si256(d_, a_);         \
+      d_ = _mm256_shuffle_epi8(d_, rot16);   \
+      c_ = _mm256_add_epi32(c_, d_);         \
+      b_ = _mm256_xor_si256(b_, c_);         \
+      b_ = CHACHA20_AVX_ROTL(b_, 12);        \
+      a_ = _mm256_add_epi32(a_, b_);         \
+      d_ = _mm256_xor_si256(d_, a_);         \
+      d_ = _mm256_shuffle_epi8(d_, rot8);    \
+      c_ = _mm256_add_epi32(c_, d_);         \
+      b_ = _mm256_xor_si256(b_, c_);         \
+      b_ = CHACHA20_AVX_ROTL(b_, 7);         \
+    } while (0)
+
+__attribute__((target("avx2"))) static void chacha20_blocks_avx2(
+    uint32_t const *const state, uint8_t *const out) {
+  /*  8 blocks. Rotations by 16 and 8 are byte shuffles.
+   */
+
+  __m256i const rot16 = _mm256_setr_epi8(
+      2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13, 2, 3, 0,
+      1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  __m256i const rot8 = _mm256_setr_epi8(
+      3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14, 3, 0, 1,
+      2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+  __m256i s[16], x[16];
+
+  for (ptrdiff_t i = 0; i < 16; i++)
+    s[i] = _mm256_set1_epi32((int) state[i]);
+
+  uint32_t lo[8], hi[8];
+
+  for (ptrdiff_t j = 0; j < 8; j++) {
+    lo[j] = state[12] + (uint32_t) j;
+    hi[j] = state[13] + (lo[j] < state[12] ? 1 : 0);
+  }
+
+  s[12] = _mm256_loadu_si256((__m256i const *) lo);
+  s[13] = _mm256_loadu_si256((__m256i const *) hi);
+
+  memcpy(x, s, sizeof x);
+
+  for (ptrdiff_t i = 0; i < 10; i++) {
+    CHACHA20_AVX_QR(x[0], x[4], x[8], x[12]);
+    CHACHA20_AVX_QR(x[1], x[5], x[9], x[13]);
+    CHACHA20_AVX_QR(x[2], x[6], x[10], x[14]);
+    CHACHA20_AVX_QR(x[3], x[7], x[11], x[15]);
+    CHACHA20_AVX_QR(x[0], x[5], x[10], x[15]);
+    CHACHA20_AVX_QR(x[1], x[6], x[11], x[12]);
+    CHACHA20_AVX_QR(x[2], x[7], x[8], x[13]);
+    CHACHA20_AVX_QR(x[3], x[4], x[9], x[14]);
+  }
+
+  for (ptrdiff_t i = 0; i < 16; i++)
+    x[i] = _mm256_add_epi32(x[i], s[i]);
+
+  /*  Transpose 4x4 words within 128-bit lanes. Then u[g][j] holds
+   *  words 4g to 4g+3 of block j in the low lane and of block j+4 in
+   *  the high lane.
+   */
+
+  __m256i u[4][4];
+
+  for (ptrdiff_t g = 0; g < 4; g++) {
+    __m256i const t0 = _mm256_unpacklo_epi32(x[g * 4], x[g * 4 + 1]);
+    __m256i const t1 = _mm256_unpacklo_epi32(x[g * 4 + 2],
+                                             x[g * 4 + 3]);
+    __m256i const t2 = _mm256_unpackhi_epi32(x[g * 4], x[g * 4 + 1]);
+    __m256i const t3 = _mm256_unpackhi_epi32(x[g * 4 + 2],
+                                             x[g * 4 + 3]);
+
+    u[g][0] = _mm256_unpacklo_epi64(t0, t1);
+    u[g][1] = _mm256_unpackhi_epi64(t0, t1);
+    u[g][2] = _mm256_unpacklo_epi64(t2, t3);
+    u[g][3] = _mm256_unpackhi_epi64(t2, t3);
+  }
+
+  for (ptrdiff_t j = 0; j < 4; j++) {
+    uint8_t *const p = out + j * CHACHA20_BLOCK_SIZE;
+    uint8_t *const q = p + 4 * CHACHA20_BLOCK_SIZE;
+
+    _mm256_storeu_si256(
+        (__m256i *) p, _mm256_permute2x128_si256(u[0][j], u[1][j],
+                                                 0x20));
+    _mm256_storeu_si256(
+        (__m256i *) (p + 32),
+        _mm256_permute2x128_si256(u[2][j], u[3][j], 0x20));
+    _mm256_storeu_si256(
+        (__m256i *) q, _mm256_permute2x128_si256(u[0][j], u[1][j],
+                                                 0x31));
+    _mm256_storeu_si256(
+        (__m256i *) (q + 32),
+        _mm256_permute2x128_si256(u[2][j], u[3][j], 0x31));
+  }
+}
+#endif
+
+void peer_chacha20_xor(uint8_t const *const key,
+                       uint64_t const nonce, uint64_t const block,
+                       uint8_t *data, ptrdiff_t size) {
+  assert(key != NULL);
+  assert(size >= 0);
+  assert(size == 0 || data != NULL);
+
+#ifdef PEER_CHACHA20_SIMD
+  uint32_t state[16];
+  uint8_t  stream[CHACHA20_BLOCK_SIZE * CHACHA20_MAX_BLOCKS];
+
+  int const is_avx2 = __builtin_cpu_supports("avx2");
+
+  chacha20_state(state, key, nonce, block);
+
+  while (size > 0) {
+    /*  Don't compute many more blocks than needed.
+     */
+
+    ptrdiff_t blocks = 1;
+
+    if (is_avx2 && size > 4 * CHACHA20_BLOCK_SIZE) {
+      chacha20_blocks_avx2(state, stream);
+      blocks = 8;
+    } else if (size > CHACHA20_BLOCK_SIZE) {
+      chacha20_blocks_sse2(state, stream);
+      blocks = 4;
+    } else
+      chacha20_block(state, stream);
+
+    ptrdiff_t const n = size < blocks * CHACHA20_BLOCK_SIZE
+                            ? size
+                            : blocks * CHACHA20_BLOCK_SIZE;
+
+    chacha20_advance(state, blocks);
+    xor_bytes(data, stream, n);
+
+    data += n;
+    size -= n;
+  }
+#else
+  peer_chacha20_xor_portable(key, nonce, block, data, size);
+#endif
+}
+
+kit_status_t peer_cipher_init(peer_cipher_t *const cipher,
+                              uint8_t const *const key,
+                              uint64_t const       nonce) {
   assert(cipher != NULL);
   assert(key != NULL);
 
@@ -16,51 +372,346 @@ kit_status_t peer_cipher_init(peer_cipher_t *cipher,
   if (key == NULL)
     return PEER_ERROR_INVALID_KEY;
 
-  memcpy(cipher->key, key, PEER_MT64_KEY_SIZE);
+  memcpy(cipher->key, key, PEER_CHACHA20_KEY_SIZE);
+  cipher->nonce = nonce;
 
-  /*  TODO
-   *  Initialize the cipher with mt64 random number generator.
-   */
+  return KIT_OK;
+}
+
+uint64_t peer_nonce_prefix(int const is_host, ptrdiff_t const actor) {
+  if (is_host)
+    return 1ull << 63;
+  if (actor < 0)
+    return 0;
+
+  uint64_t const mask = (1ull << PEER_NONCE_ACTOR_BITS) - 1;
 
-  return PEER_ERROR_NOT_IMPLEMENTED;
+  return (((uint64_t) actor + 1) & mask) << PEER_NONCE_COUNTER_BITS;
 }
 
-peer_cipher_result_t peer_encrypt(peer_cipher_t *const     cipher,
-                                  peer_packets_ref_t const packets,
-                                  kit_allocator_t const    alloc) {
+kit_status_t peer_encrypt(peer_cipher_t *const  cipher,
+                          uint64_t const        prefix,
+                          peer_packets_t *const packets) {
   assert(cipher != NULL);
+  assert(packets != NULL);
 
-  peer_cipher_result_t result;
-  memset(&result, 0, sizeof result);
+  if (cipher == NULL)
+    return PEER_ERROR_INVALID_CIPHER;
+
+  kit_status_t status = KIT_OK;
+  ptrdiff_t    n      = 0;
+
+  for (ptrdiff_t i = 0; i < packets->size; i++) {
+    peer_packet_t *const packet = packets->values + i;
+
+    if (peer_packet_messages_offset(packet) != PEER_UNDEFINED) {
+      uint8_t const mode = peer_read_u8(packet->data +
+                                        PEER_N_PACKET_MODE);
+
+      assert((mode & PEER_PACKET_MODE_CIPHER_MASK) == 0);
+
+      if ((mode & PEER_PACKET_MODE_CIPHER_MASK) != 0) {
+        status |= PEER_ERROR_INVALID_MODE;
+        continue;
+      }
+
+      /*  Packet that has no room for the nonce can't be sent plain.
+       */
+      if (packet->size + PEER_PACKET_NONCE_SIZE >
+          PEER_MAX_PACKET_SIZE) {
+        status |= PEER_ERROR_INVALID_PACKET_SIZE;
+        continue;
+      }
+
+      /*  Insert the nonce after the fixed header. Header before the
+       *  checksum stays plain, so the receiver can read the nonce.
+       */
+
+      uint64_t const nonce =
+          prefix | (cipher->nonce++ &
+                    ((1ull << PEER_NONCE_COUNTER_BITS) - 1));
+      uint8_t *const fields = packet->data + PEER_N_PACKET_OPTIONAL;
+
+      memmove(fields + PEER_PACKET_NONCE_SIZE, fields,
+              packet->size - PEER_N_PACKET_OPTIONAL);
+      packet->size += PEER_PACKET_NONCE_SIZE;
+
+      peer_write_u64(fields, nonce);
+      peer_write_u8(packet->data + PEER_N_PACKET_MODE,
+                    mode | PEER_PACKET_MODE_CHACHA20);
 
-  if (cipher == NULL) {
-    result.status = PEER_ERROR_INVALID_CIPHER;
-    return result;
+      ptrdiff_t const begin = peer_packet_checksum_offset(
+          mode | PEER_PACKET_MODE_CHACHA20);
+
+      peer_chacha20_xor(cipher->key, nonce, 0, packet->data + begin,
+                        packet->size - begin);
+    }
+
+    if (n != i)
+      memcpy(packets->values + n, packet, sizeof *packet);
+    n++;
   }
 
-  /*  TODO
-   */
+  DA_RESIZE(*packets, n);
 
-  result.status = PEER_ERROR_NOT_IMPLEMENTED;
-  return result;
+  return status;
 }
 
-peer_cipher_result_t peer_decrypt(peer_cipher_t *const     cipher,
-                                  peer_packets_ref_t const packets,
-                                  kit_allocator_t const    alloc) {
+kit_status_t peer_decrypt(peer_cipher_t const *const cipher,
+                          peer_packets_t *const      packets) {
   assert(cipher != NULL);
+  assert(packets != NULL);
+
+  if (cipher == NULL)
+    return PEER_ERROR_INVALID_CIPHER;
+
+  kit_status_t status = KIT_OK;
+  ptrdiff_t    n      = 0;
+
+  for (ptrdiff_t i = 0; i < packets->size; i++) {
+    peer_packet_t *const packet = packets->values + i;
+
+    if (peer_packet_messages_offset(packet) == PEER_UNDEFINED ||
+        packet->size > PEER_MAX_PACKET_SIZE ||
+        (peer_read_u8(packet->data + PEER_N_PACKET_MODE) &
+         PEER_PACKET_MODE_CIPHER_MASK) != PEER_PACKET_MODE_CHACHA20) {
+      status |= PEER_ERROR_INVALID_MODE;
+      continue;
+    }
+
+    uint8_t const  mode   = peer_read_u8(packet->data +
+                                         PEER_N_PACKET_MODE);
+    uint8_t *const fields = packet->data + PEER_N_PACKET_OPTIONAL;
+    uint64_t const nonce  = peer_read_u64(fields);
+
+    ptrdiff_t const begin = peer_packet_checksum_offset(mode);
+
+    peer_chacha20_xor(cipher->key, nonce, 0, packet->data + begin,
+                      packet->size - begin);
+
+    /*  Remove the nonce.
+     */
+
+    memmove(fields, fields + PEER_PACKET_NONCE_SIZE,
+            packet->size - PEER_N_PACKET_OPTIONAL -
+                PEER_PACKET_NONCE_SIZE);
+    packet->size -= PEER_PACKET_NONCE_SIZE;
+
+    packet->data[PEER_N_PACKET_MODE] &= ~PEER_PACKET_MODE_CIPHER_MASK;
+
+    if (n != i)
+      memcpy(packets->values + n, packet, sizeof *packet);
+    n++;
+  }
+
+  DA_RESIZE(*packets, n);
+
+  return status;
+}
+
+typedef struct {
+  uint64_t  v[4];
+  uint64_t  tail; /*  Pending bytes of the next word. */
+  ptrdiff_t size; /*  Total number of bytes. */
+} siphash_t;
+
+#define SIPHASH_ROTL(x_, n_) (((x_) << (n_)) | ((x_) >> (64 - (n_))))
+
+static void siphash_round(uint64_t *const v) {
+  v[0] += v[1];
+  v[1] = SIPHASH_ROTL(v[1], 13);
+  v[1] ^= v[0];
+  v[0] = SIPHASH_ROTL(v[0], 32);
+  v[2] += v[3];
+  v[3] = SIPHASH_ROTL(v[3], 16);
+  v[3] ^= v[2];
+  v[0] += v[3];
+  v[3] = SIPHASH_ROTL(v[3], 21);
+  v[3] ^= v[0];
+  v[2] += v[1];
+  v[1] = SIPHASH_ROTL(v[1], 17);
+  v[1] ^= v[2];
+  v[2] = SIPHASH_ROTL(v[2], 32);
+}
+
+static void siphash_init(siphash_t *const     s,
+                         uint8_t const *const key) {
+  uint64_t const k0 = peer_read_u64(key);
+  uint64_t const k1 = peer_read_u64(key + 8);
+
+  s->v[0] = k0 ^ 0x736f6d6570736575ull;
+  s->v[1] = k1 ^ 0x646f72616e646f6dull;
+  s->v[2] = k0 ^ 0x6c7967656e657261ull;
+  s->v[3] = k1 ^ 0x7465646279746573ull;
+  s->tail = 0;
+  s->size = 0;
+}
+
+static void siphash_word(siphash_t *const s, uint64_t const m) {
+  s->v[3] ^= m;
+  siphash_round(s->v);
+  siphash_round(s->v);
+  s->v[0] ^= m;
+}
+
+static void siphash_update(siphash_t *const     s,
+                           uint8_t const *const data,
+                           ptrdiff_t const      size) {
+  ptrdiff_t i = 0;
+
+  for (; i < size && (s->size & 7) != 0; i++) {
+    s->tail |= ((uint64_t) data[i]) << (8 * (s->size & 7));
+    s->size++;
+
+    if ((s->size & 7) == 0) {
+      siphash_word(s, s->tail);
+      s->tail = 0;
+    }
+  }
+
+  for (; i + 8 <= size; i += 8) {
+    siphash_word(s, peer_read_u64(data + i));
+    s->size += 8;
+  }
 
-  peer_cipher_result_t result;
-  memset(&result, 0, sizeof result);
+  for (; i < size; i++) {
+    s->tail |= ((uint64_t) data[i]) << (8 * (s->size & 7));
+    s->size++;
+  }
+}
+
+static uint64_t siphash_finish(siphash_t *const s) {
+  siphash_word(s, s->tail | (((uint64_t) s->size) << 56));
+
+  s->v[2] ^= 0xff;
+
+  for (int i = 0; i < 4; i++) siphash_round(s->v);
+
+  return s->v[0] ^ s->v[1] ^ s->v[2] ^ s->v[3];
+}
+
+uint64_t peer_siphash(uint8_t const *const key,
+                      uint8_t const *const data,
+                      ptrdiff_t const      size) {
+  assert(key != NULL);
+  assert(data != NULL || size == 0);
+  assert(size >= 0);
+
+  siphash_t s;
+  siphash_init(&s, key);
+  siphash_update(&s, data, size);
+  return siphash_finish(&s);
+}
+
+static uint64_t packet_tag(uint8_t const *const       key,
+                           peer_packet_t const *const packet) {
+  /*  Everything except the tag itself.
+   */
+
+  ptrdiff_t const offset = peer_packet_tag_offset(
+      peer_read_u8(packet->data + PEER_N_PACKET_MODE));
+  ptrdiff_t const end = offset + PEER_PACKET_TAG_SIZE;
+
+  siphash_t s;
+  siphash_init(&s, key);
+  siphash_update(&s, packet->data, offset);
+  siphash_update(&s, packet->data + end, packet->size - end);
+  return siphash_finish(&s);
+}
+
+kit_status_t peer_sign(uint8_t const *const  key,
+                       peer_packets_t *const packets) {
+  assert(key != NULL);
+  assert(packets != NULL);
+
+  if (key == NULL)
+    return PEER_ERROR_INVALID_KEY;
+
+  kit_status_t status = KIT_OK;
+  ptrdiff_t    n      = 0;
+
+  for (ptrdiff_t i = 0; i < packets->size; i++) {
+    peer_packet_t *const packet = packets->values + i;
+
+    if (peer_packet_messages_offset(packet) != PEER_UNDEFINED) {
+      uint8_t const mode = peer_read_u8(packet->data +
+                                        PEER_N_PACKET_MODE);
 
-  if (cipher == NULL) {
-    result.status = PEER_ERROR_INVALID_CIPHER;
-    return result;
+      assert((mode & PEER_PACKET_MODE_TAG) == 0);
+
+      if ((mode & PEER_PACKET_MODE_TAG) != 0) {
+        status |= PEER_ERROR_INVALID_MODE;
+        continue;
+      }
+
+      /*  Packet that has no room for the tag can't be sent unsigned.
+       */
+      if (packet->size + PEER_PACKET_TAG_SIZE >
+          PEER_MAX_PACKET_SIZE) {
+        status |= PEER_ERROR_INVALID_PACKET_SIZE;
+        continue;
+      }
+
+      /*  Insert the tag after the nonce.
+       */
+
+      uint8_t *const tag = packet->data +
+                           peer_packet_tag_offset(mode);
+
+      memmove(tag + PEER_PACKET_TAG_SIZE, tag,
+              packet->size - (tag - packet->data));
+      packet->size += PEER_PACKET_TAG_SIZE;
+
+      peer_write_u8(packet->data + PEER_N_PACKET_MODE,
+                    mode | PEER_PACKET_MODE_TAG);
+      peer_write_u64(tag, packet_tag(key, packet));
+    }
+
+    if (n != i)
+      memcpy(packets->values + n, packet, sizeof *packet);
+    n++;
   }
 
-  /*  TODO
+  DA_RESIZE(*packets, n);
+
+  return status;
+}
+
+kit_status_t peer_verify(uint8_t const *const key,
+                         peer_packet_t *const packet) {
+  assert(key != NULL);
+  assert(packet != NULL);
+
+  if (key == NULL)
+    return PEER_ERROR_INVALID_KEY;
+
+  if (peer_packet_messages_offset(packet) == PEER_UNDEFINED ||
+      packet->size > PEER_MAX_PACKET_SIZE ||
+      (peer_read_u8(packet->data + PEER_N_PACKET_MODE) &
+       PEER_PACKET_MODE_TAG) == 0)
+    return PEER_ERROR_INVALID_MODE;
+
+  uint8_t *const tag = packet->data +
+                       peer_packet_tag_offset(
+                           packet->data[PEER_N_PACKET_MODE]);
+
+  /*  Compare whole words, so the timing doesn't tell how many
+   *  bytes of a forged tag are right.
    */
 
-  result.status = PEER_ERROR_NOT_IMPLEMENTED;
-  return result;
+  uint64_t const diff = packet_tag(key, packet) ^ peer_read_u64(tag);
+
+  if (diff != 0)
+    return PEER_ERROR_INVALID_MESSAGE;
+
+  /*  Remove the tag.
+   */
+
+  memmove(tag, tag + PEER_PACKET_TAG_SIZE,
+          packet->size - (tag - packet->data) - PEER_PACKET_TAG_SIZE);
+  packet->size -= PEER_PACKET_TAG_SIZE;
+
+  packet->data[PEER_N_PACKET_MODE] &= ~PEER_PACKET_MODE_TAG;
+
+  return KIT_OK;
 }
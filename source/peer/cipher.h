@@ -8,26 +8,70 @@
 extern "C" {
 #endif
 
+/*  ChaCha20 packet encryption. Each packet is encrypted with its own
+ *  nonce, written in the packet header. The nonce is the sender
+ *  prefix and the packet counter, so the host and the clients that
+ *  share the key never reuse each other's nonces. A client that
+ *  takes over a slot of an earlier client has the same prefix, so
+ *  the counter should start from a random value.
+ */
 typedef struct {
-  uint8_t   key[PEER_MT64_KEY_SIZE];
-  ptrdiff_t index;
+  uint8_t  key[PEER_CHACHA20_KEY_SIZE];
+  uint64_t nonce; /*  Counter of the next packet. */
 } peer_cipher_t;
 
 kit_status_t peer_cipher_init(peer_cipher_t *cipher,
-                              uint8_t const *key);
+                              uint8_t const *key, uint64_t nonce);
 
-typedef struct {
-  kit_status_t   status;
-  peer_packets_t packets;
-} peer_cipher_result_t;
+/*  Nonce prefix of the sender. Host sets the top bit. Client puts
+ *  its actor id in the bits above the counter, or leaves them zero
+ *  before it has a session.
+ */
+uint64_t peer_nonce_prefix(int is_host, ptrdiff_t actor);
+
+/*  Encrypt packets in place. The nonce is inserted after the fixed
+ *  header, packets without room for it are removed.
+ */
+kit_status_t peer_encrypt(peer_cipher_t  *cipher,
+                          uint64_t        prefix,
+                          peer_packets_t *packets);
+
+/*  Decrypt packets in place and remove the nonce. Packets that are
+ *  not encrypted with ChaCha20 are removed.
+ */
+kit_status_t peer_decrypt(peer_cipher_t const *cipher,
+                          peer_packets_t      *packets);
+
+/*  XOR data with the ChaCha20 keystream, starting from the specified
+ *  block. Uses AVX2 or SSE2 instructions if the CPU supports them.
+ */
+void peer_chacha20_xor(uint8_t const *key, uint64_t nonce,
+                       uint64_t block, uint8_t *data, ptrdiff_t size);
+
+/*  Same as peer_chacha20_xor, but never uses SIMD instructions.
+ */
+void peer_chacha20_xor_portable(uint8_t const *key, uint64_t nonce,
+                                uint64_t block, uint8_t *data,
+                                ptrdiff_t size);
+
+/*  SipHash-2-4 with 64-bit output.
+ */
+uint64_t peer_siphash(uint8_t const *key, uint8_t const *data,
+                      ptrdiff_t size);
 
-peer_cipher_result_t peer_encrypt(peer_cipher_t     *cipher,
-                                  peer_packets_ref_t packets,
-                                  kit_allocator_t    alloc);
+/*  Insert the authentication tag into each packet. The tag covers
+ *  the whole packet, including the session id, so packets can't be
+ *  moved to another session. Should be done after encryption.
+ *  Packets without room for the tag are removed.
+ */
+kit_status_t peer_sign(uint8_t const *key, peer_packets_t *packets);
 
-peer_cipher_result_t peer_decrypt(peer_cipher_t     *cipher,
-                                  peer_packets_ref_t packets,
-                                  kit_allocator_t    alloc);
+/*  Check the packet tag in constant time, remove the tag and clear
+ *  the tag flag. Returns PEER_ERROR_INVALID_MODE if the packet has
+ *  no tag, and PEER_ERROR_INVALID_MESSAGE if the tag is wrong.
+ *  Doesn't modify the packet in that case.
+ */
+kit_status_t peer_verify(uint8_t const *key, peer_packet_t *packet);
 
 #ifdef __cplusplus
 }
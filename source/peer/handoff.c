@@ -0,0 +1,124 @@
+#include "handoff.h"
+
+#include <assert.h>
+#include <string.h>
+
+kit_status_t peer_handoff_init(peer_handoff_t *const handoff,
+                               ptrdiff_t const       capacity,
+                               kit_allocator_t const alloc) {
+  assert(handoff != NULL);
+  assert(capacity > 0);
+
+  if (handoff == NULL)
+    return PEER_ERROR_INVALID_PEER;
+  if (capacity <= 0)
+    return PEER_ERROR_INVALID_COUNT;
+
+  memset(handoff, 0, sizeof *handoff);
+  handoff->alloc = alloc;
+
+  atomic_store_explicit(&handoff->head, 0, memory_order_relaxed);
+  atomic_store_explicit(&handoff->tail, 0, memory_order_relaxed);
+
+  ptrdiff_t n = 1;
+  while (n < capacity) n *= 2;
+
+  if (alloc.allocate == NULL)
+    return PEER_ERROR_BAD_ALLOC;
+
+  handoff->cells = (peer_handoff_cell_t *) alloc.allocate(
+      alloc.state, n * sizeof *handoff->cells);
+
+  if (handoff->cells == NULL)
+    return PEER_ERROR_BAD_ALLOC;
+
+  handoff->capacity = n;
+
+  return KIT_OK;
+}
+
+void peer_handoff_destroy(peer_handoff_t *const handoff) {
+  assert(handoff != NULL);
+
+  if (handoff == NULL || handoff->cells == NULL)
+    return;
+
+  if (handoff->alloc.deallocate != NULL)
+    handoff->alloc.deallocate(handoff->alloc.state, handoff->cells);
+
+  handoff->cells    = NULL;
+  handoff->capacity = 0;
+}
+
+ptrdiff_t peer_handoff_write(peer_handoff_t *const handoff,
+                             peer_t const *const   peer,
+                             ptrdiff_t *const      cursor) {
+  assert(handoff != NULL);
+  assert(peer != NULL);
+  assert(cursor != NULL);
+
+  if (handoff == NULL || handoff->capacity == 0 || peer == NULL ||
+      cursor == NULL)
+    return 0;
+
+  size_t const tail = atomic_load_explicit(&handoff->tail,
+                                           memory_order_relaxed);
+  size_t const head = atomic_load_explicit(&handoff->head,
+                                           memory_order_acquire);
+  size_t const mask = (size_t) handoff->capacity - 1;
+
+  peer_message_batch_t const batch = peer_read(
+      peer, cursor, handoff->capacity - (ptrdiff_t) (tail - head));
+
+  for (ptrdiff_t i = 0; i < batch.size; i++) {
+    peer_handoff_cell_t *const cell =
+        handoff->cells + ((tail + (size_t) i) & mask);
+    peer_chunk_ref_t const data = peer_queue_data(&peer->queue,
+                                                  batch.index + i);
+
+    cell->index = batch.index + i;
+    cell->time  = batch.values[i].time;
+    cell->actor = batch.values[i].actor;
+    cell->size  = data.size;
+
+    if (data.size > 0)
+      memcpy(cell->data, data.values, data.size);
+  }
+
+  atomic_store_explicit(&handoff->tail, tail + (size_t) batch.size,
+                        memory_order_release);
+
+  return batch.size;
+}
+
+peer_handoff_cell_t const *peer_handoff_front(
+    peer_handoff_t *const handoff) {
+  assert(handoff != NULL);
+
+  if (handoff == NULL || handoff->capacity == 0)
+    return NULL;
+
+  size_t const head = atomic_load_explicit(&handoff->head,
+                                           memory_order_relaxed);
+  size_t const tail = atomic_load_explicit(&handoff->tail,
+                                           memory_order_acquire);
+
+  if (head == tail)
+    return NULL;
+
+  return handoff->cells + (head & ((size_t) handoff->capacity - 1));
+}
+
+void peer_handoff_pop(peer_handoff_t *const handoff) {
+  assert(handoff != NULL);
+  assert(peer_handoff_front(handoff) != NULL);
+
+  if (handoff == NULL || handoff->capacity == 0)
+    return;
+
+  size_t const head = atomic_load_explicit(&handoff->head,
+                                           memory_order_relaxed);
+
+  atomic_store_explicit(&handoff->head, head + 1,
+                        memory_order_release);
+}
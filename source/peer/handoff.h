@@ -0,0 +1,60 @@
+#ifndef PEER_HANDOFF_H
+#define PEER_HANDOFF_H
+
+#include "peer.h"
+
+#include <kit/atomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  ptrdiff_t   index; /*  Message index in the mutual queue. */
+  peer_time_t time;  /*  Message time. */
+  ptrdiff_t   actor; /*  Message actor. */
+  ptrdiff_t   size;  /*  Payload size. */
+  uint8_t     data[PEER_MAX_MESSAGE_SIZE];
+} peer_handoff_cell_t;
+
+/*  Lock-free queue of received messages with one producer, the
+ *  thread that ticks the peer, and one consumer. Messages are copied,
+ *  because the mutual queue changes while the consumer reads them.
+ */
+typedef struct {
+  kit_allocator_t      alloc;    /*  Backing allocator. */
+  ptrdiff_t            capacity; /*  Number of cells, power of two. */
+  peer_handoff_cell_t *cells;    /*  Ring buffer. */
+  KIT_ATOMIC(size_t)   head;     /*  Next consumer position. */
+  KIT_ATOMIC(size_t)   tail;     /*  Next producer position. */
+} peer_handoff_t;
+
+/*  Capacity is rounded up to a power of two.
+ */
+kit_status_t peer_handoff_init(peer_handoff_t *handoff,
+                               ptrdiff_t       capacity,
+                               kit_allocator_t alloc);
+
+void peer_handoff_destroy(peer_handoff_t *handoff);
+
+/*  Producer. Copy messages that peer_read returns for the cursor, as
+ *  many as fit. Returns the number of messages copied.
+ */
+ptrdiff_t peer_handoff_write(peer_handoff_t *handoff,
+                             peer_t const *peer, ptrdiff_t *cursor);
+
+/*  Consumer. Oldest message, or NULL if there are none. The cell
+ *  stays valid until peer_handoff_pop.
+ */
+peer_handoff_cell_t const *peer_handoff_front(
+    peer_handoff_t *handoff);
+
+/*  Consumer. Release the oldest message.
+ */
+void peer_handoff_pop(peer_handoff_t *handoff);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
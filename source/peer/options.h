@@ -22,24 +22,83 @@ enum {
       64, /* Address size should be big enough to contain IPv4 and
              IPv6 addresses and ports (6 bytes or 18 bytes). */
 
-  /*  Protocol settings.
+  PEER_LOG_BLOCK_SIZE =
+      65536, /* Message payloads are stored in blocks of this size. */
+
+  /*  Protocol settings. Packet size, timeouts and trail bounds are
+   *  defaults for peer_config_t.
    */
 
   PEER_PACKET_SIZE =
       400, /* On average, peer sends
               PEER_PACKET_SIZE / 10 = 40 kB per second. */
 
-  PEER_MT64_KEY_SIZE = 128, /* Key size for mt64 stream cipher. */
+  PEER_MAX_PACKET_SIZE =
+      1472, /* UDP payload size for 1500 bytes MTU. Packet storage
+               is this size. */
+
+  PEER_CHACHA20_KEY_SIZE = 32, /* Key size for ChaCha20 stream
+                                  cipher. */
+
+  PEER_SIPHASH_KEY_SIZE = 16, /* Key size for SipHash packet
+                                 tags. */
+
+  PEER_NONCE_COUNTER_BITS = 40, /* Low nonce bits are the packet
+                                   counter, upper bits are the
+                                   sender prefix. */
+  PEER_NONCE_ACTOR_BITS   = 23, /* Nonce bits of the client actor,
+                                   above the counter. Top bit is
+                                   set by the host. */
+
+  /*  Default trail size bounds. Trail size of each slot is scaled
+   *  between them by the slot's loss estimate.
+   */
+
+  PEER_TRAIL_SERIAL_MIN = 2, /* Number of recent messages to
+                                resend. */
+  PEER_TRAIL_SERIAL_MAX = 10,
+
+  PEER_TRAIL_SCATTER_MIN = 1, /* Number of randomly picked previous
+                                 messages to resend. */
+  PEER_TRAIL_SCATTER_MAX = 10,
+
+  PEER_TRAIL_DISTANCE_MIN = 25, /* Maximum distance of randomly picked
+                                   previous messages to resend. */
+  PEER_TRAIL_DISTANCE_MAX = 200,
+
+  /*  Loss estimation. Estimates are fixed point numbers with 16
+   *  fractional bits.
+   */
+
+  PEER_LOSS_ONE = 65536, /* Loss estimate for 100% loss. */
 
-  PEER_TRAIL_SERIAL_SIZE =
-      5, /* Number of recent messages to resend. */
+  PEER_LOSS_INITIAL =
+      3277, /* Loss estimate before any messages received, 5%. */
 
-  PEER_TRAIL_SCATTER_SIZE =
-      5, /* Number of randomly picked previous messages to resend. */
+  PEER_LOSS_SATURATION =
+      13107, /* Loss rate at which trail reaches the upper bounds,
+                20%. */
 
-  PEER_TRAIL_SCATTER_DISTANCE =
-      100, /* Maximum distance of randomly picked previous messages to
-              resend. */
+  PEER_LOSS_SHIFT = 5, /* Moving average weight of a new sample is
+                          1 / 2^5. */
+
+  PEER_FEC_GROUP_SIZE = 4, /* Number of packets covered by one parity
+                              packet. Should be less than 32. */
+
+  PEER_RESEND_WINDOW = 64, /* Number of retransmitted messages
+                              the slot remembers send times for. */
+
+  PEER_HISTORY = 0, /* Min number of mutual messages retained after
+                       the application could read them. */
+
+  PEER_SEND_THREADS = 1, /* Number of threads packing host's outgoing
+                            packets. */
+
+  PEER_SUBMIT_CAPACITY = 64, /* Number of messages other threads can
+                                submit between ticks. */
+
+  PEER_PACE_BURST = 65536, /* Max bytes a slot sends at once after
+                              being idle, if pacing is enabled. */
 
   PEER_TIMEOUT_HEARTBEAT =
       10, /* Peer will send a heartbeat notification if no messages
@@ -55,9 +114,37 @@ enum {
   /*  Packet mode values.
    */
 
-  PEER_PACKET_MODE_PLAIN = 0, /* Packet is not encrypted. */
-  PEER_PACKET_MODE_MT64  = 1, /* Packet is encrypted with mt64
-                                 cipher. */
+  PEER_PACKET_MODE_PLAIN    = 0, /* Packet is not encrypted. */
+  PEER_PACKET_MODE_RESERVED = 1, /* Invalid cipher, packets with it
+                                    are rejected. */
+  PEER_PACKET_MODE_CHACHA20 = 2, /* Packet is encrypted with ChaCha20
+                                    cipher. */
+  PEER_PACKET_MODE_CIPHER_MASK = 0x0f, /* Cipher bits of the mode. */
+  PEER_PACKET_MODE_TAG = 0x10, /* Flag. Packet has the authentication
+                                  tag. */
+  PEER_PACKET_MODE_CHECKSUM = 0x20, /* Flag. Packet checksum is set,
+                                       message checksums are not. */
+  PEER_PACKET_MODE_COMPACT  = 0x40, /* Flag. Messages have compact
+                                       headers. Implies the packet
+                                       checksum. */
+  PEER_PACKET_MODE_PARITY = 0x80, /* Flag. Packet is XOR parity of a
+                                     packet group. */
+
+  /*  Compact message header. The first byte holds the flags and the
+   *  message mode, followed by varints: data size, index delta if
+   *  the index is set, time delta and actor id plus one. Deltas are
+   *  zigzag-coded against the first index and the first time in the
+   *  packet. Zero byte ends the packet.
+   */
+
+  PEER_COMPACT_MESSAGE   = 0x80, /* Message is present. */
+  PEER_COMPACT_INDEX     = 0x40, /* Message has the index. */
+  PEER_COMPACT_MODE_MASK = 0x3f,
+
+  /*  Session flags, sent in the session response.
+   */
+
+  PEER_SESSION_COMPACT = 1, /* Host accepts compact packets. */
 
   /*  Message mode values.
    */
@@ -74,6 +161,8 @@ enum {
   PEER_M_SESSION_REQUEST  = 4,
   PEER_M_SESSION_RESPONSE = 5,
   PEER_M_SESSION_RESUME   = 6,
+  PEER_M_ACK              = 7,
+  PEER_M_SNAPSHOT         = 8,
 
   /*  Data offsets.
    */
@@ -82,7 +171,13 @@ enum {
   PEER_N_PACKET_INDEX    = 4,  /* 8 bytes */
   PEER_N_PACKET_MODE     = 12, /* 1 byte */
   PEER_N_PACKET_SIZE     = 13, /* 2 bytes */
-  PEER_N_PACKET_MESSAGES = 15,
+  PEER_N_PACKET_OPTIONAL = 15, /* Optional fields depend on the
+                                  mode, see peer_packet_header_size
+                                  in packet.h. */
+
+  PEER_PACKET_NONCE_SIZE    = 8, /* Nonce of an encrypted packet. */
+  PEER_PACKET_TAG_SIZE      = 8, /* Authentication tag. */
+  PEER_PACKET_CHECKSUM_SIZE = 4, /* Packet checksum. */
 
   PEER_N_MESSAGE_CHECKSUM      = 0,  /* 8 bytes */
   PEER_N_MESSAGE_SIZE          = 8,  /* 1 byte */
@@ -93,9 +188,16 @@ enum {
   PEER_N_MESSAGE_DATA          = 30,
 
   PEER_MAX_MESSAGE_SIZE =
-      PEER_PACKET_SIZE - PEER_N_PACKET_MESSAGES -
-      PEER_N_MESSAGE_DATA, /* Message size acquires 10 bits, so max
-                              possible value for it is 1023. */
+      1023 - PEER_N_MESSAGE_DATA, /* Message size acquires 10 bits, so
+                                     max possible value for it is
+                                     1023. Messages are also limited
+                                     by the packet size. */
+
+  PEER_MIN_PACKET_SIZE =
+      PEER_N_PACKET_OPTIONAL + PEER_PACKET_CHECKSUM_SIZE +
+      PEER_N_MESSAGE_DATA + 2 +
+      PEER_ADDRESS_SIZE, /* Packet should fit the session response
+                            message. */
 
   /*  Error codes.
    */
@@ -2,122 +2,561 @@
 
 #include "serial.h"
 
-kit_status_t peer_pack(ptrdiff_t const         source_id,
-                       ptrdiff_t const         destination_id,
-                       peer_chunks_ref_t const chunks,
-                       peer_packets_t *const   out_packets) {
-  /*  Pack chunks into packets.
+ptrdiff_t peer_packet_tag_offset(uint8_t const mode) {
+  return (mode & PEER_PACKET_MODE_CIPHER_MASK) != 0
+             ? PEER_N_PACKET_OPTIONAL + PEER_PACKET_NONCE_SIZE
+             : PEER_N_PACKET_OPTIONAL;
+}
+
+ptrdiff_t peer_packet_checksum_offset(uint8_t const mode) {
+  return (mode & PEER_PACKET_MODE_TAG) != 0
+             ? peer_packet_tag_offset(mode) + PEER_PACKET_TAG_SIZE
+             : peer_packet_tag_offset(mode);
+}
+
+ptrdiff_t peer_packet_header_size(uint8_t const mode) {
+  return (mode & PEER_PACKET_MODE_CHECKSUM) != 0
+             ? peer_packet_checksum_offset(mode) +
+                   PEER_PACKET_CHECKSUM_SIZE
+             : peer_packet_checksum_offset(mode);
+}
+
+ptrdiff_t peer_packet_messages_offset(
+    peer_packet_t const *const packet) {
+  assert(packet != NULL);
+
+  if (packet->size < PEER_N_PACKET_OPTIONAL)
+    return PEER_UNDEFINED;
+
+  ptrdiff_t const n = peer_packet_header_size(
+      peer_read_u8(packet->data + PEER_N_PACKET_MODE));
+
+  return packet->size < n ? PEER_UNDEFINED : n;
+}
+
+static uint32_t packet_checksum(peer_packet_t const *const packet) {
+  /*  Fixed header and messages. Nonce and tag are not covered, they
+   *  are removed before the checksum is verified.
    */
 
-  assert(chunks.size >= 0);
-  assert(chunks.size == 0 || chunks.values != NULL);
-  assert(source_id != destination_id);
-  assert(out_packets != NULL);
+  uint8_t const   mode = peer_read_u8(packet->data +
+                                      PEER_N_PACKET_MODE);
+  ptrdiff_t const n    = peer_packet_header_size(mode);
 
-  ptrdiff_t previous_size = out_packets->size;
-  ptrdiff_t offset        = PEER_PACKET_SIZE;
+  assert(packet->size >= n);
 
-  for (ptrdiff_t i = 0; i < chunks.size; i++) {
-    if (offset + chunks.values[i].size > PEER_PACKET_SIZE) {
-      if (out_packets->size > previous_size) {
-        /*  Write the previous packet header.
-         */
+  uint32_t const crc = peer_crc32c(0, packet->data,
+                                   PEER_N_PACKET_OPTIONAL);
 
-        assert(offset < 65536);
-        assert(offset < PEER_PACKET_SIZE - PEER_N_PACKET_MESSAGES);
+  return peer_crc32c(crc, packet->data + n, packet->size - n);
+}
 
-        out_packets->values[out_packets->size - 1].size = offset;
+static void checksum_write(peer_packet_t *const packet) {
+  uint8_t const mode = peer_read_u8(packet->data +
+                                    PEER_N_PACKET_MODE);
 
-        uint8_t *const data =
-            out_packets->values[out_packets->size - 1].data;
+  if ((mode & PEER_PACKET_MODE_CHECKSUM) != 0 &&
+      packet->size >= peer_packet_header_size(mode))
+    peer_write_u32(packet->data + peer_packet_checksum_offset(mode),
+                   packet_checksum(packet));
+}
 
-        peer_write_u8(data + PEER_N_PACKET_MODE,
-                      PEER_PACKET_MODE_PLAIN);
-        peer_write_u16(data + PEER_N_PACKET_SIZE, (uint16_t) offset);
-      }
+static void packet_close(peer_packet_t *const packet,
+                         ptrdiff_t const size, uint8_t const mode) {
+  /*  Write the packet header.
+   */
 
-      /*  Add a new packet.
-       */
+  assert(packet != NULL);
+  assert(size < 65536);
+  assert(size <= PEER_MAX_PACKET_SIZE);
 
-      ptrdiff_t const n = out_packets->size;
-      DA_RESIZE(*out_packets, n + 1);
+  packet->size = size;
 
-      if (out_packets->size != n + 1)
-        return PEER_ERROR_BAD_ALLOC;
+  peer_write_u8(packet->data + PEER_N_PACKET_MODE, mode);
+  peer_write_u16(packet->data + PEER_N_PACKET_SIZE, (uint16_t) size);
 
-      memset(out_packets->values + n, 0, sizeof *out_packets->values);
-      out_packets->values[n].source_id      = source_id;
-      out_packets->values[n].destination_id = destination_id;
+  checksum_write(packet);
+}
 
-      offset = PEER_N_PACKET_MESSAGES;
-    }
+static int is_parity(peer_packet_t const *const packet) {
+  /*  Parity packets don't contain messages.
+   */
+  return packet->size >= PEER_N_PACKET_OPTIONAL &&
+         (peer_read_u8(packet->data + PEER_N_PACKET_MODE) &
+          PEER_PACKET_MODE_PARITY) != 0;
+}
+
+static int is_compact(peer_packet_t const *const packet) {
+  return packet->size >= PEER_N_PACKET_OPTIONAL &&
+         (peer_read_u8(packet->data + PEER_N_PACKET_MODE) &
+          PEER_PACKET_MODE_COMPACT) != 0;
+}
 
-    {
-      /*  Make sure, the chunk size value is correct.
-       */
+static int is_checksum_valid(peer_packet_t const *const packet) {
+  uint8_t const mode = peer_read_u8(packet->data +
+                                    PEER_N_PACKET_MODE);
 
-      ptrdiff_t const chunk_size = (ptrdiff_t) peer_read_message_size(
-          chunks.values[i].values);
+  /*  Compact messages have no checksums of their own, so a compact
+   *  packet must have the packet checksum.
+   */
+  if ((mode & PEER_PACKET_MODE_COMPACT) != 0)
+    return (mode & PEER_PACKET_MODE_CHECKSUM) != 0 &&
+           peer_read_u32(packet->data +
+                         peer_packet_checksum_offset(mode)) ==
+               packet_checksum(packet);
+
+  return (mode & PEER_PACKET_MODE_CHECKSUM) == 0 ||
+         peer_read_u32(packet->data +
+                       peer_packet_checksum_offset(mode)) ==
+             packet_checksum(packet);
+}
 
-      assert(chunks.values[i].size == chunk_size);
+static kit_status_t packet_add(peer_packet_builder_t *const b) {
+  ptrdiff_t const n = b->packets->size;
+  DA_RESIZE(*b->packets, n + 1);
 
-      if (chunks.values[i].size != chunk_size)
-        return PEER_ERROR_INVALID_MESSAGE_SIZE;
-    }
+  if (b->packets->size != n + 1)
+    return PEER_ERROR_BAD_ALLOC;
 
-    {
-      /*  Add chunk to the current packet.
-       */
+  memset(b->packets->values + n, 0, sizeof *b->packets->values);
+  b->packets->values[n].source_id      = b->source_id;
+  b->packets->values[n].destination_id = b->destination_id;
 
-      assert(out_packets->size > 0);
-      assert(chunks.values[i].size + PEER_N_PACKET_MESSAGES <
-             PEER_PACKET_SIZE);
+  return KIT_OK;
+}
 
-      ptrdiff_t const m = out_packets->size - 1;
+static kit_status_t builder_next(peer_packet_builder_t *const b) {
+  /*  Close the current packet and start a new one.
+   */
 
-      memcpy(out_packets->values[m].data + offset,
-             chunks.values[i].values, chunks.values[i].size);
-    }
+  if (b->packets->size > b->first)
+    packet_close(b->packets->values + (b->packets->size - 1),
+                 b->offset, b->mode);
+
+  kit_status_t const s = packet_add(b);
+  if (s != KIT_OK)
+    return s;
+
+  b->offset     = peer_packet_header_size(b->mode);
+  b->base_index = PEER_UNDEFINED;
+  b->base_time  = 0;
+
+  return KIT_OK;
+}
+
+static uint8_t *builder_reserve(peer_packet_builder_t *const b,
+                                ptrdiff_t const              size) {
+  /*  Reserve space for a message in the current packet, or add a new
+   *  packet if it doesn't fit.
+   */
+
+  assert((b->mode & PEER_PACKET_MODE_COMPACT) == 0);
+  assert(size >= PEER_N_MESSAGE_DATA);
+  assert(peer_packet_header_size(b->mode) + size <= b->packet_size);
+
+  if (b->offset + size > b->packet_size &&
+      builder_next(b) != KIT_OK)
+    return NULL;
+
+  assert(b->packets->size > b->first);
+
+  uint8_t *const data = b->packets->values[b->packets->size - 1]
+                            .data +
+                        b->offset;
+  b->offset += size;
+  return data;
+}
+
+/*  Decoding state of a compact packet. Deltas are relative to the
+ *  first message time and the first message index in the packet.
+ */
+typedef struct {
+  int         is_first;
+  ptrdiff_t   index;
+  peer_time_t time;
+} compact_base_t;
+
+static ptrdiff_t compact_header(uint8_t *const              header,
+                                compact_base_t const *const base,
+                                uint8_t const               mode,
+                                ptrdiff_t const             index,
+                                peer_time_t const           time,
+                                ptrdiff_t const             actor,
+                                ptrdiff_t const data_size) {
+  /*  Header size is at most 28 bytes, so a message always fits a
+   *  compact packet if it fits a plain one.
+   */
+
+  assert((mode & ~PEER_COMPACT_MODE_MASK) == 0);
+  assert(actor >= 0 || actor == PEER_UNDEFINED);
+  assert((int64_t) actor <= 0xffffffffll);
+
+  uint64_t const base_index = base->index == PEER_UNDEFINED
+                                  ? 0
+                                  : (uint64_t) base->index;
+  uint64_t const base_time  = base->is_first ? 0
+                                             : (uint64_t) base->time;
+
+  ptrdiff_t n = 1;
+
+  header[0] = PEER_COMPACT_MESSAGE | mode;
 
-    offset += chunks.values[i].size;
+  n += peer_write_varint(header + n, (uint64_t) data_size);
+
+  if (index != PEER_UNDEFINED) {
+    header[0] |= PEER_COMPACT_INDEX;
+    n += peer_write_varint(
+        header + n,
+        peer_zigzag((int64_t) ((uint64_t) index - base_index)));
   }
 
-  if (out_packets->size == previous_size) {
-    /*  Make sure to create at least 1 packet.
+  n += peer_write_varint(
+      header + n,
+      peer_zigzag((int64_t) ((uint64_t) time - base_time)));
+  n += peer_write_varint(header + n, (uint64_t) (actor + 1));
+
+  assert(n <= PEER_N_MESSAGE_DATA);
+  return n;
+}
+
+static void compact_advance(compact_base_t *const base,
+                            ptrdiff_t const       index,
+                            peer_time_t const     time) {
+  if (base->is_first)
+    base->time = time;
+  if (base->index == PEER_UNDEFINED)
+    base->index = index;
+  base->is_first = 0;
+}
+
+static ptrdiff_t compact_read(uint8_t const *const      data,
+                              ptrdiff_t const           size,
+                              compact_base_t *const     base,
+                              peer_message_ref_t *const out) {
+  /*  Decode the compact message. Returns the full message size, 0 at
+   *  the end of the packet, or -1 if the message is invalid.
+   */
+
+  if (size <= 0 || data[0] == 0)
+    return 0;
+
+  uint8_t const flags = data[0];
+
+  if ((flags & PEER_COMPACT_MESSAGE) == 0)
+    return -1;
+
+  ptrdiff_t n = 1;
+  ptrdiff_t k = 0;
+  uint64_t  x = 0;
+
+  k = peer_read_varint(data + n, size - n, &x);
+  if (k == 0 || x > PEER_MAX_MESSAGE_SIZE)
+    return -1;
+  n += k;
+
+  ptrdiff_t const data_size = (ptrdiff_t) x;
+  ptrdiff_t       index     = PEER_UNDEFINED;
+
+  if ((flags & PEER_COMPACT_INDEX) != 0) {
+    k = peer_read_varint(data + n, size - n, &x);
+    if (k == 0)
+      return -1;
+    n += k;
+
+    uint64_t const base_index = base->index == PEER_UNDEFINED
+                                    ? 0
+                                    : (uint64_t) base->index;
+
+    index = (ptrdiff_t) (base_index + (uint64_t) peer_unzigzag(x));
+    if (index < 0)
+      return -1;
+  }
+
+  k = peer_read_varint(data + n, size - n, &x);
+  if (k == 0)
+    return -1;
+  n += k;
+
+  uint64_t const base_time = base->is_first ? 0
+                                            : (uint64_t) base->time;
+  peer_time_t const time = (peer_time_t) (base_time +
+                                          (uint64_t) peer_unzigzag(
+                                              x));
+
+  k = peer_read_varint(data + n, size - n, &x);
+  if (k == 0 || x > 0x100000000ull)
+    return -1;
+  n += k;
+
+  if (n + data_size > size)
+    return -1;
+
+  out->mode        = flags & PEER_COMPACT_MODE_MASK;
+  out->index       = index;
+  out->time        = time;
+  out->actor       = (ptrdiff_t) x - 1;
+  out->data.size   = data_size;
+  out->data.values = data + n;
+
+  compact_advance(base, index, time);
+
+  return n + data_size;
+}
+
+static kit_status_t compact_write(peer_packet_builder_t *const b,
+                                  uint8_t const                mode,
+                                  ptrdiff_t const              index,
+                                  peer_time_t const            time,
+                                  ptrdiff_t const              actor,
+                                  peer_chunk_ref_t const       data) {
+  uint8_t        header[PEER_N_MESSAGE_DATA];
+  ptrdiff_t      n = 0;
+  compact_base_t base;
+
+  if (b->packets->size > b->first) {
+    base.is_first = b->offset == peer_packet_header_size(b->mode);
+    base.index    = b->base_index;
+    base.time     = b->base_time;
+
+    n = compact_header(header, &base, mode, index, time, actor,
+                       data.size);
+  }
+
+  if (b->packets->size == b->first ||
+      b->offset + n + data.size > b->packet_size) {
+    kit_status_t const s = builder_next(b);
+    if (s != KIT_OK)
+      return s;
+
+    base.is_first = 1;
+    base.index    = PEER_UNDEFINED;
+    base.time     = 0;
+
+    n = compact_header(header, &base, mode, index, time, actor,
+                       data.size);
+  }
+
+  assert(b->offset + n + data.size <= b->packet_size);
+
+  uint8_t *const dst = b->packets->values[b->packets->size - 1]
+                           .data +
+                       b->offset;
+
+  memcpy(dst, header, n);
+  if (data.size > 0)
+    memcpy(dst + n, data.values, data.size);
+
+  compact_advance(&base, index, time);
+
+  b->offset += n + data.size;
+  b->base_index = base.index;
+  b->base_time  = base.time;
+
+  return KIT_OK;
+}
+
+void peer_builder_init(peer_packet_builder_t *const b,
+                       ptrdiff_t const              source_id,
+                       ptrdiff_t const              destination_id,
+                       ptrdiff_t const              packet_size,
+                       uint8_t const                mode,
+                       peer_packets_t *const        out_packets) {
+  assert(b != NULL);
+  assert(source_id != destination_id);
+  assert(packet_size >= PEER_MIN_PACKET_SIZE &&
+         packet_size <= PEER_MAX_PACKET_SIZE);
+  assert(out_packets != NULL);
+
+  b->source_id      = source_id;
+  b->destination_id = destination_id;
+  b->packet_size    = packet_size;
+  b->mode           = (mode & PEER_PACKET_MODE_COMPACT) != 0
+                          ? mode | PEER_PACKET_MODE_CHECKSUM
+                          : mode;
+  b->packets        = out_packets;
+  b->first          = out_packets->size;
+  b->offset         = packet_size;
+  b->base_index     = PEER_UNDEFINED;
+  b->base_time      = 0;
+}
+
+void peer_builder_continue(peer_packet_builder_t *const b,
+                           ptrdiff_t const              source_id,
+                           ptrdiff_t const       destination_id,
+                           ptrdiff_t const       packet_size,
+                           uint8_t const         mode,
+                           peer_packets_t *const out_packets) {
+  peer_builder_init(b, source_id, destination_id, packet_size, mode,
+                    out_packets);
+
+  if (out_packets->size == 0)
+    return;
+
+  peer_packet_t const *const last = out_packets->values +
+                                    (out_packets->size - 1);
+
+  if (last->source_id != source_id ||
+      last->destination_id != destination_id ||
+      peer_packet_messages_offset(last) == PEER_UNDEFINED ||
+      peer_read_u8(last->data + PEER_N_PACKET_MODE) !=
+          b->mode)
+    return;
+
+  if ((b->mode & PEER_PACKET_MODE_COMPACT) != 0) {
+    /*  Restore delta bases of the packet.
      */
 
-    DA_RESIZE(*out_packets, previous_size + 1);
+    compact_base_t base = { .is_first = 1,
+                            .index    = PEER_UNDEFINED,
+                            .time     = 0 };
 
-    if (out_packets->size != previous_size + 1)
-      return PEER_ERROR_BAD_ALLOC;
+    for (ptrdiff_t offset = peer_packet_header_size(b->mode);;) {
+      peer_message_ref_t message;
 
-    memset(out_packets->values, 0, sizeof *out_packets->values);
-    out_packets->values[0].source_id      = source_id;
-    out_packets->values[0].destination_id = destination_id;
+      ptrdiff_t const n = compact_read(last->data + offset,
+                                       last->size - offset, &base,
+                                       &message);
+      if (n < 0)
+        return;
+      if (n == 0)
+        break;
 
-    offset = 0;
+      offset += n;
+    }
+
+    b->base_index = base.index;
+    b->base_time  = base.time;
   }
 
+  b->first  = out_packets->size - 1;
+  b->offset = last->size;
+}
+
+kit_status_t peer_builder_append(peer_packet_builder_t *const b,
+                                 peer_chunk_ref_t const       chunk) {
+  assert(b != NULL && b->packets != NULL);
+  assert(chunk.values != NULL);
+
+  if (chunk.size < PEER_N_MESSAGE_DATA ||
+      peer_packet_header_size(b->mode) + chunk.size > b->packet_size)
+    return PEER_ERROR_INVALID_MESSAGE_SIZE;
+
   {
-    /*  Write the last packet header.
+    /*  Make sure, the chunk size value is correct.
      */
 
-    assert(out_packets->size > 0);
-    assert(offset < 65536);
-    assert(offset < PEER_PACKET_SIZE - PEER_N_PACKET_MESSAGES);
+    ptrdiff_t const chunk_size = (ptrdiff_t) peer_read_message_size(
+        chunk.values);
 
-    out_packets->values[out_packets->size - 1].size = offset;
+    assert(chunk.size == chunk_size);
 
-    uint8_t *const data =
-        out_packets->values[out_packets->size - 1].data;
+    if (chunk.size != chunk_size)
+      return PEER_ERROR_INVALID_MESSAGE_SIZE;
+  }
 
-    peer_write_u8(data + PEER_N_PACKET_MODE, PEER_PACKET_MODE_PLAIN);
-    peer_write_u16(data + PEER_N_PACKET_SIZE, (uint16_t) offset);
+  if ((b->mode & PEER_PACKET_MODE_COMPACT) != 0) {
+    peer_chunk_ref_t const data = {
+      .size   = chunk.size - PEER_N_MESSAGE_DATA,
+      .values = chunk.values + PEER_N_MESSAGE_DATA
+    };
+
+    return compact_write(b, peer_read_message_mode(chunk.values),
+                         peer_read_message_index(chunk.values),
+                         peer_read_message_time(chunk.values),
+                         peer_read_message_actor(chunk.values),
+                         data);
   }
 
+  uint8_t *const data = builder_reserve(b, chunk.size);
+
+  if (data == NULL)
+    return PEER_ERROR_BAD_ALLOC;
+
+  memcpy(data, chunk.values, chunk.size);
+  return KIT_OK;
+}
+
+kit_status_t peer_builder_write(peer_packet_builder_t *const b,
+                                uint8_t const                mode,
+                                ptrdiff_t const              index,
+                                peer_time_t const            time,
+                                ptrdiff_t const              actor,
+                                peer_chunk_ref_t const       data) {
+  assert(b != NULL && b->packets != NULL);
+  assert(data.size == 0 || data.values != NULL);
+
+  if (data.size < 0 || data.size > PEER_MAX_MESSAGE_SIZE ||
+      peer_packet_header_size(b->mode) + PEER_N_MESSAGE_DATA +
+              data.size >
+          b->packet_size)
+    return PEER_ERROR_INVALID_MESSAGE_SIZE;
+
+  if ((b->mode & PEER_PACKET_MODE_COMPACT) != 0)
+    return compact_write(b, mode, index, time, actor, data);
+
+  uint8_t *const message = builder_reserve(b, PEER_N_MESSAGE_DATA +
+                                                  data.size);
+
+  if (message == NULL)
+    return PEER_ERROR_BAD_ALLOC;
+
+  if ((b->mode & PEER_PACKET_MODE_CHECKSUM) != 0)
+    peer_write_message_unchecked(message, mode, index, time, actor,
+                                 data.size, data.values);
+  else
+    peer_write_message(message, mode, index, time, actor, data.size,
+                       data.values);
   return KIT_OK;
 }
 
+kit_status_t peer_builder_finish(peer_packet_builder_t *const b) {
+  assert(b != NULL && b->packets != NULL);
+
+  if (b->packets->size == b->first) {
+    /*  Make sure to create at least 1 packet.
+     */
+
+    kit_status_t const s = packet_add(b);
+    if (s != KIT_OK)
+      return s;
+
+    b->offset = 0;
+  }
+
+  packet_close(b->packets->values + (b->packets->size - 1),
+               b->offset, b->mode);
+
+  b->first  = b->packets->size;
+  b->offset = b->packet_size;
+
+  return KIT_OK;
+}
+
+kit_status_t peer_pack(ptrdiff_t const         source_id,
+                       ptrdiff_t const         destination_id,
+                       peer_chunks_ref_t const chunks,
+                       peer_packets_t *const   out_packets) {
+  /*  Pack chunks into packets.
+   */
+
+  assert(chunks.size >= 0);
+  assert(chunks.size == 0 || chunks.values != NULL);
+  assert(source_id != destination_id);
+  assert(out_packets != NULL);
+
+  peer_packet_builder_t b;
+  peer_builder_init(&b, source_id, destination_id, PEER_PACKET_SIZE,
+                    0, out_packets);
+
+  for (ptrdiff_t i = 0; i < chunks.size; i++) {
+    kit_status_t const s = peer_builder_append(&b, chunks.values[i]);
+    if (s != KIT_OK)
+      return s;
+  }
+
+  return peer_builder_finish(&b);
+}
+
 kit_status_t peer_unpack(peer_packets_ref_t const packets,
                          peer_chunks_t *const     out_chunks) {
   /*  Unpack chunks from packets.
@@ -130,16 +569,19 @@ kit_status_t peer_unpack(peer_packets_ref_t const packets,
   kit_status_t status = KIT_OK;
 
   for (ptrdiff_t i = 0; i < packets.size; i++) {
-    if (packets.values[i].size == 0)
+    if (packets.values[i].size == 0 ||
+        is_parity(packets.values + i) ||
+        is_compact(packets.values + i))
       continue;
 
-    ptrdiff_t offset = PEER_N_PACKET_MESSAGES;
+    ptrdiff_t offset = peer_packet_messages_offset(packets.values +
+                                                   i);
 
-    assert(packets.values[i].size >= offset &&
-           packets.values[i].size <= PEER_PACKET_SIZE);
+    assert(offset != PEER_UNDEFINED &&
+           packets.values[i].size <= PEER_MAX_PACKET_SIZE);
 
-    if (packets.values[i].size < offset ||
-        packets.values[i].size > PEER_PACKET_SIZE) {
+    if (offset == PEER_UNDEFINED ||
+        packets.values[i].size > PEER_MAX_PACKET_SIZE) {
       status |= PEER_ERROR_INVALID_PACKET_SIZE;
       continue;
     }
@@ -151,7 +593,7 @@ kit_status_t peer_unpack(peer_packets_ref_t const packets,
       if (size == 0)
         break;
 
-      if (size < 0 || offset + size > PEER_PACKET_SIZE) {
+      if (size < 0 || offset + size > PEER_MAX_PACKET_SIZE) {
         status |= PEER_ERROR_INVALID_MESSAGE_SIZE;
         break;
       }
@@ -180,3 +622,331 @@ kit_status_t peer_unpack(peer_packets_ref_t const packets,
 
   return status;
 }
+
+kit_status_t peer_unpack_refs(peer_packets_ref_t const packets,
+                              peer_chunk_refs_t *const out_refs) {
+  assert(packets.size >= 0);
+  assert(packets.size == 0 || packets.values != NULL);
+  assert(out_refs != NULL);
+
+  kit_status_t status = KIT_OK;
+
+  for (ptrdiff_t i = 0; i < packets.size; i++) {
+    peer_packet_t const *const packet = packets.values + i;
+
+    if (packet->size == 0 || is_parity(packet))
+      continue;
+
+    ptrdiff_t offset = peer_packet_messages_offset(packet);
+
+    assert(offset != PEER_UNDEFINED &&
+           packet->size <= PEER_MAX_PACKET_SIZE);
+
+    if (offset == PEER_UNDEFINED ||
+        packet->size > PEER_MAX_PACKET_SIZE) {
+      status |= PEER_ERROR_INVALID_PACKET_SIZE;
+      continue;
+    }
+
+    /*  Compact packet without the packet checksum is invalid, even
+     *  though it is skipped.
+     */
+    if (is_compact(packet)) {
+      if (!is_checksum_valid(packet))
+        status |= PEER_ERROR_INVALID_MESSAGE;
+      continue;
+    }
+
+    while (offset + PEER_N_MESSAGE_DATA <= packet->size) {
+      ptrdiff_t const size = (ptrdiff_t) peer_read_message_size(
+          packet->data + offset);
+
+      if (size == 0)
+        break;
+
+      if (size < PEER_N_MESSAGE_DATA ||
+          offset + size > packet->size) {
+        status |= PEER_ERROR_INVALID_MESSAGE_SIZE;
+        break;
+      }
+
+      ptrdiff_t const n = out_refs->size;
+      DA_RESIZE(*out_refs, n + 1);
+      if (out_refs->size != n + 1) {
+        status |= PEER_ERROR_BAD_ALLOC;
+        break;
+      }
+
+      out_refs->values[n].size   = size;
+      out_refs->values[n].values = packet->data + offset;
+
+      offset += size;
+    }
+  }
+
+  return status;
+}
+
+kit_status_t peer_unpack_messages(
+    peer_packets_ref_t const packets,
+    peer_message_refs_t *const out_messages) {
+  assert(packets.size >= 0);
+  assert(packets.size == 0 || packets.values != NULL);
+  assert(out_messages != NULL);
+
+  kit_status_t status = KIT_OK;
+
+  for (ptrdiff_t i = 0; i < packets.size; i++) {
+    peer_packet_t const *const packet = packets.values + i;
+
+    if (packet->size == 0 || is_parity(packet))
+      continue;
+
+    ptrdiff_t offset = peer_packet_messages_offset(packet);
+
+    assert(offset != PEER_UNDEFINED &&
+           packet->size <= PEER_MAX_PACKET_SIZE);
+
+    if (offset == PEER_UNDEFINED ||
+        packet->size > PEER_MAX_PACKET_SIZE) {
+      status |= PEER_ERROR_INVALID_PACKET_SIZE;
+      continue;
+    }
+
+    if (!is_checksum_valid(packet)) {
+      status |= PEER_ERROR_INVALID_MESSAGE;
+      continue;
+    }
+
+    int const is_message_checksum =
+        (peer_read_u8(packet->data + PEER_N_PACKET_MODE) &
+         PEER_PACKET_MODE_CHECKSUM) == 0;
+
+    int const      compact = is_compact(packet);
+    compact_base_t base    = { .is_first = 1,
+                               .index    = PEER_UNDEFINED,
+                               .time     = 0 };
+
+    for (;;) {
+      peer_message_ref_t message;
+      ptrdiff_t          size = 0;
+
+      if (compact) {
+        size = compact_read(packet->data + offset,
+                            packet->size - offset, &base, &message);
+
+        if (size == 0)
+          break;
+
+        if (size < 0) {
+          status |= PEER_ERROR_INVALID_MESSAGE_SIZE;
+          break;
+        }
+      } else {
+        if (offset + PEER_N_MESSAGE_DATA > packet->size)
+          break;
+
+        uint8_t const *const data = packet->data + offset;
+
+        size = (ptrdiff_t) peer_read_message_size(data);
+
+        if (size == 0)
+          break;
+
+        if (size < PEER_N_MESSAGE_DATA ||
+            offset + size > packet->size) {
+          status |= PEER_ERROR_INVALID_MESSAGE_SIZE;
+          break;
+        }
+
+        if (is_message_checksum &&
+            peer_read_message_checksum(data) !=
+                peer_message_checksum(data, size)) {
+          status |= PEER_ERROR_INVALID_MESSAGE;
+          offset += size;
+          continue;
+        }
+
+        message.mode        = peer_read_message_mode(data);
+        message.index       = peer_read_message_index(data);
+        message.time        = peer_read_message_time(data);
+        message.actor       = peer_read_message_actor(data);
+        message.data.size   = size - PEER_N_MESSAGE_DATA;
+        message.data.values = data + PEER_N_MESSAGE_DATA;
+      }
+
+      ptrdiff_t const n = out_messages->size;
+      DA_RESIZE(*out_messages, n + 1);
+      if (out_messages->size != n + 1) {
+        status |= PEER_ERROR_BAD_ALLOC;
+        break;
+      }
+
+      out_messages->values[n] = message;
+
+      offset += size;
+    }
+  }
+
+  return status;
+}
+
+static void parity_add(uint8_t *const             parity,
+                       ptrdiff_t *const           size,
+                       peer_packet_t const *const packet) {
+  /*  Mode flags and exact sizes of data packets are restored from
+   *  the parity too, so the rebuilt packet passes the checksum.
+   */
+  parity[PEER_N_PACKET_MODE] ^= packet->data[PEER_N_PACKET_MODE] &
+                                ~PEER_PACKET_MODE_PARITY;
+
+  for (ptrdiff_t i = PEER_N_PACKET_SIZE; i < packet->size; i++)
+    parity[i] ^= packet->data[i];
+
+  if (*size < packet->size)
+    *size = packet->size;
+}
+
+void peer_fec_encoder_init(peer_fec_encoder_t *const e) {
+  assert(e != NULL);
+  memset(e, 0, sizeof *e);
+}
+
+void peer_fec_decoder_init(peer_fec_decoder_t *const d) {
+  assert(d != NULL);
+  memset(d, 0, sizeof *d);
+}
+
+kit_status_t peer_fec_encode(peer_fec_encoder_t *const e,
+                             peer_packets_t *const     packets,
+                             ptrdiff_t const           begin) {
+  assert(e != NULL);
+  assert(packets != NULL);
+  assert(begin >= 0 && begin <= packets->size);
+
+  for (ptrdiff_t i = begin; i < packets->size; i++) {
+    if (peer_packet_messages_offset(packets->values + i) ==
+        PEER_UNDEFINED)
+      continue;
+
+    /*  Checksum covers the packet index too.
+     */
+    peer_write_u64(packets->values[i].data + PEER_N_PACKET_INDEX,
+                   (uint64_t) e->index);
+    checksum_write(packets->values + i);
+    parity_add(e->parity, &e->size, packets->values + i);
+    e->index++;
+
+    if (e->index % PEER_FEC_GROUP_SIZE != 0)
+      continue;
+
+    /*  Group is complete. Insert the parity packet after it, so the
+     *  receiver gets it before the next group.
+     */
+
+    ptrdiff_t const n = packets->size;
+    DA_RESIZE(*packets, n + 1);
+
+    if (packets->size != n + 1)
+      return PEER_ERROR_BAD_ALLOC;
+
+    i++;
+
+    if (i < n)
+      memmove(packets->values + (i + 1), packets->values + i,
+              (n - i) * sizeof *packets->values);
+
+    peer_packet_t *const parity = packets->values + i;
+
+    parity->source_id      = packets->values[i - 1].source_id;
+    parity->destination_id = packets->values[i - 1].destination_id;
+    parity->size           = e->size;
+
+    memcpy(parity->data, e->parity, PEER_MAX_PACKET_SIZE);
+
+    peer_write_u64(parity->data + PEER_N_PACKET_INDEX,
+                   (uint64_t) (e->index - PEER_FEC_GROUP_SIZE));
+    peer_write_u8(parity->data + PEER_N_PACKET_MODE,
+                  e->parity[PEER_N_PACKET_MODE] |
+                      PEER_PACKET_MODE_PARITY);
+
+    memset(e->parity, 0, PEER_MAX_PACKET_SIZE);
+    e->size = 0;
+  }
+
+  return KIT_OK;
+}
+
+int peer_fec_decode(peer_fec_decoder_t *const  d,
+                    peer_packet_t const *const packet,
+                    peer_packet_t *const       out_packet) {
+  assert(d != NULL);
+  assert(packet != NULL);
+  assert(out_packet != NULL);
+
+  if (peer_packet_messages_offset(packet) == PEER_UNDEFINED ||
+      packet->size > PEER_MAX_PACKET_SIZE)
+    return 0;
+
+  uint64_t const index = peer_read_u64(packet->data +
+                                       PEER_N_PACKET_INDEX);
+  ptrdiff_t const group = (ptrdiff_t) (index -
+                                       index % PEER_FEC_GROUP_SIZE);
+  uint32_t const bit = is_parity(packet)
+                           ? 1u << PEER_FEC_GROUP_SIZE
+                           : 1u << (index % PEER_FEC_GROUP_SIZE);
+
+  if (index > (uint64_t) PTRDIFF_MAX || group < d->group)
+    return 0;
+
+  if (group > d->group) {
+    /*  New group. The previous one can't be rebuilt anymore.
+     */
+    d->group = group;
+    d->mask  = 0;
+    d->size  = 0;
+    memset(d->parity, 0, PEER_MAX_PACKET_SIZE);
+  }
+
+  if ((d->mask & bit) != 0)
+    return 0;
+
+  d->mask |= bit;
+  parity_add(d->parity, &d->size, packet);
+
+  uint32_t const all  = (1u << (PEER_FEC_GROUP_SIZE + 1)) - 1;
+  uint32_t const lost = all & ~d->mask;
+
+  /*  Rebuild only if the parity and all but one packets are received.
+   */
+  if ((d->mask & (1u << PEER_FEC_GROUP_SIZE)) == 0 || lost == 0 ||
+      (lost & (lost - 1)) != 0)
+    return 0;
+
+  ptrdiff_t k = 0;
+  while ((lost >> k) != 1)
+    k++;
+
+  d->mask = all;
+
+  /*  Size field of the parity packet is XOR of the group sizes.
+   */
+  ptrdiff_t const size = (ptrdiff_t) peer_read_u16(
+      d->parity + PEER_N_PACKET_SIZE);
+
+  if (size < PEER_N_PACKET_OPTIONAL || size > d->size)
+    return 0;
+
+  memset(out_packet, 0, sizeof *out_packet);
+
+  out_packet->source_id      = packet->source_id;
+  out_packet->destination_id = packet->destination_id;
+  out_packet->size           = size;
+
+  memcpy(out_packet->data, d->parity, size);
+
+  peer_write_u64(out_packet->data + PEER_N_PACKET_INDEX,
+                 (uint64_t) (d->group + k));
+
+  return peer_packet_messages_offset(out_packet) != PEER_UNDEFINED;
+}
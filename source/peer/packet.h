@@ -17,7 +17,7 @@ typedef struct {
   ptrdiff_t source_id;
   ptrdiff_t destination_id;
   ptrdiff_t size;
-  uint8_t   data[PEER_PACKET_SIZE];
+  uint8_t   data[PEER_MAX_PACKET_SIZE];
 } peer_packet_t;
 
 typedef KIT_DA(peer_packet_t) peer_packets_t;
@@ -28,6 +28,85 @@ typedef KIT_DA(peer_chunk_t) peer_chunks_t;
 typedef KIT_AR(peer_chunk_ref_t) peer_chunks_ref_t;
 typedef KIT_DA(peer_chunk_ref_t) peer_chunk_refs_t;
 
+/*  Decoded message header and a reference to the message data in
+ *  the packet.
+ */
+typedef struct {
+  uint8_t          mode;
+  ptrdiff_t        index;
+  peer_time_t      time;
+  ptrdiff_t        actor;
+  peer_chunk_ref_t data;
+} peer_message_ref_t;
+
+typedef KIT_DA(peer_message_ref_t) peer_message_refs_t;
+
+/*  Packet header layout. The fixed header is followed by the nonce
+ *  if the packet is encrypted, the tag if it has the tag flag, and
+ *  the checksum if it has the checksum flag. Messages start after
+ *  the header.
+ */
+ptrdiff_t peer_packet_tag_offset(uint8_t mode);
+ptrdiff_t peer_packet_checksum_offset(uint8_t mode);
+ptrdiff_t peer_packet_header_size(uint8_t mode);
+
+/*  Header size of the packet, or PEER_UNDEFINED if the packet is too
+ *  short for its header.
+ */
+ptrdiff_t peer_packet_messages_offset(peer_packet_t const *packet);
+
+/*  Packet builder writes messages directly into packets. It adds a
+ *  new packet when the current one is full. Call peer_builder_finish
+ *  to write the last packet header. Compact mode implies the packet
+ *  checksum. The output is the same as
+ *  peer_pack would produce for the same messages, unless the builder
+ *  writes compact packets.
+ */
+typedef struct {
+  ptrdiff_t       source_id;
+  ptrdiff_t       destination_id;
+  ptrdiff_t       packet_size; /*  Max size of output packets. */
+  uint8_t         mode;        /*  Packet mode flags. */
+  peer_packets_t *packets;     /*  Output packets. */
+  ptrdiff_t       first;       /*  First packet of the builder. */
+  ptrdiff_t       offset;      /*  Write offset in the last packet. */
+  ptrdiff_t       base_index;  /*  First message index in the last
+                                   compact packet. */
+  peer_time_t     base_time;   /*  First message time in the last
+                                   compact packet. */
+} peer_packet_builder_t;
+
+void peer_builder_init(peer_packet_builder_t *b, ptrdiff_t source_id,
+                       ptrdiff_t       destination_id,
+                       ptrdiff_t packet_size, uint8_t mode,
+                       peer_packets_t *out_packets);
+
+/*  Same as peer_builder_init, but continue writing into the last
+ *  packet if it has the same source, destination and mode.
+ */
+void peer_builder_continue(peer_packet_builder_t *b,
+                           ptrdiff_t              source_id,
+                           ptrdiff_t              destination_id,
+                           ptrdiff_t              packet_size,
+                           uint8_t                mode,
+                           peer_packets_t        *out_packets);
+
+/*  Append a serialized message.
+ */
+kit_status_t peer_builder_append(peer_packet_builder_t *b,
+                                 peer_chunk_ref_t       chunk);
+
+/*  Serialize a message in place.
+ */
+kit_status_t peer_builder_write(peer_packet_builder_t *b,
+                                uint8_t mode, ptrdiff_t index,
+                                peer_time_t time, ptrdiff_t actor,
+                                peer_chunk_ref_t data);
+
+kit_status_t peer_builder_finish(peer_packet_builder_t *b);
+
+/*  Pack chunks into packets of the default size.
+ */
 kit_status_t peer_pack(ptrdiff_t source_id, ptrdiff_t destination_id,
                        peer_chunks_ref_t chunks,
                        peer_packets_t   *out_packets);
@@ -35,6 +114,58 @@ kit_status_t peer_pack(ptrdiff_t source_id, ptrdiff_t destination_id,
 kit_status_t peer_unpack(peer_packets_ref_t packets,
                          peer_chunks_t     *out_chunks);
 
+/*  Unpack chunks without copying. Chunk references point into the
+ *  packets' data. Message sizes are validated, so each chunk holds a
+ *  complete message header. Compact packets have no serialized
+ *  messages to refer to and are skipped, same as by peer_unpack.
+ *  Compact packets without the packet checksum are invalid.
+ */
+kit_status_t peer_unpack_refs(peer_packets_ref_t packets,
+                              peer_chunk_refs_t *out_refs);
+
+/*  Decode message headers of both plain and compact packets. Data
+ *  references point into the packets' data. Checksums are verified
+ *  first, packets and messages that fail are skipped.
+ */
+kit_status_t peer_unpack_messages(peer_packets_ref_t   packets,
+                                  peer_message_refs_t *out_messages);
+
+/*  Forward error correction. Packets of a stream are numbered, and
+ *  each group of PEER_FEC_GROUP_SIZE packets is followed by a parity
+ *  packet, XOR of the group's packets. Receiver rebuilds one lost
+ *  packet of a group.
+ */
+typedef struct {
+  ptrdiff_t index; /*  Next packet index. */
+  ptrdiff_t size;  /*  Max packet size in the current group. */
+  uint8_t   parity[PEER_MAX_PACKET_SIZE];
+} peer_fec_encoder_t;
+
+typedef struct {
+  ptrdiff_t group; /*  First packet index of the current group. */
+  uint32_t  mask;  /*  Received packets of the group. Last bit is
+                       for the parity packet. */
+  ptrdiff_t size;  /*  Max packet size in the group. */
+  uint8_t   parity[PEER_MAX_PACKET_SIZE];
+} peer_fec_decoder_t;
+
+void peer_fec_encoder_init(peer_fec_encoder_t *e);
+void peer_fec_decoder_init(peer_fec_decoder_t *d);
+
+/*  Number the packets starting from the specified one and insert a
+ *  parity packet after each completed group.
+ */
+kit_status_t peer_fec_encode(peer_fec_encoder_t *e,
+                             peer_packets_t     *packets,
+                             ptrdiff_t           begin);
+
+/*  Add a received packet to its group. Returns 1 and writes the
+ *  rebuilt packet if the group has exactly one lost packet left.
+ */
+int peer_fec_decode(peer_fec_decoder_t  *d,
+                    peer_packet_t const *packet,
+                    peer_packet_t       *out_packet);
+
 #ifdef __cplusplus
 }
 #endif
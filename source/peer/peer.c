@@ -6,18 +6,63 @@
 
 static_assert(((ptrdiff_t) -1) == PEER_UNDEFINED,
               "Undefined id sanity check");
-static_assert(PEER_N_PACKET_MESSAGES + PEER_N_MESSAGE_DATA <
+static_assert(PEER_N_PACKET_OPTIONAL + PEER_PACKET_CHECKSUM_SIZE +
+                      PEER_N_MESSAGE_DATA <
                   PEER_PACKET_SIZE,
               "We should be able to put messages in packets");
-static_assert(
-    2 + PEER_MT64_KEY_SIZE < PEER_MAX_MESSAGE_SIZE,
-    "We should be able to send a message with a cipher key");
-static_assert(PEER_PACKET_SIZE < 65536, "Packet size sanity check");
+static_assert(PEER_MIN_PACKET_SIZE <= PEER_PACKET_SIZE &&
+                  PEER_PACKET_SIZE <= PEER_MAX_PACKET_SIZE,
+              "Default packet size sanity check");
+static_assert(PEER_MAX_PACKET_SIZE < 65536,
+              "Packet size sanity check");
 static_assert(PEER_MAX_MESSAGE_SIZE < 1024,
               "Max message size sanity check");
 
-kit_status_t peer_init(peer_t *const peer, peer_mode_t const mode,
-                       kit_allocator_t const alloc) {
+peer_config_t peer_config_default(void) {
+  peer_config_t config;
+  memset(&config, 0, sizeof config);
+
+  config.packet_size                = PEER_PACKET_SIZE;
+  config.timeout_heartbeat          = PEER_TIMEOUT_HEARTBEAT;
+  config.timeout_ping               = PEER_TIMEOUT_PING;
+  config.timeout_connection         = PEER_TIMEOUT_CONNECTION;
+  config.trail_min.serial_size      = PEER_TRAIL_SERIAL_MIN;
+  config.trail_min.scatter_size     = PEER_TRAIL_SCATTER_MIN;
+  config.trail_min.scatter_distance = PEER_TRAIL_DISTANCE_MIN;
+  config.trail_max.serial_size      = PEER_TRAIL_SERIAL_MAX;
+  config.trail_max.scatter_size     = PEER_TRAIL_SCATTER_MAX;
+  config.trail_max.scatter_distance = PEER_TRAIL_DISTANCE_MAX;
+  config.redundancy                 = PEER_REDUNDANCY_TRAIL;
+  config.checksum                   = PEER_CHECKSUM_MESSAGE;
+  config.history                    = PEER_HISTORY;
+  config.send_threads               = PEER_SEND_THREADS;
+  config.submit_capacity            = PEER_SUBMIT_CAPACITY;
+  config.pace_rate                  = PEER_UNDEFINED;
+  config.pace_burst                 = PEER_PACE_BURST;
+
+  return config;
+}
+
+static int trail_is_valid(peer_trail_t const *const min,
+                          peer_trail_t const *const max) {
+  return min->serial_size >= 0 &&
+         min->serial_size <= max->serial_size &&
+         min->scatter_size >= 0 &&
+         min->scatter_size <= max->scatter_size &&
+         min->scatter_distance >= 0 &&
+         min->scatter_distance <= max->scatter_distance;
+}
+
+static void messages_init(peer_messages_t *const m,
+                          kit_allocator_t const  alloc) {
+  memset(m, 0, sizeof *m);
+  m->alloc = alloc;
+}
+
+kit_status_t peer_init(peer_t *const              peer,
+                       peer_mode_t const          mode,
+                       peer_config_t const *const config,
+                       kit_allocator_t const      alloc) {
   assert(peer != NULL);
   assert(mode == PEER_HOST || mode == PEER_CLIENT);
 
@@ -26,10 +71,33 @@ kit_status_t peer_init(peer_t *const peer, peer_mode_t const mode,
   if (mode != PEER_HOST && mode != PEER_CLIENT)
     return PEER_ERROR_INVALID_MODE;
 
+  peer_config_t const c = config != NULL ? *config
+                                         : peer_config_default();
+
+  assert(c.packet_size >= PEER_MIN_PACKET_SIZE &&
+         c.packet_size <= PEER_MAX_PACKET_SIZE);
+  assert(trail_is_valid(&c.trail_min, &c.trail_max));
+  assert(c.send_threads >= 1);
+  assert(c.submit_capacity >= 0);
+  assert(c.pace_rate == PEER_UNDEFINED ||
+         (c.pace_rate > 0 && c.pace_burst > 0));
+
+  if (c.packet_size < PEER_MIN_PACKET_SIZE ||
+      c.packet_size > PEER_MAX_PACKET_SIZE)
+    return PEER_ERROR_INVALID_PACKET_SIZE;
+  if (!trail_is_valid(&c.trail_min, &c.trail_max))
+    return PEER_ERROR_INVALID_COUNT;
+  if (c.send_threads < 1 || c.submit_capacity < 0)
+    return PEER_ERROR_INVALID_COUNT;
+  if (c.pace_rate != PEER_UNDEFINED &&
+      (c.pace_rate <= 0 || c.pace_burst <= 0))
+    return PEER_ERROR_INVALID_COUNT;
+
   memset(peer, 0, sizeof *peer);
 
-  peer->alloc = alloc;
-  peer->mode  = mode;
+  peer->alloc  = alloc;
+  peer->mode   = mode;
+  peer->config = c;
 
   /*  We don't need strong unpredictable random numbers.
    */
@@ -39,7 +107,21 @@ kit_status_t peer_init(peer_t *const peer, peer_mode_t const mode,
   mt64_rotate(&peer->mt64);
 
   DA_INIT(peer->slots, 0, alloc);
-  DA_INIT(peer->queue, 0, alloc);
+  messages_init(&peer->queue.messages, alloc);
+  DA_INIT(peer->queue.log.blocks, 0, alloc);
+
+  peer_arena_init(&peer->scratch, alloc);
+
+  peer->snapshot.index = PEER_UNDEFINED;
+  DA_INIT(peer->snapshot.data, 0, alloc);
+
+  kit_status_t const s = peer_submit_init(
+      &peer->submit, c.submit_capacity, alloc);
+
+  if (s != KIT_OK) {
+    peer_destroy(peer);
+    return s;
+  }
 
   if (mode == PEER_HOST) {
     /*  Actor id is a host's slot index corresponding to the peer.
@@ -86,19 +168,244 @@ kit_status_t peer_open(peer_t *const peer, peer_ids_ref_t const ids) {
     slot->local.is_id_resolved = 1;
     slot->remote.id            = PEER_UNDEFINED;
     slot->actor = peer->mode == PEER_HOST ? i : PEER_UNDEFINED;
+    slot->loss  = PEER_LOSS_INITIAL;
+
+    slot->remote_loss = PEER_LOSS_INITIAL;
+
+    slot->clock_ping     = peer->config.timeout_ping;
+    slot->snapshot_index = PEER_UNDEFINED;
+    slot->pace_tokens    = peer->config.pace_burst;
+
+    for (ptrdiff_t k = 0; k < PEER_RESEND_WINDOW; k++)
+      slot->resend[k].index = PEER_UNDEFINED;
+
+    messages_init(&slot->queue.messages, peer->alloc);
+    DA_INIT(slot->queue.log.blocks, 0, peer->alloc);
+
+    peer_fec_encoder_init(&slot->fec_out);
+    peer_fec_decoder_init(&slot->fec_in);
+  }
+
+  return KIT_OK;
+}
+
+static void log_release(peer_log_t *const log, ptrdiff_t const n) {
+  /*  Release first n blocks.
+   */
+
+  assert(n >= 0 && n <= log->blocks.size);
+
+  kit_allocator_t const alloc = log->blocks.alloc;
+
+  for (ptrdiff_t i = 0; i < n; i++)
+    if (log->blocks.values[i].data != NULL)
+      alloc.deallocate(alloc.state, log->blocks.values[i].data);
+
+  if (n < log->blocks.size)
+    memmove(log->blocks.values, log->blocks.values + n,
+            (log->blocks.size - n) * sizeof *log->blocks.values);
+
+  DA_RESIZE(log->blocks, log->blocks.size - n);
+  log->offset += n;
+
+  if (log->blocks.size == 0) {
+    log->size     = 0;
+    log->capacity = 0;
+  }
+}
+
+static kit_status_t log_reserve(peer_log_t *const log,
+                                ptrdiff_t const   size) {
+  /*  Grow the last block to fit the size, at least twice.
+   */
+
+  if (size <= log->capacity)
+    return KIT_OK;
+
+  ptrdiff_t capacity = log->capacity * 2;
+  if (capacity < size)
+    capacity = size;
+  if (capacity > PEER_LOG_BLOCK_SIZE)
+    capacity = PEER_LOG_BLOCK_SIZE;
+
+  kit_allocator_t const   alloc = log->blocks.alloc;
+  peer_log_block_t *const last  = log->blocks.values +
+                                 (log->blocks.size - 1);
+
+  uint8_t *const data = (uint8_t *) alloc.allocate(alloc.state,
+                                                   capacity);
+  if (data == NULL)
+    return PEER_ERROR_BAD_ALLOC;
+
+  if (last->data != NULL) {
+    if (log->size > 0)
+      memcpy(data, last->data, log->size);
+    alloc.deallocate(alloc.state, last->data);
+  }
+
+  last->data    = data;
+  log->capacity = capacity;
+
+  return KIT_OK;
+}
+
+static kit_status_t log_append(peer_log_t *const      log,
+                               peer_chunk_ref_t const data,
+                               ptrdiff_t *const       position) {
+  assert(data.size >= 0 && data.size <= PEER_LOG_BLOCK_SIZE);
+
+  if (data.size == 0) {
+    *position = 0;
+    return KIT_OK;
+  }
+
+  if (log->blocks.size == 0 ||
+      log->size + data.size > PEER_LOG_BLOCK_SIZE) {
+    /*  Add a new block. Memory is allocated on reserve.
+     */
+
+    ptrdiff_t const n = log->blocks.size;
+
+    DA_RESIZE(log->blocks, n + 1);
+    if (log->blocks.size != n + 1)
+      return PEER_ERROR_BAD_ALLOC;
+
+    log->blocks.values[n].data = NULL;
+    log->blocks.values[n].live = 0;
+    log->size                  = 0;
+    log->capacity              = 0;
+  }
+
+  kit_status_t const s = log_reserve(log, log->size + data.size);
+  if (s != KIT_OK)
+    return s;
+
+  peer_log_block_t *const last = log->blocks.values +
+                                 (log->blocks.size - 1);
+
+  memcpy(last->data + log->size, data.values, data.size);
+  last->live++;
+
+  *position = (log->offset + log->blocks.size - 1) *
+                  PEER_LOG_BLOCK_SIZE +
+              log->size;
+  log->size += data.size;
+
+  return KIT_OK;
+}
+
+static void log_unref(peer_log_t *const log,
+                      ptrdiff_t const   position) {
+  ptrdiff_t const block_index = position / PEER_LOG_BLOCK_SIZE -
+                                log->offset;
 
-    DA_INIT(slot->queue, 0, peer->alloc);
+  assert(block_index >= 0 && block_index < log->blocks.size);
+  assert(log->blocks.values[block_index].live > 0);
+
+  log->blocks.values[block_index].live--;
+}
+
+static uint8_t const *log_data(peer_log_t const *const log,
+                               ptrdiff_t const         position) {
+  ptrdiff_t const block_index = position / PEER_LOG_BLOCK_SIZE -
+                                log->offset;
+
+  assert(block_index >= 0 && block_index < log->blocks.size);
+
+  return log->blocks.values[block_index].data +
+         position % PEER_LOG_BLOCK_SIZE;
+}
+
+static void messages_destroy(peer_messages_t *const m) {
+  if (m->values != NULL && m->alloc.deallocate != NULL)
+    m->alloc.deallocate(m->alloc.state, m->values);
+
+  m->values   = NULL;
+  m->capacity = 0;
+  m->head     = 0;
+  m->size     = 0;
+}
+
+static peer_message_t *messages_at(peer_messages_t const *const m,
+                                   ptrdiff_t const              k) {
+  return m->values + ((m->head + k) & (m->capacity - 1));
+}
+
+static kit_status_t messages_resize(peer_messages_t *const m,
+                                    ptrdiff_t const        size) {
+  /*  Grow the ring, new messages are zeroed. On reallocation the
+   *  retained messages are unwrapped to the beginning.
+   */
+
+  assert(size >= m->size);
+
+  if (size > m->capacity) {
+    ptrdiff_t capacity = m->capacity > 0 ? m->capacity : 16;
+    while (capacity < size) capacity *= 2;
+
+    if (m->alloc.allocate == NULL)
+      return PEER_ERROR_BAD_ALLOC;
+
+    peer_message_t *const values = (peer_message_t *)
+        m->alloc.allocate(m->alloc.state,
+                          capacity * sizeof *values);
+
+    if (values == NULL)
+      return PEER_ERROR_BAD_ALLOC;
+
+    ptrdiff_t const first = m->capacity - m->head < m->size
+                                ? m->capacity - m->head
+                                : m->size;
+
+    if (first > 0)
+      memcpy(values, m->values + m->head, first * sizeof *values);
+    if (m->size > first)
+      memcpy(values + first, m->values,
+             (m->size - first) * sizeof *values);
+
+    ptrdiff_t const n = m->size;
+
+    messages_destroy(m);
+
+    m->values   = values;
+    m->capacity = capacity;
+    m->size     = n;
   }
 
+  for (ptrdiff_t k = m->size; k < size; k++)
+    memset(messages_at(m, k), 0, sizeof *m->values);
+
+  m->size = size;
+
   return KIT_OK;
 }
 
+static void messages_release(peer_messages_t *const m,
+                             ptrdiff_t const        n) {
+  assert(n >= 0 && n <= m->size);
+
+  m->head = m->size > n ? (m->head + n) & (m->capacity - 1) : 0;
+  m->size -= n;
+}
+
 static void queue_destroy(peer_queue_t *const q) {
-  for (ptrdiff_t i = 0; i < q->size; i++)
-    DA_DESTROY(q->values[i].data);
-  DA_DESTROY(*q);
+  log_release(&q->log, q->log.blocks.size);
+  DA_DESTROY(q->log.blocks);
+  messages_destroy(&q->messages);
+}
+
+static ptrdiff_t queue_end(peer_queue_t const *const q) {
+  return q->offset + q->messages.size;
 }
 
+static peer_message_t *queue_at(peer_queue_t const *const q,
+                                ptrdiff_t const           index) {
+  assert(index >= q->offset && index < queue_end(q));
+  return messages_at(&q->messages, index - q->offset);
+}
+
+static void shards_destroy(peer_t *peer);
+
 kit_status_t peer_destroy(peer_t *const peer) {
   assert(peer != NULL);
 
@@ -112,32 +419,38 @@ kit_status_t peer_destroy(peer_t *const peer) {
 
   queue_destroy(&peer->queue);
 
+  peer_arena_destroy(&peer->scratch);
+
+  shards_destroy(peer);
+
+  peer_submit_destroy(&peer->submit);
+
+  DA_DESTROY(peer->snapshot.data);
+
   return KIT_OK;
 }
 
 static kit_status_t queue_append(peer_queue_t *const q,
                                  peer_time_t time, ptrdiff_t actor,
-                                 peer_chunk_ref_t const data,
-                                 kit_allocator_t        alloc) {
-  ptrdiff_t index = q->size;
-  DA_RESIZE(*q, index + 1);
-  if (q->size != index + 1)
-    return PEER_ERROR_BAD_ALLOC;
+                                 peer_chunk_ref_t const data) {
+  peer_messages_t *const m = &q->messages;
 
-  memset(q->values + index, 0, sizeof *q->values);
+  ptrdiff_t    position = 0;
+  kit_status_t s        = log_append(&q->log, data, &position);
+  if (s != KIT_OK)
+    return s;
 
-  q->values[index].is_ready = 1;
-  q->values[index].time     = time;
-  q->values[index].actor    = actor;
+  s = messages_resize(m, m->size + 1);
+  if (s != KIT_OK)
+    return s;
 
-  DA_INIT(q->values[index].data, data.size, alloc);
-  if (q->values[index].data.size != data.size) {
-    DA_RESIZE(*q, index);
-    return PEER_ERROR_BAD_ALLOC;
-  }
+  peer_message_t *const message = messages_at(m, m->size - 1);
 
-  if (data.size > 0)
-    memcpy(q->values[index].data.values, data.values, data.size);
+  message->is_ready    = 1;
+  message->time        = time;
+  message->actor       = actor;
+  message->data_offset = position;
+  message->data_size   = data.size;
 
   return KIT_OK;
 }
@@ -145,8 +458,7 @@ static kit_status_t queue_append(peer_queue_t *const q,
 static kit_status_t queue_insert(peer_queue_t *const q,
                                  ptrdiff_t const     index,
                                  peer_time_t time, ptrdiff_t actor,
-                                 peer_chunk_ref_t const data,
-                                 kit_allocator_t        alloc) {
+                                 peer_chunk_ref_t const data) {
   if (index == PEER_UNDEFINED)
     /*  Don't save unindexed messages.
      */
@@ -157,7 +469,15 @@ static kit_status_t queue_insert(peer_queue_t *const q,
   if (index < 0)
     return PEER_ERROR_INVALID_MESSAGE_INDEX;
 
-  if (index < q->size && q->values[index].is_ready) {
+  if (index < q->offset)
+    /*  Message was already released.
+     */
+    return KIT_OK;
+
+  peer_messages_t *const m = &q->messages;
+  ptrdiff_t const        k = index - q->offset;
+
+  if (k < m->size && messages_at(m, k)->is_ready) {
     /*  FIXME
      *  Check if message is the same.
      */
@@ -166,31 +486,248 @@ static kit_status_t queue_insert(peer_queue_t *const q,
     /*  Add message to the mutual queue.
      */
 
-    ptrdiff_t const n = q->size;
+    if (k >= m->size) {
+      kit_status_t const s = messages_resize(m, k + 1);
+      if (s != KIT_OK)
+        return s;
+    }
+
+    ptrdiff_t          position = 0;
+    kit_status_t const s = log_append(&q->log, data, &position);
+    if (s != KIT_OK)
+      return s;
 
-    if (index >= n) {
-      DA_RESIZE(*q, index + 1);
-      if (q->size != index + 1)
-        return PEER_ERROR_BAD_ALLOC;
+    peer_message_t *const message = messages_at(m, k);
 
-      memset(q->values + n, 0, (index + 1 - n) * sizeof *q->values);
-    }
+    message->is_ready    = 1;
+    message->time        = time;
+    message->actor       = actor;
+    message->data_offset = position;
+    message->data_size   = data.size;
+  }
 
-    DA_INIT(q->values[index].data, data.size, alloc);
-    if (q->values[index].data.size != data.size)
-      return PEER_ERROR_BAD_ALLOC;
+  return KIT_OK;
+}
+
+peer_queue_window_t peer_queue_window(peer_queue_t const *const q) {
+  assert(q != NULL);
+
+  peer_queue_window_t window = { .begin = 0, .end = 0 };
+
+  if (q != NULL) {
+    window.begin = q->offset;
+    window.end   = queue_end(q);
+  }
+
+  return window;
+}
+
+peer_message_t const *peer_queue_message(
+    peer_queue_t const *const q, ptrdiff_t const index) {
+  assert(q != NULL);
+
+  if (q == NULL || index < q->offset || index >= queue_end(q))
+    return NULL;
 
-    q->values[index].is_ready = 1;
-    q->values[index].time     = time;
-    q->values[index].actor    = actor;
+  return queue_at(q, index);
+}
+
+peer_chunk_ref_t peer_queue_data(peer_queue_t const *const q,
+                                 ptrdiff_t const           index) {
+  assert(q != NULL);
+
+  peer_chunk_ref_t data = { .size = 0, .values = NULL };
+
+  if (q == NULL || index < q->offset || index >= queue_end(q))
+    return data;
+
+  peer_message_t const *const message = queue_at(q, index);
+
+  if (!message->is_ready || message->data_size == 0)
+    return data;
+
+  data.size   = message->data_size;
+  data.values = log_data(&q->log, message->data_offset);
+  return data;
+}
+
+kit_status_t peer_queue_trim(peer_queue_t *const q,
+                             ptrdiff_t const     index) {
+  assert(q != NULL);
+
+  if (q == NULL)
+    return PEER_ERROR_INVALID_MESSAGE;
+
+  ptrdiff_t n = index - q->offset;
+
+  if (n > q->messages.size)
+    n = q->messages.size;
+  if (n <= 0)
+    return KIT_OK;
+
+  peer_messages_t *const m = &q->messages;
+
+  for (ptrdiff_t i = 0; i < n; i++) {
+    peer_message_t const *const message = messages_at(m, i);
+
+    if (message->is_ready && message->data_size > 0)
+      log_unref(&q->log, message->data_offset);
+  }
+
+  messages_release(m, n);
+  q->offset += n;
+
+  /*  Payloads may be appended out of order, so each block counts
+   *  its retained payloads. Release first blocks without them, the
+   *  last block is kept for new payloads.
+   */
+
+  peer_log_t *const log = &q->log;
+  ptrdiff_t         k   = 0;
+
+  while (k + 1 < log->blocks.size && log->blocks.values[k].live == 0)
+    k++;
+
+  log_release(log, k);
+
+  return KIT_OK;
+}
+
+peer_message_batch_t peer_read(peer_t const *const peer,
+                               ptrdiff_t *const    cursor,
+                               ptrdiff_t const     max_size) {
+  assert(peer != NULL);
+  assert(cursor != NULL);
+  assert(max_size == PEER_UNDEFINED || max_size >= 0);
+
+  peer_message_batch_t batch;
+  memset(&batch, 0, sizeof batch);
 
-    if (data.size > 0)
-      memcpy(q->values[index].data.values, data.values, data.size);
+  if (peer == NULL || cursor == NULL)
+    return batch;
+
+  peer_queue_t const *const q = &peer->queue;
+
+  /*  Host's queued messages don't have time until the next tick.
+   */
+  ptrdiff_t end = peer->mode == PEER_HOST ? peer->queue_index
+                                          : queue_end(q);
+
+  ptrdiff_t index = *cursor;
+
+  if (index < q->offset)
+    index = q->offset;
+
+  if (max_size != PEER_UNDEFINED && end - index > max_size)
+    end = index + max_size;
+
+  /*  Batch is contiguous, stop where the ring wraps around.
+   */
+  if (index < end) {
+    peer_messages_t const *const m = &q->messages;
+    ptrdiff_t const wrap = m->capacity - (queue_at(q, index) -
+                                          m->values);
+    if (end - index > wrap)
+      end = index + wrap;
+  }
+
+  ptrdiff_t size = 0;
+
+  while (index + size < end && queue_at(q, index + size)->is_ready)
+    size++;
+
+  batch.index = index;
+  batch.size  = size;
+
+  if (size > 0)
+    batch.values = queue_at(q, index);
+
+  *cursor = index + size;
+
+  return batch;
+}
+
+kit_status_t peer_snapshot(peer_t *const          host,
+                           ptrdiff_t const        index,
+                           peer_chunk_ref_t const data) {
+  assert(host != NULL);
+  assert(data.size == 0 || data.values != NULL);
+
+  if (host == NULL)
+    return PEER_ERROR_INVALID_PEER;
+  if (host->mode != PEER_HOST)
+    return PEER_ERROR_INVALID_MODE;
+  if (data.size < 0 || (data.size > 0 && data.values == NULL))
+    return PEER_ERROR_INVALID_MESSAGE;
+  if (index < host->queue.offset || index > queue_end(&host->queue) ||
+      index < host->snapshot.index)
+    return PEER_ERROR_INVALID_MESSAGE_INDEX;
+
+  /*  Fragment header has 32-bit size and offset.
+   */
+  if (data.size > (ptrdiff_t) UINT32_MAX)
+    return PEER_ERROR_INVALID_MESSAGE_SIZE;
+
+  peer_snapshot_t *const snapshot = &host->snapshot;
+
+  /*  Clients tell snapshots apart by the index only. Transfers in
+   *  progress can't switch to different data at the same index.
+   */
+  if (index == snapshot->index)
+    return kit_ar_equal_bytes(1, data.size, data.values, 1,
+                              snapshot->data.size,
+                              snapshot->data.values)
+               ? KIT_OK
+               : PEER_ERROR_INVALID_MESSAGE_INDEX;
+
+  DA_RESIZE(snapshot->data, data.size);
+  if (snapshot->data.size != data.size) {
+    DA_RESIZE(snapshot->data, 0);
+    snapshot->index       = PEER_UNDEFINED;
+    snapshot->received    = 0;
+    snapshot->is_complete = 0;
+    return PEER_ERROR_BAD_ALLOC;
   }
 
+  if (data.size > 0)
+    memcpy(snapshot->data.values, data.values, data.size);
+
+  snapshot->index       = index;
+  snapshot->received    = data.size;
+  snapshot->is_complete = 1;
+
   return KIT_OK;
 }
 
+peer_snapshot_ref_t peer_snapshot_read(peer_t const *const peer) {
+  assert(peer != NULL);
+
+  peer_snapshot_ref_t ref;
+  memset(&ref, 0, sizeof ref);
+  ref.index = PEER_UNDEFINED;
+
+  if (peer == NULL || !peer->snapshot.is_complete)
+    return ref;
+
+  ref.index       = peer->snapshot.index;
+  ref.data.size   = peer->snapshot.data.size;
+  ref.data.values = peer->snapshot.data.values;
+
+  return ref;
+}
+
+static ptrdiff_t packet_header_max(peer_t const *const peer) {
+  /*  Largest header of the packets the peer writes. Compact packets
+   *  always have the checksum.
+   */
+
+  if (peer->config.compact ||
+      peer->config.checksum == PEER_CHECKSUM_PACKET)
+    return peer_packet_header_size(PEER_PACKET_MODE_CHECKSUM);
+
+  return peer_packet_header_size(PEER_PACKET_MODE_PLAIN);
+}
+
 kit_status_t peer_queue(peer_t *const          peer,
                         peer_chunk_ref_t const message_data) {
   assert(peer != NULL);
@@ -201,18 +738,25 @@ kit_status_t peer_queue(peer_t *const          peer,
   if (message_data.size == 0 && message_data.values == NULL)
     return PEER_ERROR_INVALID_MESSAGE;
 
+  /*  Message should fit in a packet.
+   */
+  if (message_data.size > PEER_MAX_MESSAGE_SIZE ||
+      packet_header_max(peer) + PEER_N_MESSAGE_DATA +
+              message_data.size >
+          peer->config.packet_size)
+    return PEER_ERROR_INVALID_MESSAGE_SIZE;
+
   peer_time_t const time  = 0;
   ptrdiff_t const   actor = peer->actor;
 
   switch (peer->mode) {
     case PEER_HOST:
-      return queue_append(&peer->queue, time, actor, message_data,
-                          peer->alloc);
+      return queue_append(&peer->queue, time, actor, message_data);
 
     case PEER_CLIENT:
       if (peer->slots.size > 0)
         return queue_append(&peer->slots.values[0].queue, time, actor,
-                            message_data, peer->alloc);
+                            message_data);
 
     default:;
   }
@@ -220,6 +764,61 @@ kit_status_t peer_queue(peer_t *const          peer,
   return PEER_ERROR_INVALID_MODE;
 }
 
+kit_status_t peer_submit(peer_t *const          peer,
+                         peer_chunk_ref_t const message_data) {
+  assert(peer != NULL);
+  assert(message_data.size == 0 || message_data.values != NULL);
+
+  if (peer == NULL)
+    return PEER_ERROR_INVALID_PEER;
+  if (message_data.size == 0 && message_data.values == NULL)
+    return PEER_ERROR_INVALID_MESSAGE;
+
+  /*  Check the size now, the message can't be rejected later.
+   */
+  if (message_data.size > PEER_MAX_MESSAGE_SIZE ||
+      packet_header_max(peer) + PEER_N_MESSAGE_DATA +
+              message_data.size >
+          peer->config.packet_size)
+    return PEER_ERROR_INVALID_MESSAGE_SIZE;
+
+  kit_status_t const s = peer_submit_push(&peer->submit,
+                                          message_data);
+
+  if (s == KIT_OK && peer->wake != NULL)
+    peer->wake(peer->wake_state);
+
+  return s;
+}
+
+static kit_status_t submit_drain(peer_t *const peer) {
+  /*  Client keeps submitted messages until it has a session. Drain
+   *  at most one queue length, so producers can't stall the tick.
+   */
+
+  if (peer->mode == PEER_CLIENT && peer->slots.size == 0)
+    return KIT_OK;
+
+  kit_status_t status = KIT_OK;
+
+  for (ptrdiff_t i = 0; i < peer->submit.capacity; i++) {
+    peer_submit_cell_t const *const cell = peer_submit_front(
+        &peer->submit);
+
+    if (cell == NULL)
+      break;
+
+    peer_chunk_ref_t const data = { .size   = cell->size,
+                                    .values = cell->data };
+
+    status |= peer_queue(peer, data);
+
+    peer_submit_pop(&peer->submit);
+  }
+
+  return status;
+}
+
 kit_status_t peer_connect(peer_t *const   client,
                           ptrdiff_t const server_id) {
   assert(client != NULL);
@@ -242,23 +841,394 @@ kit_status_t peer_connect(peer_t *const   client,
   return PEER_ERROR_NO_FREE_SLOTS;
 }
 
-kit_status_t peer_input(peer_t *const            peer,
-                        peer_packets_ref_t const packets) {
+static int is_index_acked(peer_slot_t const *const slot,
+                          ptrdiff_t const          index) {
+  if (index < slot->ack_index)
+    return 1;
+  if (index == slot->ack_index)
+    return 0;
+
+  ptrdiff_t const k = index - slot->ack_index - 1;
+  return k < 64 && ((slot->ack_mask >> k) & 1) != 0;
+}
+
+static int is_received(peer_queue_t const *const q,
+                       ptrdiff_t const           index) {
+  if (index < q->offset)
+    return 1;
+  return index < queue_end(q) && queue_at(q, index)->is_ready;
+}
+
+static ptrdiff_t trail_scale(ptrdiff_t const min,
+                             ptrdiff_t const max,
+                             uint32_t const  loss) {
+  assert(min <= max);
+
+  if (max <= min)
+    return min;
+
+  uint32_t const l = loss < PEER_LOSS_SATURATION
+                         ? loss
+                         : PEER_LOSS_SATURATION;
+
+  return min + (ptrdiff_t) (((int64_t) (max - min) * l) /
+                            PEER_LOSS_SATURATION);
+}
+
+peer_trail_t peer_slot_trail(peer_t const *const      peer,
+                             peer_slot_t const *const slot) {
   assert(peer != NULL);
+  assert(slot != NULL);
 
-  if (peer == NULL)
-    return PEER_ERROR_INVALID_PEER;
+  peer_trail_t trail;
+  memset(&trail, 0, sizeof trail);
 
-  kit_status_t status = KIT_OK;
+  if (peer == NULL || slot == NULL)
+    return trail;
 
-  for (ptrdiff_t i = 0; i < packets.size; i++) {
-    peer_packet_t const *const packet = packets.values + i;
+  peer_trail_t const *const min = &peer->config.trail_min;
+  peer_trail_t const *const max = &peer->config.trail_max;
 
-    int slot_found = 0;
+  uint32_t const loss = slot->remote_loss;
 
-    /*  Skip if packet not intended for this peer.
-     */
-    for (ptrdiff_t j = 0; j < peer->slots.size; j++)
+  trail.serial_size      = trail_scale(min->serial_size,
+                                       max->serial_size, loss);
+  trail.scatter_size     = trail_scale(min->scatter_size,
+                                       max->scatter_size, loss);
+  trail.scatter_distance = trail_scale(
+      min->scatter_distance, max->scatter_distance, loss);
+
+  return trail;
+}
+
+static void loss_update(peer_slot_t *const slot, int const is_lost) {
+  uint32_t const sample = is_lost ? PEER_LOSS_ONE : 0;
+
+  slot->loss = slot->loss - (slot->loss >> PEER_LOSS_SHIFT) +
+               (sample >> PEER_LOSS_SHIFT);
+}
+
+static void loss_sample(peer_slot_t *const        slot,
+                        peer_queue_t const *const q,
+                        ptrdiff_t const           index) {
+  /*  Update the loss estimate before the incoming message is added
+   *  to the queue. Messages skipped by the index are lost. Messages
+   *  received late were already counted as lost.
+   */
+
+  if (index < 0)
+    return;
+
+  ptrdiff_t const end = queue_end(q);
+
+  if (index >= end) {
+    /*  After this many samples the estimate is saturated anyway.
+     */
+    ptrdiff_t const max_gap = 8 << PEER_LOSS_SHIFT;
+
+    for (ptrdiff_t i = end; i < index && i < end + max_gap; i++)
+      loss_update(slot, 1);
+
+    loss_update(slot, 0);
+  } else if (is_received(q, index))
+    slot->in_duplicates++;
+}
+
+static kit_status_t time_write(peer_packet_builder_t *const b,
+                               uint8_t const                id,
+                               peer_time_t const            value,
+                               peer_time_t const            time,
+                               ptrdiff_t const              actor) {
+  /*  Write ping or pong message.
+   */
+
+  uint8_t data[9];
+  data[0] = id;
+  peer_write_u64(data + 1, (uint64_t) value);
+
+  peer_chunk_ref_t const ref = { .size   = sizeof data,
+                                 .values = data };
+
+  return peer_builder_write(b, PEER_MESSAGE_MODE_SERVICE,
+                            PEER_UNDEFINED, time, actor, ref);
+}
+
+static kit_status_t ping_read(peer_slot_t *const   slot,
+                              uint8_t const *const data,
+                              ptrdiff_t const      data_size) {
+  if (data_size != 9)
+    return PEER_ERROR_INVALID_MESSAGE_SIZE;
+
+  slot->pong_time   = (peer_time_t) peer_read_u64(data + 1);
+  slot->is_pong_due = 1;
+
+  return KIT_OK;
+}
+
+static void rtt_update(peer_rtt_t *const rtt, peer_time_t const r) {
+  /*  Same smoothing as TCP retransmission timer uses, with gains of
+   *  1/8 for the average and 1/4 for the deviation.
+   */
+
+  if (rtt->samples == 0) {
+    rtt->smoothed = r;
+    rtt->variance = r / 2;
+    rtt->min      = r;
+    rtt->max      = r;
+  } else {
+    peer_time_t const delta = r - rtt->smoothed;
+
+    rtt->smoothed += delta / 8;
+    rtt->variance += ((delta < 0 ? -delta : delta) - rtt->variance) /
+                     4;
+
+    if (rtt->min > r)
+      rtt->min = r;
+    if (rtt->max < r)
+      rtt->max = r;
+  }
+
+  rtt->samples++;
+}
+
+static kit_status_t pong_read(peer_slot_t *const   slot,
+                              peer_time_t const    time_local,
+                              uint8_t const *const data,
+                              ptrdiff_t const      data_size) {
+  if (data_size != 9)
+    return PEER_ERROR_INVALID_MESSAGE_SIZE;
+
+  peer_time_t const ping_time = (peer_time_t) peer_read_u64(data +
+                                                            1);
+
+  /*  Ignore answers to lost or outdated pings.
+   */
+  if (!slot->is_ping_sent || ping_time != slot->ping_time ||
+      ping_time > time_local)
+    return KIT_OK;
+
+  rtt_update(&slot->rtt, time_local - ping_time);
+  slot->is_ping_sent = 0;
+
+  return KIT_OK;
+}
+
+peer_rtt_t peer_slot_rtt(peer_slot_t const *const slot) {
+  assert(slot != NULL);
+
+  if (slot == NULL) {
+    peer_rtt_t rtt;
+    memset(&rtt, 0, sizeof rtt);
+    return rtt;
+  }
+
+  return slot->rtt;
+}
+
+peer_backlog_t peer_slot_backlog(peer_t const *const      peer,
+                                 peer_slot_t const *const slot) {
+  assert(peer != NULL);
+  assert(slot != NULL);
+
+  peer_backlog_t backlog;
+  memset(&backlog, 0, sizeof backlog);
+
+  if (peer == NULL || slot == NULL)
+    return backlog;
+
+  /*  Host sends the mutual queue, client sends the slot queue.
+   */
+  peer_queue_t const *const q = peer->mode == PEER_HOST
+                                    ? &peer->queue
+                                    : &slot->queue;
+
+  if (slot->out_index < queue_end(q))
+    backlog.messages = queue_end(q) - slot->out_index;
+
+  if (slot->snapshot_index != PEER_UNDEFINED)
+    backlog.snapshot_bytes = peer->snapshot.data.size -
+                             slot->snapshot_offset;
+
+  backlog.pace_tokens = peer->config.pace_rate == PEER_UNDEFINED
+                            ? PTRDIFF_MAX
+                            : slot->pace_tokens;
+
+  return backlog;
+}
+
+static kit_status_t ack_write(peer_packet_builder_t *const b,
+                              peer_queue_t const *const    q_in,
+                              ptrdiff_t const              in_index,
+                              uint32_t const               loss,
+                              peer_time_t const            time,
+                              ptrdiff_t const              actor) {
+  /*  Report the first missing incoming message index, received
+   *  messages after it, and our loss estimate for them.
+   */
+
+  uint64_t mask = 0;
+
+  for (ptrdiff_t k = 0; k < 64; k++)
+    if (is_received(q_in, in_index + 1 + k))
+      mask |= ((uint64_t) 1) << k;
+
+  uint8_t data[21];
+  data[0] = PEER_M_ACK;
+  peer_write_u64(data + 1, (uint64_t) in_index);
+  peer_write_u64(data + 9, mask);
+  peer_write_u32(data + 17, loss);
+
+  peer_chunk_ref_t const ref = { .size   = sizeof data,
+                                 .values = data };
+
+  return peer_builder_write(b, PEER_MESSAGE_MODE_SERVICE,
+                            PEER_UNDEFINED, time, actor, ref);
+}
+
+static kit_status_t ack_read(peer_slot_t *const   slot,
+                             uint8_t const *const data,
+                             ptrdiff_t const      data_size) {
+  if (data_size != 21)
+    return PEER_ERROR_INVALID_MESSAGE_SIZE;
+
+  ptrdiff_t const index = (ptrdiff_t) peer_read_u64(data + 1);
+  uint64_t const  mask  = peer_read_u64(data + 9);
+  uint32_t const  loss  = peer_read_u32(data + 17);
+
+  if (index < 0 || index > slot->out_index)
+    return PEER_ERROR_INVALID_MESSAGE_INDEX;
+  if (loss > PEER_LOSS_ONE)
+    return PEER_ERROR_INVALID_MESSAGE;
+
+  if (!slot->is_acked || index > slot->ack_index) {
+    slot->ack_index = index;
+    slot->ack_mask  = mask;
+  } else if (index == slot->ack_index) {
+    slot->ack_mask |= mask;
+  } else {
+    /*  Outdated acknowledgement.
+     */
+    return KIT_OK;
+  }
+
+  slot->remote_loss = loss;
+  slot->is_acked    = 1;
+  slot->is_ack_new  = 1;
+
+  return KIT_OK;
+}
+
+enum {
+  SNAPSHOT_N_INDEX  = 1,  /*  8 bytes */
+  SNAPSHOT_N_SIZE   = 9,  /*  4 bytes */
+  SNAPSHOT_N_OFFSET = 13, /*  4 bytes */
+  SNAPSHOT_N_DATA   = 17
+};
+
+static kit_status_t snapshot_read(peer_t *const        peer,
+                                  peer_slot_t *const   slot,
+                                  uint8_t const *const data,
+                                  ptrdiff_t const      data_size) {
+  /*  Fragments are accepted in order only. After a lost fragment the
+   *  rest waits for the next round.
+   */
+
+  if (data_size < SNAPSHOT_N_DATA)
+    return PEER_ERROR_INVALID_MESSAGE_SIZE;
+
+  ptrdiff_t const index  = (ptrdiff_t) peer_read_u64(
+      data + SNAPSHOT_N_INDEX);
+  ptrdiff_t const size   = peer_read_u32(data + SNAPSHOT_N_SIZE);
+  ptrdiff_t const offset = peer_read_u32(data + SNAPSHOT_N_OFFSET);
+  ptrdiff_t const chunk  = data_size - SNAPSHOT_N_DATA;
+
+  if (index < 0 || offset + chunk > size)
+    return PEER_ERROR_INVALID_MESSAGE;
+
+  peer_snapshot_t *const snapshot = &peer->snapshot;
+
+  if (index < snapshot->index ||
+      (index == snapshot->index && snapshot->is_complete)) {
+    /*  Our acknowledgement may be lost.
+     */
+    if (peer->actor != PEER_UNDEFINED)
+      slot->is_ack_due = 1;
+    return KIT_OK;
+  }
+
+  if (index != snapshot->index) {
+    DA_RESIZE(snapshot->data, size);
+    if (snapshot->data.size != size) {
+      DA_RESIZE(snapshot->data, 0);
+      snapshot->index = PEER_UNDEFINED;
+      return PEER_ERROR_BAD_ALLOC;
+    }
+
+    snapshot->index       = index;
+    snapshot->received    = 0;
+    snapshot->is_complete = 0;
+  }
+
+  if (snapshot->data.size != size)
+    return PEER_ERROR_INVALID_MESSAGE;
+
+  if (offset != snapshot->received)
+    return KIT_OK;
+
+  if (chunk > 0)
+    memcpy(snapshot->data.values + offset, data + SNAPSHOT_N_DATA,
+           chunk);
+
+  snapshot->received += chunk;
+
+  if (snapshot->received < size)
+    return KIT_OK;
+
+  snapshot->is_complete = 1;
+
+  /*  Messages before the snapshot are not needed. Acknowledge the
+   *  snapshot index, so the host starts sending messages.
+   */
+
+  peer_queue_t *const q = &peer->queue;
+
+  kit_status_t const s = peer_queue_trim(q, index);
+
+  if (q->offset < index && q->messages.size == 0)
+    q->offset = index;
+
+  if (slot->in_index < q->offset)
+    slot->in_index = q->offset;
+
+  while (is_received(q, slot->in_index)) slot->in_index++;
+
+  if (peer->actor != PEER_UNDEFINED)
+    slot->is_ack_due = 1;
+
+  return s;
+}
+
+kit_status_t peer_input(peer_t *const            peer,
+                        peer_packets_ref_t const packets) {
+  assert(peer != NULL);
+
+  if (peer == NULL)
+    return PEER_ERROR_INVALID_PEER;
+
+  kit_status_t status = KIT_OK;
+
+  peer_arena_reset(&peer->scratch);
+  kit_allocator_t const scratch = peer_arena_allocator(
+      &peer->scratch);
+
+  for (ptrdiff_t i = 0; i < packets.size; i++) {
+    peer_packet_t const *const packet = packets.values + i;
+
+    int slot_found = 0;
+
+    /*  Skip if packet not intended for this peer.
+     */
+    for (ptrdiff_t j = 0; j < peer->slots.size; j++)
       if (peer->slots.values[j].local.id == packet->destination_id) {
         slot_found = 1;
         break;
@@ -266,415 +1236,1170 @@ kit_status_t peer_input(peer_t *const            peer,
     if (!slot_found)
       continue;
 
-    slot_found = 0;
+    slot_found = 0;
+
+    for (ptrdiff_t j = 0; j < peer->slots.size; j++) {
+      peer_slot_t *const slot = peer->slots.values + j;
+
+      if (slot->local.id != packet->destination_id ||
+          slot->remote.id != packet->source_id)
+        continue;
+
+      peer_message_refs_t messages;
+      DA_INIT(messages, 0, scratch);
+
+      peer_packets_ref_t const ref = { .size = 1, .values = packet };
+
+      status |= peer_unpack_messages(ref, &messages);
+
+      /*  Client sends compact packets only if we have accepted them
+       *  in the session response.
+       */
+      if (peer->mode == PEER_HOST && peer->config.compact &&
+          packet->size >= PEER_N_PACKET_OPTIONAL &&
+          (peer_read_u8(packet->data + PEER_N_PACKET_MODE) &
+           PEER_PACKET_MODE_COMPACT) != 0)
+        slot->is_compact = 1;
+
+      /*  Rebuild a lost packet from its parity group.
+       */
+
+      peer_packet_t rebuilt;
+
+      if (peer_fec_decode(&slot->fec_in, packet, &rebuilt)) {
+        peer_packets_ref_t const rebuilt_ref = { .size   = 1,
+                                                 .values = &rebuilt };
+
+        status |= peer_unpack_messages(rebuilt_ref, &messages);
+      }
+
+      for (ptrdiff_t k = 0; k < messages.size; k++) {
+        peer_message_ref_t const *const message = messages.values +
+                                                  k;
+
+        ptrdiff_t const      data_size    = message->data.size;
+        uint8_t const *const data         = message->data.values;
+        uint8_t const        message_mode = message->mode;
+        ptrdiff_t const      index        = message->index;
+        peer_time_t const    time         = message->time;
+        ptrdiff_t const      actor        = message->actor;
+
+        if (peer->mode == PEER_HOST) {
+          /*  Check the message time.
+           *  Client's messages should not have time set.
+           */
+
+          assert(time == 0);
+
+          if (time != 0) {
+            status |= PEER_ERROR_INVALID_MESSAGE_TIME;
+            continue;
+          }
+
+          /*  Check the actor id value.
+           */
+
+          assert(actor == slot->actor);
+
+          if (actor != slot->actor) {
+            status |= PEER_ERROR_INVALID_MESSAGE_ACTOR;
+            continue;
+          }
+
+          /*  Process service-level messages.
+           */
+
+          int processed = 0;
+
+          if (message_mode == PEER_MESSAGE_MODE_SERVICE &&
+              data_size >= 1) {
+            uint8_t const service_id = peer_read_u8(data);
+
+            switch (service_id) {
+              case PEER_M_HEARTBEAT:
+                /*  Heartbeat.
+                 */
+                processed = 1;
+                break;
+
+              case PEER_M_ACK:
+                /*  Acknowledgement of our messages.
+                 */
+                status |= ack_read(slot, data, data_size);
+                processed = 1;
+                break;
+
+              case PEER_M_PING:
+                status |= ping_read(slot, data, data_size);
+                processed = 1;
+                break;
+
+              case PEER_M_PONG:
+                status |= pong_read(slot, peer->time_local, data,
+                                    data_size);
+                processed = 1;
+                break;
+
+              default:;
+            }
+          }
+
+          assert(message_mode != PEER_MESSAGE_MODE_SERVICE ||
+                 processed == 1);
+
+          if (message_mode == PEER_MESSAGE_MODE_SERVICE && !processed)
+            status |= PEER_ERROR_UNKNOWN_SERVICE_ID;
+
+          if (message_mode != PEER_MESSAGE_MODE_SERVICE) {
+            /*  Add message to the slot queue.
+             */
+
+            loss_sample(slot, &slot->queue, index);
+
+            status |= queue_insert(&slot->queue, index, time, actor,
+                                   message->data);
+
+            slot->is_ack_due = 1;
+          }
+        }
+
+        if (peer->mode == PEER_CLIENT) {
+          /*  Process service-level messages.
+           */
+
+          int processed = 0;
+
+          if (message_mode == PEER_MESSAGE_MODE_SERVICE &&
+              data_size >= 1) {
+            uint8_t const service_id = peer_read_u8(data);
+
+            switch (service_id) {
+              case PEER_M_HEARTBEAT:
+                /*  Heartbeat.
+                 */
+                processed = 1;
+                break;
+
+              case PEER_M_SESSION_RESPONSE: {
+                /*  Update client's actor id, host remote address
+                 *  and session flags.
+                 */
+                assert(data_size >= 2 &&
+                       data_size - 2 <= PEER_ADDRESS_SIZE);
+
+                if (data_size < 2 ||
+                    data_size - 2 > PEER_ADDRESS_SIZE) {
+                  status |= PEER_ERROR_INVALID_MESSAGE_SIZE;
+                  processed = 1;
+                  break;
+                }
+
+                peer->actor = actor;
+
+                uint8_t const flags = peer_read_u8(data + 1);
+
+                slot->is_compact = peer->config.compact &&
+                                   (flags & PEER_SESSION_COMPACT) !=
+                                       0;
+
+                /*  We need new id for new remote port.
+                 */
+                slot->remote.is_id_resolved = 0;
+                slot->remote.address_size   = data_size - 2;
+                memcpy(slot->remote.address_data, data + 2,
+                       data_size - 2);
+
+                /*  Packets from the new address start a new parity
+                 *  stream.
+                 */
+                peer_fec_decoder_init(&slot->fec_in);
+
+                /*  Update actor id for old messages.
+                 */
+                for (ptrdiff_t k = slot->queue.offset;
+                     k < queue_end(&slot->queue); k++)
+                  queue_at(&slot->queue, k)->actor = actor;
+
+                processed = 1;
+              } break;
+
+              case PEER_M_ACK:
+                /*  Acknowledgement of our messages.
+                 */
+                status |= ack_read(slot, data, data_size);
+                processed = 1;
+                break;
+
+              case PEER_M_PING:
+                status |= ping_read(slot, data, data_size);
+                processed = 1;
+                break;
+
+              case PEER_M_PONG:
+                status |= pong_read(slot, peer->time_local, data,
+                                    data_size);
+                processed = 1;
+                break;
+
+              case PEER_M_SNAPSHOT:
+                status |= snapshot_read(peer, slot, data, data_size);
+                processed = 1;
+                break;
+
+              default:;
+            }
+          }
+
+          assert(message_mode != PEER_MESSAGE_MODE_SERVICE ||
+                 processed == 1);
+
+          if (message_mode == PEER_MESSAGE_MODE_SERVICE && !processed)
+            status |= PEER_ERROR_UNKNOWN_SERVICE_ID;
+
+          if (message_mode != PEER_MESSAGE_MODE_SERVICE) {
+            /*  Add message to the mutual queue.
+             */
+
+            loss_sample(slot, &peer->queue, index);
+
+            status |= queue_insert(&peer->queue, index, time, actor,
+                                   message->data);
+
+            while (is_received(&peer->queue, slot->in_index))
+              slot->in_index++;
+
+            /*  Host rejects messages without the actor id.
+             */
+            if (peer->actor != PEER_UNDEFINED)
+              slot->is_ack_due = 1;
+          }
+
+          /*  Synchronize mutual time.
+           */
+
+          if (peer->time < time)
+            peer->time = time;
+        }
+      }
+
+      DA_DESTROY(messages);
+
+      slot_found = 1;
+      break;
+    }
+
+    if (slot_found || peer->mode != PEER_HOST ||
+        peer->slots.size == 0 ||
+        peer->slots.values[0].remote.id != PEER_UNDEFINED) {
+      continue;
+    }
+
+    /*  Assign a slot for the client.
+     */
+
+    /*  FIXME
+     *  Check if the client sent a session request message.
+     */
+
+    /*  New client can't read past a gap in the mutual queue. After
+     *  messages are released, only a snapshot covers them.
+     */
+    if (peer->queue.offset > 0 &&
+        peer->snapshot.index < peer->queue.offset) {
+      status |= PEER_ERROR_INVALID_OUT_INDEX;
+      continue;
+    }
+
+    for (ptrdiff_t j = 1; j < peer->slots.size; j++) {
+      peer_slot_t *const slot = peer->slots.values + j;
+
+      if (slot->remote.id == PEER_UNDEFINED &&
+          slot->local.address_size > 0) {
+        slot->state                 = PEER_SLOT_SESSION_REQUEST;
+        slot->remote.id             = packet->source_id;
+        slot->remote.is_id_resolved = 1;
+        slot->actor                 = j;
+        slot->is_compact            = 0;
+
+        slot_found = 1;
+        break;
+      }
+    }
+
+    if (!slot_found)
+      status |= PEER_ERROR_NO_FREE_SLOTS;
+  }
+
+  return status;
+}
+
+static int pace_is_open(peer_t const *const      peer,
+                        peer_slot_t const *const slot) {
+  return peer->config.pace_rate == PEER_UNDEFINED ||
+         slot->pace_tokens > 0;
+}
+
+static ptrdiff_t pace_end(peer_t const *const       peer,
+                          peer_slot_t const *const  slot,
+                          peer_queue_t const *const q) {
+  /*  End of the new messages that fit the pacer tokens. Message
+   *  headers are counted at full size, compact ones are smaller.
+   *  If there are tokens left, at least one message is sent.
+   */
+
+  if (peer->config.pace_rate == PEER_UNDEFINED)
+    return queue_end(q);
+
+  ptrdiff_t tokens = slot->pace_tokens;
+  ptrdiff_t end    = slot->out_index;
+
+  while (end < queue_end(q) && tokens > 0) {
+    tokens -= PEER_N_MESSAGE_DATA + queue_at(q, end)->data_size;
+    end++;
+  }
+
+  return end;
+}
+
+static void pace_charge(peer_t const *const         peer,
+                        peer_slot_t *const          slot,
+                        peer_packets_t const *const packets,
+                        ptrdiff_t const             begin) {
+  /*  Take tokens for all packets sent to the slot during the tick.
+   *  Retransmissions and acknowledgements are not held back, so the
+   *  debt is bounded by the bucket size. Otherwise a loss burst
+   *  would stall new messages for long.
+   */
+
+  if (peer->config.pace_rate == PEER_UNDEFINED)
+    return;
+
+  for (ptrdiff_t i = begin; i < packets->size; i++)
+    slot->pace_tokens -= packets->values[i].size;
+
+  if (slot->pace_tokens < -peer->config.pace_burst)
+    slot->pace_tokens = -peer->config.pace_burst;
+}
+
+static void pace_refill(peer_t const *const peer,
+                        peer_slot_t *const  slot,
+                        peer_time_t const   time_elapsed) {
+  ptrdiff_t const rate  = peer->config.pace_rate;
+  ptrdiff_t const burst = peer->config.pace_burst;
+
+  if (rate == PEER_UNDEFINED || slot->pace_tokens >= burst)
+    return;
+
+  if (time_elapsed > (burst - slot->pace_tokens) / rate)
+    slot->pace_tokens = burst;
+  else
+    slot->pace_tokens += rate * time_elapsed;
+
+  if (slot->pace_tokens > burst)
+    slot->pace_tokens = burst;
+}
+
+static peer_time_t pace_wait(peer_t const *const      peer,
+                             peer_slot_t const *const slot) {
+  /*  Time before the pacer allows to send again.
+   */
+
+  if (pace_is_open(peer, slot))
+    return 0;
+
+  return -slot->pace_tokens / peer->config.pace_rate + 1;
+}
+
+static kit_status_t message_write(
+    peer_packet_builder_t *const b, peer_queue_t const *const q,
+    ptrdiff_t const index) {
+  peer_message_t const *const message = queue_at(q, index);
+  peer_chunk_ref_t const      data    = peer_queue_data(q, index);
+
+  return peer_builder_write(b, PEER_MESSAGE_MODE_APPLICATION, index,
+                            message->time, message->actor, data);
+}
+
+static kit_status_t trail_write(mt64_state_t *const          rng,
+                                peer_queue_t const *const    q,
+                                ptrdiff_t const              index,
+                                peer_trail_t const *const    trail,
+                                peer_packet_builder_t *const b) {
+  assert(rng != NULL);
+  assert(q != NULL);
+  assert(trail != NULL);
+  assert(b != NULL);
+  assert(index >= q->offset && index <= queue_end(q));
+
+  kit_status_t status = KIT_OK;
+
+  /*  Released messages are not resent.
+   */
+
+  ptrdiff_t trail_size = trail->serial_size;
+
+  if (trail_size > index ||
+      index - trail_size < trail->scatter_distance)
+    trail_size = index;
+
+  for (ptrdiff_t i = index - trail_size; i < index; i++)
+    if (i >= q->offset)
+      status |= message_write(b, q, i);
+
+  ptrdiff_t scatter_trail_distance = trail->scatter_distance;
+  ptrdiff_t scatter_trail_size     = trail->scatter_size;
+
+  if (scatter_trail_distance > index - trail_size)
+    scatter_trail_distance = index - trail_size;
+  if (scatter_trail_size > scatter_trail_distance)
+    scatter_trail_size = scatter_trail_distance;
+
+  ptrdiff_t const trail_begin = index - scatter_trail_distance;
+
+  for (ptrdiff_t i = 0; i < scatter_trail_size; i++) {
+    ptrdiff_t const message_index =
+        trail_begin + (ptrdiff_t) (mt64_generate(rng) %
+                                   (uint64_t) scatter_trail_distance);
+
+    if (message_index >= q->offset)
+      status |= message_write(b, q, message_index);
+  }
+
+  return status;
+}
+
+static kit_status_t shared_pack(
+    mt64_state_t *const rng, peer_queue_t const *const q,
+    ptrdiff_t const index, ptrdiff_t const end,
+    int const is_heartbeat,
+    peer_trail_t const trail, peer_time_t const time,
+    ptrdiff_t const actor, ptrdiff_t const source_id,
+    ptrdiff_t const destination_id, ptrdiff_t const packet_size,
+    uint8_t const mode, peer_packets_t *const out_packets) {
+  /*  Pack new messages up to the end, or the heartbeat message,
+   *  followed by trail messages if the trail is not empty. The
+   *  result depends only on the message range and the trail, so it
+   *  can be shared by slots.
+   */
+
+  assert(rng != NULL);
+  assert(q != NULL);
+  assert(index >= q->offset && index <= end &&
+         end <= queue_end(q));
+
+  if (index < q->offset || index > end || end > queue_end(q))
+    return PEER_ERROR_INVALID_OUT_INDEX;
+
+  peer_packet_builder_t b;
+  peer_builder_init(&b, source_id, destination_id, packet_size,
+                    mode, out_packets);
+
+  kit_status_t status = KIT_OK;
+
+  if (is_heartbeat) {
+    uint8_t const          id_heartbeat = PEER_M_HEARTBEAT;
+    peer_chunk_ref_t const data = { .size   = 1,
+                                    .values = &id_heartbeat };
+
+    status |= peer_builder_write(&b, PEER_MESSAGE_MODE_SERVICE,
+                                 PEER_UNDEFINED, time, actor, data);
+  } else {
+    for (ptrdiff_t i = index; i < end; i++)
+      status |= message_write(&b, q, i);
+  }
+
+  if (trail.serial_size > 0 || trail.scatter_size > 0)
+    status |= trail_write(rng, q, index, &trail, &b);
+
+  status |= peer_builder_finish(&b);
+
+  return status;
+}
+
+static uint8_t packet_mode(peer_t const *const      peer,
+                           peer_slot_t const *const slot) {
+  uint8_t mode = PEER_PACKET_MODE_PLAIN;
+
+  if (slot != NULL && slot->is_compact)
+    mode |= PEER_PACKET_MODE_COMPACT;
+  if (peer->config.checksum == PEER_CHECKSUM_PACKET)
+    mode |= PEER_PACKET_MODE_CHECKSUM;
+
+  return mode;
+}
+
+static ptrdiff_t slot_retained(peer_t const *const      peer,
+                               peer_slot_t const *const slot) {
+  /*  First outgoing message index the slot may still need.
+   */
+
+  if (slot->snapshot_index != PEER_UNDEFINED)
+    return slot->snapshot_index;
+
+  if (slot->is_acked)
+    return slot->ack_index;
+
+  peer_trail_t const trail = peer_slot_trail(peer, slot);
+
+  return slot->out_index - trail.serial_size - trail.scatter_distance;
+}
+
+static peer_trail_t send_trail(peer_t const *const      peer,
+                               peer_slot_t const *const slot) {
+  /*  If the remote sends acknowledgements, lost messages are
+   *  retransmitted, and the trail only saves a round trip on a
+   *  lossy link. Scale it from zero by the reported loss, so a clean
+   *  link has no trail.
+   */
+
+  peer_trail_t trail;
+  memset(&trail, 0, sizeof trail);
+
+  if (peer->config.redundancy != PEER_REDUNDANCY_TRAIL)
+    return trail;
+
+  if (!slot->is_acked)
+    return peer_slot_trail(peer, slot);
+
+  peer_trail_t const *const max = &peer->config.trail_max;
+
+  trail.serial_size      = trail_scale(0, max->serial_size,
+                                       slot->remote_loss);
+  trail.scatter_size     = trail_scale(0, max->scatter_size,
+                                       slot->remote_loss);
+  trail.scatter_distance = trail_scale(0, max->scatter_distance,
+                                       slot->remote_loss);
+
+  return trail;
+}
+
+static int trail_equal(peer_trail_t const *const a,
+                       peer_trail_t const *const b) {
+  return a->serial_size == b->serial_size &&
+         a->scatter_size == b->scatter_size &&
+         a->scatter_distance == b->scatter_distance;
+}
+
+static kit_status_t slot_resend(peer_packet_builder_t *const b,
+                                peer_queue_t const *const    q_out,
+                                peer_slot_t *const           slot,
+                                ptrdiff_t const              begin,
+                                ptrdiff_t const              end,
+                                peer_time_t const interval,
+                                peer_time_t const time_local,
+                                int *const        written) {
+  /*  Resend lost messages in the range, skipping those acknowledged
+   *  or resent less than the interval ago.
+   */
+
+  kit_status_t status = KIT_OK;
+
+  for (ptrdiff_t i = begin; i < end; i++) {
+    if (i < q_out->offset || is_index_acked(slot, i))
+      continue;
+
+    peer_resend_t *const r = slot->resend +
+                             (i % PEER_RESEND_WINDOW);
+
+    if (r->index == i && time_local - r->time < interval)
+      continue;
+
+    status |= message_write(b, q_out, i);
+    r->index = i;
+    r->time  = time_local;
+    *written = 1;
+  }
+
+  return status;
+}
+
+static kit_status_t slot_pack(peer_t const *const       peer,
+                              peer_queue_t const *const q_out,
+                              peer_queue_t const *const q_in,
+                              peer_slot_t *const        slot,
+                              int const                 is_timeout,
+                              peer_time_t const         time,
+                              peer_packets_t *const     out_packets) {
+  /*  Pack the slot's own messages: retransmissions of messages the
+   *  remote reported missing, our acknowledgement, ping and pong.
+   *  Write them into the last packet for the slot if there is space.
+   */
+
+  peer_trail_t const trail      = peer_slot_trail(peer, slot);
+  peer_time_t const  time_local = peer->time_local;
+  ptrdiff_t const    actor      = peer->actor;
+
+  peer_packet_builder_t b;
+  peer_builder_continue(&b, slot->local.id, slot->remote.id,
+                        peer->config.packet_size,
+                        packet_mode(peer, slot),
+                        out_packets);
+
+  kit_status_t status  = KIT_OK;
+  int          written = 0;
+
+  if (slot->is_acked) {
+    /*  On a new acknowledgement, messages before the last one
+     *  received by remote are lost. On timeout, the recent messages
+     *  may be lost too.
+     */
+
+    ptrdiff_t lost_end = slot->ack_index;
+
+    if (slot->is_ack_new)
+      for (ptrdiff_t k = 0; k < 64; k++)
+        if (((slot->ack_mask >> k) & 1) != 0)
+          lost_end = slot->ack_index + 1 + k;
+
+    ptrdiff_t const recent_begin = is_timeout
+                                       ? slot->out_index -
+                                             trail.serial_size
+                                       : slot->out_index;
+
+    /*  Messages before the snapshot are not sent.
+     */
+    ptrdiff_t const begin = slot->snapshot_index > slot->ack_index
+                                ? slot->snapshot_index
+                                : slot->ack_index;
+
+    /*  Resend a message again after a round trip. Until the first
+     *  pong, wait a ping period.
+     */
+    peer_time_t const interval = slot->rtt.samples > 0
+                                     ? slot->rtt.smoothed
+                                     : peer->config.timeout_ping;
+
+    /*  Scan only the lost ranges, not the whole backlog.
+     */
+    ptrdiff_t recent = recent_begin > lost_end ? recent_begin
+                                               : lost_end;
+    if (recent < begin)
+      recent = begin;
+
+    status |= slot_resend(&b, q_out, slot, begin, lost_end,
+                          interval, time_local, &written);
+    status |= slot_resend(&b, q_out, slot, recent, slot->out_index,
+                          interval, time_local, &written);
+
+    slot->is_ack_new = 0;
+  }
+
+  if (slot->is_ack_due) {
+    status |= ack_write(&b, q_in, slot->in_index, slot->loss, time,
+                        actor);
+    slot->is_ack_due = 0;
+    written          = 1;
+  }
+
+  /*  Host rejects messages without the actor id.
+   */
+
+  if (slot->clock_ping <= 0 && actor != PEER_UNDEFINED) {
+    status |= time_write(&b, PEER_M_PING, time_local, time, actor);
+    slot->ping_time    = time_local;
+    slot->is_ping_sent = 1;
+    slot->clock_ping   = peer->config.timeout_ping;
+    written            = 1;
+  }
+
+  if (slot->is_pong_due && actor != PEER_UNDEFINED) {
+    status |= time_write(&b, PEER_M_PONG, slot->pong_time, time,
+                         actor);
+    slot->is_pong_due = 0;
+    written           = 1;
+  }
+
+  if (written)
+    status |= peer_builder_finish(&b);
+
+  return status;
+}
+
+/*  Packets encoded for one slot during the tick. Other slots with
+ *  the same out index reuse them.
+ */
+typedef struct {
+  int          is_heartbeat;
+  uint8_t      mode;
+  peer_trail_t trail;
+  ptrdiff_t    index;
+  ptrdiff_t    end;
+  ptrdiff_t    packets_begin;
+  ptrdiff_t    packets_end;
+} encoding_t;
+
+typedef KIT_DA(encoding_t) encodings_t;
+
+typedef struct {
+  encodings_t    encodings;
+  peer_packets_t packets;
+} encoding_cache_t;
+
+static kit_status_t packets_copy(
+    peer_packets_t const *const src, ptrdiff_t const begin,
+    ptrdiff_t const end, ptrdiff_t const source_id,
+    ptrdiff_t const destination_id, peer_packets_t *const dst) {
+  assert(begin >= 0 && begin <= end && end <= src->size);
+
+  ptrdiff_t const n = dst->size;
+
+  DA_RESIZE(*dst, n + (end - begin));
+  if (dst->size != n + (end - begin))
+    return PEER_ERROR_BAD_ALLOC;
+
+  for (ptrdiff_t i = 0; i < end - begin; i++) {
+    peer_packet_t const *const from = src->values + (begin + i);
+    peer_packet_t *const       to   = dst->values + (n + i);
+
+    to->source_id      = source_id;
+    to->destination_id = destination_id;
+    to->size           = from->size;
+    memcpy(to->data, from->data, from->size);
+  }
+
+  return KIT_OK;
+}
+
+static kit_status_t broadcast_pack(
+    peer_t const *const peer, mt64_state_t *const rng,
+    encoding_cache_t *const cache, ptrdiff_t const end,
+    int const is_heartbeat, peer_slot_t const *const slot,
+    peer_packets_t *const out_packets) {
+  /*  Encode the message range once per tick, then copy packets for
+   *  each slot and only change addressing.
+   */
+
+  peer_trail_t const trail = send_trail(peer, slot);
+  uint8_t const      mode  = packet_mode(peer, slot);
+
+  for (ptrdiff_t i = 0; i < cache->encodings.size; i++) {
+    encoding_t const *const e = cache->encodings.values + i;
+
+    if (e->is_heartbeat == is_heartbeat &&
+        e->mode == mode &&
+        trail_equal(&e->trail, &trail) &&
+        e->index == slot->out_index && e->end == end)
+      return packets_copy(&cache->packets, e->packets_begin,
+                          e->packets_end, slot->local.id,
+                          slot->remote.id, out_packets);
+  }
 
-    for (ptrdiff_t j = 0; j < peer->slots.size; j++) {
-      peer_slot_t *const slot = peer->slots.values + j;
+  ptrdiff_t const begin = cache->packets.size;
 
-      if (slot->local.id != packet->destination_id ||
-          slot->remote.id != packet->source_id)
-        continue;
+  kit_status_t const s = shared_pack(
+      rng, &peer->queue, slot->out_index, end, is_heartbeat,
+      trail, peer->time, peer->actor, slot->local.id,
+      slot->remote.id, peer->config.packet_size, mode,
+      &cache->packets);
 
-      peer_chunks_t chunks;
-      DA_INIT(chunks, 0, peer->alloc);
+  if (s != KIT_OK)
+    return s;
 
-      peer_packets_ref_t const ref = { .size = 1, .values = packet };
+  ptrdiff_t const n = cache->encodings.size;
+  DA_RESIZE(cache->encodings, n + 1);
 
-      status |= peer_unpack(ref, &chunks);
+  if (cache->encodings.size == n + 1) {
+    encoding_t *const e = cache->encodings.values + n;
 
-      for (ptrdiff_t k = 0; k < chunks.size; k++) {
-        peer_chunk_t *const chunk = chunks.values + k;
+    e->is_heartbeat  = is_heartbeat;
+    e->mode          = mode;
+    e->trail         = trail;
+    e->index         = slot->out_index;
+    e->end           = end;
+    e->packets_begin = begin;
+    e->packets_end   = cache->packets.size;
+  }
 
-        /*  FIXME
-         *  Check the checksum.
-         */
+  return packets_copy(&cache->packets, begin, cache->packets.size,
+                      slot->local.id, slot->remote.id, out_packets);
+}
 
-        ptrdiff_t const data_size = peer_read_message_data_size(
-            chunk->values);
-        uint8_t const message_mode = peer_read_message_mode(
-            chunk->values);
-        ptrdiff_t const index = peer_read_message_index(
-            chunk->values);
-        peer_time_t const time = peer_read_message_time(
-            chunk->values);
-        uint32_t const actor = peer_read_message_actor(chunk->values);
+static kit_status_t snapshot_write(
+    peer_t const *const peer, peer_slot_t *const slot,
+    peer_packets_t *const out_packets) {
+  /*  Write snapshot fragments, one per message, from the slot's
+   *  offset while the pacer allows. The round ends after the last
+   *  fragment.
+   */
 
-        if (peer->mode == PEER_HOST) {
-          /*  Check the message time.
-           *  Client's messages should not have time set.
-           */
+  peer_snapshot_t const *const snapshot = &peer->snapshot;
 
-          assert(time == 0);
+  ptrdiff_t chunk = peer->config.packet_size -
+                    packet_header_max(peer) - PEER_N_MESSAGE_DATA -
+                    SNAPSHOT_N_DATA;
+  if (chunk > PEER_MAX_MESSAGE_SIZE - SNAPSHOT_N_DATA)
+    chunk = PEER_MAX_MESSAGE_SIZE - SNAPSHOT_N_DATA;
 
-          if (time != 0) {
-            status |= PEER_ERROR_INVALID_MESSAGE_TIME;
-            continue;
-          }
+  assert(chunk > 0);
 
-          /*  Check the actor id value.
-           */
+  peer_packet_builder_t b;
+  peer_builder_init(&b, slot->local.id, slot->remote.id,
+                    peer->config.packet_size,
+                    packet_mode(peer, slot), out_packets);
 
-          assert(actor == slot->actor);
+  kit_status_t status = KIT_OK;
+  ptrdiff_t    offset = slot->snapshot_offset;
+  ptrdiff_t    tokens = peer->config.pace_rate == PEER_UNDEFINED
+                            ? PTRDIFF_MAX
+                            : slot->pace_tokens;
 
-          if (actor != slot->actor) {
-            status |= PEER_ERROR_INVALID_MESSAGE_ACTOR;
-            continue;
-          }
+  /*  Empty snapshot is sent as one empty fragment.
+   */
 
-          /*  Process service-level messages.
-           */
+  do {
+    ptrdiff_t const size = snapshot->data.size - offset < chunk
+                               ? snapshot->data.size - offset
+                               : chunk;
+
+    uint8_t data[PEER_MAX_MESSAGE_SIZE];
+    data[0] = PEER_M_SNAPSHOT;
+    peer_write_u64(data + SNAPSHOT_N_INDEX,
+                   (uint64_t) snapshot->index);
+    peer_write_u32(data + SNAPSHOT_N_SIZE,
+                   (uint32_t) snapshot->data.size);
+    peer_write_u32(data + SNAPSHOT_N_OFFSET, (uint32_t) offset);
+    if (size > 0)
+      memcpy(data + SNAPSHOT_N_DATA,
+             snapshot->data.values + offset, size);
+
+    peer_chunk_ref_t const ref = { .size   = SNAPSHOT_N_DATA + size,
+                                   .values = data };
+
+    status |= peer_builder_write(&b, PEER_MESSAGE_MODE_SERVICE,
+                                 PEER_UNDEFINED, peer->time,
+                                 peer->actor, ref);
+    offset += size;
+    tokens -= PEER_N_MESSAGE_DATA + ref.size;
+  } while (offset < snapshot->data.size && tokens > 0);
+
+  status |= peer_builder_finish(&b);
+
+  if (offset < snapshot->data.size) {
+    slot->snapshot_offset = offset;
+  } else {
+    slot->snapshot_offset = 0;
+    slot->clock_snapshot  = peer->config.timeout_ping;
+  }
 
-          int processed = 0;
+  return status;
+}
 
-          if (message_mode == PEER_MESSAGE_MODE_SERVICE &&
-              data_size >= 1) {
-            uint8_t const service_id = peer_read_u8(
-                chunk->values + PEER_N_MESSAGE_DATA);
+static void snapshot_start(peer_t const *const peer,
+                           peer_slot_t *const  slot) {
+  /*  Skip the messages before the snapshot.
+   */
 
-            switch (service_id) {
-              case PEER_M_HEARTBEAT:
-                /*  Heartbeat.
-                 */
-                processed = 1;
-                break;
+  if (slot->out_index < peer->snapshot.index)
+    slot->out_index = peer->snapshot.index;
 
-              default:;
-            }
-          }
+  slot->snapshot_index  = peer->snapshot.index;
+  slot->snapshot_offset = 0;
+  slot->clock_snapshot  = 0;
+}
 
-          assert(message_mode != PEER_MESSAGE_MODE_SERVICE ||
-                 processed == 1);
+static kit_status_t slots_send(peer_t const *const     peer,
+                               mt64_state_t *const     rng,
+                               encoding_cache_t *const cache,
+                               ptrdiff_t const         begin,
+                               ptrdiff_t const         end,
+                               peer_packets_t *const   out_packets) {
+  /*  Send messages to clients in the slot range. Only the slots in
+   *  the range are changed, the peer is read-only, so ranges can be
+   *  sent in parallel.
+   */
 
-          if (message_mode == PEER_MESSAGE_MODE_SERVICE && !processed)
-            status |= PEER_ERROR_UNKNOWN_SERVICE_ID;
+  kit_status_t status = KIT_OK;
 
-          if (message_mode != PEER_MESSAGE_MODE_SERVICE) {
-            /*  Add message to the slot queue.
-             */
+  for (ptrdiff_t i = begin; i < end; i++) {
+    peer_slot_t *const slot = peer->slots.values + i;
 
-            peer_chunk_ref_t const data = {
-              .size   = data_size,
-              .values = chunk->values + PEER_N_MESSAGE_DATA
-            };
+    switch (slot->state) {
+      case PEER_SLOT_EMPTY: break;
 
-            status |= queue_insert(&slot->queue, index, time, actor,
-                                   data, peer->alloc);
-          }
-        }
+      case PEER_SLOT_SESSION_REQUEST: {
+        /*  Send the session response message.
+         */
 
-        if (peer->mode == PEER_CLIENT) {
-          /*  Process service-level messages.
-           */
+        uint8_t data[2 + PEER_ADDRESS_SIZE];
+        data[0] = PEER_M_SESSION_RESPONSE;
+        data[1] = peer->config.compact ? PEER_SESSION_COMPACT : 0;
+        memcpy(data + 2, slot->local.address_data,
+               slot->local.address_size);
 
-          int processed = 0;
+        peer_chunk_ref_t const ref = {
+          .size = 2 + slot->local.address_size, .values = data
+        };
 
-          if (message_mode == PEER_MESSAGE_MODE_SERVICE &&
-              data_size >= 1) {
-            uint8_t const service_id = peer_read_u8(
-                chunk->values + PEER_N_MESSAGE_DATA);
+        /*  Session response is never compact, the client doesn't
+         *  know the session flags yet.
+         */
 
-            switch (service_id) {
-              case PEER_M_HEARTBEAT:
-                /*  Heartbeat.
-                 */
-                processed = 1;
-                break;
+        peer_packet_builder_t b;
+        peer_builder_init(&b, peer->slots.values[0].local.id,
+                          slot->remote.id, peer->config.packet_size,
+                          packet_mode(peer, NULL), out_packets);
 
-              case PEER_M_SESSION_RESPONSE: {
-                /*  Update client's actor id and host remote address.
-                 */
-                assert(data_size - 1 <= PEER_ADDRESS_SIZE);
-                peer->actor = actor;
+        status |= peer_builder_write(&b, PEER_MESSAGE_MODE_SERVICE,
+                                     PEER_UNDEFINED, peer->time,
+                                     slot->actor, ref);
+        status |= peer_builder_finish(&b);
 
-                /*  We need new id for new remote port.
-                 */
-                slot->remote.is_id_resolved = 0;
-                slot->remote.address_size   = data_size - 1;
-                memcpy(slot->remote.address_data,
-                       chunk->values + PEER_N_MESSAGE_DATA + 1,
-                       data_size - 1);
+        /*  Send the snapshot instead of the history before it.
+         *  Snapshot older than the released messages is useless.
+         */
+        if (peer->snapshot.index != PEER_UNDEFINED &&
+            peer->snapshot.index >= peer->queue.offset)
+          snapshot_start(peer, slot);
 
-                /*  Update actor id for old messages.
-                 */
-                for (ptrdiff_t k = 0; k < slot->queue.size; k++)
-                  slot->queue.values[k].actor = actor;
+        /*  Released messages are not sent to new clients.
+         */
+        if (slot->out_index < peer->queue.offset)
+          slot->out_index = peer->queue.offset;
 
-                processed = 1;
-              } break;
+        slot->clock_heartbeat = peer->config.timeout_heartbeat;
+        slot->clock_ping      = peer->config.timeout_ping;
+        slot->state           = PEER_SLOT_READY;
+      } break;
 
-              default:;
-            }
-          }
+      case PEER_SLOT_READY: {
+        ptrdiff_t const packets_begin = out_packets->size;
 
-          assert(message_mode != PEER_MESSAGE_MODE_SERVICE ||
-                 processed == 1);
+        /*  Resync the remote that missed released messages, or
+         *  restart the transfer if there is a newer snapshot.
+         */
 
-          if (message_mode == PEER_MESSAGE_MODE_SERVICE && !processed)
-            status |= PEER_ERROR_UNKNOWN_SERVICE_ID;
+        ptrdiff_t const snapshot_index = peer->snapshot.index;
 
-          if (message_mode != PEER_MESSAGE_MODE_SERVICE) {
-            /*  Add message to the mutual queue.
-             */
+        if (snapshot_index >= peer->queue.offset &&
+            ((slot->snapshot_index == PEER_UNDEFINED &&
+              slot->is_acked &&
+              slot->ack_index < peer->queue.offset) ||
+             (slot->snapshot_index != PEER_UNDEFINED &&
+              slot->snapshot_index < snapshot_index)))
+          snapshot_start(peer, slot);
 
-            peer_chunk_ref_t const data = {
-              .size   = data_size,
-              .values = chunk->values + PEER_N_MESSAGE_DATA
-            };
+        if (slot->snapshot_index != PEER_UNDEFINED &&
+            slot->is_acked &&
+            slot->ack_index >= slot->snapshot_index)
+          slot->snapshot_index = PEER_UNDEFINED;
 
-            status |= queue_insert(&peer->queue, index, time, actor,
-                                   data, peer->alloc);
-          }
+        int const is_snapshot = slot->snapshot_index !=
+                                PEER_UNDEFINED;
 
-          /*  Synchronize mutual time.
+        if (is_snapshot && slot->clock_snapshot <= 0 &&
+            pace_is_open(peer, slot)) {
+          /*  Resend the snapshot until it is acknowledged. The
+           *  fragments also keep the session alive.
            */
 
-          if (peer->time < time)
-            peer->time = time;
+          status |= snapshot_write(peer, slot, out_packets);
+
+          slot->clock_heartbeat = peer->config.timeout_heartbeat;
         }
-      }
 
-      for (ptrdiff_t k = 0; k < chunks.size; k++)
-        DA_DESTROY(chunks.values[k]);
-      DA_DESTROY(chunks);
+        int const is_new = !is_snapshot &&
+                           slot->out_index < queue_end(&peer->queue);
+        int const is_timeout = !is_snapshot && !is_new &&
+                               slot->clock_heartbeat <= 0;
 
-      slot_found = 1;
-      break;
-    }
+        ptrdiff_t const end = pace_end(peer, slot, &peer->queue);
 
-    if (slot_found || peer->mode != PEER_HOST ||
-        peer->slots.size == 0 ||
-        peer->slots.values[0].remote.id != PEER_UNDEFINED) {
-      continue;
-    }
+        if ((is_new && end > slot->out_index) || is_timeout) {
+          /*  Send new messages that fit the pacer, or heartbeat
+           *  message if there are no new messages.
+           */
 
-    /*  Assign a slot for the client.
-     */
+          kit_status_t const s = broadcast_pack(
+              peer, rng, cache, is_timeout ? slot->out_index : end,
+              is_timeout, slot, out_packets);
 
-    /*  FIXME
-     *  Check if the client sent a session request message.
-     */
+          if (s == KIT_OK && !is_timeout)
+            slot->out_index = end;
 
-    for (ptrdiff_t j = 1; j < peer->slots.size; j++) {
-      peer_slot_t *const slot = peer->slots.values + j;
+          status |= s;
 
-      if (slot->remote.id == PEER_UNDEFINED &&
-          slot->local.address_size > 0) {
-        slot->state                 = PEER_SLOT_SESSION_REQUEST;
-        slot->remote.id             = packet->source_id;
-        slot->remote.is_id_resolved = 1;
-        slot->actor                 = j;
+          slot->clock_heartbeat = peer->config.timeout_heartbeat;
+        }
 
-        slot_found = 1;
-        break;
-      }
-    }
+        /*  Send retransmissions and acknowledgement.
+         */
+        status |= slot_pack(peer, &peer->queue, &slot->queue, slot,
+                            is_timeout, peer->time, out_packets);
 
-    if (!slot_found)
-      status |= PEER_ERROR_NO_FREE_SLOTS;
+        if (peer->config.redundancy == PEER_REDUNDANCY_FEC)
+          status |= peer_fec_encode(&slot->fec_out, out_packets,
+                                    packets_begin);
+
+        pace_charge(peer, slot, out_packets, packets_begin);
+      } break;
+
+      default:
+        assert(0);
+        status |= PEER_ERROR_INVALID_SLOT_STATE;
+    }
   }
 
   return status;
 }
 
-static kit_status_t chunks_append_trail(
-    mt64_state_t *const rng, peer_queue_t const *const q,
-    ptrdiff_t const index, peer_chunks_t *const out_chunks) {
-  assert(rng != NULL);
-  assert(q != NULL);
-  assert(out_chunks != NULL);
-  assert(index >= 0 && index <= q->size);
-
-  kit_allocator_t const alloc = out_chunks->alloc;
+struct peer_send_shard {
+  mt64_state_t     rng;     /*  Own random stream of the shard. */
+  encoding_cache_t cache;   /*  Packets encoded by the shard. */
+  peer_packets_t   packets; /*  Outgoing packets of the shard. */
+  kit_status_t     status;
+};
 
-  ptrdiff_t trail_size = PEER_TRAIL_SERIAL_SIZE;
+static void shards_destroy(peer_t *const peer) {
+  peer_workers_destroy(&peer->workers);
 
-  if (trail_size > index ||
-      index - trail_size < PEER_TRAIL_SCATTER_DISTANCE)
-    trail_size = index;
+  if (peer->shards == NULL)
+    return;
 
-  if (trail_size > 0) {
-    ptrdiff_t const offset = out_chunks->size;
-    DA_RESIZE(*out_chunks, offset + trail_size);
-    assert(out_chunks->size == offset + trail_size);
-    if (out_chunks->size != offset + trail_size)
-      return PEER_ERROR_BAD_ALLOC;
+  for (ptrdiff_t i = 0; i < peer->shard_count; i++) {
+    DA_DESTROY(peer->shards[i].cache.encodings);
+    DA_DESTROY(peer->shards[i].cache.packets);
+    DA_DESTROY(peer->shards[i].packets);
+  }
 
-    ptrdiff_t const trail_begin = index - trail_size;
+  if (peer->alloc.deallocate != NULL)
+    peer->alloc.deallocate(peer->alloc.state, peer->shards);
 
-    for (ptrdiff_t i = 0; i < trail_size; i++) {
-      peer_message_t const *const message = q->values +
-                                            (trail_begin + i);
-      peer_chunk_t *const chunk = out_chunks->values + (offset + i);
-      ptrdiff_t const     chunk_size = PEER_N_MESSAGE_DATA +
-                                   message->data.size;
+  peer->shards      = NULL;
+  peer->shard_count = 0;
+}
 
-      DA_INIT(*chunk, chunk_size, alloc);
+static kit_status_t shards_update(peer_t *const peer) {
+  /*  Start or stop send threads when the config changes. Random
+   *  streams of the shards are seeded from the peer's one, so the
+   *  output doesn't depend on the threads timing.
+   */
 
-      if (chunk->size != chunk_size) {
-        for (ptrdiff_t j = 0; j <= i; j++)
-          DA_DESTROY(out_chunks->values[offset + j]);
-        DA_RESIZE(*out_chunks, offset);
-        return PEER_ERROR_BAD_ALLOC;
-      }
+  ptrdiff_t const count = peer->config.send_threads > 1
+                              ? peer->config.send_threads
+                              : 0;
 
-      peer_write_message(chunk->values, PEER_MESSAGE_MODE_APPLICATION,
-                         trail_begin + i, message->time,
-                         message->actor, message->data.size,
-                         message->data.values);
-    }
-  }
+  if (count == peer->shard_count)
+    return KIT_OK;
 
-  ptrdiff_t scatter_trail_distance = PEER_TRAIL_SCATTER_DISTANCE;
-  ptrdiff_t scatter_trail_size     = PEER_TRAIL_SCATTER_SIZE;
+  shards_destroy(peer);
 
-  if (scatter_trail_distance > index - trail_size)
-    scatter_trail_distance = index - trail_size;
-  if (scatter_trail_size > scatter_trail_distance)
-    scatter_trail_size = scatter_trail_distance;
+  if (count == 0)
+    return KIT_OK;
 
-  if (scatter_trail_size > 0) {
-    ptrdiff_t const offset = out_chunks->size;
-    DA_RESIZE(*out_chunks, offset + scatter_trail_size);
-    assert(out_chunks->size == offset + scatter_trail_size);
-    if (out_chunks->size != offset + scatter_trail_size)
-      return PEER_ERROR_BAD_ALLOC;
+  if (peer->alloc.allocate == NULL)
+    return PEER_ERROR_BAD_ALLOC;
 
-    ptrdiff_t const trail_begin = index - scatter_trail_distance;
+  peer->shards = (peer_send_shard_t *) peer->alloc.allocate(
+      peer->alloc.state, count * sizeof *peer->shards);
 
-    for (ptrdiff_t i = 0; i < scatter_trail_size; i++) {
-      ptrdiff_t const message_index =
-          trail_begin +
-          (ptrdiff_t) (mt64_generate(rng) %
-                       (uint64_t) scatter_trail_distance);
+  if (peer->shards == NULL)
+    return PEER_ERROR_BAD_ALLOC;
 
-      peer_message_t const *const message = q->values + message_index;
-      peer_chunk_t *const chunk = out_chunks->values + (offset + i);
-      ptrdiff_t const     chunk_size = PEER_N_MESSAGE_DATA +
-                                   message->data.size;
+  peer->shard_count = count;
 
-      DA_INIT(*chunk, chunk_size, alloc);
+  for (ptrdiff_t i = 0; i < count; i++) {
+    peer_send_shard_t *const shard = peer->shards + i;
 
-      if (chunk->size != chunk_size) {
-        for (ptrdiff_t j = 0; j <= i; j++)
-          DA_DESTROY(out_chunks->values[offset + j]);
-        DA_RESIZE(*out_chunks, offset);
-        return PEER_ERROR_BAD_ALLOC;
-      }
+    mt64_init(&shard->rng, mt64_generate(&peer->mt64));
+    mt64_rotate(&shard->rng);
 
-      peer_write_message(chunk->values, PEER_MESSAGE_MODE_APPLICATION,
-                         message_index, message->time, message->actor,
-                         message->data.size, message->data.values);
-    }
+    DA_INIT(shard->cache.encodings, 0, peer->alloc);
+    DA_INIT(shard->cache.packets, 0, peer->alloc);
+    DA_INIT(shard->packets, 0, peer->alloc);
+    shard->status = KIT_OK;
   }
 
-  return KIT_OK;
-}
+  kit_status_t const s = peer_workers_init(&peer->workers, count - 1,
+                                           peer->alloc);
 
-typedef struct {
-  kit_status_t      status;
-  peer_chunk_refs_t refs;
-  peer_chunks_ref_t ref;
-} chunks_wrap_t;
+  if (s != KIT_OK)
+    shards_destroy(peer);
 
-static chunks_wrap_t chunks_wrap(peer_chunks_t const *const chunks,
-                                 kit_allocator_t const      alloc) {
-  assert(chunks != NULL);
+  return s;
+}
 
-  chunks_wrap_t result;
-  memset(&result, 0, sizeof result);
+static void shard_send(void *const state, ptrdiff_t const index) {
+  peer_t const *const      peer  = (peer_t const *) state;
+  peer_send_shard_t *const shard = peer->shards + index;
 
-  ptrdiff_t const size = chunks->size;
+  /*  Contiguous slot ranges of equal size, the first slot is the
+   *  host itself.
+   */
 
-  DA_INIT(result.refs, size, alloc);
-  assert(result.refs.size == size);
-  if (result.refs.size != size) {
-    result.status = PEER_ERROR_BAD_ALLOC;
-    return result;
-  }
+  ptrdiff_t const n     = peer->slots.size - 1;
+  ptrdiff_t const begin = 1 + n * index / peer->shard_count;
+  ptrdiff_t const end   = 1 + n * (index + 1) / peer->shard_count;
 
-  for (ptrdiff_t i = 0; i < size; i++) {
-    result.refs.values[i].size   = chunks->values[i].size;
-    result.refs.values[i].values = chunks->values[i].values;
-  }
+  DA_RESIZE(shard->cache.encodings, 0);
+  DA_RESIZE(shard->cache.packets, 0);
+  DA_RESIZE(shard->packets, 0);
 
-  result.ref.size   = result.refs.size;
-  result.ref.values = result.refs.values;
-  return result;
+  shard->status = slots_send(peer, &shard->rng, &shard->cache, begin,
+                             end, &shard->packets);
 }
 
-static kit_status_t queue_pack(mt64_state_t *const       rng,
-                               peer_queue_t const *const q,
-                               ptrdiff_t const           index,
-                               ptrdiff_t                 source_id,
-                               ptrdiff_t             destination_id,
-                               peer_packets_t *const out_packets,
-                               kit_allocator_t       alloc) {
-  ptrdiff_t const size = q->size - index;
-
-  assert(rng != NULL);
-  assert(q != NULL);
-  assert(size >= 0);
-
-  if (size < 0)
-    return PEER_ERROR_INVALID_OUT_INDEX;
-  if (size == 0)
-    return KIT_OK;
-
-  peer_chunks_t chunks;
-  DA_INIT(chunks, size, alloc);
-  assert(chunks.size == size);
-  if (chunks.size != size)
-    return PEER_ERROR_BAD_ALLOC;
-
-  if (chunks.size != 0)
-    memset(chunks.values, 0, size * sizeof *chunks.values);
+static kit_status_t shards_send(peer_t *const         peer,
+                                peer_packets_t *const out_packets) {
+  peer_workers_run(&peer->workers, shard_send, peer);
 
-  /*  Prepare messages' data.
+  /*  Concatenate in the shard order.
    */
 
-  for (ptrdiff_t i = 0; i < size; i++) {
-    assert(index + i >= 0 && index + i < q->size);
+  kit_status_t status = KIT_OK;
 
-    peer_message_t const *const message = q->values + (index + i);
+  for (ptrdiff_t i = 0; i < peer->shard_count; i++) {
+    peer_send_shard_t const *const shard = peer->shards + i;
 
-    ptrdiff_t const full_size = PEER_N_MESSAGE_DATA +
-                                message->data.size;
+    status |= shard->status;
 
-    DA_INIT(chunks.values[i], full_size, alloc);
-    if (chunks.values[i].size != full_size)
-      return PEER_ERROR_BAD_ALLOC;
+    ptrdiff_t const n = out_packets->size;
+    DA_RESIZE(*out_packets, n + shard->packets.size);
 
-    peer_write_message(chunks.values[i].values,
-                       PEER_MESSAGE_MODE_APPLICATION, index + i,
-                       message->time, message->actor,
-                       message->data.size, message->data.values);
-  }
+    if (out_packets->size != n + shard->packets.size) {
+      DA_RESIZE(*out_packets, n);
+      return status | PEER_ERROR_BAD_ALLOC;
+    }
 
-  /*  Append trail messages.
-   */
+    if (shard->packets.size > 0)
+      memcpy(out_packets->values + n, shard->packets.values,
+             shard->packets.size * sizeof *shard->packets.values);
+  }
 
-  kit_status_t result = chunks_append_trail(rng, q, index, &chunks);
+  return status;
+}
 
-  /*  Pack messages into packets.
+static kit_status_t queue_release(peer_t *const   peer,
+                                  ptrdiff_t const readable) {
+  /*  Release mutual messages that were readable at the previous
+   *  tick, so the application had a tick to read them. Host keeps
+   *  the messages clients may still need, and the messages after
+   *  the snapshot for new clients.
    */
 
-  chunks_wrap_t const wrap = chunks_wrap(&chunks, alloc);
+  ptrdiff_t index      = peer->queue_readable;
+  peer->queue_readable = readable;
 
-  if (wrap.status != KIT_OK) {
-    result |= wrap.status;
-    return result;
-  }
+  if (peer->config.history == PEER_UNDEFINED)
+    return KIT_OK;
 
-  result |= peer_pack(source_id, destination_id, wrap.ref,
-                      out_packets);
+  if (index > queue_end(&peer->queue) - peer->config.history)
+    index = queue_end(&peer->queue) - peer->config.history;
 
-  for (ptrdiff_t i = 0; i < chunks.size; i++)
-    DA_DESTROY(chunks.values[i]);
+  if (peer->mode == PEER_HOST) {
+    for (ptrdiff_t i = 1; i < peer->slots.size; i++) {
+      peer_slot_t const *const slot = peer->slots.values + i;
 
-  DA_DESTROY(chunks);
-  DA_DESTROY(wrap.refs);
+      if (slot->state == PEER_SLOT_READY &&
+          index > slot_retained(peer, slot))
+        index = slot_retained(peer, slot);
+    }
 
-  return result;
+    if (peer->snapshot.index != PEER_UNDEFINED &&
+        index > peer->snapshot.index)
+      index = peer->snapshot.index;
+  }
+
+  return peer_queue_trim(&peer->queue, index);
 }
 
 peer_tick_result_t peer_tick(peer_t *const     peer,
@@ -705,7 +2430,7 @@ peer_tick_result_t peer_tick(peer_t *const     peer,
     return result;
   }
 
-  result.status = KIT_OK;
+  result.status = submit_drain(peer);
 
   /*  Update clock.
    */
@@ -717,6 +2442,12 @@ peer_tick_result_t peer_tick(peer_t *const     peer,
 
     if (slot->clock_heartbeat > 0)
       slot->clock_heartbeat -= time_elapsed;
+    if (slot->clock_ping > 0)
+      slot->clock_ping -= time_elapsed;
+    if (slot->clock_snapshot > 0)
+      slot->clock_snapshot -= time_elapsed;
+
+    pace_refill(peer, slot, time_elapsed);
   }
 
   if (peer->mode == PEER_HOST) {
@@ -727,218 +2458,203 @@ peer_tick_result_t peer_tick(peer_t *const     peer,
     /*  Synchronize mutual message queue.
      */
 
-    for (ptrdiff_t i = peer->queue_index; i < peer->queue.size; i++)
-      peer->queue.values[i].time = peer->time;
+    for (ptrdiff_t i = peer->queue_index; i < queue_end(&peer->queue);
+         i++)
+      queue_at(&peer->queue, i)->time = peer->time;
 
     for (ptrdiff_t i = 1; i < peer->slots.size; i++) {
       peer_slot_t *const slot = peer->slots.values + i;
 
-      for (; slot->in_index < slot->queue.size; slot->in_index++) {
-        peer_message_t const *const message = slot->queue.values +
-                                              slot->in_index;
+      for (; slot->in_index < queue_end(&slot->queue);
+           slot->in_index++) {
+        peer_message_t const *const message = queue_at(
+            &slot->queue, slot->in_index);
 
         if (message->is_ready == 0)
           break;
 
         assert(slot->actor == message->actor);
 
-        peer_chunk_ref_t const data = {
-          .size = message->data.size, .values = message->data.values
-        };
+        peer_chunk_ref_t const data = peer_queue_data(&slot->queue,
+                                                      slot->in_index);
 
-        kit_status_t const s = queue_append(
-            &peer->queue, peer->time, slot->actor, data, peer->alloc);
+        kit_status_t const s = queue_append(&peer->queue, peer->time,
+                                            slot->actor, data);
 
         assert(s == KIT_OK);
         result.status |= s;
       }
+
+      /*  Merged messages are not needed anymore.
+       */
+      result.status |= peer_queue_trim(&slot->queue, slot->in_index);
     }
 
-    peer->queue_index = peer->queue.size;
+    peer->queue_index = queue_end(&peer->queue);
 
     /*  Send messages to clients.
      */
 
-    for (ptrdiff_t i = 1; i < peer->slots.size; i++) {
-      peer_slot_t *const slot = peer->slots.values + i;
-
-      switch (slot->state) {
-        case PEER_SLOT_EMPTY: break;
-
-        case PEER_SLOT_SESSION_REQUEST: {
-          /*  Send the session response message.
-           */
-
-          uint8_t
-              message[PEER_N_MESSAGE_DATA + 1 + PEER_ADDRESS_SIZE];
-          uint8_t data[1 + PEER_ADDRESS_SIZE];
-          data[0] = PEER_M_SESSION_RESPONSE;
-          memcpy(data + 1, slot->local.address_data,
-                 slot->local.address_size);
+    result.status |= shards_update(peer);
 
-          ptrdiff_t const index = PEER_UNDEFINED;
+    peer_arena_reset(&peer->scratch);
 
-          peer_write_message(message, PEER_MESSAGE_MODE_SERVICE,
-                             index, peer->time, slot->actor,
-                             slot->local.address_size + 1, data);
+    kit_allocator_t const scratch = peer_arena_allocator(
+        &peer->scratch);
 
-          peer_chunk_ref_t const ref = {
-            .size = PEER_N_MESSAGE_DATA + 1 +
-                    slot->local.address_size,
-            .values = message
-          };
+    encoding_cache_t cache;
+    DA_INIT(cache.encodings, 0, scratch);
+    DA_INIT(cache.packets, 0, scratch);
 
-          peer_chunks_ref_t const chref = { .size   = 1,
-                                            .values = &ref };
+    if (peer->shard_count > 1)
+      result.status |= shards_send(peer, &result.packets);
+    else
+      result.status |= slots_send(peer, &peer->mt64, &cache, 1,
+                                  peer->slots.size, &result.packets);
 
-          result.status |= peer_pack(peer->slots.values[0].local.id,
-                                     slot->remote.id, chref,
-                                     &result.packets);
+    DA_DESTROY(cache.encodings);
+    DA_DESTROY(cache.packets);
 
-          slot->clock_heartbeat = PEER_TIMEOUT_HEARTBEAT;
-          slot->state           = PEER_SLOT_READY;
-        } break;
-
-        case PEER_SLOT_READY: {
-          if (slot->out_index < peer->queue.size) {
-            /*  Send new messages.
-             */
+    result.status |= queue_release(peer, peer->queue_index);
+  }
 
-            kit_status_t const s = queue_pack(
-                &peer->mt64, &peer->queue, slot->out_index,
-                slot->local.id, slot->remote.id, &result.packets,
-                peer->alloc);
+  if (peer->mode == PEER_CLIENT && peer->slots.size > 0) {
+    peer_slot_t *const slot = peer->slots.values;
 
-            if (s == KIT_OK)
-              slot->out_index = peer->queue.size;
+    /*  Client's messages don't have time set.
+     */
 
-            result.status |= s;
+    ptrdiff_t const packets_begin = result.packets.size;
 
-            slot->clock_heartbeat = PEER_TIMEOUT_HEARTBEAT;
+    int const is_new     = slot->out_index < queue_end(&slot->queue);
+    int const is_timeout = !is_new && slot->clock_heartbeat <= 0;
 
-          } else if (slot->clock_heartbeat <= 0) {
-            /*  No new messages. Send heartbeat message.
-             */
+    ptrdiff_t const end = is_timeout
+                              ? slot->out_index
+                              : pace_end(peer, slot, &slot->queue);
 
-            peer_chunks_t chunks;
-            DA_INIT(chunks, 1, peer->alloc);
-            assert(chunks.size == 1);
-            if (chunks.size != 1) {
-              result.status |= PEER_ERROR_BAD_ALLOC;
-              break;
-            }
+    if ((is_new && end > slot->out_index) || is_timeout) {
+      /*  Send new messages that fit the pacer, or heartbeat message
+       *  if there are no new messages.
+       */
 
-            DA_INIT(chunks.values[0], PEER_N_MESSAGE_DATA + 1,
-                    peer->alloc);
-            assert(chunks.values[0].size == PEER_N_MESSAGE_DATA + 1);
-
-            if (chunks.values[0].size != PEER_N_MESSAGE_DATA + 1) {
-              DA_DESTROY(chunks.values[0]);
-              DA_RESIZE(chunks, 0);
-              result.status |= PEER_ERROR_BAD_ALLOC;
-            } else {
-              ptrdiff_t const index        = PEER_UNDEFINED;
-              uint8_t const   id_heartbeat = PEER_M_HEARTBEAT;
-
-              peer_write_message(chunks.values[0].values,
-                                 PEER_MESSAGE_MODE_SERVICE, index,
-                                 peer->time, peer->actor,
-                                 sizeof id_heartbeat, &id_heartbeat);
-            }
+      kit_status_t const s = shared_pack(
+          &peer->mt64, &slot->queue, slot->out_index, end,
+          is_timeout, send_trail(peer, slot), 0, peer->actor,
+          slot->local.id, slot->remote.id, peer->config.packet_size,
+          packet_mode(peer, slot), &result.packets);
 
-            result.status |= chunks_append_trail(
-                &peer->mt64, &peer->queue, slot->out_index, &chunks);
+      if (s == KIT_OK)
+        slot->out_index = end;
 
-            chunks_wrap_t const wrap = chunks_wrap(&chunks,
-                                                   peer->alloc);
+      result.status |= s;
 
-            result.status |= wrap.status;
+      if (is_timeout)
+        slot->clock_heartbeat = peer->config.timeout_heartbeat;
+    }
 
-            result.status |= peer_pack(slot->local.id,
-                                       slot->remote.id, wrap.ref,
-                                       &result.packets);
+    /*  Send retransmissions and acknowledgement.
+     */
+    result.status |= slot_pack(peer, &slot->queue, &peer->queue, slot,
+                               is_timeout, 0, &result.packets);
 
-            slot->clock_heartbeat = PEER_TIMEOUT_HEARTBEAT;
+    if (peer->config.redundancy == PEER_REDUNDANCY_FEC)
+      result.status |= peer_fec_encode(
+          &slot->fec_out, &result.packets, packets_begin);
 
-            for (ptrdiff_t i = 0; i < chunks.size; i++)
-              DA_DESTROY(chunks.values[i]);
+    pace_charge(peer, slot, &result.packets, packets_begin);
 
-            DA_DESTROY(chunks);
-            DA_DESTROY(wrap.refs);
-          }
-        } break;
+    /*  Release messages acknowledged by the host, or behind the
+     *  trail window. Wait for the actor id, because messages sent
+     *  before the session response are rejected by the host.
+     */
+    if (peer->actor != PEER_UNDEFINED)
+      result.status |= peer_queue_trim(&slot->queue,
+                                       slot_retained(peer, slot));
 
-        default:
-          assert(0);
-          result.status |= PEER_ERROR_INVALID_SLOT_STATE;
-      }
-    }
+    result.status |= queue_release(peer, slot->in_index);
   }
 
-  if (peer->mode == PEER_CLIENT && peer->slots.size > 0) {
-    peer_slot_t *const slot = peer->slots.values;
+  return result;
+}
 
-    if (slot->out_index < slot->queue.size) {
-      /*  Send new messages.
-       */
+static peer_time_t timeout_min(peer_time_t const timeout,
+                               peer_time_t const clock) {
+  peer_time_t const t = clock > 0 ? clock : 0;
+  if (timeout == PEER_UNDEFINED || t < timeout)
+    return t;
+  return timeout;
+}
 
-      kit_status_t const s = queue_pack(
-          &peer->mt64, &slot->queue, slot->out_index, slot->local.id,
-          slot->remote.id, &result.packets, peer->alloc);
+peer_time_t peer_next_timeout(peer_t const *const peer) {
+  assert(peer != NULL);
 
-      if (s == KIT_OK)
-        slot->out_index = slot->queue.size;
+  if (peer == NULL)
+    return PEER_UNDEFINED;
 
-      result.status |= s;
-    } else if (slot->clock_heartbeat <= 0) {
-      /*  No new messages. Send heartbeat message.
-       */
+  /*  Submitted messages are added on the next tick. Client keeps
+   *  them until it has a session, see submit_drain.
+   */
+  if ((peer->mode == PEER_HOST || peer->slots.size > 0) &&
+      !peer_submit_is_empty(&peer->submit))
+    return 0;
 
-      peer_chunks_t chunks;
-      DA_INIT(chunks, 1, peer->alloc);
-      assert(chunks.size == 1);
+  peer_time_t timeout = PEER_UNDEFINED;
 
-      if (chunks.size != 1) {
-        result.status |= PEER_ERROR_BAD_ALLOC;
-        return result;
-      }
+  if (peer->mode == PEER_HOST) {
+    for (ptrdiff_t i = 1; i < peer->slots.size; i++) {
+      peer_slot_t const *const slot = peer->slots.values + i;
 
-      DA_INIT(chunks.values[0], PEER_N_MESSAGE_DATA + 1, peer->alloc);
-      assert(chunks.values[0].size == PEER_N_MESSAGE_DATA + 1);
-
-      if (chunks.values[0].size != PEER_N_MESSAGE_DATA + 1) {
-        DA_DESTROY(chunks.values[0]);
-        DA_RESIZE(chunks, 0);
-        result.status |= PEER_ERROR_BAD_ALLOC;
-      } else {
-        ptrdiff_t const   index        = PEER_UNDEFINED;
-        peer_time_t const time         = 0;
-        uint8_t const     id_heartbeat = PEER_M_HEARTBEAT;
-
-        peer_write_message(
-            chunks.values[0].values, PEER_MESSAGE_MODE_SERVICE, index,
-            time, peer->actor, sizeof id_heartbeat, &id_heartbeat);
-      }
+      switch (slot->state) {
+        case PEER_SLOT_SESSION_REQUEST: return 0;
 
-      result.status |= chunks_append_trail(&peer->mt64, &peer->queue,
-                                           slot->out_index, &chunks);
+        case PEER_SLOT_READY:
+          /*  Backlog waits for the pacer.
+           */
+          if (slot->snapshot_index != PEER_UNDEFINED)
+            timeout = timeout_min(
+                timeout, slot->clock_snapshot > 0
+                             ? slot->clock_snapshot
+                             : pace_wait(peer, slot));
+          else if (slot->out_index < queue_end(&peer->queue))
+            timeout = timeout_min(timeout, pace_wait(peer, slot));
+          if (slot->is_pong_due)
+            return 0;
+          timeout = timeout_min(timeout, slot->clock_heartbeat);
+          timeout = timeout_min(timeout, slot->clock_ping);
+          break;
 
-      chunks_wrap_t const wrap = chunks_wrap(&chunks, peer->alloc);
+        default:;
+      }
 
-      result.status |= wrap.status;
+      if (slot->in_index < queue_end(&slot->queue) &&
+          queue_at(&slot->queue, slot->in_index)->is_ready)
+        return 0;
 
-      result.status |= peer_pack(slot->local.id, slot->remote.id,
-                                 wrap.ref, &result.packets);
+      if (slot->is_ack_due || slot->is_ack_new)
+        return 0;
+    }
+  }
 
-      slot->clock_heartbeat = PEER_TIMEOUT_HEARTBEAT;
+  if (peer->mode == PEER_CLIENT && peer->slots.size > 0) {
+    peer_slot_t const *const slot = peer->slots.values;
 
-      for (ptrdiff_t i = 0; i < chunks.size; i++)
-        DA_DESTROY(chunks.values[i]);
+    if (slot->remote.id != PEER_UNDEFINED) {
+      if (slot->is_ack_due || slot->is_ack_new)
+        return 0;
+      if (slot->out_index < queue_end(&slot->queue))
+        timeout = timeout_min(timeout, pace_wait(peer, slot));
+      timeout = timeout_min(timeout, slot->clock_heartbeat);
 
-      DA_DESTROY(chunks);
-      DA_DESTROY(wrap.refs);
+      /*  Ping and pong are sent only when the actor id is known.
+       */
+      if (peer->actor != PEER_UNDEFINED) {
+        if (slot->is_pong_due)
+          return 0;
+        timeout = timeout_min(timeout, slot->clock_ping);
+      }
     }
   }
 
-  return result;
+  return timeout;
 }
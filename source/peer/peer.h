@@ -1,7 +1,10 @@
 #ifndef PEER_PEER_H
 #define PEER_PEER_H
 
+#include "arena.h"
 #include "packet.h"
+#include "submit.h"
+#include "workers.h"
 
 #include <kit/allocator.h>
 #include <kit/mersenne_twister_64.h>
@@ -12,10 +15,11 @@ extern "C" {
 #endif
 
 typedef struct {
-  int          is_ready;
-  peer_time_t  time;
-  ptrdiff_t    actor;
-  peer_chunk_t data;
+  int         is_ready;
+  peer_time_t time;
+  ptrdiff_t   actor;
+  ptrdiff_t   data_offset; /*  Payload position in the queue log. */
+  ptrdiff_t   data_size;   /*  Payload size. */
 } peer_message_t;
 
 typedef struct {
@@ -36,7 +40,90 @@ typedef enum {
   PEER_SLOT_READY
 } peer_slot_state_t;
 
-typedef KIT_DA(peer_message_t) peer_queue_t;
+/*  Ring buffer of message descriptors. Releasing messages moves the
+ *  head, retained messages stay in place. Capacity is zero or a
+ *  power of two.
+ */
+typedef struct {
+  kit_allocator_t alloc;
+  ptrdiff_t       capacity; /*  Number of cells. */
+  ptrdiff_t       head;     /*  Cell of the first retained message. */
+  ptrdiff_t       size;     /*  Number of retained messages. */
+  peer_message_t *values;   /*  Cells. */
+} peer_messages_t;
+
+typedef struct {
+  uint8_t  *data;
+  ptrdiff_t live; /*  Number of retained payloads in the block. */
+} peer_log_block_t;
+
+typedef KIT_DA(peer_log_block_t) peer_log_blocks_t;
+
+/*  Append-only payload storage. Payloads are written into blocks of
+ *  up to PEER_LOG_BLOCK_SIZE bytes and never span two blocks.
+ *  Position of a payload is its byte offset from the beginning of
+ *  the first block ever allocated, as if all blocks were full size.
+ *  The last block starts at the size of its first payload and grows,
+ *  empty payloads are not stored.
+ */
+typedef struct {
+  ptrdiff_t         offset;   /*  Number of released blocks. */
+  ptrdiff_t         size;     /*  Bytes used in the last block. */
+  ptrdiff_t         capacity; /*  Bytes allocated for the last
+                                  block. */
+  peer_log_blocks_t blocks;
+} peer_log_t;
+
+/*  Message queue with stable indices. Messages before the offset are
+ *  released.
+ */
+typedef struct {
+  ptrdiff_t       offset;   /*  First retained message index. */
+  peer_messages_t messages; /*  Retained messages. */
+  peer_log_t      log;      /*  Messages' payloads. */
+} peer_queue_t;
+
+typedef struct {
+  ptrdiff_t begin; /*  First retained message index. */
+  ptrdiff_t end;   /*  Next message index. */
+} peer_queue_window_t;
+
+/*  Consecutive messages of a queue. Points into the queue, so it is
+ *  valid until the peer changes.
+ */
+typedef struct {
+  ptrdiff_t             index;  /*  Index of the first message. */
+  ptrdiff_t             size;   /*  Number of messages. */
+  peer_message_t const *values; /*  Messages. */
+} peer_message_batch_t;
+
+/*  Number of previous messages resent alongside new messages, so a
+ *  lost packet is recovered without a round trip.
+ */
+typedef struct {
+  ptrdiff_t serial_size;      /*  Recent messages to resend. */
+  ptrdiff_t scatter_size;     /*  Random previous messages to
+                                  resend. */
+  ptrdiff_t scatter_distance; /*  Max distance of random previous
+                                  messages. */
+} peer_trail_t;
+
+/*  Last retransmission of an outgoing message.
+ */
+typedef struct {
+  ptrdiff_t   index; /*  Message index, or PEER_UNDEFINED. */
+  peer_time_t time;  /*  Local time of the retransmission. */
+} peer_resend_t;
+
+/*  Round trip time statistics, in the time units of peer_tick.
+ */
+typedef struct {
+  ptrdiff_t   samples;  /*  Number of measurements. */
+  peer_time_t smoothed; /*  Moving average. */
+  peer_time_t variance; /*  Moving average of the deviation. */
+  peer_time_t min;      /*  Min measured value. */
+  peer_time_t max;      /*  Max measured value. */
+} peer_rtt_t;
 
 typedef struct {
   peer_slot_state_t state;  /*  Session state. */
@@ -52,6 +139,70 @@ typedef struct {
   ptrdiff_t out_index; /*  Outgoing message queue index. */
   peer_time_t
       clock_heartbeat; /*  Time left before the next heartbeat. */
+
+  /*  Selective acknowledgement state. Remote reports the first
+   *  missing index of our outgoing messages and a bitmap of received
+   *  messages after it.
+   */
+  ptrdiff_t ack_index; /*  First message index missing on remote. */
+  uint64_t  ack_mask;  /*  Bit k is set if remote has message
+                           ack_index + 1 + k. */
+
+  /*  Retransmissions, indexed by message index modulo the window.
+   *  A message is resent again only after a round trip, so the
+   *  remote can acknowledge the previous copy first.
+   */
+  peer_resend_t resend[PEER_RESEND_WINDOW];
+
+  unsigned is_acked   : 1; /*  Remote sends acknowledgements. */
+  unsigned is_ack_new : 1; /*  Acknowledgement not processed yet. */
+  unsigned is_ack_due : 1; /*  We should send an acknowledgement. */
+
+  /*  Link quality estimate from incoming message indices. Gaps count
+   *  as losses. Duplicates are counted separately, because most of
+   *  them are trail copies. We report the estimate in our
+   *  acknowledgements, the remote reports its estimate for our
+   *  outgoing messages in the same way.
+   */
+  uint32_t  loss;          /*  Moving average of the loss rate,
+                               PEER_LOSS_ONE means 100%. */
+  uint32_t  remote_loss;   /*  Loss rate of our outgoing messages
+                               reported by the remote. */
+  ptrdiff_t in_duplicates; /*  Number of duplicate messages
+                               received. */
+
+  peer_fec_encoder_t fec_out; /*  Outgoing packets parity. */
+  peer_fec_decoder_t fec_in;  /*  Incoming packets parity. */
+
+  /*  Ping cycle. Ping carries our local time, remote echoes it back
+   *  in pong.
+   */
+  peer_time_t clock_ping; /*  Time left before the next ping. */
+  peer_time_t ping_time;  /*  Local time of the last ping. */
+  peer_time_t pong_time;  /*  Remote time to echo back. */
+  peer_rtt_t  rtt;        /*  Round trip time. */
+
+  unsigned is_ping_sent : 1; /*  Waiting for pong. */
+  unsigned is_pong_due  : 1; /*  We should send a pong. */
+
+  unsigned is_compact : 1; /*  Both sides agreed on compact
+                               packets. */
+
+  /*  Snapshot transfer. Host doesn't send mutual messages to the
+   *  slot until the remote acknowledges the snapshot index.
+   */
+  ptrdiff_t   snapshot_index;  /*  Snapshot being sent, or
+                                   PEER_UNDEFINED. */
+  peer_time_t clock_snapshot;  /*  Time left before the snapshot is
+                                   sent again. */
+  ptrdiff_t   snapshot_offset; /*  Next fragment offset. */
+
+  /*  Token bucket pacer. Large backlogs are sent across several
+   *  ticks, the out index moves by the messages that fit.
+   */
+  ptrdiff_t pace_tokens; /*  Bytes the slot may send, negative if
+                             the last tick went over, but not below
+                             minus the bucket size. */
 } peer_slot_t;
 
 typedef KIT_DA(peer_slot_t) peer_slots_t;
@@ -59,23 +210,149 @@ typedef KIT_AR(ptrdiff_t) peer_ids_ref_t;
 
 typedef enum { PEER_HOST, PEER_CLIENT } peer_mode_t;
 
+/*  How outgoing messages are protected from packet loss before the
+ *  remote acknowledges them. Parity packets are always accepted.
+ */
+typedef enum {
+  PEER_REDUNDANCY_TRAIL, /*  Resend previous messages. */
+  PEER_REDUNDANCY_FEC    /*  Send parity packets. */
+} peer_redundancy_t;
+
+/*  Checksum level of outgoing plain packets. Compact packets always
+ *  have the packet checksum, as compact messages have no checksum
+ *  field.
+ */
+typedef enum {
+  PEER_CHECKSUM_MESSAGE, /*  Checksum of each message. */
+  PEER_CHECKSUM_PACKET   /*  One checksum of the whole packet. */
+} peer_checksum_t;
+
+/*  Protocol settings of a peer. Both sides of a session may use
+ *  different settings, only the packet size should fit the path MTU.
+ */
+typedef struct {
+  ptrdiff_t         packet_size;        /*  Max outgoing packet
+                                            size, without the nonce
+                                            and the tag. */
+  peer_time_t       timeout_heartbeat;  /*  Heartbeat interval. */
+  peer_time_t       timeout_ping;       /*  Ping interval. */
+  peer_time_t       timeout_connection; /*  Silence before the
+                                            connection is lost. */
+  peer_trail_t      trail_min;          /*  Trail size on a clean
+                                            link. */
+  peer_trail_t      trail_max;          /*  Trail size on a lossy
+                                            link. */
+  peer_redundancy_t redundancy;         /*  Loss protection mode. */
+  int               compact;            /*  Send compact packets if
+                                            remote accepts them. */
+  peer_checksum_t   checksum;           /*  Checksum level. */
+  ptrdiff_t         history;            /*  Min number of mutual
+                                            messages retained, or
+                                            PEER_UNDEFINED to keep
+                                            all. */
+  ptrdiff_t         send_threads;       /*  Threads packing host's
+                                            outgoing packets. Slots
+                                            are split between them,
+                                            so the allocator should be
+                                            thread-safe if more than
+                                            one. */
+  ptrdiff_t         submit_capacity;    /*  Size of the submission
+                                            queue, used by
+                                            peer_init. */
+  ptrdiff_t         pace_rate;          /*  Bytes per ms each slot
+                                            may send, or
+                                            PEER_UNDEFINED for no
+                                            limit. No limit by
+                                            default. */
+  ptrdiff_t         pace_burst;         /*  Token bucket size of
+                                            each slot. */
+} peer_config_t;
+
+typedef struct peer_send_shard peer_send_shard_t;
+
+/*  Application state with the mutual messages before the index
+ *  applied. Host sends it to new clients instead of the messages
+ *  before the index, in PEER_M_SNAPSHOT fragments.
+ */
+typedef struct {
+  ptrdiff_t    index;       /*  First message not in the state, or
+                                PEER_UNDEFINED. */
+  ptrdiff_t    received;    /*  Bytes received by the client. */
+  int          is_complete; /*  All bytes are received. */
+  peer_chunk_t data;        /*  State data. */
+} peer_snapshot_t;
+
+typedef struct {
+  ptrdiff_t        index; /*  Snapshot index, or PEER_UNDEFINED. */
+  peer_chunk_ref_t data;  /*  State data. */
+} peer_snapshot_ref_t;
+
+/*  Data waiting to be sent to the slot.
+ */
+typedef struct {
+  ptrdiff_t messages;       /*  Outgoing messages not sent yet. */
+  ptrdiff_t snapshot_bytes; /*  Snapshot bytes left in the current
+                                round, or 0. */
+  ptrdiff_t pace_tokens;    /*  Bytes the pacer allows now. */
+} peer_backlog_t;
+
+/*  Called by peer_submit from the submitting thread after the
+ *  message is added to the submission queue.
+ */
+typedef void (*peer_wake_fn)(void *state);
+
 typedef struct {
-  kit_allocator_t  alloc;       /*  Memory allocator. */
-  peer_mode_t      mode;        /*  Host or client. */
-  peer_time_t      time;        /*  Current mutual time. */
-  peer_time_t      time_local;  /*  Current local time. */
-  ptrdiff_t        actor;       /*  Peer actor id. */
-  peer_slots_t     slots;       /*  All sessions. */
-  peer_queue_t     queue;       /*  Shared mutual message queue. */
-  ptrdiff_t        queue_index; /*  Unprocessed messages index. */
-  kit_mt64_state_t mt64;        /*  Random number generator. */
+  kit_allocator_t    alloc;          /*  Memory allocator. */
+  peer_mode_t        mode;           /*  Host or client. */
+  peer_time_t        time;           /*  Current mutual time. */
+  peer_time_t        time_local;     /*  Current local time. */
+  ptrdiff_t          actor;          /*  Peer actor id. */
+  peer_slots_t       slots;          /*  All sessions. */
+  peer_queue_t       queue;          /*  Shared mutual message
+                                         queue. */
+  ptrdiff_t          queue_index;    /*  Unprocessed messages
+                                         index. */
+  ptrdiff_t          queue_readable; /*  End of readable mutual
+                                         messages at the previous
+                                         tick. */
+  kit_mt64_state_t   mt64;           /*  Random number generator. */
+  peer_arena_t       scratch;        /*  Temporary memory, reset on
+                                         each tick and input. */
+  peer_config_t      config;         /*  Protocol settings. */
+  peer_workers_t     workers;        /*  Host send threads. */
+  peer_send_shard_t *shards;         /*  Host send state per
+                                         thread. */
+  ptrdiff_t          shard_count;    /*  Number of send shards. */
+  peer_submit_t      submit;         /*  Messages from other
+                                         threads. */
+  peer_wake_fn       wake;           /*  Wakes the ticking thread
+                                         on submit, or NULL. Set
+                                         before other threads
+                                         submit. */
+  void              *wake_state;     /*  Wake function argument. */
+  peer_snapshot_t    snapshot;       /*  Latest state snapshot. */
 } peer_t;
 
+/*  Default protocol settings from options.h.
+ */
+peer_config_t peer_config_default(void);
+
+/*  Initialize the peer. Default settings are used if config is NULL.
+ */
 kit_status_t peer_init(peer_t *host, peer_mode_t mode,
-                       kit_allocator_t alloc);
+                       peer_config_t const *config,
+                       kit_allocator_t      alloc);
 kit_status_t peer_open(peer_t *peer, peer_ids_ref_t ids);
 kit_status_t peer_destroy(peer_t *peer);
 kit_status_t peer_queue(peer_t *peer, peer_chunk_ref_t message_data);
+
+/*  Same as peer_queue, but may be called from any thread while
+ *  another thread ticks the peer. The message is copied into the
+ *  submission queue and added to the message queue on the next tick.
+ *  Never blocks, returns PEER_ERROR_NO_FREE_SLOTS if the submission
+ *  queue is full. Calls the peer's wake function if it is set.
+ */
+kit_status_t peer_submit(peer_t *peer, peer_chunk_ref_t message_data);
 kit_status_t peer_connect(peer_t *client, ptrdiff_t server_id);
 kit_status_t peer_input(peer_t *peer, peer_packets_ref_t packets);
 
@@ -86,6 +363,83 @@ typedef struct {
 
 peer_tick_result_t peer_tick(peer_t *peer, peer_time_t time_elapsed);
 
+/*  Range of message indices retained by the queue.
+ */
+peer_queue_window_t peer_queue_window(peer_queue_t const *q);
+
+/*  Message with the specified index, or NULL if the message is not
+ *  retained.
+ */
+peer_message_t const *peer_queue_message(peer_queue_t const *q,
+                                         ptrdiff_t           index);
+
+/*  Payload of the message with the specified index. Empty if the
+ *  message is not retained or not received yet.
+ */
+peer_chunk_ref_t peer_queue_data(peer_queue_t const *q,
+                                 ptrdiff_t           index);
+
+/*  Release messages before the index. Indices of other messages don't
+ *  change. Peer trims slot queues itself, and trims the mutual queue
+ *  one tick after messages become readable, keeping the history
+ *  size of them and the messages the host still sends. Read the
+ *  mutual queue after each tick, or set history to PEER_UNDEFINED to
+ *  keep it all. Host rejects new clients with
+ *  PEER_ERROR_INVALID_OUT_INDEX once messages are released, unless
+ *  a snapshot covers them.
+ */
+kit_status_t peer_queue_trim(peer_queue_t *q, ptrdiff_t index);
+
+/*  Messages of the mutual queue after the cursor, up to the first
+ *  one that is not received yet, and at most max_size of them if
+ *  max_size is not PEER_UNDEFINED. Host's messages are readable
+ *  after the tick that sets their time. Moves the cursor past the
+ *  batch. Released messages are skipped, so the batch index may be
+ *  greater than the cursor was. Batch also ends where the queue
+ *  storage wraps around, read again for the rest. Payloads are in
+ *  peer_queue_data.
+ */
+peer_message_batch_t peer_read(peer_t const *peer, ptrdiff_t *cursor,
+                               ptrdiff_t max_size);
+
+/*  Register the state snapshot at the message index. The data is
+ *  copied. New clients receive the snapshot and the messages after
+ *  the index only, so the host may trim the history up to it. The
+ *  index should be greater than the previous one, registering
+ *  different data at the same index fails.
+ */
+kit_status_t peer_snapshot(peer_t *host, ptrdiff_t index,
+                           peer_chunk_ref_t data);
+
+/*  Latest complete snapshot. Client receives it when joining, and
+ *  should read the mutual queue from its index. Index is
+ *  PEER_UNDEFINED if there is no snapshot.
+ */
+peer_snapshot_ref_t peer_snapshot_read(peer_t const *peer);
+
+/*  Trail size for the slot, scaled between the peer's trail bounds
+ *  by the loss rate the remote reports for our messages.
+ */
+peer_trail_t peer_slot_trail(peer_t const      *peer,
+                             peer_slot_t const *slot);
+
+/*  Round trip time statistics for the slot. No samples if the
+ *  remote didn't answer a ping yet.
+ */
+peer_rtt_t peer_slot_rtt(peer_slot_t const *slot);
+
+/*  Backlog of the slot, for monitoring the catch up of new and
+ *  reconnected clients.
+ */
+peer_backlog_t peer_slot_backlog(peer_t const      *peer,
+                                 peer_slot_t const *slot);
+
+/*  Time left before the next tick has something to send. Returns 0 if
+ *  the next tick is due now, or PEER_UNDEFINED if there is nothing to
+ *  wait for.
+ */
+peer_time_t peer_next_timeout(peer_t const *peer);
+
 #ifdef __cplusplus
 }
 #endif
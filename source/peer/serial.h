@@ -1,6 +1,7 @@
 #ifndef PEER_SERIAL_H
 #define PEER_SERIAL_H
 
+#include "checksum.h"
 #include "options.h"
 
 #include <assert.h>
@@ -151,13 +152,24 @@ static void peer_write_message_mode(uint8_t *const message,
   message[PEER_N_MESSAGE_SIZE_AND_MODE] |= mode << 2;
 }
 
-static void peer_write_message(uint8_t *const       destination,
-                               uint8_t const        mode,
-                               ptrdiff_t const      index,
-                               peer_time_t const    time,
-                               ptrdiff_t const      actor,
-                               ptrdiff_t const      data_size,
-                               uint8_t const *const data) {
+/*  CRC32C of the message after the checksum field.
+ */
+static uint64_t peer_message_checksum(uint8_t const *const message,
+                                      ptrdiff_t const      size) {
+  assert(message != NULL);
+  assert(size >= PEER_N_MESSAGE_DATA);
+  return peer_crc32c(0, message + PEER_N_MESSAGE_SIZE,
+                     size - PEER_N_MESSAGE_SIZE);
+}
+
+/*  Serialize the message with zero checksum. Used if the packet
+ *  checksum covers the message.
+ */
+static void peer_write_message_unchecked(
+    uint8_t *const destination, uint8_t const mode,
+    ptrdiff_t const index, peer_time_t const time,
+    ptrdiff_t const actor, ptrdiff_t const data_size,
+    uint8_t const *const data) {
   assert(destination != NULL);
   assert(data_size >= 0 && data_size <= PEER_MAX_MESSAGE_SIZE);
   assert(data_size == 0 || data != NULL);
@@ -165,13 +177,9 @@ static void peer_write_message(uint8_t *const       destination,
   assert(actor >= 0 || actor == PEER_UNDEFINED);
   assert((int64_t) actor <= 0xffffffffll);
 
-  /*  FIXME
-   *  Calculate the checksum.
-   */
-  uint64_t const checksum  = 0;
   uint16_t const full_size = PEER_N_MESSAGE_DATA + data_size;
 
-  peer_write_u64(destination + PEER_N_MESSAGE_CHECKSUM, checksum);
+  peer_write_u64(destination + PEER_N_MESSAGE_CHECKSUM, 0);
   peer_write_message_size(destination, full_size);
   peer_write_message_mode(destination, mode);
   peer_write_u64(destination + PEER_N_MESSAGE_INDEX, index);
@@ -185,6 +193,74 @@ static void peer_write_message(uint8_t *const       destination,
     memcpy(destination + PEER_N_MESSAGE_DATA, data, data_size);
 }
 
+static void peer_write_message(uint8_t *const       destination,
+                               uint8_t const        mode,
+                               ptrdiff_t const      index,
+                               peer_time_t const    time,
+                               ptrdiff_t const      actor,
+                               ptrdiff_t const      data_size,
+                               uint8_t const *const data) {
+  peer_write_message_unchecked(destination, mode, index, time, actor,
+                               data_size, data);
+
+  peer_write_u64(destination + PEER_N_MESSAGE_CHECKSUM,
+                 peer_message_checksum(destination,
+                                       PEER_N_MESSAGE_DATA +
+                                           data_size));
+}
+
+/*  Variable-length integers, 7 bits per byte, low bits first. Signed
+ *  values are zigzag-coded, so small negative values are short too.
+ */
+
+enum { PEER_VARINT_MAX_SIZE = 10 };
+
+static uint64_t peer_zigzag(int64_t const x) {
+  return (((uint64_t) x) << 1) ^ (uint64_t) (x >> 63);
+}
+
+static int64_t peer_unzigzag(uint64_t const x) {
+  return (int64_t) (x >> 1) ^ -(int64_t) (x & 1);
+}
+
+static ptrdiff_t peer_write_varint(uint8_t *const destination,
+                                   uint64_t       x) {
+  assert(destination != NULL);
+
+  ptrdiff_t n = 0;
+
+  while (x >= 0x80) {
+    destination[n++] = (uint8_t) (x | 0x80);
+    x >>= 7;
+  }
+
+  destination[n++] = (uint8_t) x;
+  return n;
+}
+
+/*  Returns the number of bytes read, or 0 if the value doesn't fit
+ *  the source size.
+ */
+static ptrdiff_t peer_read_varint(uint8_t const *const source,
+                                  ptrdiff_t const      size,
+                                  uint64_t *const      x) {
+  assert(source != NULL);
+  assert(x != NULL);
+
+  uint64_t value = 0;
+
+  for (ptrdiff_t n = 0; n < size && n < PEER_VARINT_MAX_SIZE; n++) {
+    value |= ((uint64_t) (source[n] & 0x7f)) << (7 * n);
+
+    if ((source[n] & 0x80) == 0) {
+      *x = value;
+      return n + 1;
+    }
+  }
+
+  return 0;
+}
+
 #ifdef __GNUC__
 #  pragma GCC diagnostic pop
 #endif
@@ -1,36 +1,181 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/*  Required for recvmmsg and sendmmsg.
+ */
+#  define _GNU_SOURCE
+#endif
+
 #include "socket_pool.h"
 
 #include <assert.h>
 
 #ifndef PEER_DISABLE_SYSTEM_SOCKETS
-static kit_status_t find_pool_node(
-    peer_socket_pool_t *const pool, int const protocol,
-    uint16_t const remote_port, ptrdiff_t const remote_address_size,
-    char const *const remote_address, ptrdiff_t *const out_id) {
-  assert(pool != NULL);
+#  if defined(__linux__)
+#    define PEER_HAVE_MMSG
+#    define PEER_HAVE_EPOLL
+#    include <sys/epoll.h>
+#    include <sys/eventfd.h>
+#  endif
+static uint64_t node_key_hash(peer_node_key_t const *const key) {
+  /*  FNV-1a over protocol, port and binary address.
+   */
+
+  uint64_t h = 14695981039346656037ull;
+
+  h = (h ^ (uint8_t) key->protocol) * 1099511628211ull;
+  h = (h ^ (uint8_t) (key->port & 0xff)) * 1099511628211ull;
+  h = (h ^ (uint8_t) (key->port >> 8)) * 1099511628211ull;
+
+  for (ptrdiff_t i = 0; i < sizeof key->address; i++)
+    h = (h ^ key->address[i]) * 1099511628211ull;
+
+  return h;
+}
+
+static int node_key_equal(peer_node_key_t const *const left,
+                          peer_node_key_t const *const right) {
+  return left->protocol == right->protocol &&
+         left->port == right->port &&
+         memcmp(left->address, right->address,
+                sizeof left->address) == 0;
+}
+
+static void node_key_name(peer_node_key_t const *const key,
+                          peer_node_t *const           node) {
+  memset(&node->remote_name, 0, sizeof node->remote_name);
+
+  node->remote_name.ipv4.sin_family = AF_INET;
+  node->remote_name.ipv4.sin_port   = htons(key->port);
+  memcpy(&node->remote_name.ipv4.sin_addr, key->address,
+         sizeof node->remote_name.ipv4.sin_addr);
+
+  node->remote_name_size = sizeof node->remote_name.ipv4;
+}
+
+static void node_key_ipv4(peer_node_key_t *const          key,
+                          struct sockaddr_in const *const name) {
+  memset(key, 0, sizeof *key);
+
+  key->id       = PEER_UNDEFINED;
+  key->protocol = PEER_UDP_IPv4;
+  key->port     = ntohs(name->sin_port);
+  memcpy(key->address, &name->sin_addr, sizeof name->sin_addr);
+  key->hash = node_key_hash(key);
+}
+
+static kit_status_t node_key_text(peer_node_key_t *const key,
+                                  int const              protocol,
+                                  uint16_t const         port,
+                                  ptrdiff_t const        size,
+                                  char const *const      text) {
   assert(protocol == PEER_UDP_IPv4);
-  assert(remote_address_size > 0);
+  assert(size > 0 && size <= PEER_ADDRESS_SIZE - 2);
 
   if (protocol != PEER_UDP_IPv4)
     return PEER_ERROR_UNKNOWN_PROTOCOL;
+  if (size <= 0 || size > PEER_ADDRESS_SIZE - 2)
+    return PEER_ERROR_INVALID_ADDRESS;
 
-  *out_id = -1;
+  /*  Same bound as peer_pool_connect, plus the terminator.
+   */
+  char buf[PEER_ADDRESS_SIZE - 1];
+  memcpy(buf, text, size);
+  buf[size] = '\0';
 
-  for (ptrdiff_t i = 0; i < pool->nodes.size; i++) {
-    peer_node_t const *const node = pool->nodes.values + i;
-
-    if (node->socket == INVALID_SOCKET &&
-        node->protocol == protocol &&
-        node->local_port == PEER_ANY_PORT &&
-        node->remote_port == remote_port &&
-        AR_EQUAL(kit_str(node->remote_address_size,
-                         (char const *) node->remote_address),
-                 kit_str(remote_address_size, remote_address))) {
-      *out_id = i;
-      return KIT_OK;
+  struct sockaddr_in name;
+  memset(&name, 0, sizeof name);
+
+  name.sin_family = AF_INET;
+  name.sin_port   = htons(port);
+
+  if (inet_pton(AF_INET, buf, &name.sin_addr) != 1)
+    return PEER_ERROR_INVALID_ADDRESS;
+
+  node_key_ipv4(key, &name);
+  return KIT_OK;
+}
+
+static void node_index_put(peer_node_keys_t *const      index,
+                           peer_node_key_t const *const key) {
+  /*  Linear probing. Capacity is a power of two.
+   */
+
+  assert(index->size > 0);
+  assert((index->size & (index->size - 1)) == 0);
+
+  uint64_t const mask = (uint64_t) index->size - 1;
+
+  for (uint64_t i = key->hash & mask;; i = (i + 1) & mask)
+    if (index->values[i].id == PEER_UNDEFINED) {
+      index->values[i] = *key;
+      return;
+    }
+}
+
+static kit_status_t node_index_grow(peer_socket_pool_t *const pool) {
+  ptrdiff_t const size = pool->index.size == 0 ? 64
+                                               : pool->index.size * 2;
+
+  peer_node_keys_t index;
+  DA_INIT(index, size, pool->alloc);
+  assert(index.size == size);
+  if (index.size != size) {
+    DA_DESTROY(index);
+    return PEER_ERROR_BAD_ALLOC;
+  }
+
+  for (ptrdiff_t i = 0; i < size; i++)
+    index.values[i].id = PEER_UNDEFINED;
+
+  for (ptrdiff_t i = 0; i < pool->index.size; i++)
+    if (pool->index.values[i].id != PEER_UNDEFINED)
+      node_index_put(&index, pool->index.values + i);
+
+  DA_DESTROY(pool->index);
+  pool->index = index;
+
+  return KIT_OK;
+}
+
+static kit_status_t find_pool_node_by_key(
+    peer_socket_pool_t *const pool, peer_node_key_t const *const key,
+    ptrdiff_t *const out_id) {
+  assert(pool != NULL);
+  assert(key != NULL);
+  assert(out_id != NULL);
+
+  *out_id = PEER_UNDEFINED;
+
+  if (pool->index.size > 0) {
+    uint64_t const mask = (uint64_t) pool->index.size - 1;
+
+    for (uint64_t i = key->hash & mask;; i = (i + 1) & mask) {
+      peer_node_key_t const *const entry = pool->index.values + i;
+
+      if (entry->id == PEER_UNDEFINED)
+        break;
+
+      if (entry->hash == key->hash && node_key_equal(entry, key)) {
+        *out_id = entry->id;
+        return KIT_OK;
+      }
     }
   }
 
+  /*  Add a new remote node.
+   */
+
+  if ((pool->index_size + 1) * 2 > pool->index.size) {
+    kit_status_t const s = node_index_grow(pool);
+    if (s != KIT_OK)
+      return s;
+  }
+
+  char text[PEER_ADDRESS_SIZE - 2];
+  memset(text, 0, sizeof text);
+
+  if (inet_ntop(AF_INET, key->address, text, sizeof text) == NULL)
+    return PEER_ERROR_INVALID_ADDRESS;
+
   ptrdiff_t const n = pool->nodes.size;
 
   DA_RESIZE(pool->nodes, n + 1);
@@ -42,17 +187,44 @@ static kit_status_t find_pool_node(
   memset(node, 0, sizeof *node);
 
   node->socket              = INVALID_SOCKET;
-  node->protocol            = protocol;
+  node->protocol            = key->protocol;
   node->local_port          = PEER_ANY_PORT;
-  node->remote_port         = remote_port;
-  node->remote_address_size = remote_address_size;
+  node->remote_port         = key->port;
+  node->remote_address_size = strlen(text);
+  node->connected_id        = PEER_UNDEFINED;
 
-  memcpy(node->remote_address, remote_address, remote_address_size);
+  memcpy(node->remote_address, text, node->remote_address_size);
+  node_key_name(key, node);
+
+  peer_node_key_t entry = *key;
+  entry.id              = n;
+  node_index_put(&pool->index, &entry);
+  pool->index_size++;
 
   *out_id = n;
   return KIT_OK;
 }
 
+static kit_status_t find_pool_node(
+    peer_socket_pool_t *const pool, int const protocol,
+    uint16_t const remote_port, ptrdiff_t const remote_address_size,
+    char const *const remote_address, ptrdiff_t *const out_id) {
+  assert(pool != NULL);
+  assert(protocol == PEER_UDP_IPv4);
+  assert(remote_address_size > 0);
+
+  *out_id = PEER_UNDEFINED;
+
+  peer_node_key_t    key;
+  kit_status_t const s = node_key_text(&key, protocol, remote_port,
+                                       remote_address_size,
+                                       remote_address);
+  if (s != KIT_OK)
+    return s;
+
+  return find_pool_node_by_key(pool, &key, out_id);
+}
+
 static kit_status_t resolve_address_and_id(
     peer_socket_pool_t *const pool, peer_t *const peer) {
   kit_status_t status = KIT_OK;
@@ -136,10 +308,19 @@ static kit_status_t resolve_address_and_id(
             (uint16_t) (slot->remote.address_data[1] |
                         (slot->remote.address_data[2] << 8));
 
-        ptrdiff_t          id;
-        kit_status_t const s = find_pool_node(
-            pool, protocol, port, node->remote_address_size,
-            (char const *) node->remote_address, &id);
+        ptrdiff_t    id = PEER_UNDEFINED;
+        kit_status_t s  = PEER_ERROR_UNKNOWN_PROTOCOL;
+
+        if (protocol == PEER_UDP_IPv4 &&
+            node->protocol == PEER_UDP_IPv4) {
+          peer_node_key_t key;
+          node_key_ipv4(&key, &node->remote_name.ipv4);
+
+          key.port = port;
+          key.hash = node_key_hash(&key);
+
+          s = find_pool_node_by_key(pool, &key, &id);
+        }
 
         if (s != KIT_OK)
           status |= s;
@@ -184,8 +365,16 @@ kit_status_t peer_pool_init(peer_socket_pool_t *const pool,
   if (pool == NULL)
     return PEER_ERROR_INVALID_POOL;
 
-  pool->alloc = alloc;
+  memset(pool, 0, sizeof *pool);
+
+  pool->alloc       = alloc;
+  pool->batch_size  = PEER_POOL_BATCH_SIZE;
+  pool->wait_handle = -1;
+  pool->wake_handle = INVALID_SOCKET;
+
   DA_INIT(pool->nodes, 0, alloc);
+  DA_INIT(pool->index, 0, alloc);
+  DA_INIT(pool->received, 0, alloc);
 
   return KIT_OK;
 }
@@ -197,31 +386,137 @@ kit_status_t peer_pool_destroy(peer_socket_pool_t *const pool) {
     return PEER_ERROR_INVALID_POOL;
 
   for (ptrdiff_t i = 0; i < pool->nodes.size; i++)
-    closesocket(pool->nodes.values[i].socket);
+    if (pool->nodes.values[i].socket != INVALID_SOCKET)
+      closesocket(pool->nodes.values[i].socket);
 
   DA_DESTROY(pool->nodes);
+  DA_DESTROY(pool->index);
+  DA_DESTROY(pool->received);
+
+  if (pool->wake_handle != INVALID_SOCKET)
+    closesocket(pool->wake_handle);
+
+#  ifdef PEER_HAVE_EPOLL
+  if (pool->wait_handle != -1)
+    close(pool->wait_handle);
+#  endif
 
   return KIT_OK;
 }
 
-kit_status_t peer_pool_open(peer_socket_pool_t *const pool,
-                            peer_t *const peer, int const protocol,
-                            uint16_t const  port,
-                            ptrdiff_t const count) {
+static void pool_wake(void *const state) {
+  /*  Called from the submitting thread. If the handle is already
+   *  signaled the call may fail, which is fine.
+   */
+
+  peer_socket_pool_t const *const pool =
+      (peer_socket_pool_t const *) state;
+
+#  ifdef PEER_HAVE_EPOLL
+  uint64_t const one = 1;
+  ssize_t const  n   = write(pool->wake_handle, &one, sizeof one);
+  (void) n;
+#  else
+  char const c = 0;
+  send(pool->wake_handle, &c, 1, 0);
+#  endif
+}
+
+static void wake_drain(peer_socket_pool_t const *const pool) {
+#  ifdef PEER_HAVE_EPOLL
+  uint64_t      value;
+  ssize_t const n = read(pool->wake_handle, &value, sizeof value);
+  (void) n;
+#  else
+  char buffer[16];
+  while (recv(pool->wake_handle, buffer, sizeof buffer, 0) > 0) { }
+#  endif
+}
+
+static kit_status_t wake_attach(peer_socket_pool_t *const pool,
+                                peer_t *const             peer) {
+  /*  Create the wake handle once, before other threads may submit
+   *  to the peer.
+   */
+
+  if (pool->wake_handle == INVALID_SOCKET) {
+#  ifdef PEER_HAVE_EPOLL
+    pool->wake_handle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (pool->wake_handle == -1)
+      return PEER_ERROR_CREATE_SOCKET_FAILED;
+
+    /*  Rebuild the epoll set to register the new handle.
+     */
+    if (pool->wait_handle != -1) {
+      close(pool->wait_handle);
+      pool->wait_handle = -1;
+    }
+#  else
+    /*  Socket connected to itself, so it can be polled with the
+     *  nodes.
+     */
+
+    socket_t const s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (s == INVALID_SOCKET)
+      return PEER_ERROR_CREATE_SOCKET_FAILED;
+
+    struct sockaddr_in name;
+    memset(&name, 0, sizeof name);
+
+    name.sin_family      = AF_INET;
+    name.sin_port        = htons(PEER_ANY_PORT);
+    name.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socklen_t len = sizeof name;
+
+    if (peer_socket_set_nonblocking(s) != 0 ||
+        bind(s, (struct sockaddr const *) &name, sizeof name) ==
+            -1 ||
+        getsockname(s, (struct sockaddr *) &name, &len) == -1 ||
+        connect(s, (struct sockaddr const *) &name, len) == -1) {
+      closesocket(s);
+      return PEER_ERROR_CREATE_SOCKET_FAILED;
+    }
+
+    pool->wake_handle = s;
+#  endif
+  }
+
+  peer->wake       = pool_wake;
+  peer->wake_state = pool;
+
+  return KIT_OK;
+}
+
+static kit_status_t pool_open(peer_socket_pool_t *const pool,
+                              peer_t *const peer, int const protocol,
+                              uint16_t const  port,
+                              ptrdiff_t const count,
+                              ptrdiff_t const slot_count) {
+  /*  Open count sockets and slot_count slots. First slot uses the
+   *  first socket, other slots are spread over all sockets.
+   */
+
   assert(pool != NULL);
   assert(peer != NULL);
   assert(count > 0);
+  assert(slot_count >= count);
 
   if (pool == NULL)
     return PEER_ERROR_INVALID_POOL;
   if (peer == NULL)
     return PEER_ERROR_INVALID_PEER;
-  if (count <= 0)
+  if (count <= 0 || slot_count < count)
     return PEER_ERROR_INVALID_COUNT;
 
-  kit_status_t    status = KIT_OK;
+  kit_status_t    status = wake_attach(pool, peer);
   ptrdiff_t const n      = pool->nodes.size;
 
+  if (status != KIT_OK)
+    return status;
+
   switch (protocol) {
     case PEER_UDP_IPv4:
       DA_RESIZE(pool->nodes, n + count);
@@ -236,6 +531,9 @@ kit_status_t peer_pool_open(peer_socket_pool_t *const pool,
       memset(pool->nodes.values + n, 0,
              count * sizeof *pool->nodes.values);
 
+      for (ptrdiff_t i = 0; i < count; i++)
+        pool->nodes.values[n + i].socket = INVALID_SOCKET;
+
       for (ptrdiff_t i = 0; i < count; i++) {
         peer_node_t *const node = pool->nodes.values + (n + i);
 
@@ -256,8 +554,11 @@ kit_status_t peer_pool_open(peer_socket_pool_t *const pool,
         struct sockaddr_in name;
         memset(&name, 0, sizeof name);
 
+        /*  Only the first socket can be bound to the specified port.
+         */
+
         name.sin_family      = AF_INET;
-        name.sin_port        = htons(port);
+        name.sin_port        = htons(i == 0 ? port : PEER_ANY_PORT);
         name.sin_addr.s_addr = htonl(INADDR_ANY);
 
         if (bind(node->socket, (struct sockaddr const *) &name,
@@ -277,9 +578,10 @@ kit_status_t peer_pool_open(peer_socket_pool_t *const pool,
           break;
         }
 
-        node->protocol    = PEER_UDP_IPv4;
-        node->local_port  = ntohs(name.sin_port);
-        node->remote_port = PEER_ANY_PORT;
+        node->protocol     = PEER_UDP_IPv4;
+        node->local_port   = ntohs(name.sin_port);
+        node->remote_port  = PEER_ANY_PORT;
+        node->connected_id = PEER_UNDEFINED;
       }
 
       break;
@@ -298,11 +600,14 @@ kit_status_t peer_pool_open(peer_socket_pool_t *const pool,
 
   if (status == KIT_OK) {
     DA(ptrdiff_t) ids;
-    DA_INIT(ids, count, pool->alloc);
-    assert(ids.size == count);
+    DA_INIT(ids, slot_count, pool->alloc);
+    assert(ids.size == slot_count);
 
-    if (ids.size == count) {
-      for (ptrdiff_t i = 0; i < count; i++) ids.values[i] = n + i;
+    if (ids.size == slot_count) {
+      for (ptrdiff_t i = 0; i < slot_count; i++) {
+        ids.values[i] = n + i % count;
+        pool->nodes.values[ids.values[i]].slot_count++;
+      }
       peer_ids_ref_t const ref = { .size   = ids.size,
                                    .values = ids.values };
       status |= peer_open(peer, ref);
@@ -322,6 +627,21 @@ kit_status_t peer_pool_open(peer_socket_pool_t *const pool,
   return status;
 }
 
+kit_status_t peer_pool_open(peer_socket_pool_t *const pool,
+                            peer_t *const peer, int const protocol,
+                            uint16_t const  port,
+                            ptrdiff_t const count) {
+  return pool_open(pool, peer, protocol, port, count, count);
+}
+
+kit_status_t peer_pool_open_multiplexed(
+    peer_socket_pool_t *const pool, peer_t *const peer,
+    int const protocol, uint16_t const port,
+    ptrdiff_t const socket_count, ptrdiff_t const slot_count) {
+  return pool_open(pool, peer, protocol, port, socket_count,
+                   slot_count);
+}
+
 kit_status_t peer_pool_connect(peer_socket_pool_t *const pool,
                                peer_t *const peer, int const protocol,
                                kit_str_t const address,
@@ -342,9 +662,13 @@ kit_status_t peer_pool_connect(peer_socket_pool_t *const pool,
   if (port == PEER_ANY_PORT)
     return PEER_ERROR_INVALID_PORT;
 
-  ptrdiff_t    remote_id;
-  kit_status_t s = find_pool_node(pool, protocol, port, address.size,
-                                  address.values, &remote_id);
+  kit_status_t s = wake_attach(pool, peer);
+  if (s != KIT_OK)
+    return s;
+
+  ptrdiff_t remote_id;
+  s = find_pool_node(pool, protocol, port, address.size,
+                     address.values, &remote_id);
   if (s != KIT_OK)
     return s;
 
@@ -359,169 +683,613 @@ kit_status_t peer_pool_connect(peer_socket_pool_t *const pool,
   return peer_connect(peer, remote_id);
 }
 
-kit_status_t peer_pool_tick(peer_socket_pool_t *const pool,
-                            peer_t *const             peer,
-                            peer_time_t const         time_elapsed) {
-  assert(pool != NULL);
-  assert(peer != NULL);
-  assert(time_elapsed >= 0);
+static ptrdiff_t pool_batch_size(
+    peer_socket_pool_t const *const pool) {
+  if (pool->batch_size < 1)
+    return 1;
+  if (pool->batch_size > PEER_POOL_MAX_BATCH_SIZE)
+    return PEER_POOL_MAX_BATCH_SIZE;
+  return pool->batch_size;
+}
 
-  if (pool == NULL)
-    return PEER_ERROR_INVALID_POOL;
-  if (peer == NULL)
-    return PEER_ERROR_INVALID_PEER;
-  if (time_elapsed < 0)
-    return PEER_ERROR_INVALID_TIME_ELAPSED;
+static int is_receive_transient(int const er) {
+  /*  Connected UDP sockets report ICMP errors for earlier datagrams
+   *  on the next receive. The socket stays usable.
+   */
+  return er == ECONNREFUSED || er == ECONNRESET;
+}
 
-  kit_status_t status = KIT_OK;
+static kit_status_t receive_error(int const er) {
+  if (er == EAGAIN || er == EWOULDBLOCK)
+    return KIT_OK;
 
-  status |= resolve_address_and_id(pool, peer);
+  assert(er != EMSGSIZE);
 
-  peer_packets_t packets;
-  DA_INIT(packets, 0, pool->alloc);
+  return PEER_ERROR_SOCKET_RECEIVE_FAILED;
+}
 
-  for (ptrdiff_t i = 0; i < pool->nodes.size; i++) {
-    peer_node_t *const node = pool->nodes.values + i;
+/*  Receive up to count datagrams into packets. Returns the number of
+ *  datagrams received, or -1 on failure.
+ */
+static ptrdiff_t receive_batch(socket_t const           s,
+                               peer_packet_t *const      packets,
+                               struct sockaddr_in *const names,
+                               ptrdiff_t const           count) {
+#  ifdef PEER_HAVE_MMSG
+  struct mmsghdr messages[PEER_POOL_MAX_BATCH_SIZE];
+  struct iovec   vectors[PEER_POOL_MAX_BATCH_SIZE];
+
+  assert(count <= PEER_POOL_MAX_BATCH_SIZE);
+
+  memset(messages, 0, count * sizeof *messages);
+
+  for (ptrdiff_t i = 0; i < count; i++) {
+    vectors[i].iov_base = packets[i].data;
+    vectors[i].iov_len  = PEER_MAX_PACKET_SIZE;
+
+    messages[i].msg_hdr.msg_name    = names + i;
+    messages[i].msg_hdr.msg_namelen = sizeof *names;
+    messages[i].msg_hdr.msg_iov     = vectors + i;
+    messages[i].msg_hdr.msg_iovlen  = 1;
+  }
 
-    if (node->socket == INVALID_SOCKET)
+  int const n = recvmmsg(s, messages, (unsigned) count, 0, NULL);
+
+  for (int i = 0; i < n; i++)
+    packets[i].size = (ptrdiff_t) messages[i].msg_len;
+
+  return n;
+#  else
+  ptrdiff_t n = 0;
+
+  for (; n < count; n++) {
+    socklen_t len = sizeof *names;
+
+    ptrdiff_t const size = recvfrom(
+        s, (char *) packets[n].data, PEER_MAX_PACKET_SIZE, 0,
+        (struct sockaddr *) (names + n), &len);
+
+    if (size == -1)
+      return n > 0 ? n : -1;
+
+    packets[n].size = size;
+  }
+
+  return n;
+#  endif
+}
+
+static kit_status_t pool_receive(peer_socket_pool_t *const pool) {
+  /*  Drain every socket until it would block.
+   */
+
+  ptrdiff_t const batch = pool_batch_size(pool);
+
+  struct sockaddr_in names[PEER_POOL_MAX_BATCH_SIZE];
+
+  kit_status_t status = KIT_OK;
+
+  DA_RESIZE(pool->received, 0);
+
+  for (ptrdiff_t i = 0; i < pool->nodes.size; i++) {
+    if (pool->nodes.values[i].socket == INVALID_SOCKET)
       continue;
-    if (node->protocol != PEER_UDP_IPv4)
+    if (pool->nodes.values[i].protocol != PEER_UDP_IPv4)
       continue;
 
-    struct sockaddr_in remote;
-    memset(&remote, 0, sizeof remote);
+    for (;;) {
+      ptrdiff_t const n = pool->received.size;
 
-    socklen_t len = sizeof remote;
+      DA_RESIZE(pool->received, n + batch);
+      assert(pool->received.size == n + batch);
+      if (pool->received.size != n + batch) {
+        DA_RESIZE(pool->received, n);
+        return status | PEER_ERROR_BAD_ALLOC;
+      }
 
-    uint8_t buf[PEER_PACKET_SIZE];
+      memset(names, 0, batch * sizeof *names);
 
-    ptrdiff_t const size = recvfrom(
-        node->socket, buf, PEER_PACKET_SIZE, 0,
-        (struct sockaddr *) &remote, &len);
+      ptrdiff_t const count = receive_batch(
+          pool->nodes.values[i].socket, pool->received.values + n,
+          names, batch);
 
-    if (size == -1) {
-      int const er = errno;
+      if (count <= 0) {
+        int const er = errno;
 
-      if (er != EAGAIN) {
-        assert(er != EMSGSIZE);
-        assert(er != ECONNRESET);
+        DA_RESIZE(pool->received, n);
 
-        if (er != 0)
-          status |= PEER_ERROR_SOCKET_RECEIVE_FAILED;
+        if (count == -1 && is_receive_transient(er)) {
+          pool->stats.receive_errors++;
+          continue;
+        }
+        if (count == -1)
+          status |= receive_error(er);
+        break;
       }
-    }
 
-    if (size <= 0)
-      continue;
+      pool->stats.receive_batches++;
+      pool->stats.receive_datagrams += count;
+      if (pool->stats.receive_batch_max < count)
+        pool->stats.receive_batch_max = count;
 
-    char sbuf[PEER_ADDRESS_SIZE - 1];
-    inet_ntop(AF_INET,
-              &((struct sockaddr_in const *) &remote)->sin_addr, sbuf,
-              sizeof sbuf);
+      /*  Resolve source ids. Connected sockets receive from one
+       *  remote node only.
+       */
 
-    uint16_t const remote_port = ntohs(remote.sin_port);
+      ptrdiff_t const connected_id =
+          pool->nodes.values[i].connected_id;
 
-    ptrdiff_t          id;
-    kit_status_t const s = find_pool_node(
-        pool, node->protocol, remote_port, strlen(sbuf), sbuf, &id);
+      ptrdiff_t m = n;
 
-    if (s != KIT_OK) {
-      status |= s;
-      continue;
-    }
+      for (ptrdiff_t j = 0; j < count; j++) {
+        if (pool->received.values[n + j].size <= 0)
+          continue;
 
-    ptrdiff_t const n = packets.size;
+        if (pool->is_authenticated &&
+            peer_verify(pool->mac_key,
+                        pool->received.values + (n + j)) != KIT_OK) {
+          pool->stats.rejected++;
+          continue;
+        }
 
-    DA_RESIZE(packets, n + 1);
-    assert(packets.size == n + 1);
-    if (packets.size != n + 1) {
-      status |= PEER_ERROR_BAD_ALLOC;
-      continue;
+        ptrdiff_t id = connected_id;
+
+        if (id == PEER_UNDEFINED) {
+          peer_node_key_t key;
+          node_key_ipv4(&key, names + j);
+
+          kit_status_t const s = find_pool_node_by_key(pool, &key,
+                                                       &id);
+
+          if (s != KIT_OK) {
+            status |= s;
+            continue;
+          }
+        }
+
+        peer_packet_t *const packet = pool->received.values + m;
+
+        if (m != n + j)
+          memcpy(packet, pool->received.values + (n + j),
+                 sizeof *packet);
+
+        packet->source_id      = id;
+        packet->destination_id = i;
+        m++;
+      }
+
+      DA_RESIZE(pool->received, m);
+
+      if (count < batch)
+        break;
     }
+  }
 
-    memset(packets.values + n, 0, sizeof *packets.values);
+  return status;
+}
 
-    packets.values[n].source_id      = id;
-    packets.values[n].destination_id = i;
-    packets.values[n].size           = size;
+/*  Send count packets from one socket. Null names are used for
+ *  connected sockets. Returns the number of packets sent, or -1 on
+ *  failure.
+ */
+static ptrdiff_t send_batch(socket_t const                s,
+                            peer_packet_t const *const    packets,
+                            peer_sockaddr_t const *const *names,
+                            socklen_t const *const        name_sizes,
+                            ptrdiff_t const               count) {
+#  ifdef PEER_HAVE_MMSG
+  struct mmsghdr messages[PEER_POOL_MAX_BATCH_SIZE];
+  struct iovec   vectors[PEER_POOL_MAX_BATCH_SIZE];
+
+  assert(count <= PEER_POOL_MAX_BATCH_SIZE);
+
+  memset(messages, 0, count * sizeof *messages);
+
+  for (ptrdiff_t i = 0; i < count; i++) {
+    vectors[i].iov_base = (void *) packets[i].data;
+    vectors[i].iov_len  = packets[i].size;
+
+    messages[i].msg_hdr.msg_name    = (void *) names[i];
+    messages[i].msg_hdr.msg_namelen = name_sizes[i];
+    messages[i].msg_hdr.msg_iov     = vectors + i;
+    messages[i].msg_hdr.msg_iovlen  = 1;
+  }
 
-    memcpy(packets.values[n].data, buf, size);
+  return sendmmsg(s, messages, (unsigned) count, 0);
+#  else
+  for (ptrdiff_t i = 0; i < count; i++) {
+    ptrdiff_t const n =
+        names[i] == NULL
+            ? send(s, (char const *) packets[i].data, packets[i].size,
+                   0)
+            : sendto(s, (char const *) packets[i].data,
+                     packets[i].size, 0, &names[i]->base,
+                     name_sizes[i]);
+
+    if (n != packets[i].size)
+      return i > 0 ? i : -1;
   }
 
-  peer_packets_ref_t const ref = { .size   = packets.size,
-                                   .values = packets.values };
+  return count;
+#  endif
+}
 
-  status |= peer_input(peer, ref);
+static kit_status_t pool_send(peer_socket_pool_t *const pool,
+                              peer_packets_ref_t const  packets) {
+  ptrdiff_t const batch = pool_batch_size(pool);
+
+  peer_sockaddr_t const *names[PEER_POOL_MAX_BATCH_SIZE];
+  socklen_t              name_sizes[PEER_POOL_MAX_BATCH_SIZE];
 
-  DA_DESTROY(packets);
+  kit_status_t status = KIT_OK;
 
-  peer_tick_result_t const tick = peer_tick(peer, time_elapsed);
+  for (ptrdiff_t i = 0; i < packets.size;) {
+    /*  Collect consecutive packets with the same source socket.
+     */
 
-  for (ptrdiff_t i = 0; i < tick.packets.size; i++) {
-    peer_packet_t const *packet = tick.packets.values + i;
+    ptrdiff_t const source_id = packets.values[i].source_id;
 
-    assert(packet->source_id >= 0);
-    assert(packet->source_id < pool->nodes.size);
-    assert(packet->destination_id >= 0);
-    assert(packet->destination_id < pool->nodes.size);
+    assert(source_id >= 0);
+    assert(source_id < pool->nodes.size);
 
-    if (packet->source_id < 0 ||
-        packet->source_id >= pool->nodes.size ||
-        packet->destination_id < 0 ||
-        packet->destination_id >= pool->nodes.size) {
+    if (source_id < 0 || source_id >= pool->nodes.size) {
       status |= PEER_ERROR_INVALID_ID;
+      i++;
       continue;
     }
 
-    peer_node_t const *const src = pool->nodes.values +
-                                   packet->source_id;
-    peer_node_t const *const dst = pool->nodes.values +
-                                   packet->destination_id;
+    peer_node_t const *const src = pool->nodes.values + source_id;
 
     assert(src->socket != INVALID_SOCKET);
     if (src->socket == INVALID_SOCKET) {
       status |= PEER_ERROR_INVALID_SOCKET;
+      i++;
       continue;
     }
 
-    assert(src->protocol == dst->protocol);
-    assert(src->protocol == PEER_UDP_IPv4);
+    ptrdiff_t count = 0;
 
-    if (src->protocol != dst->protocol ||
-        src->protocol != PEER_UDP_IPv4) {
-      status |= PEER_ERROR_UNKNOWN_PROTOCOL;
-      continue;
-    }
+    while (count < batch && i + count < packets.size) {
+      peer_packet_t const *const packet = packets.values +
+                                          (i + count);
 
-    struct sockaddr_in name;
-    memset(&name, 0, sizeof name);
+      if (packet->source_id != source_id)
+        break;
+
+      assert(packet->destination_id >= 0);
+      assert(packet->destination_id < pool->nodes.size);
+
+      if (packet->destination_id < 0 ||
+          packet->destination_id >= pool->nodes.size) {
+        status |= PEER_ERROR_INVALID_ID;
+        break;
+      }
+
+      peer_node_t const *const dst = pool->nodes.values +
+                                     packet->destination_id;
+
+      assert(src->protocol == dst->protocol);
+      assert(src->protocol == PEER_UDP_IPv4);
 
-    name.sin_family = AF_INET;
-    name.sin_port   = htons(dst->remote_port);
+      if (src->protocol != dst->protocol ||
+          src->protocol != PEER_UDP_IPv4) {
+        status |= PEER_ERROR_UNKNOWN_PROTOCOL;
+        break;
+      }
+
+      if (src->connected_id == packet->destination_id) {
+        names[count]      = NULL;
+        name_sizes[count] = 0;
+      } else {
+        names[count]      = &dst->remote_name;
+        name_sizes[count] = dst->remote_name_size;
+      }
 
-    if (inet_pton(AF_INET, (char const *) dst->remote_address,
-                  &name.sin_addr.s_addr) == -1) {
-      status |= PEER_ERROR_GET_SOCKET_NAME_FAILED;
+      count++;
+    }
+
+    if (count == 0) {
+      /*  Skip the invalid packet.
+       */
+      i++;
       continue;
     }
 
-    ptrdiff_t const n = sendto(
-        src->socket, packet->data, packet->size, 0,
-        (struct sockaddr const *) &name, sizeof name);
+    ptrdiff_t const n = send_batch(src->socket, packets.values + i,
+                                   names, name_sizes, count);
 
-    if (n != packet->size) {
+    if (n <= 0) {
       int const er = errno;
       assert(er != EMSGSIZE);
       assert(er != ECONNRESET);
       assert(er != EWOULDBLOCK);
+      (void) er;
       status |= PEER_ERROR_SOCKET_SEND_FAILED;
+
+      /*  Skip the packet that failed.
+       */
+      i++;
+      continue;
     }
+
+    pool->stats.send_batches++;
+    pool->stats.send_datagrams += n;
+    if (pool->stats.send_batch_max < n)
+      pool->stats.send_batch_max = n;
+
+    i += n;
+  }
+
+  return status;
+}
+
+static kit_status_t connect_sockets(peer_socket_pool_t *const pool,
+                                    peer_t const *const       peer) {
+  /*  Connect local sockets that talk to exactly one remote node. The
+   *  first host slot accepts new clients, so it stays unconnected.
+   */
+
+  kit_status_t status = KIT_OK;
+
+  ptrdiff_t const first = peer->mode == PEER_HOST ? 1 : 0;
+
+  for (ptrdiff_t i = first; i < peer->slots.size; i++) {
+    peer_slot_t const *const slot = peer->slots.values + i;
+
+    if (slot->local.id < 0 || slot->local.id >= pool->nodes.size ||
+        slot->remote.id < 0 || slot->remote.id >= pool->nodes.size ||
+        !slot->remote.is_id_resolved)
+      continue;
+
+    peer_node_t *const       node   = pool->nodes.values +
+                                      slot->local.id;
+    peer_node_t const *const remote = pool->nodes.values +
+                                      slot->remote.id;
+
+    if (node->socket == INVALID_SOCKET || node->slot_count != 1 ||
+        node->connected_id == slot->remote.id ||
+        remote->remote_name_size == 0)
+      continue;
+
+    if (connect(node->socket, &remote->remote_name.base,
+                remote->remote_name_size) == -1) {
+      status |= PEER_ERROR_INVALID_SOCKET;
+      continue;
+    }
+
+    node->connected_id = slot->remote.id;
   }
 
+  return status;
+}
+
+kit_status_t peer_pool_set_key(peer_socket_pool_t *const pool,
+                               uint8_t const *const      key,
+                               uint64_t const            nonce) {
+  assert(pool != NULL);
+
+  if (pool == NULL)
+    return PEER_ERROR_INVALID_POOL;
+
+  kit_status_t const s = peer_cipher_init(&pool->cipher, key, nonce);
+
+  pool->is_encrypted = s == KIT_OK;
+
+  return s;
+}
+
+kit_status_t peer_pool_set_mac_key(peer_socket_pool_t *const pool,
+                                   uint8_t const *const      key) {
+  assert(pool != NULL);
+  assert(key != NULL);
+
+  if (pool == NULL)
+    return PEER_ERROR_INVALID_POOL;
+  if (key == NULL)
+    return PEER_ERROR_INVALID_KEY;
+
+  memcpy(pool->mac_key, key, sizeof pool->mac_key);
+  pool->is_authenticated = 1;
+
+  return KIT_OK;
+}
+
+kit_status_t peer_pool_tick(peer_socket_pool_t *const pool,
+                            peer_t *const             peer,
+                            peer_time_t const         time_elapsed) {
+  assert(pool != NULL);
+  assert(peer != NULL);
+  assert(time_elapsed >= 0);
+
+  if (pool == NULL)
+    return PEER_ERROR_INVALID_POOL;
+  if (peer == NULL)
+    return PEER_ERROR_INVALID_PEER;
+  if (time_elapsed < 0)
+    return PEER_ERROR_INVALID_TIME_ELAPSED;
+
+  kit_status_t status = KIT_OK;
+
+  status |= resolve_address_and_id(pool, peer);
+
+  if (pool->connect_sockets)
+    status |= connect_sockets(pool, peer);
+
+  status |= pool_receive(pool);
+
+  if (pool->is_encrypted) {
+    /*  Anyone can send us a plain or short datagram, so drop it
+     *  instead of failing the tick.
+     */
+    ptrdiff_t const count = pool->received.size;
+    peer_decrypt(&pool->cipher, &pool->received);
+    pool->stats.rejected += count - pool->received.size;
+  }
+
+  peer_packets_ref_t const ref = { .size   = pool->received.size,
+                                   .values = pool->received.values };
+
+  status |= peer_input(peer, ref);
+
+  peer_tick_result_t tick = peer_tick(peer, time_elapsed);
+
+  if (pool->is_encrypted)
+    status |= peer_encrypt(
+        &pool->cipher,
+        peer_nonce_prefix(peer->mode == PEER_HOST, peer->actor),
+        &tick.packets);
+
+  if (pool->is_authenticated)
+    status |= peer_sign(pool->mac_key, &tick.packets);
+
+  peer_packets_ref_t const out = { .size   = tick.packets.size,
+                                   .values = tick.packets.values };
+
+  status |= pool_send(pool, out);
+
   DA_DESTROY(tick.packets);
 
   status |= tick.status;
 
   return status;
 }
+
+static int wait_milliseconds(peer_t const *const peer,
+                             peer_time_t const   timeout) {
+  peer_time_t t = peer_next_timeout(peer);
+
+  if (t == PEER_UNDEFINED || (timeout >= 0 && timeout < t))
+    t = timeout;
+  if (t > INT32_MAX)
+    t = INT32_MAX;
+
+  return t < 0 ? -1 : (int) t;
+}
+
+#  ifdef PEER_HAVE_EPOLL
+static kit_status_t wait_sync(peer_socket_pool_t *const pool) {
+  /*  Register new sockets with epoll. Closed sockets are removed
+   *  from the epoll set by the system.
+   */
+
+  if (pool->wait_handle == -1) {
+    pool->wait_handle = epoll_create1(EPOLL_CLOEXEC);
+    pool->wait_count  = 0;
+
+    if (pool->wait_handle == -1)
+      return PEER_ERROR_CREATE_SOCKET_FAILED;
+
+    if (pool->wake_handle != INVALID_SOCKET) {
+      struct epoll_event event;
+      memset(&event, 0, sizeof event);
+
+      event.events   = EPOLLIN;
+      event.data.u64 = UINT64_MAX;
+
+      if (epoll_ctl(pool->wait_handle, EPOLL_CTL_ADD,
+                    pool->wake_handle, &event) == -1)
+        return PEER_ERROR_INVALID_SOCKET;
+    }
+  }
+
+  if (pool->wait_count > pool->nodes.size)
+    pool->wait_count = pool->nodes.size;
+
+  for (; pool->wait_count < pool->nodes.size; pool->wait_count++) {
+    peer_node_t const *const node = pool->nodes.values +
+                                    pool->wait_count;
+
+    if (node->socket == INVALID_SOCKET)
+      continue;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+
+    event.events   = EPOLLIN;
+    event.data.u64 = (uint64_t) pool->wait_count;
+
+    if (epoll_ctl(pool->wait_handle, EPOLL_CTL_ADD, node->socket,
+                  &event) == -1 &&
+        errno != EEXIST)
+      return PEER_ERROR_INVALID_SOCKET;
+  }
+
+  return KIT_OK;
+}
+#  endif
+
+kit_status_t peer_pool_wait(peer_socket_pool_t *const pool,
+                            peer_t *const             peer,
+                            peer_time_t const         timeout) {
+  assert(pool != NULL);
+  assert(peer != NULL);
+
+  if (pool == NULL)
+    return PEER_ERROR_INVALID_POOL;
+  if (peer == NULL)
+    return PEER_ERROR_INVALID_PEER;
+
+  /*  Clear earlier wakeups before checking the submission queue, so
+   *  a message submitted after the check still wakes us up.
+   */
+  if (pool->wake_handle != INVALID_SOCKET)
+    wake_drain(pool);
+
+  int const milliseconds = wait_milliseconds(peer, timeout);
+
+  if (milliseconds == 0)
+    return KIT_OK;
+
+#  ifdef PEER_HAVE_EPOLL
+  kit_status_t const s = wait_sync(pool);
+  if (s != KIT_OK)
+    return s;
+
+  struct epoll_event events[16];
+
+  int const capacity = (int) (sizeof events / sizeof *events);
+
+  if (epoll_wait(pool->wait_handle, events, capacity,
+                 milliseconds) == -1 &&
+      errno != EINTR)
+    return PEER_ERROR_SOCKET_RECEIVE_FAILED;
+
+  return KIT_OK;
+#  else
+  DA(struct pollfd) fds;
+  DA_INIT(fds, pool->nodes.size + 1, pool->alloc);
+  assert(fds.size == pool->nodes.size + 1);
+  if (fds.size != pool->nodes.size + 1)
+    return PEER_ERROR_BAD_ALLOC;
+
+  ptrdiff_t n = 0;
+
+  if (pool->wake_handle != INVALID_SOCKET) {
+    memset(fds.values, 0, sizeof *fds.values);
+    fds.values[0].fd     = pool->wake_handle;
+    fds.values[0].events = POLLIN;
+    n++;
+  }
+
+  for (ptrdiff_t i = 0; i < pool->nodes.size; i++) {
+    if (pool->nodes.values[i].socket == INVALID_SOCKET)
+      continue;
+
+    memset(fds.values + n, 0, sizeof *fds.values);
+    fds.values[n].fd     = pool->nodes.values[i].socket;
+    fds.values[n].events = POLLIN;
+    n++;
+  }
+
+  int const result = peer_poll(fds.values, (unsigned long) n,
+                               milliseconds);
+
+  DA_DESTROY(fds);
+
+  if (result == -1 && errno != EINTR)
+    return PEER_ERROR_SOCKET_RECEIVE_FAILED;
+
+  return KIT_OK;
+#  endif
+}
 #endif
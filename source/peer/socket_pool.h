@@ -1,6 +1,7 @@
 #ifndef PEER_SOCKET_POOL_H
 #define PEER_SOCKET_POOL_H
 
+#include "cipher.h"
 #include "peer.h"
 #include "sockets.h"
 #include <kit/dynamic_array.h>
@@ -17,23 +18,81 @@ enum {
   PEER_UDP_IPv6,
   PEER_TCP_IPv4,
   PEER_TCP_IPv6,
-  PEER_ANY_PORT = 0
+  PEER_ANY_PORT = 0,
+
+  PEER_POOL_BATCH_SIZE =
+      32, /* Default number of datagrams moved by one batched system
+             call. */
+
+  PEER_POOL_MAX_BATCH_SIZE = 256 /* Batch size upper limit. */
 };
 
+typedef union {
+  struct sockaddr     base;
+  struct sockaddr_in  ipv4;
+  struct sockaddr_in6 ipv6;
+} peer_sockaddr_t;
+
 typedef struct {
-  socket_t  socket;
-  int       protocol;
-  uint16_t  local_port;
-  uint16_t  remote_port;
-  ptrdiff_t remote_address_size;
-  uint8_t   remote_address[PEER_ADDRESS_SIZE - 2];
+  socket_t        socket;
+  int             protocol;
+  uint16_t        local_port;
+  uint16_t        remote_port;
+  ptrdiff_t       remote_address_size;
+  uint8_t         remote_address[PEER_ADDRESS_SIZE - 2];
+  peer_sockaddr_t remote_name;      /*  Binary remote address. */
+  socklen_t       remote_name_size; /*  Binary remote address size. */
+  ptrdiff_t       connected_id;     /*  Connected remote node id. */
+  ptrdiff_t       slot_count;       /*  Slots using the socket. */
 } peer_node_t;
 
 typedef KIT_DA(peer_node_t) peer_nodes_t;
 
 typedef struct {
-  kit_allocator_t alloc;
-  peer_nodes_t    nodes;
+  ptrdiff_t id;          /*  Node id, or PEER_UNDEFINED if empty. */
+  uint64_t  hash;        /*  Key hash. */
+  int       protocol;    /*  Remote protocol. */
+  uint16_t  port;        /*  Remote port. */
+  uint8_t   address[16]; /*  Binary remote address. */
+} peer_node_key_t;
+
+typedef KIT_DA(peer_node_key_t) peer_node_keys_t;
+
+typedef struct {
+  ptrdiff_t receive_batches;   /*  Receive calls that got data. */
+  ptrdiff_t receive_datagrams; /*  Datagrams received. */
+  ptrdiff_t receive_batch_max; /*  Largest receive batch. */
+  ptrdiff_t send_batches;      /*  Send calls that sent data. */
+  ptrdiff_t send_datagrams;    /*  Datagrams sent. */
+  ptrdiff_t send_batch_max;    /*  Largest send batch. */
+  ptrdiff_t rejected;          /*  Datagrams with invalid tags, or
+                                   not encrypted if the pool
+                                   decrypts. */
+  ptrdiff_t receive_errors;    /*  Transient receive errors, from
+                                   ICMP on connected sockets. */
+} peer_pool_stats_t;
+
+typedef struct {
+  kit_allocator_t   alloc;
+  peer_nodes_t      nodes;
+  peer_node_keys_t  index;       /*  Remote nodes hash table. */
+  ptrdiff_t         index_size;  /*  Remote nodes count. */
+  ptrdiff_t         batch_size;  /*  Datagrams per system call, from 1
+                                     to PEER_POOL_MAX_BATCH_SIZE. */
+  peer_pool_stats_t stats;       /*  Batched I/O counters. */
+  peer_packets_t    received;    /*  Receive buffer. */
+  int               wait_handle; /*  epoll instance on Linux. */
+  ptrdiff_t         wait_count;  /*  Nodes registered for waiting. */
+  socket_t          wake_handle; /*  Signaled by peer_submit. eventfd
+                                     on Linux, loopback UDP socket
+                                     elsewhere. */
+  int connect_sockets; /*  Connect sockets that talk to exactly one
+                           remote node, so the system can skip route
+                           lookups. Disabled by default. */
+  int           is_encrypted; /*  Encrypt all packets. */
+  peer_cipher_t cipher;       /*  Packet cipher. */
+  int     is_authenticated; /*  Sign and verify all packets. */
+  uint8_t mac_key[PEER_SIPHASH_KEY_SIZE]; /*  Packet tag key. */
 } peer_socket_pool_t;
 
 /*  Helper functions to glue the peer library and system sockets.
@@ -48,13 +107,47 @@ kit_status_t peer_pool_open(peer_socket_pool_t *pool, peer_t *peer,
                             int protocol, uint16_t port,
                             ptrdiff_t count);
 
+/*  Open socket_count sockets shared by slot_count slots. Host slots
+ *  are demultiplexed by remote endpoint, so the number of clients is
+ *  not limited by the number of sockets.
+ */
+kit_status_t peer_pool_open_multiplexed(peer_socket_pool_t *pool,
+                                        peer_t *peer, int protocol,
+                                        uint16_t  port,
+                                        ptrdiff_t socket_count,
+                                        ptrdiff_t slot_count);
+
 kit_status_t peer_pool_connect(peer_socket_pool_t *pool, peer_t *peer,
                                int protocol, kit_str_t address,
                                uint16_t port);
 
+/*  Encrypt outgoing packets and drop incoming packets that are not
+ *  encrypted, counting them in stats.rejected. Nonce is the packet
+ *  counter, the pool adds the prefix of the ticked peer, see
+ *  peer_cipher_t. Encrypted packets are PEER_PACKET_NONCE_SIZE bytes
+ *  larger, so the peer packet size should leave room for it.
+ */
+kit_status_t peer_pool_set_key(peer_socket_pool_t *pool,
+                               uint8_t const *key, uint64_t nonce);
+
+/*  Sign outgoing packets and drop incoming packets without a valid
+ *  tag right after they are received, before the source lookup.
+ *  Signed packets are PEER_PACKET_TAG_SIZE bytes larger.
+ */
+kit_status_t peer_pool_set_mac_key(peer_socket_pool_t *pool,
+                                   uint8_t const      *key);
+
 kit_status_t peer_pool_tick(peer_socket_pool_t *pool, peer_t *peer,
                             peer_time_t time_elapsed);
 
+/*  Block until a socket becomes readable, another thread submits a
+ *  message to a peer opened by the pool, the peer's next timeout
+ *  passes, or the timeout passes. Timeout in milliseconds, or
+ *  PEER_UNDEFINED to wait for the peer's next timeout only.
+ */
+kit_status_t peer_pool_wait(peer_socket_pool_t *pool, peer_t *peer,
+                            peer_time_t timeout);
+
 #  ifdef __cplusplus
 }
 #  endif
@@ -58,6 +58,11 @@ static int peer_socket_set_nonblocking(socket_t s) {
   return 0;
 }
 
+static int peer_poll(struct pollfd *fds, unsigned long n,
+                     int timeout) {
+  return WSAPoll(fds, n, timeout);
+}
+
 #    ifdef __cplusplus
 }
 #    endif
@@ -68,6 +73,7 @@ static int peer_socket_set_nonblocking(socket_t s) {
 #    include <errno.h>
 #    include <fcntl.h>
 #    include <netinet/in.h>
+#    include <poll.h>
 #    include <signal.h>
 #    include <sys/ioctl.h>
 #    include <sys/select.h>
@@ -102,6 +108,11 @@ static int peer_socket_set_nonblocking(socket_t s) {
   return fcntl(s, F_SETFL, flags | O_NONBLOCK);
 }
 
+static int peer_poll(struct pollfd *fds, unsigned long n,
+                     int timeout) {
+  return poll(fds, (nfds_t) n, timeout);
+}
+
 #    ifdef __cplusplus
 }
 #    endif
@@ -0,0 +1,160 @@
+#include "submit.h"
+
+#include <assert.h>
+#include <string.h>
+
+kit_status_t peer_submit_init(peer_submit_t *const  queue,
+                              ptrdiff_t const       capacity,
+                              kit_allocator_t const alloc) {
+  assert(queue != NULL);
+  assert(capacity >= 0);
+
+  if (queue == NULL)
+    return PEER_ERROR_INVALID_PEER;
+  if (capacity < 0)
+    return PEER_ERROR_INVALID_COUNT;
+
+  memset(queue, 0, sizeof *queue);
+  queue->alloc = alloc;
+
+  atomic_store_explicit(&queue->tail, 0, memory_order_relaxed);
+
+  if (capacity == 0)
+    return KIT_OK;
+
+  ptrdiff_t n = 1;
+  while (n < capacity) n *= 2;
+
+  if (alloc.allocate == NULL)
+    return PEER_ERROR_BAD_ALLOC;
+
+  queue->cells = (peer_submit_cell_t *) alloc.allocate(
+      alloc.state, n * sizeof *queue->cells);
+
+  if (queue->cells == NULL)
+    return PEER_ERROR_BAD_ALLOC;
+
+  for (ptrdiff_t i = 0; i < n; i++)
+    atomic_store_explicit(&queue->cells[i].sequence, (size_t) i,
+                          memory_order_relaxed);
+
+  queue->capacity = n;
+
+  return KIT_OK;
+}
+
+void peer_submit_destroy(peer_submit_t *const queue) {
+  assert(queue != NULL);
+
+  if (queue == NULL || queue->cells == NULL)
+    return;
+
+  if (queue->alloc.deallocate != NULL)
+    queue->alloc.deallocate(queue->alloc.state, queue->cells);
+
+  queue->cells    = NULL;
+  queue->capacity = 0;
+}
+
+kit_status_t peer_submit_push(peer_submit_t *const   queue,
+                              peer_chunk_ref_t const data) {
+  assert(queue != NULL);
+  assert(data.size >= 0 && data.size <= PEER_MAX_MESSAGE_SIZE);
+  assert(data.size == 0 || data.values != NULL);
+
+  if (queue == NULL)
+    return PEER_ERROR_INVALID_PEER;
+  if (data.size < 0 || data.size > PEER_MAX_MESSAGE_SIZE)
+    return PEER_ERROR_INVALID_MESSAGE_SIZE;
+  if (data.size != 0 && data.values == NULL)
+    return PEER_ERROR_INVALID_MESSAGE;
+  if (queue->capacity == 0)
+    return PEER_ERROR_NO_FREE_SLOTS;
+
+  size_t const mask = (size_t) queue->capacity - 1;
+
+  /*  Claim a position. If another producer took it first, retry with
+   *  the new tail.
+   */
+
+  size_t position = atomic_load_explicit(&queue->tail,
+                                         memory_order_relaxed);
+  peer_submit_cell_t *cell;
+
+  for (;;) {
+    cell = queue->cells + (position & mask);
+
+    size_t const sequence = atomic_load_explicit(
+        &cell->sequence, memory_order_acquire);
+    ptrdiff_t const diff = (ptrdiff_t) (sequence - position);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+              &queue->tail, &position, position + 1,
+              memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (diff < 0)
+      return PEER_ERROR_NO_FREE_SLOTS;
+    else
+      position = atomic_load_explicit(&queue->tail,
+                                      memory_order_relaxed);
+  }
+
+  cell->size = data.size;
+  if (data.size > 0)
+    memcpy(cell->data, data.values, data.size);
+
+  atomic_store_explicit(&cell->sequence, position + 1,
+                        memory_order_release);
+
+  return KIT_OK;
+}
+
+peer_submit_cell_t *peer_submit_front(peer_submit_t *const queue) {
+  assert(queue != NULL);
+
+  if (queue == NULL || queue->capacity == 0)
+    return NULL;
+
+  peer_submit_cell_t *const cell =
+      queue->cells + (queue->head & ((size_t) queue->capacity - 1));
+
+  if (atomic_load_explicit(&cell->sequence, memory_order_acquire) !=
+      queue->head + 1)
+    return NULL;
+
+  return cell;
+}
+
+void peer_submit_pop(peer_submit_t *const queue) {
+  assert(queue != NULL);
+  assert(peer_submit_front(queue) != NULL);
+
+  if (queue == NULL || queue->capacity == 0)
+    return;
+
+  peer_submit_cell_t *const cell =
+      queue->cells + (queue->head & ((size_t) queue->capacity - 1));
+
+  /*  Free the cell for the producer one lap ahead.
+   */
+  atomic_store_explicit(&cell->sequence,
+                        queue->head + (size_t) queue->capacity,
+                        memory_order_release);
+
+  queue->head++;
+}
+
+int peer_submit_is_empty(peer_submit_t const *const queue) {
+  assert(queue != NULL);
+
+  if (queue == NULL || queue->capacity == 0)
+    return 1;
+
+  peer_submit_cell_t const *const cell =
+      queue->cells + (queue->head & ((size_t) queue->capacity - 1));
+
+  return atomic_load_explicit(&cell->sequence,
+                              memory_order_acquire) !=
+         queue->head + 1;
+}
@@ -0,0 +1,68 @@
+#ifndef PEER_SUBMIT_H
+#define PEER_SUBMIT_H
+
+#include "packet.h"
+
+#include <kit/allocator.h>
+#include <kit/atomic.h>
+#include <kit/status.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  KIT_ATOMIC(size_t) sequence; /*  Cell state, see peer_submit_t. */
+  ptrdiff_t          size;     /*  Message size. */
+  uint8_t            data[PEER_MAX_MESSAGE_SIZE];
+} peer_submit_cell_t;
+
+/*  Bounded lock-free queue of messages with many producers and one
+ *  consumer. Cell sequence equals the position when the cell is free
+ *  for the producer at that position, and the position plus one
+ *  when the message is written. Producers never wait, push fails if
+ *  the queue is full.
+ */
+typedef struct {
+  kit_allocator_t     alloc;    /*  Backing allocator. */
+  ptrdiff_t           capacity; /*  Number of cells, power of two. */
+  peer_submit_cell_t *cells;    /*  Ring buffer. */
+  KIT_ATOMIC(size_t)  tail;     /*  Next producer position. */
+  size_t              head;     /*  Next consumer position. */
+} peer_submit_t;
+
+/*  Capacity is rounded up to a power of two. Zero capacity makes a
+ *  queue that is always full.
+ */
+kit_status_t peer_submit_init(peer_submit_t  *queue,
+                              ptrdiff_t       capacity,
+                              kit_allocator_t alloc);
+
+void peer_submit_destroy(peer_submit_t *queue);
+
+/*  Copy the message into the queue. Thread-safe. Returns
+ *  PEER_ERROR_NO_FREE_SLOTS if the queue is full.
+ */
+kit_status_t peer_submit_push(peer_submit_t   *queue,
+                              peer_chunk_ref_t data);
+
+/*  Oldest message, or NULL if the queue is empty. Only the consumer
+ *  thread may call it. The cell stays valid until
+ *  peer_submit_pop.
+ */
+peer_submit_cell_t *peer_submit_front(peer_submit_t *queue);
+
+/*  Release the oldest message. Only the consumer thread may call it.
+ */
+void peer_submit_pop(peer_submit_t *queue);
+
+/*  Check if there are no messages. Only the consumer thread may call
+ *  it.
+ */
+int peer_submit_is_empty(peer_submit_t const *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+#include "workers.h"
+
+#include "options.h"
+#include <assert.h>
+#include <kit/threads.h>
+#include <string.h>
+
+typedef struct {
+  peer_workers_shared_t *shared;
+  ptrdiff_t              index;
+  thrd_t                 thread;
+} worker_t;
+
+struct peer_workers_shared {
+  mtx_t       mutex;
+  cnd_t       start;      /*  New job or stop. */
+  cnd_t       done;       /*  All threads are done with the job. */
+  ptrdiff_t   generation; /*  Number of jobs started. */
+  ptrdiff_t   pending;    /*  Threads still running the job. */
+  int         is_stopped;
+  peer_job_fn job;
+  void       *state;
+  ptrdiff_t   count;      /*  Number of started threads. */
+  worker_t    threads[1];
+};
+
+static int worker_loop(void *const arg) {
+  worker_t *const              worker = (worker_t *) arg;
+  peer_workers_shared_t *const s      = worker->shared;
+
+  ptrdiff_t generation = 0;
+
+  mtx_lock(&s->mutex);
+
+  for (;;) {
+    while (!s->is_stopped && s->generation == generation)
+      cnd_wait(&s->start, &s->mutex);
+
+    if (s->is_stopped)
+      break;
+
+    generation = s->generation;
+
+    peer_job_fn const job   = s->job;
+    void *const       state = s->state;
+
+    mtx_unlock(&s->mutex);
+    job(state, worker->index);
+    mtx_lock(&s->mutex);
+
+    if (--s->pending == 0)
+      cnd_signal(&s->done);
+  }
+
+  mtx_unlock(&s->mutex);
+
+  return 0;
+}
+
+static void shared_stop(peer_workers_shared_t *const s) {
+  mtx_lock(&s->mutex);
+  s->is_stopped = 1;
+  cnd_broadcast(&s->start);
+  mtx_unlock(&s->mutex);
+
+  for (ptrdiff_t i = 0; i < s->count; i++)
+    thrd_join(s->threads[i].thread, NULL);
+
+  cnd_destroy(&s->done);
+  cnd_destroy(&s->start);
+  mtx_destroy(&s->mutex);
+}
+
+kit_status_t peer_workers_init(peer_workers_t *const workers,
+                               ptrdiff_t const       count,
+                               kit_allocator_t const alloc) {
+  assert(workers != NULL);
+  assert(count >= 0);
+
+  if (workers == NULL)
+    return PEER_ERROR_INVALID_POOL;
+  if (count < 0)
+    return PEER_ERROR_INVALID_COUNT;
+
+  memset(workers, 0, sizeof *workers);
+  workers->alloc = alloc;
+
+  if (count == 0)
+    return KIT_OK;
+
+  if (alloc.allocate == NULL)
+    return PEER_ERROR_BAD_ALLOC;
+
+  peer_workers_shared_t *const s = (peer_workers_shared_t *)
+      alloc.allocate(alloc.state,
+                     sizeof *s + (count - 1) * sizeof *s->threads);
+
+  if (s == NULL)
+    return PEER_ERROR_BAD_ALLOC;
+
+  memset(s, 0, sizeof *s);
+
+  if (mtx_init(&s->mutex, mtx_plain) != thrd_success ||
+      cnd_init(&s->start) != thrd_success ||
+      cnd_init(&s->done) != thrd_success) {
+    if (alloc.deallocate != NULL)
+      alloc.deallocate(alloc.state, s);
+    return PEER_ERROR_BAD_ALLOC;
+  }
+
+  for (; s->count < count; s->count++) {
+    worker_t *const worker = s->threads + s->count;
+
+    worker->shared = s;
+    worker->index  = s->count + 1;
+
+    if (thrd_create(&worker->thread, worker_loop, worker) !=
+        thrd_success) {
+      shared_stop(s);
+      if (alloc.deallocate != NULL)
+        alloc.deallocate(alloc.state, s);
+      return PEER_ERROR_BAD_ALLOC;
+    }
+  }
+
+  workers->count  = count;
+  workers->shared = s;
+
+  return KIT_OK;
+}
+
+void peer_workers_destroy(peer_workers_t *const workers) {
+  assert(workers != NULL);
+
+  if (workers == NULL || workers->shared == NULL)
+    return;
+
+  shared_stop(workers->shared);
+
+  if (workers->alloc.deallocate != NULL)
+    workers->alloc.deallocate(workers->alloc.state, workers->shared);
+
+  workers->count  = 0;
+  workers->shared = NULL;
+}
+
+void peer_workers_run(peer_workers_t *const workers,
+                      peer_job_fn const job, void *const state) {
+  assert(workers != NULL);
+  assert(job != NULL);
+
+  if (workers == NULL || job == NULL)
+    return;
+
+  peer_workers_shared_t *const s = workers->shared;
+
+  if (s == NULL) {
+    job(state, 0);
+    return;
+  }
+
+  mtx_lock(&s->mutex);
+  s->job     = job;
+  s->state   = state;
+  s->pending = s->count;
+  s->generation++;
+  cnd_broadcast(&s->start);
+  mtx_unlock(&s->mutex);
+
+  job(state, 0);
+
+  mtx_lock(&s->mutex);
+  while (s->pending > 0) cnd_wait(&s->done, &s->mutex);
+  mtx_unlock(&s->mutex);
+}
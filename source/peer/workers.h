@@ -0,0 +1,47 @@
+#ifndef PEER_WORKERS_H
+#define PEER_WORKERS_H
+
+#include <kit/allocator.h>
+#include <kit/status.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct peer_workers_shared peer_workers_shared_t;
+
+/*  Job callback. Index is from 0 to the number of workers, zero is
+ *  the calling thread.
+ */
+typedef void (*peer_job_fn)(void *state, ptrdiff_t index);
+
+/*  Pool of threads that run one job at a time. Threads sleep between
+ *  jobs, so the pool can live as long as its owner.
+ */
+typedef struct {
+  kit_allocator_t        alloc;  /*  Backing allocator. */
+  ptrdiff_t              count;  /*  Number of worker threads. */
+  peer_workers_shared_t *shared; /*  State shared with threads. */
+} peer_workers_t;
+
+/*  Start count threads. With zero count jobs run on the calling
+ *  thread only.
+ */
+kit_status_t peer_workers_init(peer_workers_t *workers,
+                               ptrdiff_t       count,
+                               kit_allocator_t alloc);
+
+void peer_workers_destroy(peer_workers_t *workers);
+
+/*  Call job for each index from 0 to count, in parallel. Returns when
+ *  all calls are done.
+ */
+void peer_workers_run(peer_workers_t *workers, peer_job_fn job,
+                      void *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,59 @@
+#include "../../peer/arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define KIT_TEST_FILE arena
+#include <kit_test/test.h>
+
+static void *counting_allocate(void *state, ptrdiff_t size) {
+  ++*(ptrdiff_t *) state;
+  return malloc((size_t) size);
+}
+
+static void counting_deallocate(void *state, void *pointer) {
+  (void) state;
+  free(pointer);
+}
+
+TEST("arena coalesces blocks on reset") {
+  ptrdiff_t             count = 0;
+  kit_allocator_t const alloc = { .state      = &count,
+                                  .allocate   = counting_allocate,
+                                  .deallocate = counting_deallocate };
+
+  peer_arena_t arena;
+  peer_arena_init(&arena, alloc);
+
+  kit_allocator_t const scratch = peer_arena_allocator(&arena);
+
+  for (ptrdiff_t i = 0; i < 10; i++) {
+    uint8_t *p = scratch.allocate(scratch.state, 1000);
+    REQUIRE(p != NULL);
+    REQUIRE(((uintptr_t) p) % 16 == 0);
+    p[999] = 1;
+  }
+
+  REQUIRE(count > 1);
+
+  peer_arena_reset(&arena);
+  count = 0;
+
+  /*  Same usage should not call the backing allocator.
+   */
+
+  for (int k = 0; k < 3; k++) {
+    for (ptrdiff_t i = 0; i < 10; i++) {
+      uint8_t *p = scratch.allocate(scratch.state, 1000);
+      REQUIRE(p != NULL);
+      p[0] = 1;
+      scratch.deallocate(scratch.state, p);
+    }
+
+    peer_arena_reset(&arena);
+  }
+
+  REQUIRE_EQ(count, 0);
+
+  peer_arena_destroy(&arena);
+}
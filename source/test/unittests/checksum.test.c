@@ -0,0 +1,37 @@
+#include "../../peer/checksum.h"
+
+#include <string.h>
+
+#define KIT_TEST_FILE checksum
+#include <kit_test/test.h>
+
+TEST("checksum crc32c check value") {
+  uint8_t const data[] = "123456789";
+
+  REQUIRE_EQ(peer_crc32c(0, data, 9), 0xe3069283u);
+  REQUIRE_EQ(peer_crc32c_portable(0, data, 9), 0xe3069283u);
+  REQUIRE_EQ(peer_crc32c(0, NULL, 0), 0u);
+}
+
+TEST("checksum crc32c continues over chunks") {
+  uint8_t data[300];
+  for (ptrdiff_t i = 0; i < sizeof data; i++)
+    data[i] = (uint8_t) (i * 31 + 7);
+
+  /*  Odd sizes and offsets cover the byte-by-byte tails.
+   */
+  for (ptrdiff_t size = 0; size <= 37; size++) {
+    uint32_t const whole = peer_crc32c_portable(0, data + 1, size);
+
+    REQUIRE_EQ(peer_crc32c(0, data + 1, size), whole);
+
+    for (ptrdiff_t split = 0; split <= size; split += 5) {
+      uint32_t const head = peer_crc32c(0, data + 1, split);
+      REQUIRE_EQ(peer_crc32c(head, data + 1 + split, size - split),
+                 whole);
+    }
+  }
+
+  REQUIRE_EQ(peer_crc32c(0, data, sizeof data),
+             peer_crc32c_portable(0, data, sizeof data));
+}
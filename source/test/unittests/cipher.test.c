@@ -0,0 +1,339 @@
+#include "../../peer/cipher.h"
+#include "../../peer/serial.h"
+
+#include <string.h>
+
+#define KIT_TEST_FILE cipher
+#include <kit_test/test.h>
+
+TEST("cipher chacha20 test vector") {
+  /*  RFC 8439, section 2.4.2. The 96-bit nonce with 32-bit counter
+   *  maps to 64-bit counter and 64-bit nonce.
+   */
+
+  uint8_t key[PEER_CHACHA20_KEY_SIZE];
+  for (ptrdiff_t i = 0; i < sizeof key; i++) key[i] = (uint8_t) i;
+
+  char const text[] = "Ladies and Gentlemen of the class of '99: "
+                      "If I could offer you only one tip for the "
+                      "future, sunscreen would be it.";
+
+  uint8_t const expected[] = {
+    0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba,
+    0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81, 0xe9, 0x7e, 0x7a, 0xec,
+    0x1d, 0x43, 0x60, 0xc2, 0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f,
+    0xae, 0x0b, 0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab,
+    0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57, 0x16, 0x39,
+    0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35,
+    0x9f, 0x08, 0x61, 0xd8, 0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d,
+    0x6a, 0x61, 0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+    0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c,
+    0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36, 0x5a, 0xf9, 0x0b, 0xbf,
+    0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78,
+    0x5e, 0x42, 0x87, 0x4d,
+  };
+
+  REQUIRE(sizeof text - 1 == sizeof expected);
+
+  uint8_t data[sizeof expected];
+
+  memcpy(data, text, sizeof data);
+  peer_chacha20_xor(key, 0x4a000000, 1, data, sizeof data);
+  REQUIRE(memcmp(data, expected, sizeof data) == 0);
+
+  memcpy(data, text, sizeof data);
+  peer_chacha20_xor_portable(key, 0x4a000000, 1, data, sizeof data);
+  REQUIRE(memcmp(data, expected, sizeof data) == 0);
+}
+
+TEST("cipher chacha20 simd matches portable") {
+  uint8_t key[PEER_CHACHA20_KEY_SIZE];
+  for (ptrdiff_t i = 0; i < sizeof key; i++)
+    key[i] = (uint8_t) (i * 13 + 5);
+
+  static uint8_t a[PEER_MAX_PACKET_SIZE], b[PEER_MAX_PACKET_SIZE];
+
+  /*  Block counter crosses 32 bits inside of the multi-block
+   *  batches.
+   */
+  uint64_t const blocks[] = { 0, 0xfffffffdull };
+
+  for (ptrdiff_t k = 0; k < 2; k++)
+    for (ptrdiff_t size = 0; size <= PEER_MAX_PACKET_SIZE;
+         size += size < 600 ? 1 : 97) {
+      for (ptrdiff_t i = 0; i < size; i++)
+        a[i] = b[i] = (uint8_t) (i * 7);
+
+      peer_chacha20_xor(key, 12345, blocks[k], a, size);
+      peer_chacha20_xor_portable(key, 12345, blocks[k], b, size);
+
+      REQUIRE(memcmp(a, b, size) == 0);
+    }
+}
+
+TEST("cipher encrypt and decrypt packets in place") {
+  kit_allocator_t alloc = kit_alloc_default();
+
+  uint8_t key[PEER_CHACHA20_KEY_SIZE];
+  memset(key, 42, sizeof key);
+
+  peer_cipher_t cipher;
+  REQUIRE(peer_cipher_init(&cipher, key, 100) == KIT_OK);
+
+  uint8_t payload[150];
+  memset(payload, 3, sizeof payload);
+  peer_chunk_ref_t const data = { .size   = sizeof payload,
+                                  .values = payload };
+
+  peer_packets_t packets, plain;
+  DA_INIT(packets, 0, alloc);
+  DA_INIT(plain, 0, alloc);
+
+  peer_packet_builder_t b;
+  peer_builder_init(&b, 0, 1, PEER_PACKET_SIZE,
+                    PEER_PACKET_MODE_CHECKSUM, &packets);
+  for (ptrdiff_t i = 0; i < 5; i++)
+    REQUIRE(peer_builder_write(&b, PEER_MESSAGE_MODE_APPLICATION, i,
+                               0, 0, data) == KIT_OK);
+  REQUIRE(peer_builder_finish(&b) == KIT_OK);
+  REQUIRE(packets.size == 3);
+
+  DA_RESIZE(plain, packets.size);
+  REQUIRE(plain.size == packets.size);
+  if (plain.size != packets.size)
+    return;
+  memcpy(plain.values, packets.values,
+         packets.size * sizeof *packets.values);
+
+  REQUIRE(peer_encrypt(&cipher, 0, &packets) == KIT_OK);
+  REQUIRE(cipher.nonce == 103);
+
+  for (ptrdiff_t i = 0; i < packets.size; i++) {
+    peer_packet_t const *const p = packets.values + i;
+
+    REQUIRE((p->data[PEER_N_PACKET_MODE] &
+             PEER_PACKET_MODE_CIPHER_MASK) ==
+            PEER_PACKET_MODE_CHACHA20);
+    /*  Nonce is inserted after the fixed header.
+     */
+    ptrdiff_t const n = peer_packet_header_size(
+        PEER_PACKET_MODE_CHECKSUM);
+
+    REQUIRE(p->size == plain.values[i].size + PEER_PACKET_NONCE_SIZE);
+    REQUIRE(peer_read_u64(p->data + PEER_N_PACKET_OPTIONAL) ==
+            100 + i);
+    REQUIRE(memcmp(p->data + PEER_PACKET_NONCE_SIZE + n,
+                   plain.values[i].data + n,
+                   plain.values[i].size - n) != 0);
+  }
+
+  /*  Plain packets and packets with a reserved cipher are removed.
+   */
+  ptrdiff_t const n = packets.size;
+  DA_RESIZE(packets, n + 2);
+  REQUIRE(packets.size == n + 2);
+  if (packets.size != n + 2)
+    return;
+  packets.values[n]     = plain.values[0];
+  packets.values[n + 1] = plain.values[0];
+  packets.values[n + 1].data[PEER_N_PACKET_MODE] |=
+      PEER_PACKET_MODE_RESERVED;
+
+  REQUIRE(peer_decrypt(&cipher, &packets) == PEER_ERROR_INVALID_MODE);
+  REQUIRE(packets.size == plain.size);
+
+  for (ptrdiff_t i = 0; i < packets.size && i < plain.size; i++) {
+    peer_packet_t const *const p = packets.values + i;
+    peer_packet_t const *const q = plain.values + i;
+
+    REQUIRE(p->size == q->size);
+    REQUIRE(memcmp(p->data, q->data, q->size) == 0);
+  }
+
+  peer_message_refs_t messages;
+  DA_INIT(messages, 0, alloc);
+
+  peer_packets_ref_t const ref = { .size   = packets.size,
+                                   .values = packets.values };
+  REQUIRE(peer_unpack_messages(ref, &messages) == KIT_OK);
+  REQUIRE(messages.size == 5);
+
+  /*  Packet without room for the nonce is not sent plain.
+   */
+  packets.values[0].size = PEER_MAX_PACKET_SIZE;
+  REQUIRE(peer_encrypt(&cipher, 0, &packets) ==
+          PEER_ERROR_INVALID_PACKET_SIZE);
+  REQUIRE(packets.size == plain.size - 1);
+
+  DA_DESTROY(messages);
+  DA_DESTROY(plain);
+  DA_DESTROY(packets);
+}
+
+TEST("cipher nonce prefix separates senders") {
+  kit_allocator_t alloc = kit_alloc_default();
+
+  uint64_t const host    = peer_nonce_prefix(1, 0);
+  uint64_t const request = peer_nonce_prefix(0, PEER_UNDEFINED);
+  uint64_t const first   = peer_nonce_prefix(0, 1);
+  uint64_t const second  = peer_nonce_prefix(0, 2);
+
+  uint64_t const counter = (1ull << PEER_NONCE_COUNTER_BITS) - 1;
+
+  REQUIRE(host != request && host != first && host != second);
+  REQUIRE(request != first && request != second);
+  REQUIRE(first != second);
+  REQUIRE(((host | request | first | second) & counter) == 0);
+
+  /*  Encrypted nonce has the prefix and the counter.
+   */
+
+  uint8_t key[PEER_CHACHA20_KEY_SIZE];
+  memset(key, 42, sizeof key);
+
+  peer_cipher_t cipher;
+  REQUIRE(peer_cipher_init(&cipher, key, counter) == KIT_OK);
+
+  peer_packets_t packets;
+  DA_INIT(packets, 0, alloc);
+
+  uint8_t payload[] = { 1, 2, 3 };
+  peer_chunk_ref_t const data = { .size   = sizeof payload,
+                                  .values = payload };
+
+  peer_packet_builder_t b;
+  peer_builder_init(&b, 0, 1, PEER_PACKET_SIZE,
+                    PEER_PACKET_MODE_CHECKSUM, &packets);
+  REQUIRE(peer_builder_write(&b, PEER_MESSAGE_MODE_APPLICATION, 0, 0,
+                             0, data) == KIT_OK);
+  REQUIRE(peer_builder_write(&b, PEER_MESSAGE_MODE_APPLICATION, 1, 0,
+                             0, data) == KIT_OK);
+  REQUIRE(peer_builder_finish(&b) == KIT_OK);
+
+  DA_RESIZE(packets, 2);
+  REQUIRE(packets.size == 2);
+  if (packets.size != 2)
+    return;
+  packets.values[1] = packets.values[0];
+
+  /*  Counter wraps inside its bits.
+   */
+  REQUIRE(peer_encrypt(&cipher, first, &packets) == KIT_OK);
+  REQUIRE(peer_read_u64(packets.values[0].data +
+                        PEER_N_PACKET_OPTIONAL) == (first | counter));
+  REQUIRE(peer_read_u64(packets.values[1].data +
+                        PEER_N_PACKET_OPTIONAL) == first);
+
+  DA_DESTROY(packets);
+}
+
+TEST("cipher siphash test vectors") {
+  /*  Reference vectors from the SipHash paper.
+   */
+
+  uint8_t key[PEER_SIPHASH_KEY_SIZE];
+  uint8_t data[64];
+
+  for (ptrdiff_t i = 0; i < sizeof key; i++) key[i] = (uint8_t) i;
+  for (ptrdiff_t i = 0; i < sizeof data; i++) data[i] = (uint8_t) i;
+
+  REQUIRE(peer_siphash(key, data, 0) == 0x726fdb47dd0e0e31ull);
+  REQUIRE(peer_siphash(key, data, 15) == 0xa129ca6149be45e5ull);
+  REQUIRE(peer_siphash(key, data, 63) == 0x958a324ceb064572ull);
+}
+
+TEST("cipher sign and verify packets") {
+  kit_allocator_t alloc = kit_alloc_default();
+
+  uint8_t key[PEER_SIPHASH_KEY_SIZE], other[PEER_SIPHASH_KEY_SIZE];
+  memset(key, 7, sizeof key);
+  memset(other, 8, sizeof other);
+
+  uint8_t payload[100];
+  memset(payload, 5, sizeof payload);
+  peer_chunk_ref_t const data = { .size   = sizeof payload,
+                                  .values = payload };
+
+  peer_packets_t packets;
+  DA_INIT(packets, 0, alloc);
+
+  peer_packet_builder_t b;
+  peer_builder_init(&b, 0, 1, PEER_PACKET_SIZE,
+                    PEER_PACKET_MODE_CHECKSUM, &packets);
+  for (ptrdiff_t i = 0; i < 3; i++)
+    REQUIRE(peer_builder_write(&b, PEER_MESSAGE_MODE_APPLICATION, i,
+                               0, 0, data) == KIT_OK);
+  REQUIRE(peer_builder_finish(&b) == KIT_OK);
+  REQUIRE(packets.size == 2);
+
+  if (packets.size != 2) {
+    DA_DESTROY(packets);
+    return;
+  }
+
+  peer_packet_t const plain = packets.values[0];
+
+  REQUIRE(peer_verify(key, packets.values) ==
+          PEER_ERROR_INVALID_MODE);
+
+  REQUIRE(peer_sign(key, &packets) == KIT_OK);
+
+  /*  Tag is inserted after the fixed header.
+   */
+  REQUIRE(packets.values[0].size ==
+          plain.size + PEER_PACKET_TAG_SIZE);
+
+  for (ptrdiff_t i = 0; i < packets.size; i++) {
+    peer_packet_t const *const p = packets.values + i;
+
+    REQUIRE((p->data[PEER_N_PACKET_MODE] & PEER_PACKET_MODE_TAG) !=
+            0);
+
+    /*  Tag covers the packet without the tag field.
+     */
+    ptrdiff_t const tag = peer_packet_tag_offset(
+        p->data[PEER_N_PACKET_MODE]);
+    ptrdiff_t const end = tag + PEER_PACKET_TAG_SIZE;
+
+    uint8_t   bytes[PEER_MAX_PACKET_SIZE];
+    ptrdiff_t n = p->size - PEER_PACKET_TAG_SIZE;
+    memcpy(bytes, p->data, tag);
+    memcpy(bytes + tag, p->data + end, p->size - end);
+
+    REQUIRE(peer_read_u64(p->data + tag) ==
+            peer_siphash(key, bytes, n));
+  }
+
+  peer_packet_t forged = packets.values[0];
+
+  REQUIRE(peer_verify(other, &forged) == PEER_ERROR_INVALID_MESSAGE);
+
+  forged.data[PEER_N_PACKET_SESSION] ^= 1;
+  REQUIRE(peer_verify(key, &forged) == PEER_ERROR_INVALID_MESSAGE);
+
+  forged = packets.values[0];
+  forged.data[forged.size - 1] ^= 0x10;
+  REQUIRE(peer_verify(key, &forged) == PEER_ERROR_INVALID_MESSAGE);
+
+  forged = packets.values[0];
+  forged.size--;
+  REQUIRE(peer_verify(key, &forged) == PEER_ERROR_INVALID_MESSAGE);
+
+  for (ptrdiff_t i = 0; i < packets.size; i++)
+    REQUIRE(peer_verify(key, packets.values + i) == KIT_OK);
+
+  REQUIRE(packets.values[0].size == plain.size);
+  REQUIRE(memcmp(packets.values[0].data, plain.data, plain.size) ==
+          0);
+
+  peer_message_refs_t messages;
+  DA_INIT(messages, 0, alloc);
+
+  peer_packets_ref_t const ref = { .size   = packets.size,
+                                   .values = packets.values };
+  REQUIRE(peer_unpack_messages(ref, &messages) == KIT_OK);
+  REQUIRE(messages.size == 3);
+
+  DA_DESTROY(messages);
+  DA_DESTROY(packets);
+}
@@ -119,3 +119,439 @@ TEST("packet pack and unpack a lot of chunks") {
   for (ptrdiff_t i = 0; i < foo.size; i++) DA_DESTROY(foo.values[i]);
   DA_DESTROY(foo);
 }
+
+TEST("packet unpack refs points into packets") {
+  kit_allocator_t alloc = kit_alloc_default();
+
+  uint8_t chunks[600];
+
+  for (ptrdiff_t i = 0; i < sizeof chunks; i++) chunks[i] = i;
+
+  for (ptrdiff_t i = 0; i < 3; i++)
+    peer_write_message_size(chunks + i * 200, 200);
+
+  peer_chunk_ref_t const mrefs[] = {
+    { .size = 200, .values = chunks },
+    { .size = 200, .values = chunks + 200 },
+    { .size = 200, .values = chunks + 400 }
+  };
+
+  peer_chunks_ref_t const mref = { .size = 3, .values = mrefs };
+
+  peer_packets_t packets;
+  DA_INIT(packets, 0, alloc);
+
+  REQUIRE(peer_pack(0, 1, mref, &packets) == KIT_OK);
+  REQUIRE(packets.size == 3);
+
+  peer_packets_ref_t const pref = { .size   = packets.size,
+                                    .values = packets.values };
+
+  peer_chunk_refs_t refs;
+  DA_INIT(refs, 0, alloc);
+
+  REQUIRE(peer_unpack_refs(pref, &refs) == KIT_OK);
+
+  REQUIRE(refs.size == 3);
+  for (ptrdiff_t i = 0; i < refs.size && i < packets.size; i++) {
+    REQUIRE(AR_EQUAL(mrefs[i], refs.values[i]));
+    REQUIRE(refs.values[i].values ==
+            packets.values[i].data + peer_packet_header_size(0));
+  }
+
+  /*  Message size beyond the packet size is rejected.
+   */
+  peer_write_message_size(packets.values[0].data +
+                              peer_packet_header_size(0),
+                          300);
+
+  DA_RESIZE(refs, 0);
+  REQUIRE(peer_unpack_refs(pref, &refs) ==
+          PEER_ERROR_INVALID_MESSAGE_SIZE);
+  REQUIRE(refs.size == 2);
+
+  DA_DESTROY(refs);
+  DA_DESTROY(packets);
+}
+
+TEST("packet builder output matches pack") {
+  kit_allocator_t alloc = kit_alloc_default();
+
+  uint8_t payload[300];
+  for (ptrdiff_t i = 0; i < sizeof payload; i++) payload[i] = i * 7;
+
+  uint8_t          chunks[10][PEER_N_MESSAGE_DATA + 300];
+  peer_chunk_ref_t mrefs[10];
+
+  peer_packets_t packed, built;
+  DA_INIT(packed, 0, alloc);
+  DA_INIT(built, 0, alloc);
+
+  peer_packet_builder_t b;
+  peer_builder_init(&b, 0, 1, PEER_PACKET_SIZE, 0, &built);
+
+  for (ptrdiff_t i = 0; i < 10; i++) {
+    ptrdiff_t const        size = 10 + i * 29;
+    peer_chunk_ref_t const data = { .size = size, .values = payload };
+
+    peer_write_message(chunks[i], PEER_MESSAGE_MODE_APPLICATION, i,
+                       100 + i, 3, size, payload);
+    mrefs[i].size   = PEER_N_MESSAGE_DATA + size;
+    mrefs[i].values = chunks[i];
+
+    REQUIRE(peer_builder_write(&b, PEER_MESSAGE_MODE_APPLICATION, i,
+                               100 + i, 3, data) == KIT_OK);
+  }
+
+  REQUIRE(peer_builder_finish(&b) == KIT_OK);
+
+  peer_chunks_ref_t const mref = { .size = 10, .values = mrefs };
+  REQUIRE(peer_pack(0, 1, mref, &packed) == KIT_OK);
+
+  REQUIRE(packed.size > 1);
+  REQUIRE(packed.size == built.size);
+
+  for (ptrdiff_t i = 0; i < packed.size && i < built.size; i++) {
+    REQUIRE(packed.values[i].size == built.values[i].size);
+    REQUIRE(memcmp(packed.values[i].data, built.values[i].data,
+                   PEER_PACKET_SIZE) == 0);
+  }
+
+  DA_DESTROY(packed);
+  DA_DESTROY(built);
+}
+
+TEST("packet pack empty after other packets") {
+  kit_allocator_t alloc = kit_alloc_default();
+
+  uint8_t chunk[PEER_N_MESSAGE_DATA];
+  peer_write_message(chunk, PEER_MESSAGE_MODE_APPLICATION, 0, 0, 0, 0,
+                     NULL);
+
+  peer_chunk_ref_t const  ref  = { .size   = PEER_N_MESSAGE_DATA,
+                                   .values = chunk };
+  peer_chunks_ref_t const mref = { .size = 1, .values = &ref };
+  peer_chunks_ref_t const none = { .size = 0, .values = NULL };
+
+  peer_packets_t packets;
+  DA_INIT(packets, 0, alloc);
+
+  REQUIRE(peer_pack(0, 1, mref, &packets) == KIT_OK);
+  REQUIRE(peer_pack(2, 3, none, &packets) == KIT_OK);
+
+  REQUIRE(packets.size == 2);
+  REQUIRE(packets.size == 2 && packets.values[0].source_id == 0 &&
+          packets.values[0].size ==
+              peer_packet_header_size(0) + PEER_N_MESSAGE_DATA);
+  REQUIRE(packets.size == 2 && packets.values[1].source_id == 2 &&
+          packets.values[1].size == 0);
+
+  DA_DESTROY(packets);
+}
+
+TEST("packet fec rebuilds lost packet") {
+  kit_allocator_t alloc = kit_alloc_default();
+
+  peer_packets_t packets;
+  DA_INIT(packets, 0, alloc);
+
+  /*  One message per packet, different sizes.
+   */
+  for (ptrdiff_t i = 0; i < PEER_FEC_GROUP_SIZE; i++) {
+    uint8_t          data[100];
+    peer_chunk_ref_t data_ref = { .size   = 10 + i * 20,
+                                  .values = data };
+    memset(data, (int) i + 1, sizeof data);
+
+    uint8_t chunk[PEER_N_MESSAGE_DATA + 100];
+    peer_write_message(chunk, PEER_MESSAGE_MODE_APPLICATION, i, 0, 0,
+                       data_ref.size, data_ref.values);
+
+    peer_chunk_ref_t const  ref  = { .size   = PEER_N_MESSAGE_DATA +
+                                               data_ref.size,
+                                     .values = chunk };
+    peer_chunks_ref_t const mref = { .size = 1, .values = &ref };
+
+    REQUIRE(peer_pack(0, 1, mref, &packets) == KIT_OK);
+  }
+
+  peer_fec_encoder_t e;
+  peer_fec_encoder_init(&e);
+
+  REQUIRE(peer_fec_encode(&e, &packets, 0) == KIT_OK);
+  REQUIRE(packets.size == PEER_FEC_GROUP_SIZE + 1);
+
+  if (packets.size != PEER_FEC_GROUP_SIZE + 1)
+    return;
+
+  peer_packet_t const *const parity = packets.values +
+                                      PEER_FEC_GROUP_SIZE;
+  REQUIRE(parity->data[PEER_N_PACKET_MODE] ==
+          PEER_PACKET_MODE_PARITY);
+
+  /*  Parity packets don't contain messages.
+   */
+  peer_packets_ref_t const pref = { .size = 1, .values = parity };
+
+  peer_chunk_refs_t refs;
+  DA_INIT(refs, 0, alloc);
+  REQUIRE(peer_unpack_refs(pref, &refs) == KIT_OK);
+  REQUIRE(refs.size == 0);
+
+  /*  Lose the third packet.
+   */
+  peer_fec_decoder_t d;
+  peer_fec_decoder_init(&d);
+
+  peer_packet_t rebuilt;
+  int           count = 0;
+
+  for (ptrdiff_t i = 0; i < packets.size; i++)
+    if (i != 2)
+      count += peer_fec_decode(&d, packets.values + i, &rebuilt);
+
+  REQUIRE(count == 1);
+
+  if (count == 1) {
+    peer_packet_t const *const lost = packets.values + 2;
+
+    REQUIRE(rebuilt.size == lost->size);
+    REQUIRE(memcmp(rebuilt.data, lost->data, lost->size) == 0);
+
+    peer_packets_ref_t const rref = { .size = 1, .values = &rebuilt };
+
+    REQUIRE(peer_unpack_refs(rref, &refs) == KIT_OK);
+    REQUIRE(refs.size == 1);
+    REQUIRE(refs.size == 1 &&
+            refs.values[0].size == PEER_N_MESSAGE_DATA + 50);
+  }
+
+  DA_DESTROY(refs);
+  DA_DESTROY(packets);
+}
+
+TEST("packet compact messages round trip") {
+  kit_allocator_t alloc = kit_alloc_default();
+
+  /*  Headers dominate small messages.
+   */
+  uint8_t payload[4];
+  for (ptrdiff_t i = 0; i < sizeof payload; i++) payload[i] = i * 3;
+
+  peer_chunk_ref_t const data = { .size   = sizeof payload,
+                                  .values = payload };
+  uint8_t const          id   = PEER_M_HEARTBEAT;
+  peer_chunk_ref_t const beat = { .size = 1, .values = &id };
+
+  peer_packets_t plain, compact;
+  DA_INIT(plain, 0, alloc);
+  DA_INIT(compact, 0, alloc);
+
+  peer_packet_builder_t b, c;
+  peer_builder_init(&b, 0, 1, PEER_PACKET_SIZE, 0, &plain);
+  peer_builder_init(&c, 0, 1, PEER_PACKET_SIZE,
+                    PEER_PACKET_MODE_COMPACT, &compact);
+
+  REQUIRE(peer_builder_write(&b, PEER_MESSAGE_MODE_SERVICE,
+                             PEER_UNDEFINED, 100000, PEER_UNDEFINED,
+                             beat) == KIT_OK);
+  REQUIRE(peer_builder_write(&c, PEER_MESSAGE_MODE_SERVICE,
+                             PEER_UNDEFINED, 100000, PEER_UNDEFINED,
+                             beat) == KIT_OK);
+
+  for (ptrdiff_t i = 0; i < 60; i++) {
+    REQUIRE(peer_builder_write(&b, PEER_MESSAGE_MODE_APPLICATION,
+                               5000 + i, 100000 - i * 7, i % 4,
+                               data) == KIT_OK);
+    REQUIRE(peer_builder_write(&c, PEER_MESSAGE_MODE_APPLICATION,
+                               5000 + i, 100000 - i * 7, i % 4,
+                               data) == KIT_OK);
+  }
+
+  REQUIRE(peer_builder_finish(&b) == KIT_OK);
+  REQUIRE(peer_builder_finish(&c) == KIT_OK);
+
+  /*  Write more into the last packet.
+   */
+  peer_builder_continue(&c, 0, 1, PEER_PACKET_SIZE,
+                        PEER_PACKET_MODE_COMPACT, &compact);
+
+  REQUIRE(c.first == compact.size - 1);
+  REQUIRE(peer_builder_write(&c, PEER_MESSAGE_MODE_APPLICATION, 5060,
+                             99580, 0, data) == KIT_OK);
+  REQUIRE(peer_builder_finish(&c) == KIT_OK);
+
+  REQUIRE(compact.size * 2 <= plain.size);
+
+  for (ptrdiff_t i = 0; i < compact.size; i++)
+    REQUIRE((compact.values[i].data[PEER_N_PACKET_MODE] &
+             PEER_PACKET_MODE_COMPACT) != 0);
+
+  peer_message_refs_t messages;
+  DA_INIT(messages, 0, alloc);
+
+  peer_packets_ref_t const ref = { .size   = compact.size,
+                                   .values = compact.values };
+  REQUIRE(peer_unpack_messages(ref, &messages) == KIT_OK);
+  REQUIRE(messages.size == 62);
+
+  if (messages.size == 62) {
+    REQUIRE(messages.values[0].mode == PEER_MESSAGE_MODE_SERVICE);
+    REQUIRE(messages.values[0].index == PEER_UNDEFINED);
+    REQUIRE(messages.values[0].time == 100000);
+    REQUIRE(messages.values[0].actor == PEER_UNDEFINED);
+    REQUIRE(messages.values[0].data.size == 1);
+
+    for (ptrdiff_t i = 0; i < 61; i++) {
+      peer_message_ref_t const *const m = messages.values + 1 + i;
+
+      REQUIRE(m->mode == PEER_MESSAGE_MODE_APPLICATION);
+      REQUIRE(m->index == 5000 + i);
+      REQUIRE(m->time == 100000 - i * 7);
+      REQUIRE(m->actor == i % 4);
+      REQUIRE(kit_ar_equal_bytes(1, m->data.size, m->data.values, 1,
+                                 data.size, data.values));
+    }
+  }
+
+  /*  Compact packets have no serialized messages.
+   */
+  peer_chunk_refs_t refs;
+  DA_INIT(refs, 0, alloc);
+  REQUIRE(peer_unpack_refs(ref, &refs) == KIT_OK);
+  REQUIRE(refs.size == 0);
+
+  /*  Compact packet without the packet checksum is rejected.
+   */
+  REQUIRE(compact.size > 1);
+  compact.values[0].data[PEER_N_PACKET_MODE] &=
+      ~PEER_PACKET_MODE_CHECKSUM;
+
+  DA_RESIZE(messages, 0);
+  REQUIRE(peer_unpack_messages(ref, &messages) ==
+          PEER_ERROR_INVALID_MESSAGE);
+  REQUIRE(messages.size > 0 && messages.size < 62);
+  REQUIRE(peer_unpack_refs(ref, &refs) == PEER_ERROR_INVALID_MESSAGE);
+  REQUIRE(refs.size == 0);
+
+  DA_DESTROY(refs);
+  DA_DESTROY(messages);
+  DA_DESTROY(plain);
+  DA_DESTROY(compact);
+}
+
+TEST("packet checksum rejects corrupted data") {
+  kit_allocator_t alloc = kit_alloc_default();
+
+  uint8_t payload[40];
+  memset(payload, 9, sizeof payload);
+  peer_chunk_ref_t const data = { .size   = sizeof payload,
+                                  .values = payload };
+
+  uint8_t const modes[] = { PEER_PACKET_MODE_PLAIN,
+                            PEER_PACKET_MODE_CHECKSUM,
+                            PEER_PACKET_MODE_COMPACT };
+
+  for (ptrdiff_t k = 0; k < sizeof modes; k++) {
+    peer_packets_t packets;
+    DA_INIT(packets, 0, alloc);
+
+    peer_packet_builder_t b;
+    peer_builder_init(&b, 0, 1, PEER_PACKET_SIZE, modes[k], &packets);
+
+    for (ptrdiff_t i = 0; i < 3; i++)
+      REQUIRE(peer_builder_write(&b, PEER_MESSAGE_MODE_APPLICATION, i,
+                                 0, 0, data) == KIT_OK);
+    REQUIRE(peer_builder_finish(&b) == KIT_OK);
+    REQUIRE(packets.size == 1);
+
+    if (packets.size != 1)
+      return;
+
+    /*  Only packets with the checksum flag reserve the field.
+     */
+    REQUIRE(peer_packet_messages_offset(packets.values) ==
+            (modes[k] == PEER_PACKET_MODE_PLAIN
+                 ? PEER_N_PACKET_OPTIONAL
+                 : PEER_N_PACKET_OPTIONAL +
+                       PEER_PACKET_CHECKSUM_SIZE));
+
+    peer_packets_ref_t const ref = { .size   = 1,
+                                     .values = packets.values };
+
+    peer_message_refs_t messages;
+    DA_INIT(messages, 0, alloc);
+
+    REQUIRE(peer_unpack_messages(ref, &messages) == KIT_OK);
+    REQUIRE(messages.size == 3);
+
+    /*  Flip a bit of the last message data. Per-message checksums
+     *  drop only that message, the packet checksum drops the whole
+     *  packet.
+     */
+    packets.values[0].data[packets.values[0].size - 1] ^= 4;
+
+    DA_RESIZE(messages, 0);
+    REQUIRE(peer_unpack_messages(ref, &messages) ==
+            PEER_ERROR_INVALID_MESSAGE);
+    REQUIRE(messages.size ==
+            (modes[k] == PEER_PACKET_MODE_PLAIN ? 2 : 0));
+
+    DA_DESTROY(messages);
+    DA_DESTROY(packets);
+  }
+}
+
+TEST("packet checksum covers session and index") {
+  kit_allocator_t alloc = kit_alloc_default();
+
+  uint8_t payload[40];
+  memset(payload, 9, sizeof payload);
+  peer_chunk_ref_t const data = { .size   = sizeof payload,
+                                  .values = payload };
+
+  ptrdiff_t const offsets[] = { PEER_N_PACKET_SESSION,
+                                PEER_N_PACKET_INDEX };
+
+  for (ptrdiff_t k = 0; k < 2; k++) {
+    peer_packets_t packets;
+    DA_INIT(packets, 0, alloc);
+
+    peer_packet_builder_t b;
+    peer_builder_init(&b, 0, 1, PEER_PACKET_SIZE,
+                      PEER_PACKET_MODE_CHECKSUM, &packets);
+
+    REQUIRE(peer_builder_write(&b, PEER_MESSAGE_MODE_APPLICATION, 0,
+                               0, 0, data) == KIT_OK);
+    REQUIRE(peer_builder_finish(&b) == KIT_OK);
+    REQUIRE(packets.size == 1);
+
+    if (packets.size != 1)
+      return;
+
+    /*  FEC writes the packet index after the packet is closed.
+     */
+    peer_fec_encoder_t e;
+    peer_fec_encoder_init(&e);
+    REQUIRE(peer_fec_encode(&e, &packets, 0) == KIT_OK);
+
+    peer_packets_ref_t const ref = { .size   = 1,
+                                     .values = packets.values };
+
+    peer_message_refs_t messages;
+    DA_INIT(messages, 0, alloc);
+
+    REQUIRE(peer_unpack_messages(ref, &messages) == KIT_OK);
+    REQUIRE(messages.size == 1);
+
+    packets.values[0].data[offsets[k]] ^= 1;
+
+    DA_RESIZE(messages, 0);
+    REQUIRE(peer_unpack_messages(ref, &messages) ==
+            PEER_ERROR_INVALID_MESSAGE);
+    REQUIRE(messages.size == 0);
+
+    DA_DESTROY(messages);
+    DA_DESTROY(packets);
+  }
+}
@@ -1,5 +1,7 @@
+#include "../../peer/handoff.h"
 #include "../../peer/peer.h"
 
+#include <kit/threads.h>
 #include <string.h>
 
 #define KIT_TEST_FILE peer
@@ -12,7 +14,6 @@
  *  - Session token.
  *  - Session version.
  *  - Reconnect.
- *  - History pruning.
  *  - Encryption.
  *  - Predefined public keys.
  */
@@ -38,6 +39,14 @@ static int resolve_address_id_(peer_t *const       client,
   return has_id_(host, client->slots.values[0].remote.id);
 }
 
+static int data_equal_(peer_queue_t const *const q,
+                       ptrdiff_t const           index,
+                       uint8_t const *const      data,
+                       ptrdiff_t const           size) {
+  peer_chunk_ref_t const ref = peer_queue_data(q, index);
+  return kit_ar_equal_bytes(1, size, data, 1, ref.size, ref.values);
+}
+
 static int send_packets_to_(peer_tick_result_t const tick,
                             peer_t *const            peer) {
   if (tick.status != KIT_OK)
@@ -83,9 +92,10 @@ TEST("peer host to client initial state update") {
    */
   peer_t host, client;
 
-  REQUIRE(peer_init(&host, PEER_HOST, kit_alloc_default()) == KIT_OK);
-  REQUIRE(peer_init(&client, PEER_CLIENT, kit_alloc_default()) ==
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
           KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
 
   /*  Open sockets.
    */
@@ -124,31 +134,31 @@ TEST("peer host to client initial state update") {
 
   /*  Check if host's data was updated.
    */
-  REQUIRE(host.queue.size == 3);
-  REQUIRE(host.queue.size == 3 && host.queue.values[0].time == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[0].actor == 0);
-  REQUIRE(host.queue.size == 3 &&
-          host.queue.values[0].data.size == 2);
-  REQUIRE(host.queue.size == 3 && host.queue.values[1].time == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[1].actor == 0);
-  REQUIRE(host.queue.size == 3 &&
-          host.queue.values[1].data.size == 4);
-  REQUIRE(host.queue.size == 3 && host.queue.values[2].time == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[2].actor == 0);
-  REQUIRE(host.queue.size == 3 &&
-          host.queue.values[2].data.size == 3);
-  REQUIRE(host.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 2, data, 1,
-                             host.queue.values[0].data.size,
-                             host.queue.values[0].data.values));
-  REQUIRE(host.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 4, data + 2, 1,
-                             host.queue.values[1].data.size,
-                             host.queue.values[1].data.values));
-  REQUIRE(host.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 3, data + 6, 1,
-                             host.queue.values[2].data.size,
-                             host.queue.values[2].data.values));
+  REQUIRE(host.queue.messages.size == 3);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 0)->time == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 0)->actor == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_data(&host.queue, 0).size == 2);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 1)->time == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 1)->actor == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_data(&host.queue, 1).size == 4);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 2)->time == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 2)->actor == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_data(&host.queue, 2).size == 3);
+  REQUIRE(host.queue.messages.size == 3 &&
+          data_equal_(&host.queue, 0, data, 2));
+  REQUIRE(host.queue.messages.size == 3 &&
+          data_equal_(&host.queue, 1, data + 2, 4));
+  REQUIRE(host.queue.messages.size == 3 &&
+          data_equal_(&host.queue, 2, data + 6, 3));
 
   /*  Initialize client-to-host connection.
    */
@@ -208,28 +218,25 @@ TEST("peer host to client initial state update") {
 
   /*  Check if client's data was updated.
    */
-  REQUIRE_EQ(client.queue.size, 3);
-  REQUIRE(client.queue.size == 3 && client.queue.values[0].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[0].actor == 0);
-  REQUIRE(client.queue.size == 3 && client.queue.values[1].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[1].actor == 0);
-  REQUIRE(client.queue.size == 3 && client.queue.values[2].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[2].actor == 0);
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 2, data, 1,
-                             client.queue.values[0].data.size,
-                             client.queue.values[0].data.values));
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 4, data + 2, 1,
-                             client.queue.values[1].data.size,
-                             client.queue.values[1].data.values));
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 3, data + 6, 1,
-                             client.queue.values[2].data.size,
-                             client.queue.values[2].data.values));
+  REQUIRE_EQ(client.queue.messages.size, 3);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 0)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 0)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 1)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 1)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 2)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 2)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 0, data, 2));
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 1, data + 2, 4));
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 2, data + 6, 3));
 
   /*  Destroy the host and the client.
    */
@@ -242,9 +249,10 @@ TEST("peer host to client state update once") {
    */
   peer_t host, client;
 
-  REQUIRE(peer_init(&host, PEER_HOST, kit_alloc_default()) == KIT_OK);
-  REQUIRE(peer_init(&client, PEER_CLIENT, kit_alloc_default()) ==
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
           KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
 
   /*  Open sockets.
    */
@@ -339,25 +347,25 @@ TEST("peer host to client state update once") {
 
   /*  Check if host's data was updated.
    */
-  REQUIRE(host.queue.size == 3);
-  REQUIRE(host.queue.size == 3 && host.queue.values[0].time == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[0].actor == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[1].time == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[1].actor == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[2].time == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[2].actor == 0);
-  REQUIRE(host.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 2, data, 1,
-                             host.queue.values[0].data.size,
-                             host.queue.values[0].data.values));
-  REQUIRE(host.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 4, data + 2, 1,
-                             host.queue.values[1].data.size,
-                             host.queue.values[1].data.values));
-  REQUIRE(host.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 3, data + 6, 1,
-                             host.queue.values[2].data.size,
-                             host.queue.values[2].data.values));
+  REQUIRE(host.queue.messages.size == 3);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 0)->time == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 0)->actor == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 1)->time == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 1)->actor == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 2)->time == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 2)->actor == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          data_equal_(&host.queue, 0, data, 2));
+  REQUIRE(host.queue.messages.size == 3 &&
+          data_equal_(&host.queue, 1, data + 2, 4));
+  REQUIRE(host.queue.messages.size == 3 &&
+          data_equal_(&host.queue, 2, data + 6, 3));
 
   /*  Host will generate packets which must be sent to the client.
    */
@@ -371,28 +379,25 @@ TEST("peer host to client state update once") {
 
   /*  Check if client's data was updated.
    */
-  REQUIRE(client.queue.size == 3);
-  REQUIRE(client.queue.size == 3 && client.queue.values[0].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[0].actor == 0);
-  REQUIRE(client.queue.size == 3 && client.queue.values[1].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[1].actor == 0);
-  REQUIRE(client.queue.size == 3 && client.queue.values[2].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[2].actor == 0);
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 2, data, 1,
-                             client.queue.values[0].data.size,
-                             client.queue.values[0].data.values));
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 4, data + 2, 1,
-                             client.queue.values[1].data.size,
-                             client.queue.values[1].data.values));
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 3, data + 6, 1,
-                             client.queue.values[2].data.size,
-                             client.queue.values[2].data.values));
+  REQUIRE(client.queue.messages.size == 3);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 0)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 0)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 1)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 1)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 2)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 2)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 0, data, 2));
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 1, data + 2, 4));
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 2, data + 6, 3));
 
   /*  Destroy the host and the client.
    */
@@ -405,9 +410,10 @@ TEST("peer host to client state update twice") {
    */
   peer_t host, client;
 
-  REQUIRE(peer_init(&host, PEER_HOST, kit_alloc_default()) == KIT_OK);
-  REQUIRE(peer_init(&client, PEER_CLIENT, kit_alloc_default()) ==
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
           KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
 
   /*  Open sockets.
    */
@@ -500,13 +506,13 @@ TEST("peer host to client state update twice") {
 
   /*  Check if host's data was updated.
    */
-  REQUIRE(host.queue.size == 1);
-  REQUIRE(host.queue.size == 1 && host.queue.values[0].time == 0);
-  REQUIRE(host.queue.size == 1 && host.queue.values[0].actor == 0);
-  REQUIRE(host.queue.size == 1 &&
-          kit_ar_equal_bytes(1, 2, data, 1,
-                             host.queue.values[0].data.size,
-                             host.queue.values[0].data.values));
+  REQUIRE(host.queue.messages.size == 1);
+  REQUIRE(host.queue.messages.size == 1 &&
+          peer_queue_message(&host.queue, 0)->time == 0);
+  REQUIRE(host.queue.messages.size == 1 &&
+          peer_queue_message(&host.queue, 0)->actor == 0);
+  REQUIRE(host.queue.messages.size == 1 &&
+          data_equal_(&host.queue, 0, data, 2));
 
   /*  Host will generate packets which must be sent to the client.
    */
@@ -520,14 +526,13 @@ TEST("peer host to client state update twice") {
 
   /*  Check if client's data was updated.
    */
-  REQUIRE(client.queue.size == 1);
-  REQUIRE(client.queue.size == 1 && client.queue.values[0].time == 0);
-  REQUIRE(client.queue.size == 1 &&
-          client.queue.values[0].actor == 0);
-  REQUIRE(client.queue.size == 1 &&
-          kit_ar_equal_bytes(1, 2, data, 1,
-                             client.queue.values[0].data.size,
-                             client.queue.values[0].data.values));
+  REQUIRE(client.queue.messages.size == 1);
+  REQUIRE(client.queue.messages.size == 1 &&
+          peer_queue_message(&client.queue, 0)->time == 0);
+  REQUIRE(client.queue.messages.size == 1 &&
+          peer_queue_message(&client.queue, 0)->actor == 0);
+  REQUIRE(client.queue.messages.size == 1 &&
+          data_equal_(&client.queue, 0, data, 2));
 
   /*  Put data to the host.
    */
@@ -536,19 +541,19 @@ TEST("peer host to client state update twice") {
 
   /*  Check if host's data was updated.
    */
-  REQUIRE(host.queue.size == 3);
-  REQUIRE(host.queue.size == 3 && host.queue.values[1].time == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[1].actor == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[2].time == 0);
-  REQUIRE(host.queue.size == 3 && host.queue.values[2].actor == 0);
-  REQUIRE(host.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 4, data + 2, 1,
-                             host.queue.values[1].data.size,
-                             host.queue.values[1].data.values));
-  REQUIRE(host.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 3, data + 6, 1,
-                             host.queue.values[2].data.size,
-                             host.queue.values[2].data.values));
+  REQUIRE(host.queue.messages.size == 3);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 1)->time == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 1)->actor == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 2)->time == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          peer_queue_message(&host.queue, 2)->actor == 0);
+  REQUIRE(host.queue.messages.size == 3 &&
+          data_equal_(&host.queue, 1, data + 2, 4));
+  REQUIRE(host.queue.messages.size == 3 &&
+          data_equal_(&host.queue, 2, data + 6, 3));
 
   /*  Host will generate packets which must be sent to the client.
    */
@@ -562,21 +567,19 @@ TEST("peer host to client state update twice") {
 
   /*  Check if client's data was updated.
    */
-  REQUIRE(client.queue.size == 3);
-  REQUIRE(client.queue.size == 3 && client.queue.values[1].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[1].actor == 0);
-  REQUIRE(client.queue.size == 3 && client.queue.values[2].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[2].actor == 0);
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 4, data + 2, 1,
-                             client.queue.values[1].data.size,
-                             client.queue.values[1].data.values));
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 3, data + 6, 1,
-                             client.queue.values[2].data.size,
-                             client.queue.values[2].data.values));
+  REQUIRE(client.queue.messages.size == 3);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 1)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 1)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 2)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 2)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 1, data + 2, 4));
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 2, data + 6, 3));
 
   /*  Destroy the host and the client.
    */
@@ -591,9 +594,9 @@ TEST("peer client to client state update") {
   kit_allocator_t alloc = kit_alloc_default();
   peer_t          host, alice, bob;
 
-  REQUIRE(peer_init(&host, PEER_HOST, alloc) == KIT_OK);
-  REQUIRE(peer_init(&alice, PEER_CLIENT, alloc) == KIT_OK);
-  REQUIRE(peer_init(&bob, PEER_CLIENT, alloc) == KIT_OK);
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, alloc) == KIT_OK);
+  REQUIRE(peer_init(&alice, PEER_CLIENT, NULL, alloc) == KIT_OK);
+  REQUIRE(peer_init(&bob, PEER_CLIENT, NULL, alloc) == KIT_OK);
 
   ptrdiff_t const      sockets[]     = { 1, 2, 3, 4, 5, 6 };
   peer_ids_ref_t const host_sockets  = { .size   = 3,
@@ -676,25 +679,23 @@ TEST("peer client to client state update") {
 
   /*  Check if Alice' data was updated.
    */
-  REQUIRE(alice.queue.size == 1);
-  REQUIRE(alice.queue.size == 1 && alice.queue.values[0].time == 0);
-  REQUIRE(alice.queue.size == 1 &&
-          alice.queue.values[0].actor == alice.actor);
-  REQUIRE(alice.queue.size == 1 &&
-          kit_ar_equal_bytes(1, 5, data, 1,
-                             alice.queue.values[0].data.size,
-                             alice.queue.values[0].data.values));
+  REQUIRE(alice.queue.messages.size == 1);
+  REQUIRE(alice.queue.messages.size == 1 &&
+          peer_queue_message(&alice.queue, 0)->time == 0);
+  REQUIRE(alice.queue.messages.size == 1 &&
+          peer_queue_message(&alice.queue, 0)->actor == alice.actor);
+  REQUIRE(alice.queue.messages.size == 1 &&
+          data_equal_(&alice.queue, 0, data, 5));
 
   /*  Check if Bob's data was updated.
    */
-  REQUIRE(bob.queue.size == 1);
-  REQUIRE(bob.queue.size == 1 && bob.queue.values[0].time == 0);
-  REQUIRE(bob.queue.size == 1 &&
-          bob.queue.values[0].actor == alice.actor);
-  REQUIRE(bob.queue.size == 1 &&
-          kit_ar_equal_bytes(1, 5, data, 1,
-                             bob.queue.values[0].data.size,
-                             bob.queue.values[0].data.values));
+  REQUIRE(bob.queue.messages.size == 1);
+  REQUIRE(bob.queue.messages.size == 1 &&
+          peer_queue_message(&bob.queue, 0)->time == 0);
+  REQUIRE(bob.queue.messages.size == 1 &&
+          peer_queue_message(&bob.queue, 0)->actor == alice.actor);
+  REQUIRE(bob.queue.messages.size == 1 &&
+          data_equal_(&bob.queue, 0, data, 5));
 
   /*  Destroy peers.
    */
@@ -710,9 +711,9 @@ TEST("peer two clients state update") {
   kit_allocator_t alloc = kit_alloc_default();
   peer_t          host, alice, bob;
 
-  REQUIRE(peer_init(&host, PEER_HOST, alloc) == KIT_OK);
-  REQUIRE(peer_init(&alice, PEER_CLIENT, alloc) == KIT_OK);
-  REQUIRE(peer_init(&bob, PEER_CLIENT, alloc) == KIT_OK);
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, alloc) == KIT_OK);
+  REQUIRE(peer_init(&alice, PEER_CLIENT, NULL, alloc) == KIT_OK);
+  REQUIRE(peer_init(&bob, PEER_CLIENT, NULL, alloc) == KIT_OK);
 
   ptrdiff_t const      sockets[]     = { 1, 2, 3, 4, 5, 6 };
   peer_ids_ref_t const host_sockets  = { .size   = 3,
@@ -798,39 +799,35 @@ TEST("peer two clients state update") {
 
   /*  Check if Alice' data was updated.
    */
-  REQUIRE(alice.queue.size == 2);
-  REQUIRE(alice.queue.size == 2 && alice.queue.values[0].time == 0);
-  REQUIRE(alice.queue.size == 2 &&
-          alice.queue.values[0].actor == alice.actor);
-  REQUIRE(alice.queue.size == 2 && alice.queue.values[1].time == 0);
-  REQUIRE(alice.queue.size == 2 &&
-          alice.queue.values[1].actor == bob.actor);
-  REQUIRE(alice.queue.size == 2 &&
-          kit_ar_equal_bytes(1, 3, data, 1,
-                             alice.queue.values[0].data.size,
-                             alice.queue.values[0].data.values));
-  REQUIRE(alice.queue.size == 2 &&
-          kit_ar_equal_bytes(1, 2, data + 3, 1,
-                             alice.queue.values[1].data.size,
-                             alice.queue.values[1].data.values));
+  REQUIRE(alice.queue.messages.size == 2);
+  REQUIRE(alice.queue.messages.size == 2 &&
+          peer_queue_message(&alice.queue, 0)->time == 0);
+  REQUIRE(alice.queue.messages.size == 2 &&
+          peer_queue_message(&alice.queue, 0)->actor == alice.actor);
+  REQUIRE(alice.queue.messages.size == 2 &&
+          peer_queue_message(&alice.queue, 1)->time == 0);
+  REQUIRE(alice.queue.messages.size == 2 &&
+          peer_queue_message(&alice.queue, 1)->actor == bob.actor);
+  REQUIRE(alice.queue.messages.size == 2 &&
+          data_equal_(&alice.queue, 0, data, 3));
+  REQUIRE(alice.queue.messages.size == 2 &&
+          data_equal_(&alice.queue, 1, data + 3, 2));
 
   /*  Check if Bob's data was updated.
    */
-  REQUIRE(bob.queue.size == 2);
-  REQUIRE(bob.queue.size == 2 && bob.queue.values[0].time == 0);
-  REQUIRE(bob.queue.size == 2 &&
-          bob.queue.values[0].actor == alice.actor);
-  REQUIRE(bob.queue.size == 2 && bob.queue.values[1].time == 0);
-  REQUIRE(bob.queue.size == 2 &&
-          bob.queue.values[1].actor == bob.actor);
-  REQUIRE(bob.queue.size == 2 &&
-          kit_ar_equal_bytes(1, 3, data, 1,
-                             bob.queue.values[0].data.size,
-                             bob.queue.values[0].data.values));
-  REQUIRE(bob.queue.size == 2 &&
-          kit_ar_equal_bytes(1, 2, data + 3, 1,
-                             bob.queue.values[1].data.size,
-                             bob.queue.values[1].data.values));
+  REQUIRE(bob.queue.messages.size == 2);
+  REQUIRE(bob.queue.messages.size == 2 &&
+          peer_queue_message(&bob.queue, 0)->time == 0);
+  REQUIRE(bob.queue.messages.size == 2 &&
+          peer_queue_message(&bob.queue, 0)->actor == alice.actor);
+  REQUIRE(bob.queue.messages.size == 2 &&
+          peer_queue_message(&bob.queue, 1)->time == 0);
+  REQUIRE(bob.queue.messages.size == 2 &&
+          peer_queue_message(&bob.queue, 1)->actor == bob.actor);
+  REQUIRE(bob.queue.messages.size == 2 &&
+          data_equal_(&bob.queue, 0, data, 3));
+  REQUIRE(bob.queue.messages.size == 2 &&
+          data_equal_(&bob.queue, 1, data + 3, 2));
 
   /*  Destroy peers.
    */
@@ -846,9 +843,9 @@ TEST("peer message time") {
   kit_allocator_t alloc = kit_alloc_default();
   peer_t          host, alice, bob;
 
-  REQUIRE(peer_init(&host, PEER_HOST, alloc) == KIT_OK);
-  REQUIRE(peer_init(&alice, PEER_CLIENT, alloc) == KIT_OK);
-  REQUIRE(peer_init(&bob, PEER_CLIENT, alloc) == KIT_OK);
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, alloc) == KIT_OK);
+  REQUIRE(peer_init(&alice, PEER_CLIENT, NULL, alloc) == KIT_OK);
+  REQUIRE(peer_init(&bob, PEER_CLIENT, NULL, alloc) == KIT_OK);
 
   ptrdiff_t const      sockets[]     = { 1, 2, 3, 4, 5, 6 };
   peer_ids_ref_t const host_sockets  = { .size   = 3,
@@ -945,15 +942,19 @@ TEST("peer message time") {
 
   /*  Check if Alice' data was updated.
    */
-  REQUIRE(alice.queue.size == 2);
-  REQUIRE(alice.queue.size == 2 && alice.queue.values[0].time == 10);
-  REQUIRE(alice.queue.size == 2 && alice.queue.values[1].time == 25);
+  REQUIRE(alice.queue.messages.size == 2);
+  REQUIRE(alice.queue.messages.size == 2 &&
+          peer_queue_message(&alice.queue, 0)->time == 10);
+  REQUIRE(alice.queue.messages.size == 2 &&
+          peer_queue_message(&alice.queue, 1)->time == 25);
 
   /*  Check if Bob's data was updated.
    */
-  REQUIRE(bob.queue.size == 2);
-  REQUIRE(bob.queue.size == 2 && bob.queue.values[0].time == 10);
-  REQUIRE(bob.queue.size == 2 && bob.queue.values[1].time == 25);
+  REQUIRE(bob.queue.messages.size == 2);
+  REQUIRE(bob.queue.messages.size == 2 &&
+          peer_queue_message(&bob.queue, 0)->time == 10);
+  REQUIRE(bob.queue.messages.size == 2 &&
+          peer_queue_message(&bob.queue, 1)->time == 25);
 
   /*  Destroy peers.
    */
@@ -967,9 +968,10 @@ TEST("peer host to client time update") {
    */
   peer_t host, client;
 
-  REQUIRE(peer_init(&host, PEER_HOST, kit_alloc_default()) == KIT_OK);
-  REQUIRE(peer_init(&client, PEER_CLIENT, kit_alloc_default()) ==
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
           KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
 
   /*  Open sockets.
    */
@@ -1074,13 +1076,13 @@ TEST("peer host to client time update") {
 
   /*  Check if client's data was updated.
    */
-  REQUIRE(client.queue.size == 3);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[0].time == 12);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[1].time == 12);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[2].time == 12);
+  REQUIRE(client.queue.messages.size == 3);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 0)->time == 12);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 1)->time == 12);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 2)->time == 12);
 
   /*  Check if client's time was updated.
    */
@@ -1097,9 +1099,10 @@ TEST("peer host to client heartbeat") {
    */
   peer_t host, client;
 
-  REQUIRE(peer_init(&host, PEER_HOST, kit_alloc_default()) == KIT_OK);
-  REQUIRE(peer_init(&client, PEER_CLIENT, kit_alloc_default()) ==
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
           KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
 
   /*  Open sockets.
    */
@@ -1206,9 +1209,10 @@ TEST("peer host to client packet loss") {
    */
   peer_t host, client;
 
-  REQUIRE(peer_init(&host, PEER_HOST, kit_alloc_default()) == KIT_OK);
-  REQUIRE(peer_init(&client, PEER_CLIENT, kit_alloc_default()) ==
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
           KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
 
   /*  Open sockets.
    */
@@ -1324,31 +1328,1701 @@ TEST("peer host to client packet loss") {
 
   /*  Check if client's data was updated.
    */
-  REQUIRE(client.queue.size == 3);
-  REQUIRE(client.queue.size == 3 && client.queue.values[0].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[0].actor == 0);
-  REQUIRE(client.queue.size == 3 && client.queue.values[1].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[1].actor == 0);
-  REQUIRE(client.queue.size == 3 && client.queue.values[2].time == 0);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[2].actor == 0);
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 2, data, 1,
-                             client.queue.values[0].data.size,
-                             client.queue.values[0].data.values));
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 4, data + 2, 1,
-                             client.queue.values[1].data.size,
-                             client.queue.values[1].data.values));
-  REQUIRE(client.queue.size == 3 &&
-          kit_ar_equal_bytes(1, 3, data + 6, 1,
-                             client.queue.values[2].data.size,
-                             client.queue.values[2].data.values));
+  REQUIRE(client.queue.messages.size == 3);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 0)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 0)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 1)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 1)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 2)->time == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 2)->actor == 0);
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 0, data, 2));
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 1, data + 2, 4));
+  REQUIRE(client.queue.messages.size == 3 &&
+          data_equal_(&client.queue, 2, data + 6, 3));
 
   /*  Destroy the host and the client.
    */
   REQUIRE(peer_destroy(&host) == KIT_OK);
   REQUIRE(peer_destroy(&client) == KIT_OK);
 }
+
+TEST("peer next timeout") {
+  peer_t host, client;
+
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  ptrdiff_t const      sockets[]      = { 1, 2, 3 };
+  peer_ids_ref_t const host_sockets   = { .size   = 2,
+                                          .values = sockets },
+                       client_sockets = { .size   = 1,
+                                          .values = sockets + 2 };
+
+  REQUIRE(peer_open(&host, host_sockets) == KIT_OK);
+  REQUIRE(peer_open(&client, client_sockets) == KIT_OK);
+
+  if (host.slots.size == 2) {
+    host.slots.values[1].local.address_size    = 1;
+    host.slots.values[1].local.address_data[0] = 2;
+  }
+
+  /*  Nothing to wait for before connecting.
+   */
+  REQUIRE(peer_next_timeout(&host) == PEER_UNDEFINED);
+  REQUIRE(peer_next_timeout(&client) == PEER_UNDEFINED);
+
+  REQUIRE(peer_connect(&client, host_sockets.values[0]) == KIT_OK);
+  REQUIRE(peer_next_timeout(&client) == 0);
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(peer_next_timeout(&host) == 0);
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(resolve_address_id_(&client, &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  /*  Heartbeat is due after the timeout.
+   */
+  REQUIRE(peer_next_timeout(&host) == PEER_TIMEOUT_HEARTBEAT);
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 4), &client));
+  REQUIRE(peer_next_timeout(&host) == PEER_TIMEOUT_HEARTBEAT - 4);
+
+  /*  New messages are due now.
+   */
+  uint8_t          data[]   = { 1, 2, 3 };
+  peer_chunk_ref_t data_ref = { .size = 3, .values = data };
+  REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+  REQUIRE(peer_next_timeout(&host) == 0);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer history pruning") {
+  peer_t host, client;
+
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  host.config.history   = 10;
+  client.config.history = 10;
+
+  ptrdiff_t const      sockets[]      = { 1, 2, 3 };
+  peer_ids_ref_t const host_sockets   = { .size   = 2,
+                                          .values = sockets },
+                       client_sockets = { .size   = 1,
+                                          .values = sockets + 2 };
+
+  REQUIRE(peer_open(&host, host_sockets) == KIT_OK);
+  REQUIRE(peer_open(&client, client_sockets) == KIT_OK);
+
+  if (host.slots.size == 2) {
+    host.slots.values[1].local.address_size    = 1;
+    host.slots.values[1].local.address_data[0] = 2;
+  }
+
+  REQUIRE(peer_connect(&client, host_sockets.values[0]) == KIT_OK);
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(resolve_address_id_(&client, &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  /*  Send messages from the host and from the client.
+   */
+  for (ptrdiff_t i = 0; i < 300; i++) {
+    uint8_t          data[]   = { (uint8_t) i };
+    peer_chunk_ref_t data_ref = { .size = 1, .values = data };
+    REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+    REQUIRE(peer_queue(&client, data_ref) == KIT_OK);
+
+    if (i % 10 == 9) {
+      REQUIRE(
+          send_packets_to_and_free_(peer_tick(&client, 1), &host));
+      REQUIRE(
+          send_packets_to_and_free_(peer_tick(&host, 1), &client));
+    }
+  }
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 1), &client));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 1), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 1), &client));
+
+  /*  Everything is acknowledged. Host keeps the history, client's
+   *  slot queue is empty. Indices are stable.
+   */
+  peer_queue_window_t const host_window = peer_queue_window(
+      &host.queue);
+  peer_queue_window_t const slot_window = peer_queue_window(
+      &client.slots.values[0].queue);
+
+  REQUIRE_EQ(host_window.end, 600);
+  REQUIRE_EQ(host_window.begin, 590);
+  REQUIRE_EQ(slot_window.end, 300);
+  REQUIRE_EQ(slot_window.begin, 300);
+
+  /*  Client releases mutual messages a tick after they became
+   *  readable, and keeps the history too.
+   */
+  REQUIRE_EQ(client.queue.offset, 580);
+  REQUIRE_EQ(client.queue.messages.size, 20);
+
+  REQUIRE_EQ(peer_queue_trim(&client.queue, 595), KIT_OK);
+  REQUIRE_EQ(client.queue.offset, 595);
+  REQUIRE_EQ(client.queue.messages.size, 5);
+
+  REQUIRE_EQ(peer_destroy(&host), KIT_OK);
+  REQUIRE_EQ(peer_destroy(&client), KIT_OK);
+}
+
+TEST("peer queue payload log") {
+  peer_t host;
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+
+  uint8_t data[300];
+
+  for (ptrdiff_t i = 0; i < 500; i++) {
+    memset(data, (int) (i & 0xff), sizeof data);
+    peer_chunk_ref_t const ref = { .size   = sizeof data,
+                                   .values = data };
+    REQUIRE(peer_queue(&host, ref) == KIT_OK);
+  }
+
+  /*  Payloads don't span blocks.
+   */
+  REQUIRE(host.queue.log.blocks.size ==
+          (500 + PEER_LOG_BLOCK_SIZE / 300 - 1) /
+              (PEER_LOG_BLOCK_SIZE / 300));
+
+  memset(data, 0, sizeof data);
+  REQUIRE(data_equal_(&host.queue, 0, data, sizeof data));
+  memset(data, 499 & 0xff, sizeof data);
+  REQUIRE(data_equal_(&host.queue, 499, data, sizeof data));
+
+  /*  Trimming releases blocks before the first retained payload.
+   */
+  REQUIRE(peer_queue_trim(&host.queue, 450) == KIT_OK);
+  REQUIRE(host.queue.log.offset == 450 / (PEER_LOG_BLOCK_SIZE / 300));
+  REQUIRE(peer_queue_data(&host.queue, 449).size == 0);
+  REQUIRE(data_equal_(&host.queue, 499, data, sizeof data));
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+}
+
+TEST("peer broadcast shares encoded packets") {
+  peer_t host;
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+
+  ptrdiff_t const      sockets[]    = { 1, 2, 3, 4 };
+  peer_ids_ref_t const host_sockets = { .size   = 4,
+                                        .values = sockets };
+
+  REQUIRE(peer_open(&host, host_sockets) == KIT_OK);
+  REQUIRE(host.slots.size == 4);
+
+  /*  Emulate three connected clients.
+   */
+  for (ptrdiff_t i = 1; i < host.slots.size; i++) {
+    host.slots.values[i].state                 = PEER_SLOT_READY;
+    host.slots.values[i].remote.id             = 10 + i;
+    host.slots.values[i].remote.is_id_resolved = 1;
+  }
+
+  uint8_t          data[]   = { 1, 2, 3 };
+  peer_chunk_ref_t data_ref = { .size = 3, .values = data };
+  REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+  REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+
+  peer_tick_result_t const tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+  REQUIRE(tick.packets.size == 3);
+
+  for (ptrdiff_t i = 0; i < tick.packets.size; i++) {
+    peer_packet_t const *const p = tick.packets.values + i;
+
+    REQUIRE(p->source_id == sockets[i + 1]);
+    REQUIRE(p->destination_id == 11 + i);
+    REQUIRE(p->size == tick.packets.values[0].size);
+    REQUIRE(memcmp(p->data, tick.packets.values[0].data, p->size) ==
+            0);
+  }
+
+  DA_DESTROY(tick.packets);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+}
+
+TEST("peer selective acknowledgement") {
+  peer_t host, client;
+
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  /*  Keep all received messages for the checks.
+   */
+  client.config.history = PEER_UNDEFINED;
+
+  ptrdiff_t const      sockets[]      = { 1, 2, 3 };
+  peer_ids_ref_t const host_sockets   = { .size   = 2,
+                                          .values = sockets },
+                       client_sockets = { .size   = 1,
+                                          .values = sockets + 2 };
+
+  REQUIRE(peer_open(&host, host_sockets) == KIT_OK);
+  REQUIRE(peer_open(&client, client_sockets) == KIT_OK);
+
+  if (host.slots.size == 2) {
+    host.slots.values[1].local.address_size    = 1;
+    host.slots.values[1].local.address_data[0] = 2;
+  }
+
+  REQUIRE(peer_connect(&client, host_sockets.values[0]) == KIT_OK);
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(resolve_address_id_(&client, &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  uint8_t          data[]   = { 1, 2, 3 };
+  peer_chunk_ref_t data_ref = { .size = 3, .values = data };
+
+  /*  Client acknowledges the first message, and reports a clean
+   *  link.
+   */
+  if (client.slots.size == 1)
+    client.slots.values[0].loss = 0;
+
+  REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  REQUIRE(host.slots.size == 2 && host.slots.values[1].is_acked);
+  REQUIRE(host.slots.size == 2 &&
+          host.slots.values[1].ack_index == 1);
+
+  /*  Lose two messages.
+   */
+  REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+  REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+
+  peer_tick_result_t tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+  DA_DESTROY(tick.packets);
+
+  /*  New message is sent without the trail on a clean link.
+   */
+  REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+
+  tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+
+  peer_packets_ref_t const packets_ref = {
+    .size = tick.packets.size, .values = tick.packets.values
+  };
+
+  peer_chunk_refs_t refs;
+  DA_INIT(refs, 0, kit_alloc_default());
+  REQUIRE(peer_unpack_refs(packets_ref, &refs) == KIT_OK);
+  REQUIRE(refs.size == 1);
+  DA_DESTROY(refs);
+
+  REQUIRE(peer_input(&client, packets_ref) == KIT_OK);
+  DA_DESTROY(tick.packets);
+
+  REQUIRE(client.queue.messages.size == 4);
+  REQUIRE(client.queue.messages.size == 4 &&
+          !peer_queue_message(&client.queue, 1)->is_ready);
+
+  /*  Client reports the missing messages, host resends them. The
+   *  resend is lost.
+   */
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+
+  if (host.slots.size == 2) {
+    host.slots.values[1].rtt.samples  = 1;
+    host.slots.values[1].rtt.smoothed = 50;
+  }
+
+  tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+  REQUIRE(tick.packets.size > 0);
+  DA_DESTROY(tick.packets);
+
+  /*  Host doesn't resend them again within a round trip.
+   */
+  if (host.slots.size == 2)
+    host.slots.values[1].is_ack_new = 1;
+
+  tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+  REQUIRE(tick.packets.size == 0);
+  DA_DESTROY(tick.packets);
+
+  /*  After a round trip, host resends them.
+   */
+  if (host.slots.size == 2)
+    host.slots.values[1].is_ack_new = 1;
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 50), &client));
+
+  REQUIRE(client.queue.messages.size == 4);
+  for (ptrdiff_t i = 0; i < client.queue.messages.size; i++)
+    REQUIRE(data_equal_(&client.queue, i, data, 3));
+
+  /*  Trail is sent on a lossy link.
+   */
+  if (host.slots.size == 2)
+    host.slots.values[1].remote_loss = PEER_LOSS_ONE;
+
+  REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+
+  tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+
+  peer_packets_ref_t const lossy_ref = {
+    .size = tick.packets.size, .values = tick.packets.values
+  };
+
+  DA_INIT(refs, 0, kit_alloc_default());
+  REQUIRE(peer_unpack_refs(lossy_ref, &refs) == KIT_OK);
+  REQUIRE(refs.size > 1);
+  DA_DESTROY(refs);
+  DA_DESTROY(tick.packets);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer loss estimate scales the trail") {
+  peer_t host, client;
+
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  ptrdiff_t const      sockets[]      = { 1, 2, 3 };
+  peer_ids_ref_t const host_sockets   = { .size   = 2,
+                                          .values = sockets },
+                       client_sockets = { .size   = 1,
+                                          .values = sockets + 2 };
+
+  REQUIRE(peer_open(&host, host_sockets) == KIT_OK);
+  REQUIRE(peer_open(&client, client_sockets) == KIT_OK);
+  REQUIRE(host.slots.size == 2);
+
+  if (host.slots.size != 2)
+    return;
+
+  peer_slot_t *const slot = host.slots.values + 1;
+
+  slot->local.address_size    = 1;
+  slot->local.address_data[0] = 2;
+
+  /*  Trail is scaled between the bounds.
+   */
+  peer_trail_t trail = peer_slot_trail(&host, slot);
+  REQUIRE(trail.serial_size > host.config.trail_min.serial_size);
+  REQUIRE(trail.serial_size < host.config.trail_max.serial_size);
+
+  slot->remote_loss = 0;
+  trail             = peer_slot_trail(&host, slot);
+  REQUIRE(trail.serial_size == host.config.trail_min.serial_size);
+  REQUIRE(trail.scatter_size == host.config.trail_min.scatter_size);
+  REQUIRE(trail.scatter_distance ==
+          host.config.trail_min.scatter_distance);
+
+  slot->remote_loss = PEER_LOSS_ONE;
+  trail             = peer_slot_trail(&host, slot);
+  REQUIRE(trail.serial_size == host.config.trail_max.serial_size);
+  REQUIRE(trail.scatter_size == host.config.trail_max.scatter_size);
+  REQUIRE(trail.scatter_distance ==
+          host.config.trail_max.scatter_distance);
+
+  slot->remote_loss = PEER_LOSS_INITIAL;
+
+  REQUIRE(peer_connect(&client, host_sockets.values[0]) == KIT_OK);
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(resolve_address_id_(&client, &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  uint8_t          data[]   = { 1, 2, 3 };
+  peer_chunk_ref_t data_ref = { .size = 3, .values = data };
+
+  /*  Messages in order lower the estimate.
+   */
+  uint32_t loss = slot->loss;
+
+  REQUIRE(peer_queue(&client, data_ref) == KIT_OK);
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(slot->loss < loss);
+
+  /*  Skipped messages raise the estimate.
+   */
+  loss = slot->loss;
+
+  REQUIRE(peer_queue(&client, data_ref) == KIT_OK);
+  peer_tick_result_t tick = peer_tick(&client, 0);
+  REQUIRE(tick.status == KIT_OK);
+  DA_DESTROY(tick.packets);
+
+  REQUIRE(peer_queue(&client, data_ref) == KIT_OK);
+  tick = peer_tick(&client, 0);
+  REQUIRE(tick.status == KIT_OK);
+
+  peer_packets_ref_t const packets_ref = {
+    .size = tick.packets.size, .values = tick.packets.values
+  };
+
+  REQUIRE(peer_input(&host, packets_ref) == KIT_OK);
+  REQUIRE(slot->loss > loss);
+
+  /*  Duplicates are counted separately.
+   */
+  loss                     = slot->loss;
+  ptrdiff_t const dup_size = slot->in_duplicates;
+
+  REQUIRE(peer_input(&host, packets_ref) == KIT_OK);
+  REQUIRE(slot->loss == loss);
+  REQUIRE(slot->in_duplicates > dup_size);
+
+  DA_DESTROY(tick.packets);
+
+  /*  Host reports the estimate in the acknowledgement, and the
+   *  client scales its trail by it.
+   */
+  REQUIRE(client.slots.size == 1);
+  if (client.slots.size != 1)
+    return;
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(client.slots.values[0].remote_loss == slot->loss);
+
+  peer_slot_t const *const client_slot = client.slots.values;
+  client.slots.values[0].remote_loss   = PEER_LOSS_ONE;
+  trail = peer_slot_trail(&client, client_slot);
+  REQUIRE(trail.serial_size == client.config.trail_max.serial_size);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer fec rebuilds lost packet") {
+  peer_t host, client;
+
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  host.config.redundancy = PEER_REDUNDANCY_FEC;
+
+  ptrdiff_t const      sockets[]      = { 1, 2, 3 };
+  peer_ids_ref_t const host_sockets   = { .size   = 2,
+                                          .values = sockets },
+                       client_sockets = { .size   = 1,
+                                          .values = sockets + 2 };
+
+  REQUIRE(peer_open(&host, host_sockets) == KIT_OK);
+  REQUIRE(peer_open(&client, client_sockets) == KIT_OK);
+
+  if (host.slots.size == 2) {
+    host.slots.values[1].local.address_size    = 1;
+    host.slots.values[1].local.address_data[0] = 2;
+  }
+
+  REQUIRE(peer_connect(&client, host_sockets.values[0]) == KIT_OK);
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(resolve_address_id_(&client, &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  /*  Each message takes a whole packet.
+   */
+  uint8_t data[300];
+  memset(data, 7, sizeof data);
+  peer_chunk_ref_t data_ref = { .size = sizeof data, .values = data };
+
+  for (ptrdiff_t i = 0; i < PEER_FEC_GROUP_SIZE * 2; i++)
+    REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+
+  peer_tick_result_t tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+  REQUIRE(tick.packets.size == PEER_FEC_GROUP_SIZE * 2 + 2);
+
+  /*  Lose one packet of each group.
+   */
+  for (ptrdiff_t i = 0; i < tick.packets.size; i++) {
+    if (i == 1 || i == PEER_FEC_GROUP_SIZE + 3)
+      continue;
+
+    peer_packets_ref_t const ref = { .size   = 1,
+                                     .values = tick.packets.values +
+                                               i };
+    REQUIRE(peer_input(&client, ref) == KIT_OK);
+  }
+
+  DA_DESTROY(tick.packets);
+
+  REQUIRE(client.queue.messages.size == PEER_FEC_GROUP_SIZE * 2);
+  for (ptrdiff_t i = 0; i < client.queue.messages.size; i++)
+    REQUIRE(data_equal_(&client.queue, i, data, sizeof data));
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer ping measures round trip time") {
+  peer_t host, client;
+
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  ptrdiff_t const      sockets[]      = { 1, 2, 3 };
+  peer_ids_ref_t const host_sockets   = { .size   = 2,
+                                          .values = sockets },
+                       client_sockets = { .size   = 1,
+                                          .values = sockets + 2 };
+
+  REQUIRE(peer_open(&host, host_sockets) == KIT_OK);
+  REQUIRE(peer_open(&client, client_sockets) == KIT_OK);
+  REQUIRE(host.slots.size == 2);
+
+  if (host.slots.size != 2)
+    return;
+
+  host.slots.values[1].local.address_size    = 1;
+  host.slots.values[1].local.address_data[0] = 2;
+
+  REQUIRE(peer_connect(&client, host_sockets.values[0]) == KIT_OK);
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(resolve_address_id_(&client, &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  peer_slot_t const *const slot = host.slots.values + 1;
+
+  REQUIRE(peer_slot_rtt(slot).samples == 0);
+  REQUIRE(peer_next_timeout(&host) == PEER_TIMEOUT_HEARTBEAT);
+
+  /*  Round trips of 30 and 70.
+   */
+  for (ptrdiff_t i = 0; i < 2; i++) {
+    REQUIRE(send_packets_to_and_free_(
+        peer_tick(&host, PEER_TIMEOUT_PING), &client));
+    REQUIRE(slot->is_ping_sent);
+    REQUIRE(peer_next_timeout(&client) == 0);
+
+    peer_tick_result_t const tick = peer_tick(&client, 0);
+    REQUIRE(tick.status == KIT_OK);
+
+    peer_tick_result_t const wait = peer_tick(&host, 30 + i * 40);
+    REQUIRE(wait.status == KIT_OK);
+    DA_DESTROY(wait.packets);
+
+    REQUIRE(send_packets_to_and_free_(tick, &host));
+    REQUIRE(!slot->is_ping_sent);
+  }
+
+  peer_rtt_t const rtt = peer_slot_rtt(slot);
+
+  REQUIRE_EQ(rtt.samples, 2);
+  REQUIRE_EQ(rtt.min, 30);
+  REQUIRE_EQ(rtt.max, 70);
+  REQUIRE_EQ(rtt.smoothed, 35);
+  REQUIRE_EQ(rtt.variance, 21);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer config packet size") {
+  peer_config_t config = peer_config_default();
+  peer_t        host, client;
+
+  config.packet_size = PEER_MAX_PACKET_SIZE;
+  REQUIRE(peer_init(&host, PEER_HOST, &config, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  ptrdiff_t const      sockets[]      = { 1, 2, 3 };
+  peer_ids_ref_t const host_sockets   = { .size   = 2,
+                                          .values = sockets },
+                       client_sockets = { .size   = 1,
+                                          .values = sockets + 2 };
+
+  REQUIRE(peer_open(&host, host_sockets) == KIT_OK);
+  REQUIRE(peer_open(&client, client_sockets) == KIT_OK);
+
+  if (host.slots.size == 2) {
+    host.slots.values[1].local.address_size    = 1;
+    host.slots.values[1].local.address_data[0] = 2;
+  }
+
+  REQUIRE(peer_connect(&client, host_sockets.values[0]) == KIT_OK);
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(resolve_address_id_(&client, &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  /*  Messages too big for default packets.
+   */
+  uint8_t data[900];
+  memset(data, 5, sizeof data);
+  peer_chunk_ref_t data_ref = { .size = sizeof data, .values = data };
+
+  REQUIRE(peer_queue(&client, data_ref) ==
+          PEER_ERROR_INVALID_MESSAGE_SIZE);
+  REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+
+  /*  Several messages share one packet.
+   */
+  data_ref.size = 300;
+  for (ptrdiff_t i = 0; i < 3; i++)
+    REQUIRE(peer_queue(&host, data_ref) == KIT_OK);
+
+  peer_tick_result_t const tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+  REQUIRE(tick.packets.size == 2);
+
+  for (ptrdiff_t i = 0; i < tick.packets.size; i++)
+    REQUIRE(tick.packets.values[i].size <= PEER_MAX_PACKET_SIZE);
+
+  REQUIRE(send_packets_to_and_free_(tick, &client));
+
+  REQUIRE(client.queue.messages.size == 4);
+  REQUIRE(data_equal_(&client.queue, 0, data, sizeof data));
+  for (ptrdiff_t i = 1; i < client.queue.messages.size; i++)
+    REQUIRE(data_equal_(&client.queue, i, data, 300));
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer compact session") {
+  peer_config_t config = peer_config_default();
+  peer_t        host, client;
+
+  config.compact = 1;
+  REQUIRE(peer_init(&host, PEER_HOST, &config, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, &config,
+                    kit_alloc_default()) == KIT_OK);
+
+  ptrdiff_t const      sockets[]      = { 1, 2, 3 };
+  peer_ids_ref_t const host_sockets   = { .size   = 2,
+                                          .values = sockets },
+                       client_sockets = { .size   = 1,
+                                          .values = sockets + 2 };
+
+  REQUIRE(peer_open(&host, host_sockets) == KIT_OK);
+  REQUIRE(peer_open(&client, client_sockets) == KIT_OK);
+  REQUIRE(host.slots.size == 2);
+  REQUIRE(client.slots.size == 1);
+
+  if (host.slots.size != 2 || client.slots.size != 1)
+    return;
+
+  host.slots.values[1].local.address_size    = 1;
+  host.slots.values[1].local.address_data[0] = 2;
+
+  REQUIRE(peer_connect(&client, host_sockets.values[0]) == KIT_OK);
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(resolve_address_id_(&client, &host));
+
+  /*  Host accepts compact packets, so the client switches to them.
+   *  Host switches after the first compact packet from the client.
+   */
+  REQUIRE(client.slots.values[0].is_compact);
+  REQUIRE(!host.slots.values[1].is_compact);
+
+  uint8_t data[4] = { 1, 2, 3, 4 };
+  peer_chunk_ref_t const data_ref = { .size   = sizeof data,
+                                      .values = data };
+
+  REQUIRE(peer_queue(&client, data_ref) == KIT_OK);
+
+  peer_tick_result_t tick = peer_tick(&client, 0);
+  REQUIRE(tick.status == KIT_OK);
+  REQUIRE(tick.packets.size == 1);
+  for (ptrdiff_t i = 0; i < tick.packets.size; i++)
+    REQUIRE((tick.packets.values[i].data[PEER_N_PACKET_MODE] &
+             PEER_PACKET_MODE_COMPACT) != 0);
+  REQUIRE(send_packets_to_and_free_(tick, &host));
+
+  REQUIRE(host.slots.values[1].is_compact);
+  REQUIRE(host.slots.values[1].queue.messages.size == 1);
+  REQUIRE(data_equal_(&host.slots.values[1].queue, 0, data,
+                      sizeof data));
+
+  tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+  REQUIRE(tick.packets.size == 1);
+  for (ptrdiff_t i = 0; i < tick.packets.size; i++)
+    REQUIRE((tick.packets.values[i].data[PEER_N_PACKET_MODE] &
+             PEER_PACKET_MODE_COMPACT) != 0);
+  REQUIRE(send_packets_to_and_free_(tick, &client));
+
+  REQUIRE(client.queue.messages.size == 1);
+  REQUIRE(data_equal_(&client.queue, 0, data, sizeof data));
+
+  /*  Plain packets are still accepted.
+   */
+  client.slots.values[0].is_compact = 0;
+
+  REQUIRE(peer_queue(&client, data_ref) == KIT_OK);
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  peer_queue_t const *const q = &host.slots.values[1].queue;
+
+  REQUIRE(q->offset + q->messages.size == 2);
+  REQUIRE(data_equal_(q, 1, data, sizeof data));
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer send threads") {
+  /*  Without random trail the output doesn't depend on the number of
+   *  send threads.
+   */
+
+  peer_config_t config = peer_config_default();
+  config.trail_min.scatter_size = 0;
+  config.trail_max.scatter_size = 0;
+
+  peer_t host[2];
+  REQUIRE(peer_init(host, PEER_HOST, &config, kit_alloc_default()) ==
+          KIT_OK);
+  config.send_threads = 4;
+  REQUIRE(peer_init(host + 1, PEER_HOST, &config,
+                    kit_alloc_default()) == KIT_OK);
+
+  ptrdiff_t sockets[11];
+  for (ptrdiff_t i = 0; i < 11; i++) sockets[i] = i + 1;
+  peer_ids_ref_t const host_sockets = { .size   = 11,
+                                        .values = sockets };
+
+  for (ptrdiff_t k = 0; k < 2; k++) {
+    REQUIRE(peer_open(host + k, host_sockets) == KIT_OK);
+    REQUIRE(host[k].slots.size == 11);
+
+    /*  Emulate clients that got different numbers of messages.
+     */
+    for (ptrdiff_t i = 1; i < host[k].slots.size; i++) {
+      peer_slot_t *const slot = host[k].slots.values + i;
+
+      slot->state                 = i == 5 ? PEER_SLOT_EMPTY
+                                           : PEER_SLOT_READY;
+      slot->remote.id             = 100 + i;
+      slot->remote.is_id_resolved = 1;
+      slot->out_index             = i % 3;
+    }
+  }
+
+  uint8_t          data[]   = { 1, 2, 3, 4, 5 };
+  peer_chunk_ref_t data_ref = { .size = 5, .values = data };
+
+  for (ptrdiff_t n = 0; n < 3; n++) {
+    peer_tick_result_t tick[2];
+
+    for (ptrdiff_t k = 0; k < 2; k++) {
+      for (ptrdiff_t i = 0; i < 3; i++)
+        REQUIRE(peer_queue(host + k, data_ref) == KIT_OK);
+
+      tick[k] = peer_tick(host + k, 5);
+      REQUIRE(tick[k].status == KIT_OK);
+    }
+
+    REQUIRE(host[1].shard_count == 4);
+    REQUIRE(tick[0].packets.size >= 9);
+    REQUIRE(tick[0].packets.size == tick[1].packets.size);
+
+    for (ptrdiff_t i = 0; i < tick[0].packets.size &&
+                          i < tick[1].packets.size;
+         i++) {
+      peer_packet_t const *const a = tick[0].packets.values + i;
+      peer_packet_t const *const b = tick[1].packets.values + i;
+
+      REQUIRE(a->source_id == b->source_id);
+      REQUIRE(a->destination_id == b->destination_id);
+      REQUIRE(a->size == b->size);
+      REQUIRE(memcmp(a->data, b->data, a->size) == 0);
+    }
+
+    DA_DESTROY(tick[0].packets);
+    DA_DESTROY(tick[1].packets);
+  }
+
+  /*  Threads stop when the config changes.
+   */
+  host[1].config.send_threads = 1;
+  peer_tick_result_t const tick = peer_tick(host + 1, 0);
+  REQUIRE(tick.status == KIT_OK);
+  REQUIRE(host[1].shard_count == 0);
+  DA_DESTROY(tick.packets);
+
+  REQUIRE(peer_destroy(host) == KIT_OK);
+  REQUIRE(peer_destroy(host + 1) == KIT_OK);
+}
+
+TEST("peer submit queue full") {
+  peer_config_t config   = peer_config_default();
+  config.submit_capacity = 3;
+
+  peer_t host;
+  REQUIRE(peer_init(&host, PEER_HOST, &config, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(host.submit.capacity == 4);
+  REQUIRE(peer_next_timeout(&host) != 0);
+
+  uint8_t data[] = { 0 };
+
+  for (ptrdiff_t i = 0; i < 4; i++) {
+    data[0]                   = (uint8_t) i;
+    peer_chunk_ref_t const ref = { .size = 1, .values = data };
+    REQUIRE(peer_submit(&host, ref) == KIT_OK);
+  }
+
+  /*  Submitted messages are due on the next tick.
+   */
+  REQUIRE(peer_next_timeout(&host) == 0);
+
+  peer_chunk_ref_t const ref = { .size = 1, .values = data };
+  REQUIRE(peer_submit(&host, ref) == PEER_ERROR_NO_FREE_SLOTS);
+
+  peer_tick_result_t const tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+  DA_DESTROY(tick.packets);
+
+  REQUIRE(host.queue.messages.size == 4);
+  for (ptrdiff_t i = 0; i < host.queue.messages.size; i++) {
+    uint8_t const x = (uint8_t) i;
+    REQUIRE(data_equal_(&host.queue, i, &x, 1));
+  }
+
+  REQUIRE(peer_submit(&host, ref) == KIT_OK);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+}
+
+enum { SUBMIT_THREADS = 4, SUBMIT_MESSAGES = 500 };
+
+typedef struct {
+  peer_t *peer;
+  uint8_t id;
+} submit_producer_t;
+
+static int submit_run_(void *const arg) {
+  submit_producer_t const *const p = (submit_producer_t const *) arg;
+
+  for (ptrdiff_t i = 0; i < SUBMIT_MESSAGES;) {
+    uint8_t const data[] = { p->id, (uint8_t) (i & 0xff),
+                             (uint8_t) (i >> 8) };
+    peer_chunk_ref_t const ref = { .size = 3, .values = data };
+
+    kit_status_t const s = peer_submit(p->peer, ref);
+
+    if (s == KIT_OK)
+      i++;
+    else if (s == PEER_ERROR_NO_FREE_SLOTS)
+      thrd_yield();
+    else
+      return 1;
+  }
+
+  return 0;
+}
+
+TEST("peer submit from threads") {
+  peer_t host;
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+
+  host.config.history = PEER_UNDEFINED;
+
+  submit_producer_t producers[SUBMIT_THREADS];
+  thrd_t            threads[SUBMIT_THREADS];
+
+  for (ptrdiff_t i = 0; i < SUBMIT_THREADS; i++) {
+    producers[i].peer = &host;
+    producers[i].id   = (uint8_t) i;
+    REQUIRE(thrd_create(threads + i, submit_run_, producers + i) ==
+            thrd_success);
+  }
+
+  /*  Tick while producers are running.
+   */
+  ptrdiff_t const total = SUBMIT_THREADS * SUBMIT_MESSAGES;
+
+  for (ptrdiff_t n = 0;
+       n < 100000 && host.queue.messages.size < total; n++) {
+    peer_tick_result_t const tick = peer_tick(&host, 0);
+    REQUIRE(tick.status == KIT_OK);
+    DA_DESTROY(tick.packets);
+    thrd_yield();
+  }
+
+  for (ptrdiff_t i = 0; i < SUBMIT_THREADS; i++) {
+    int result = -1;
+    thrd_join(threads[i], &result);
+    REQUIRE(result == 0);
+  }
+
+  REQUIRE(host.queue.messages.size == total);
+
+  /*  Messages of each producer keep their order.
+   */
+  ptrdiff_t next[SUBMIT_THREADS] = { 0 };
+
+  for (ptrdiff_t i = 0; i < host.queue.messages.size; i++) {
+    peer_chunk_ref_t const data = peer_queue_data(&host.queue, i);
+
+    REQUIRE(data.size == 3);
+    if (data.size != 3 || data.values[0] >= SUBMIT_THREADS)
+      break;
+
+    ptrdiff_t const id    = data.values[0];
+    ptrdiff_t const index = data.values[1] |
+                            (((ptrdiff_t) data.values[2]) << 8);
+
+    REQUIRE(index == next[id]);
+    next[id] = index + 1;
+  }
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+}
+
+TEST("peer read cursor") {
+  peer_t host;
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+
+  uint8_t data[] = { 1, 2, 3 };
+
+  for (ptrdiff_t i = 0; i < 3; i++) {
+    peer_chunk_ref_t const ref = { .size = 1 + i, .values = data };
+    REQUIRE(peer_queue(&host, ref) == KIT_OK);
+  }
+
+  /*  Messages are not readable before the tick sets their time.
+   */
+  ptrdiff_t            cursor = 0;
+  peer_message_batch_t batch  = peer_read(&host, &cursor,
+                                          PEER_UNDEFINED);
+  REQUIRE(batch.size == 0);
+  REQUIRE(cursor == 0);
+
+  peer_tick_result_t const tick = peer_tick(&host, 7);
+  REQUIRE(tick.status == KIT_OK);
+  DA_DESTROY(tick.packets);
+
+  batch = peer_read(&host, &cursor, 2);
+  REQUIRE(batch.index == 0);
+  REQUIRE(batch.size == 2);
+  REQUIRE(cursor == 2);
+  REQUIRE(batch.values == peer_queue_message(&host.queue, 0));
+  REQUIRE(batch.size == 2 && batch.values[1].time == 7);
+
+  batch = peer_read(&host, &cursor, PEER_UNDEFINED);
+  REQUIRE(batch.index == 2);
+  REQUIRE(batch.size == 1);
+  REQUIRE(cursor == 3);
+  REQUIRE(data_equal_(&host.queue, 2, data, 3));
+
+  batch = peer_read(&host, &cursor, PEER_UNDEFINED);
+  REQUIRE(batch.size == 0);
+  REQUIRE(cursor == 3);
+
+  /*  Released messages are skipped.
+   */
+  REQUIRE(peer_queue_trim(&host.queue, 2) == KIT_OK);
+  cursor = 0;
+  batch  = peer_read(&host, &cursor, PEER_UNDEFINED);
+  REQUIRE(batch.index == 2);
+  REQUIRE(batch.size == 1);
+  REQUIRE(cursor == 3);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+}
+
+TEST("peer read stops at missing message") {
+  peer_t client;
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  /*  Emulate the mutual queue with the second message lost. The
+   *  ring wraps around after the first message.
+   */
+  peer_messages_t *const m = &client.queue.messages;
+
+  m->values = (peer_message_t *) m->alloc.allocate(
+      m->alloc.state, 4 * sizeof *m->values);
+  REQUIRE(m->values != NULL);
+  if (m->values == NULL)
+    return;
+  memset(m->values, 0, 4 * sizeof *m->values);
+  m->capacity = 4;
+  m->head     = 3;
+  m->size     = 3;
+
+  m->values[3].is_ready = 1;
+  m->values[1].is_ready = 1;
+
+  ptrdiff_t                  cursor = 0;
+  peer_message_batch_t const a = peer_read(&client, &cursor,
+                                           PEER_UNDEFINED);
+  REQUIRE(a.index == 0);
+  REQUIRE(a.size == 1);
+  REQUIRE(cursor == 1);
+  REQUIRE(a.values == m->values + 3);
+
+  m->values[0].is_ready = 1;
+
+  peer_message_batch_t const b = peer_read(&client, &cursor,
+                                           PEER_UNDEFINED);
+  REQUIRE(b.index == 1);
+  REQUIRE(b.size == 2);
+  REQUIRE(cursor == 3);
+  REQUIRE(b.values == m->values);
+
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+enum { HANDOFF_MESSAGES = 2000 };
+
+static int handoff_run_(void *const arg) {
+  peer_handoff_t *const handoff = (peer_handoff_t *) arg;
+
+  for (ptrdiff_t i = 0; i < HANDOFF_MESSAGES;) {
+    peer_handoff_cell_t const *const cell = peer_handoff_front(
+        handoff);
+
+    if (cell == NULL) {
+      thrd_yield();
+      continue;
+    }
+
+    if (cell->index != i || cell->size != 2 ||
+        cell->data[0] != (uint8_t) (i & 0xff) ||
+        cell->data[1] != (uint8_t) (i >> 8))
+      return 1;
+
+    peer_handoff_pop(handoff);
+    i++;
+  }
+
+  return 0;
+}
+
+TEST("peer handoff to consumer thread") {
+  peer_t host;
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+
+  /*  Producer may fall behind when the handoff is full, keep the
+   *  messages until it copies them.
+   */
+  host.config.history = PEER_UNDEFINED;
+
+  peer_handoff_t handoff;
+  REQUIRE(peer_handoff_init(&handoff, 7, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(handoff.capacity == 8);
+
+  thrd_t consumer;
+  REQUIRE(thrd_create(&consumer, handoff_run_, &handoff) ==
+          thrd_success);
+
+  ptrdiff_t cursor = 0;
+  ptrdiff_t queued = 0;
+
+  for (ptrdiff_t n = 0; n < 1000000 && cursor < HANDOFF_MESSAGES;
+       n++) {
+    for (ptrdiff_t k = 0; k < 5 && queued < HANDOFF_MESSAGES;
+         k++, queued++) {
+      uint8_t const data[] = { (uint8_t) (queued & 0xff),
+                               (uint8_t) (queued >> 8) };
+      peer_chunk_ref_t const ref = { .size = 2, .values = data };
+      REQUIRE(peer_queue(&host, ref) == KIT_OK);
+    }
+
+    peer_tick_result_t const tick = peer_tick(&host, 1);
+    REQUIRE(tick.status == KIT_OK);
+    DA_DESTROY(tick.packets);
+
+    peer_handoff_write(&handoff, &host, &cursor);
+    thrd_yield();
+  }
+
+  int result = -1;
+  thrd_join(consumer, &result);
+  REQUIRE(result == 0);
+  REQUIRE(cursor == HANDOFF_MESSAGES);
+
+  peer_handoff_destroy(&handoff);
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+}
+
+static int snapshot_join_(peer_t *const host, peer_t *const client) {
+  ptrdiff_t const      sockets[]      = { 1, 2, 3 };
+  peer_ids_ref_t const host_sockets   = { .size   = 2,
+                                          .values = sockets },
+                       client_sockets = { .size   = 1,
+                                          .values = sockets + 2 };
+
+  if (peer_open(host, host_sockets) != KIT_OK ||
+      host->slots.size != 2)
+    return 0;
+
+  host->slots.values[1].local.address_size    = 1;
+  host->slots.values[1].local.address_data[0] = 2;
+
+  if (peer_open(client, client_sockets) != KIT_OK ||
+      peer_connect(client, 1) != KIT_OK)
+    return 0;
+
+  /*  Session request and response.
+   */
+  return send_packets_to_and_free_(peer_tick(client, 0), host) &&
+         send_packets_to_and_free_(peer_tick(host, 0), client) &&
+         resolve_address_id_(client, host) &&
+         send_packets_to_and_free_(peer_tick(client, 0), host);
+}
+
+TEST("peer snapshot late join") {
+  peer_t host, client;
+
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  /*  Host history before the client joins.
+   */
+  uint8_t data[3000];
+  for (ptrdiff_t i = 0; i < (ptrdiff_t) sizeof data; i++)
+    data[i] = (uint8_t) (i * 7);
+
+  for (ptrdiff_t i = 0; i < 10; i++) {
+    peer_chunk_ref_t const ref = { .size = 1, .values = data + i };
+    REQUIRE(peer_queue(&host, ref) == KIT_OK);
+  }
+
+  peer_tick_result_t const tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+  DA_DESTROY(tick.packets);
+
+  /*  The snapshot has the state after 8 messages. The history
+   *  before it is not needed.
+   */
+  peer_chunk_ref_t const state = { .size   = sizeof data,
+                                   .values = data };
+
+  REQUIRE(peer_snapshot(&client, 8, state) ==
+          PEER_ERROR_INVALID_MODE);
+  REQUIRE(peer_snapshot(&host, 11, state) ==
+          PEER_ERROR_INVALID_MESSAGE_INDEX);
+  REQUIRE(peer_snapshot(&host, 8, state) == KIT_OK);
+  REQUIRE(peer_snapshot(&host, 8, state) == KIT_OK);
+  REQUIRE(peer_queue_trim(&host.queue, 8) == KIT_OK);
+
+  peer_chunk_ref_t const other = { .size   = sizeof data - 1,
+                                   .values = data };
+  REQUIRE(peer_snapshot(&host, 8, other) ==
+          PEER_ERROR_INVALID_MESSAGE_INDEX);
+  REQUIRE(peer_snapshot(&host, 7, state) ==
+          PEER_ERROR_INVALID_MESSAGE_INDEX);
+
+  REQUIRE(snapshot_join_(&host, &client));
+  REQUIRE(peer_snapshot_read(&client).index == PEER_UNDEFINED);
+
+  /*  Host sends the snapshot fragments only.
+   */
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  peer_snapshot_ref_t const snapshot = peer_snapshot_read(&client);
+  REQUIRE(snapshot.index == 8);
+  REQUIRE(kit_ar_equal_bytes(1, snapshot.data.size,
+                             snapshot.data.values, 1, sizeof data,
+                             data));
+  REQUIRE(client.queue.offset == 8);
+  REQUIRE(client.queue.messages.size == 0);
+
+  /*  Messages after the snapshot are sent when the client
+   *  acknowledges it.
+   */
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 0), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+  REQUIRE(host.slots.size == 2 &&
+          host.slots.values[1].snapshot_index == PEER_UNDEFINED);
+
+  REQUIRE(client.queue.offset == 8);
+  REQUIRE(client.queue.messages.size == 2);
+  REQUIRE(client.queue.messages.size == 2 &&
+          data_equal_(&client.queue, 8, data + 8, 1));
+  REQUIRE(client.queue.messages.size == 2 &&
+          data_equal_(&client.queue, 9, data + 9, 1));
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer snapshot lost fragment") {
+  peer_t host, client;
+
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  uint8_t data[3000];
+  for (ptrdiff_t i = 0; i < (ptrdiff_t) sizeof data; i++)
+    data[i] = (uint8_t) (i * 5);
+
+  peer_chunk_ref_t const state = { .size   = sizeof data,
+                                   .values = data };
+  REQUIRE(peer_snapshot(&host, 0, state) == KIT_OK);
+
+  REQUIRE(snapshot_join_(&host, &client));
+
+  /*  Lose the first fragment.
+   */
+  peer_tick_result_t tick = peer_tick(&host, 0);
+  REQUIRE(tick.status == KIT_OK);
+  REQUIRE(tick.packets.size > 1);
+
+  if (tick.packets.size > 1) {
+    peer_packets_ref_t const ref = { .size   = tick.packets.size - 1,
+                                     .values = tick.packets.values +
+                                               1 };
+    REQUIRE(peer_input(&client, ref) == KIT_OK);
+  }
+
+  DA_DESTROY(tick.packets);
+
+  REQUIRE(peer_snapshot_read(&client).index == PEER_UNDEFINED);
+
+  /*  Not sent again before the ping interval.
+   */
+  tick = peer_tick(&host, 1);
+  REQUIRE(tick.status == KIT_OK);
+  REQUIRE(tick.packets.size == 0);
+  DA_DESTROY(tick.packets);
+
+  peer_time_t const timeout = peer_next_timeout(&host);
+  REQUIRE(timeout > 0 && timeout <= host.config.timeout_ping - 1);
+
+  REQUIRE(send_packets_to_and_free_(
+      peer_tick(&host, host.config.timeout_ping), &client));
+
+  peer_snapshot_ref_t const snapshot = peer_snapshot_read(&client);
+  REQUIRE(snapshot.index == 0);
+  REQUIRE(kit_ar_equal_bytes(1, snapshot.data.size,
+                             snapshot.data.values, 1, sizeof data,
+                             data));
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer pacing spreads backlog") {
+  peer_config_t config = peer_config_default();
+  peer_t        host, client;
+
+  config.pace_rate  = 10;
+  config.pace_burst = 1000;
+  REQUIRE(peer_init(&host, PEER_HOST, &config, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  client.config.history = PEER_UNDEFINED;
+
+  uint8_t data[100];
+  memset(data, 42, sizeof data);
+
+  for (ptrdiff_t i = 0; i < 100; i++) {
+    peer_chunk_ref_t const ref = { .size   = sizeof data,
+                                   .values = data };
+    REQUIRE(peer_queue(&host, ref) == KIT_OK);
+  }
+
+  REQUIRE(snapshot_join_(&host, &client));
+  REQUIRE(host.slots.size == 2);
+  if (host.slots.size != 2)
+    return;
+
+  peer_slot_t const *const slot = host.slots.values + 1;
+
+  /*  The first tick sends only the burst.
+   */
+  peer_tick_result_t tick = peer_tick(&host, 0);
+  REQUIRE(send_packets_to_(tick, &client));
+
+  ptrdiff_t bytes = 0;
+  for (ptrdiff_t i = 0; i < tick.packets.size; i++)
+    bytes += tick.packets.values[i].size;
+  DA_DESTROY(tick.packets);
+
+  peer_backlog_t const backlog = peer_slot_backlog(&host, slot);
+  REQUIRE(backlog.messages > 0 && backlog.messages < 100);
+  REQUIRE(backlog.pace_tokens <= 0);
+  REQUIRE(bytes >= 1000 && bytes <= 1000 + config.packet_size);
+  REQUIRE(peer_next_timeout(&host) > 0);
+
+  /*  The rest follows at the pace rate.
+   */
+  ptrdiff_t ticks = 1;
+
+  for (; ticks < 1000 && client.queue.messages.size < 100; ticks++) {
+    REQUIRE(send_packets_to_and_free_(peer_tick(&client, 10),
+                                      &host));
+    REQUIRE(send_packets_to_and_free_(peer_tick(&host, 10),
+                                      &client));
+  }
+
+  REQUIRE(ticks > 10);
+  REQUIRE(client.queue.messages.size == 100);
+  REQUIRE(peer_slot_backlog(&host, slot).messages == 0);
+
+  ptrdiff_t cursor = 0;
+  REQUIRE(peer_read(&client, &cursor, PEER_UNDEFINED).size == 100);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer pacing spreads snapshot") {
+  peer_config_t config = peer_config_default();
+  peer_t        host, client;
+
+  config.pace_rate  = 10;
+  config.pace_burst = 1000;
+  REQUIRE(peer_init(&host, PEER_HOST, &config, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  uint8_t data[5000];
+  for (ptrdiff_t i = 0; i < (ptrdiff_t) sizeof data; i++)
+    data[i] = (uint8_t) (i * 3);
+
+  peer_chunk_ref_t const state = { .size   = sizeof data,
+                                   .values = data };
+  REQUIRE(peer_snapshot(&host, 0, state) == KIT_OK);
+
+  REQUIRE(snapshot_join_(&host, &client));
+  REQUIRE(host.slots.size == 2);
+  if (host.slots.size != 2)
+    return;
+
+  peer_slot_t const *const slot = host.slots.values + 1;
+
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  ptrdiff_t const left = peer_slot_backlog(&host, slot)
+                             .snapshot_bytes;
+  REQUIRE(left > 0 && left < (ptrdiff_t) sizeof data);
+  REQUIRE(peer_snapshot_read(&client).index == PEER_UNDEFINED);
+
+  ptrdiff_t ticks = 1;
+
+  for (; ticks < 1000 &&
+         peer_snapshot_read(&client).index == PEER_UNDEFINED;
+       ticks++)
+    REQUIRE(send_packets_to_and_free_(peer_tick(&host, 10),
+                                      &client));
+
+  REQUIRE(ticks > 2);
+
+  peer_snapshot_ref_t const snapshot = peer_snapshot_read(&client);
+  REQUIRE(snapshot.index == 0);
+  REQUIRE(kit_ar_equal_bytes(1, snapshot.data.size,
+                             snapshot.data.values, 1, sizeof data,
+                             data));
+
+  /*  Transfer ends with the acknowledgement.
+   */
+  REQUIRE(send_packets_to_and_free_(peer_tick(&client, 10), &host));
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 10), &client));
+  REQUIRE(peer_slot_backlog(&host, slot).snapshot_bytes == 0);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer snapshot retains history after it") {
+  peer_config_t config = peer_config_default();
+  peer_t        host, client;
+
+  config.history = 2;
+  REQUIRE(peer_init(&host, PEER_HOST, &config, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  uint8_t data[10];
+  for (ptrdiff_t i = 0; i < (ptrdiff_t) sizeof data; i++) {
+    data[i] = (uint8_t) (i + 1);
+
+    peer_chunk_ref_t const ref = { .size = 1, .values = data + i };
+    REQUIRE(peer_queue(&host, ref) == KIT_OK);
+  }
+
+  peer_chunk_ref_t const state = { .size = 5, .values = data };
+  REQUIRE(peer_snapshot(&host, 5, state) == KIT_OK);
+
+  /*  Messages are released on the tick after they became readable.
+   *  History size alone would release messages before 8.
+   */
+  for (ptrdiff_t i = 0; i < 2; i++) {
+    peer_tick_result_t const tick = peer_tick(&host, 0);
+    REQUIRE(tick.status == KIT_OK);
+    DA_DESTROY(tick.packets);
+  }
+  REQUIRE(host.queue.offset == 5);
+
+  /*  Client keeps all messages for the check below.
+   */
+  client.config.history = PEER_UNDEFINED;
+
+  REQUIRE(snapshot_join_(&host, &client));
+
+  for (ptrdiff_t i = 0; i < 5; i++) {
+    REQUIRE(send_packets_to_and_free_(peer_tick(&host, 1), &client));
+    REQUIRE(send_packets_to_and_free_(peer_tick(&client, 1), &host));
+  }
+
+  REQUIRE(peer_snapshot_read(&client).index == 5);
+
+  ptrdiff_t                  cursor = 0;
+  peer_message_batch_t const batch  = peer_read(&client, &cursor,
+                                                PEER_UNDEFINED);
+  REQUIRE(batch.index == 5);
+  REQUIRE(batch.size == 5);
+  REQUIRE(batch.size == 5 && data_equal_(&client.queue, 9, data + 9,
+                                         1));
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer join after history release") {
+  peer_config_t config = peer_config_default();
+  peer_t        host, client;
+
+  config.history = 2;
+  REQUIRE(peer_init(&host, PEER_HOST, &config, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  uint8_t const data[] = { 1 };
+  for (ptrdiff_t i = 0; i < 10; i++) {
+    peer_chunk_ref_t const ref = { .size = 1, .values = data };
+    REQUIRE(peer_queue(&host, ref) == KIT_OK);
+  }
+
+  peer_tick_result_t tick;
+
+  for (ptrdiff_t i = 0; i < 2; i++) {
+    tick = peer_tick(&host, 0);
+    REQUIRE(tick.status == KIT_OK);
+    DA_DESTROY(tick.packets);
+  }
+  REQUIRE(host.queue.offset == 8);
+
+  ptrdiff_t const      sockets[]      = { 1, 2, 3 };
+  peer_ids_ref_t const host_sockets   = { .size   = 2,
+                                          .values = sockets },
+                       client_sockets = { .size   = 1,
+                                          .values = sockets + 2 };
+
+  REQUIRE(peer_open(&host, host_sockets) == KIT_OK);
+  REQUIRE(peer_open(&client, client_sockets) == KIT_OK);
+  REQUIRE(peer_connect(&client, 1) == KIT_OK);
+
+  if (host.slots.size == 2) {
+    host.slots.values[1].local.address_size    = 1;
+    host.slots.values[1].local.address_data[0] = 2;
+  }
+
+  /*  Client would never read past the released messages.
+   */
+  tick = peer_tick(&client, 0);
+  REQUIRE(tick.status == KIT_OK);
+
+  peer_packets_ref_t const ref = { .size   = tick.packets.size,
+                                   .values = tick.packets.values };
+  REQUIRE(peer_input(&host, ref) == PEER_ERROR_INVALID_OUT_INDEX);
+  DA_DESTROY(tick.packets);
+
+  REQUIRE(host.slots.size == 2 &&
+          host.slots.values[1].remote.id == PEER_UNDEFINED);
+
+  /*  Snapshot covers them.
+   */
+  peer_chunk_ref_t const state = { .size = 1, .values = data };
+  REQUIRE(peer_snapshot(&host, 8, state) == KIT_OK);
+  REQUIRE(send_packets_to_and_free_(
+      peer_tick(&client, client.config.timeout_heartbeat), &host));
+  REQUIRE(host.slots.size == 2 &&
+          host.slots.values[1].remote.id == 3);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer mutual queue is released by default") {
+  peer_t host, client;
+
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  REQUIRE(snapshot_join_(&host, &client));
+
+  /*  Both sides read the mutual queue after each tick.
+   */
+  ptrdiff_t host_cursor = 0, client_cursor = 0;
+  ptrdiff_t host_read = 0, client_read = 0;
+
+  for (ptrdiff_t i = 0; i < 1000; i++) {
+    uint8_t const          data[] = { (uint8_t) i };
+    peer_chunk_ref_t const ref    = { .size = 1, .values = data };
+    REQUIRE(peer_queue(&host, ref) == KIT_OK);
+
+    REQUIRE(send_packets_to_and_free_(peer_tick(&host, 1), &client));
+    host_read += peer_read(&host, &host_cursor, PEER_UNDEFINED).size;
+    REQUIRE(send_packets_to_and_free_(peer_tick(&client, 1), &host));
+    client_read += peer_read(&client, &client_cursor, PEER_UNDEFINED)
+                       .size;
+  }
+
+  REQUIRE(host_read == 1000);
+  REQUIRE(client_read >= 990);
+
+  /*  Only the messages of the last ticks are retained.
+   */
+  REQUIRE(host.queue.offset > 900);
+  REQUIRE(host.queue.messages.size < 100);
+  REQUIRE(client.queue.offset > 900);
+  REQUIRE(client.queue.messages.size < 100);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
+
+TEST("peer queue log allocates lazily") {
+  peer_t host;
+  REQUIRE(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()) ==
+          KIT_OK);
+
+  uint8_t data[100];
+  memset(data, 7, sizeof data);
+
+  /*  Empty payloads are not stored.
+   */
+  peer_chunk_ref_t const empty = { .size = 0, .values = data };
+  REQUIRE(peer_queue(&host, empty) == KIT_OK);
+  REQUIRE(host.queue.log.blocks.size == 0);
+  REQUIRE(peer_queue_data(&host.queue, 0).size == 0);
+
+  /*  First block is sized to the payload, then grows.
+   */
+
+  peer_chunk_ref_t const small = { .size = 10, .values = data };
+  REQUIRE(peer_queue(&host, small) == KIT_OK);
+  REQUIRE(host.queue.log.blocks.size == 1);
+  REQUIRE(host.queue.log.capacity == 10);
+
+  peer_chunk_ref_t const large = { .size   = sizeof data,
+                                   .values = data };
+  REQUIRE(peer_queue(&host, large) == KIT_OK);
+  REQUIRE(host.queue.log.capacity == 110);
+  REQUIRE(data_equal_(&host.queue, 1, data, 10));
+  REQUIRE(data_equal_(&host.queue, 2, data, sizeof data));
+
+  REQUIRE(peer_queue_trim(&host.queue, 3) == KIT_OK);
+  REQUIRE(host.queue.log.blocks.size == 1);
+  REQUIRE(host.queue.log.blocks.size == 1 &&
+          host.queue.log.blocks.values[0].live == 0);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+}
+
+TEST("peer pacing debt is bounded") {
+  REQUIRE(peer_config_default().pace_rate == PEER_UNDEFINED);
+
+  peer_config_t config = peer_config_default();
+  peer_t        host, client;
+
+  config.pace_rate  = 10;
+  config.pace_burst = 50;
+  REQUIRE(peer_init(&host, PEER_HOST, &config, kit_alloc_default()) ==
+          KIT_OK);
+  REQUIRE(peer_init(&client, PEER_CLIENT, NULL,
+                    kit_alloc_default()) == KIT_OK);
+
+  uint8_t data[300];
+  memset(data, 1, sizeof data);
+
+  for (ptrdiff_t i = 0; i < 3; i++) {
+    peer_chunk_ref_t const ref = { .size   = sizeof data,
+                                   .values = data };
+    REQUIRE(peer_queue(&host, ref) == KIT_OK);
+  }
+
+  REQUIRE(snapshot_join_(&host, &client));
+  REQUIRE(host.slots.size == 2);
+  if (host.slots.size != 2)
+    return;
+
+  /*  One message goes over the bucket, the debt is clamped.
+   */
+  REQUIRE(send_packets_to_and_free_(peer_tick(&host, 0), &client));
+
+  peer_backlog_t const backlog = peer_slot_backlog(
+      &host, host.slots.values + 1);
+  REQUIRE(backlog.messages == 2);
+  REQUIRE(backlog.pace_tokens == -config.pace_burst);
+  REQUIRE(peer_next_timeout(&host) ==
+          config.pace_burst / config.pace_rate + 1);
+
+  REQUIRE(peer_destroy(&host) == KIT_OK);
+  REQUIRE(peer_destroy(&client) == KIT_OK);
+}
@@ -1,4 +1,6 @@
+#include "../../peer/serial.h"
 #include "../../peer/socket_pool.h"
+#include <kit/threads.h>
 
 #define KIT_TEST_FILE socket_pool
 #include <kit_test/test.h>
@@ -11,10 +13,13 @@ TEST("socket pool UDP IPv4") {
   REQUIRE_EQ(peer_pool_init(&pool, kit_alloc_default()), KIT_OK);
 
   peer_t host, client;
-  REQUIRE_EQ(peer_init(&host, PEER_HOST, kit_alloc_default()),
-             KIT_OK);
-  REQUIRE_EQ(peer_init(&client, PEER_CLIENT, kit_alloc_default()),
+  REQUIRE_EQ(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()),
              KIT_OK);
+  REQUIRE_EQ(
+      peer_init(&client, PEER_CLIENT, NULL, kit_alloc_default()),
+      KIT_OK);
+
+  client.config.history = PEER_UNDEFINED;
 
   REQUIRE_EQ(
       peer_pool_open(&pool, &host, PEER_UDP_IPv4, PEER_ANY_PORT, 2),
@@ -48,13 +53,13 @@ TEST("socket pool UDP IPv4") {
   REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
   REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
 
-  REQUIRE_EQ(client.queue.size, 3);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[0].time == 12);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[1].time == 12);
-  REQUIRE(client.queue.size == 3 &&
-          client.queue.values[2].time == 12);
+  REQUIRE_EQ(client.queue.messages.size, 3);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 0)->time == 12);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 1)->time == 12);
+  REQUIRE(client.queue.messages.size == 3 &&
+          peer_queue_message(&client.queue, 2)->time == 12);
 
   REQUIRE_EQ(client.time, 12);
 
@@ -65,3 +70,504 @@ TEST("socket pool UDP IPv4") {
   peer_sockets_cleanup();
 }
 #endif
+
+#ifndef PEER_DISABLE_SYSTEM_SOCKETS
+TEST("socket pool drains all datagrams in one tick") {
+  peer_sockets_init();
+
+  peer_socket_pool_t pool;
+  REQUIRE_EQ(peer_pool_init(&pool, kit_alloc_default()), KIT_OK);
+
+  pool.batch_size = 4;
+
+  peer_t host, client;
+  REQUIRE_EQ(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()),
+             KIT_OK);
+  REQUIRE_EQ(
+      peer_init(&client, PEER_CLIENT, NULL, kit_alloc_default()),
+      KIT_OK);
+
+  REQUIRE_EQ(
+      peer_pool_open(&pool, &host, PEER_UDP_IPv4, PEER_ANY_PORT, 2),
+      KIT_OK);
+
+  REQUIRE(pool.nodes.size == 2 &&
+          peer_pool_connect(
+              &pool, &client, PEER_UDP_IPv4, SZ("127.0.0.1"),
+              pool.nodes.values[0].local_port) == KIT_OK);
+
+  REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+  REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+  REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+
+  /*  Every message takes a whole packet.
+   */
+  uint8_t          data[300];
+  peer_chunk_ref_t data_ref = { .size = sizeof data, .values = data };
+  memset(data, 7, sizeof data);
+
+  for (ptrdiff_t i = 0; i < 10; i++)
+    REQUIRE_EQ(peer_queue(&host, data_ref), KIT_OK);
+
+  ptrdiff_t const sent = pool.stats.send_datagrams;
+
+  REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  REQUIRE(pool.stats.send_datagrams - sent >= 10);
+  REQUIRE(pool.stats.send_batch_max == 4);
+
+  ptrdiff_t const received = pool.stats.receive_datagrams;
+
+  REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+  REQUIRE(pool.stats.receive_datagrams - received >= 10);
+  REQUIRE(pool.stats.receive_batch_max == 4);
+  REQUIRE_EQ(client.queue.messages.size, 10);
+
+  REQUIRE_EQ(peer_destroy(&host), KIT_OK);
+  REQUIRE_EQ(peer_destroy(&client), KIT_OK);
+  REQUIRE_EQ(peer_pool_destroy(&pool), KIT_OK);
+
+  peer_sockets_cleanup();
+}
+#endif
+
+#ifndef PEER_DISABLE_SYSTEM_SOCKETS
+TEST("socket pool wait") {
+  peer_sockets_init();
+
+  peer_socket_pool_t pool;
+  REQUIRE_EQ(peer_pool_init(&pool, kit_alloc_default()), KIT_OK);
+
+  peer_t host, client;
+  REQUIRE_EQ(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()),
+             KIT_OK);
+  REQUIRE_EQ(
+      peer_init(&client, PEER_CLIENT, NULL, kit_alloc_default()),
+      KIT_OK);
+
+  REQUIRE_EQ(
+      peer_pool_open(&pool, &host, PEER_UDP_IPv4, PEER_ANY_PORT, 2),
+      KIT_OK);
+
+  /*  Nothing to receive, wait for the timeout.
+   */
+  REQUIRE_EQ(peer_pool_wait(&pool, &host, 1), KIT_OK);
+
+  REQUIRE(pool.nodes.size == 2 &&
+          peer_pool_connect(
+              &pool, &client, PEER_UDP_IPv4, SZ("127.0.0.1"),
+              pool.nodes.values[0].local_port) == KIT_OK);
+
+  /*  Client is due to send the session request.
+   */
+  REQUIRE_EQ(peer_pool_wait(&pool, &client, PEER_UNDEFINED), KIT_OK);
+  REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+
+  /*  Host will wake up when the request arrives.
+   */
+  REQUIRE_EQ(peer_pool_wait(&pool, &host, 5000), KIT_OK);
+  REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  REQUIRE(host.slots.size == 2 &&
+          host.slots.values[1].state == PEER_SLOT_READY);
+
+  REQUIRE_EQ(peer_destroy(&host), KIT_OK);
+  REQUIRE_EQ(peer_destroy(&client), KIT_OK);
+  REQUIRE_EQ(peer_pool_destroy(&pool), KIT_OK);
+
+  peer_sockets_cleanup();
+}
+#endif
+
+#ifndef PEER_DISABLE_SYSTEM_SOCKETS
+static int wait_submit_run_(void *const arg) {
+  uint8_t const          data[] = { 42 };
+  peer_chunk_ref_t const ref    = { .size = 1, .values = data };
+
+  return peer_submit((peer_t *) arg, ref) == KIT_OK ? 0 : 1;
+}
+
+TEST("socket pool wait wakes up on submit") {
+  peer_sockets_init();
+
+  peer_socket_pool_t pool;
+  REQUIRE_EQ(peer_pool_init(&pool, kit_alloc_default()), KIT_OK);
+
+  peer_t host;
+  REQUIRE_EQ(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()),
+             KIT_OK);
+  REQUIRE_EQ(
+      peer_pool_open(&pool, &host, PEER_UDP_IPv4, PEER_ANY_PORT, 1),
+      KIT_OK);
+
+  /*  Host has nothing to do, so only the submit ends the wait. The
+   *  message may be submitted before or during the wait.
+   */
+  thrd_t producer;
+  REQUIRE(thrd_create(&producer, wait_submit_run_, &host) ==
+          thrd_success);
+
+  REQUIRE_EQ(peer_pool_wait(&pool, &host, PEER_UNDEFINED), KIT_OK);
+
+  int result = -1;
+  thrd_join(producer, &result);
+  REQUIRE(result == 0);
+
+  REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  REQUIRE(host.queue.messages.size == 1);
+
+  REQUIRE_EQ(peer_destroy(&host), KIT_OK);
+  REQUIRE_EQ(peer_pool_destroy(&pool), KIT_OK);
+
+  peer_sockets_cleanup();
+}
+#endif
+
+#ifndef PEER_DISABLE_SYSTEM_SOCKETS
+TEST("socket pool connect max length address") {
+  peer_sockets_init();
+
+  peer_socket_pool_t pool;
+  REQUIRE_EQ(peer_pool_init(&pool, kit_alloc_default()), KIT_OK);
+
+  peer_t client;
+  REQUIRE_EQ(
+      peer_init(&client, PEER_CLIENT, NULL, kit_alloc_default()),
+      KIT_OK);
+
+  /*  Longest address connect accepts is parsed, not refused by size.
+   */
+  char address[PEER_ADDRESS_SIZE - 2];
+  memset(address, '1', sizeof address);
+  kit_str_t const text = { .size   = sizeof address,
+                           .values = address };
+
+  REQUIRE_EQ(peer_pool_connect(&pool, &client, PEER_UDP_IPv4, text,
+                               1000),
+             PEER_ERROR_INVALID_ADDRESS);
+  REQUIRE(pool.nodes.size == 0);
+
+  REQUIRE_EQ(peer_destroy(&client), KIT_OK);
+  REQUIRE_EQ(peer_pool_destroy(&pool), KIT_OK);
+
+  peer_sockets_cleanup();
+}
+#endif
+
+#ifndef PEER_DISABLE_SYSTEM_SOCKETS
+TEST("socket pool connected sockets") {
+  peer_sockets_init();
+
+  peer_socket_pool_t pool;
+  REQUIRE_EQ(peer_pool_init(&pool, kit_alloc_default()), KIT_OK);
+
+  pool.connect_sockets = 1;
+
+  peer_t host, client;
+  REQUIRE_EQ(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()),
+             KIT_OK);
+  REQUIRE_EQ(
+      peer_init(&client, PEER_CLIENT, NULL, kit_alloc_default()),
+      KIT_OK);
+
+  REQUIRE_EQ(
+      peer_pool_open(&pool, &host, PEER_UDP_IPv4, PEER_ANY_PORT, 2),
+      KIT_OK);
+
+  REQUIRE(pool.nodes.size == 2 &&
+          peer_pool_connect(
+              &pool, &client, PEER_UDP_IPv4, SZ("127.0.0.1"),
+              pool.nodes.values[0].local_port) == KIT_OK);
+
+  for (ptrdiff_t i = 0; i < 4; i++) {
+    REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+    REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  }
+
+  uint8_t          data[]   = { 1, 2, 3 };
+  peer_chunk_ref_t data_ref = { .size = 3, .values = data };
+  REQUIRE_EQ(peer_queue(&host, data_ref), KIT_OK);
+
+  REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+
+  REQUIRE_EQ(client.queue.messages.size, 1);
+
+  /*  Host's first socket accepts new clients.
+   */
+  REQUIRE(pool.nodes.values[0].connected_id == PEER_UNDEFINED);
+  REQUIRE(pool.nodes.values[1].connected_id != PEER_UNDEFINED);
+
+  REQUIRE(client.slots.size == 1 &&
+          pool.nodes.values[client.slots.values[0].local.id]
+                  .connected_id == client.slots.values[0].remote.id);
+
+  REQUIRE_EQ(peer_destroy(&host), KIT_OK);
+  REQUIRE_EQ(peer_destroy(&client), KIT_OK);
+  REQUIRE_EQ(peer_pool_destroy(&pool), KIT_OK);
+
+  peer_sockets_cleanup();
+}
+#endif
+
+#ifndef PEER_DISABLE_SYSTEM_SOCKETS
+TEST("socket pool connection refused") {
+  peer_sockets_init();
+
+  peer_socket_pool_t pool;
+  REQUIRE_EQ(peer_pool_init(&pool, kit_alloc_default()), KIT_OK);
+
+  pool.connect_sockets = 1;
+
+  peer_t host, client;
+  REQUIRE_EQ(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()),
+             KIT_OK);
+  REQUIRE_EQ(
+      peer_init(&client, PEER_CLIENT, NULL, kit_alloc_default()),
+      KIT_OK);
+
+  REQUIRE_EQ(
+      peer_pool_open(&pool, &host, PEER_UDP_IPv4, PEER_ANY_PORT, 1),
+      KIT_OK);
+
+  REQUIRE(pool.nodes.size == 1 &&
+          peer_pool_connect(
+              &pool, &client, PEER_UDP_IPv4, SZ("127.0.0.1"),
+              pool.nodes.values[0].local_port) == KIT_OK);
+
+  /*  Nobody listens on the host port, connected client socket
+   *  receives ICMP port unreachable errors.
+   */
+  REQUIRE(pool.nodes.size >= 1);
+  closesocket(pool.nodes.values[0].socket);
+  pool.nodes.values[0].socket = INVALID_SOCKET;
+
+  for (ptrdiff_t i = 0; i < 4; i++)
+    REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+
+#  ifdef __linux__
+  REQUIRE(pool.stats.receive_errors > 0);
+#  endif
+
+  REQUIRE_EQ(peer_destroy(&host), KIT_OK);
+  REQUIRE_EQ(peer_destroy(&client), KIT_OK);
+  REQUIRE_EQ(peer_pool_destroy(&pool), KIT_OK);
+
+  peer_sockets_cleanup();
+}
+#endif
+
+#ifndef PEER_DISABLE_SYSTEM_SOCKETS
+TEST("socket pool authenticated packets") {
+  peer_sockets_init();
+
+  peer_socket_pool_t pool;
+  REQUIRE_EQ(peer_pool_init(&pool, kit_alloc_default()), KIT_OK);
+
+  uint8_t mac_key[PEER_SIPHASH_KEY_SIZE];
+  uint8_t cipher_key[PEER_CHACHA20_KEY_SIZE];
+  memset(mac_key, 1, sizeof mac_key);
+  memset(cipher_key, 2, sizeof cipher_key);
+
+  REQUIRE_EQ(peer_pool_set_mac_key(&pool, mac_key), KIT_OK);
+  REQUIRE_EQ(peer_pool_set_key(&pool, cipher_key, 0), KIT_OK);
+
+  peer_t host, client;
+  REQUIRE_EQ(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()),
+             KIT_OK);
+  REQUIRE_EQ(
+      peer_init(&client, PEER_CLIENT, NULL, kit_alloc_default()),
+      KIT_OK);
+
+  REQUIRE_EQ(
+      peer_pool_open(&pool, &host, PEER_UDP_IPv4, PEER_ANY_PORT, 2),
+      KIT_OK);
+
+  REQUIRE(pool.nodes.size == 2 &&
+          peer_pool_connect(
+              &pool, &client, PEER_UDP_IPv4, SZ("127.0.0.1"),
+              pool.nodes.values[0].local_port) == KIT_OK);
+
+  /*  Forged packet is dropped before it reaches the host.
+   */
+
+  uint8_t junk[PEER_N_PACKET_OPTIONAL + 40];
+  memset(junk, 0, sizeof junk);
+  peer_write_u8(junk + PEER_N_PACKET_MODE, PEER_PACKET_MODE_TAG);
+  peer_write_u16(junk + PEER_N_PACKET_SIZE, sizeof junk);
+
+  struct sockaddr_in name;
+  memset(&name, 0, sizeof name);
+  name.sin_family      = AF_INET;
+  name.sin_port        = htons(pool.nodes.values[0].local_port);
+  name.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  REQUIRE(sendto(pool.nodes.values[1].socket, (char const *) junk,
+                 sizeof junk, 0, (struct sockaddr const *) &name,
+                 sizeof name) == sizeof junk);
+
+  REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  REQUIRE_EQ(pool.stats.rejected, 1);
+
+  for (ptrdiff_t i = 0; i < 4; i++) {
+    REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+    REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  }
+
+  uint8_t          data[]   = { 1, 2, 3 };
+  peer_chunk_ref_t data_ref = { .size = 3, .values = data };
+  REQUIRE_EQ(peer_queue(&host, data_ref), KIT_OK);
+
+  REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+
+  REQUIRE_EQ(client.queue.messages.size, 1);
+  REQUIRE_EQ(pool.stats.rejected, 1);
+
+  REQUIRE_EQ(peer_destroy(&host), KIT_OK);
+  REQUIRE_EQ(peer_destroy(&client), KIT_OK);
+  REQUIRE_EQ(peer_pool_destroy(&pool), KIT_OK);
+
+  peer_sockets_cleanup();
+}
+#endif
+
+#ifndef PEER_DISABLE_SYSTEM_SOCKETS
+TEST("socket pool drops packets it can't decrypt") {
+  peer_sockets_init();
+
+  peer_socket_pool_t pool;
+  REQUIRE_EQ(peer_pool_init(&pool, kit_alloc_default()), KIT_OK);
+
+  uint8_t cipher_key[PEER_CHACHA20_KEY_SIZE];
+  memset(cipher_key, 2, sizeof cipher_key);
+  REQUIRE_EQ(peer_pool_set_key(&pool, cipher_key, 0), KIT_OK);
+
+  peer_t host, client;
+  REQUIRE_EQ(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()),
+             KIT_OK);
+  REQUIRE_EQ(
+      peer_init(&client, PEER_CLIENT, NULL, kit_alloc_default()),
+      KIT_OK);
+
+  REQUIRE_EQ(
+      peer_pool_open(&pool, &host, PEER_UDP_IPv4, PEER_ANY_PORT, 2),
+      KIT_OK);
+
+  REQUIRE(pool.nodes.size == 2 &&
+          peer_pool_connect(
+              &pool, &client, PEER_UDP_IPv4, SZ("127.0.0.1"),
+              pool.nodes.values[0].local_port) == KIT_OK);
+
+  /*  Plain and short datagrams are dropped without an error.
+   */
+
+  uint8_t plain[PEER_N_PACKET_OPTIONAL + 40];
+  memset(plain, 0, sizeof plain);
+  peer_write_u16(plain + PEER_N_PACKET_SIZE, sizeof plain);
+
+  struct sockaddr_in name;
+  memset(&name, 0, sizeof name);
+  name.sin_family      = AF_INET;
+  name.sin_port        = htons(pool.nodes.values[0].local_port);
+  name.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  REQUIRE(sendto(pool.nodes.values[1].socket, (char const *) plain,
+                 sizeof plain, 0, (struct sockaddr const *) &name,
+                 sizeof name) == sizeof plain);
+  REQUIRE(sendto(pool.nodes.values[1].socket, (char const *) plain,
+                 3, 0, (struct sockaddr const *) &name,
+                 sizeof name) == 3);
+
+  REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  REQUIRE_EQ(pool.stats.rejected, 2);
+
+  for (ptrdiff_t i = 0; i < 4; i++) {
+    REQUIRE_EQ(peer_pool_tick(&pool, &client, 0), KIT_OK);
+    REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  }
+
+  REQUIRE(host.slots.size == 2 &&
+          host.slots.values[1].state == PEER_SLOT_READY);
+  REQUIRE_EQ(pool.stats.rejected, 2);
+
+  REQUIRE_EQ(peer_destroy(&host), KIT_OK);
+  REQUIRE_EQ(peer_destroy(&client), KIT_OK);
+  REQUIRE_EQ(peer_pool_destroy(&pool), KIT_OK);
+
+  peer_sockets_cleanup();
+}
+#endif
+
+#ifndef PEER_DISABLE_SYSTEM_SOCKETS
+TEST("socket pool multiplexed host") {
+  peer_sockets_init();
+
+  /*  Each peer has its own pool, so clients don't receive
+   *  packets sent to the host.
+   */
+
+  peer_socket_pool_t pool, client_pool[2];
+  REQUIRE_EQ(peer_pool_init(&pool, kit_alloc_default()), KIT_OK);
+  for (ptrdiff_t i = 0; i < 2; i++)
+    REQUIRE_EQ(peer_pool_init(client_pool + i, kit_alloc_default()),
+               KIT_OK);
+
+  pool.connect_sockets = 1;
+
+  peer_t host, client[2];
+  REQUIRE_EQ(peer_init(&host, PEER_HOST, NULL, kit_alloc_default()),
+             KIT_OK);
+  for (ptrdiff_t i = 0; i < 2; i++)
+    REQUIRE_EQ(
+        peer_init(client + i, PEER_CLIENT, NULL, kit_alloc_default()),
+        KIT_OK);
+
+  REQUIRE_EQ(peer_pool_open_multiplexed(&pool, &host, PEER_UDP_IPv4,
+                                        PEER_ANY_PORT, 1, 3),
+             KIT_OK);
+  REQUIRE(pool.nodes.size == 1 && host.slots.size == 3);
+  REQUIRE(pool.nodes.values[0].slot_count == 3);
+
+  for (ptrdiff_t i = 0; i < 2; i++)
+    REQUIRE_EQ(peer_pool_connect(client_pool + i, client + i,
+                                 PEER_UDP_IPv4, SZ("127.0.0.1"),
+                                 pool.nodes.values[0].local_port),
+               KIT_OK);
+
+  for (ptrdiff_t k = 0; k < 4; k++) {
+    for (ptrdiff_t i = 0; i < 2; i++)
+      REQUIRE_EQ(peer_pool_tick(client_pool + i, client + i, 0),
+                 KIT_OK);
+    REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  }
+
+  REQUIRE(host.slots.values[1].state == PEER_SLOT_READY);
+  REQUIRE(host.slots.values[2].state == PEER_SLOT_READY);
+
+  uint8_t          data[]   = { 1, 2, 3 };
+  peer_chunk_ref_t data_ref = { .size = 3, .values = data };
+  REQUIRE_EQ(peer_queue(&host, data_ref), KIT_OK);
+
+  REQUIRE_EQ(peer_pool_tick(&pool, &host, 0), KIT_OK);
+  for (ptrdiff_t i = 0; i < 2; i++)
+    REQUIRE_EQ(peer_pool_tick(client_pool + i, client + i, 0),
+               KIT_OK);
+
+  REQUIRE_EQ(client[0].queue.messages.size, 1);
+  REQUIRE_EQ(client[1].queue.messages.size, 1);
+
+  /*  Shared socket is never connected.
+   */
+  REQUIRE(pool.nodes.values[0].connected_id == PEER_UNDEFINED);
+
+  REQUIRE_EQ(peer_destroy(&host), KIT_OK);
+  for (ptrdiff_t i = 0; i < 2; i++)
+    REQUIRE_EQ(peer_destroy(client + i), KIT_OK);
+  REQUIRE_EQ(peer_pool_destroy(&pool), KIT_OK);
+  for (ptrdiff_t i = 0; i < 2; i++)
+    REQUIRE_EQ(peer_pool_destroy(client_pool + i), KIT_OK);
+
+  peer_sockets_cleanup();
+}
+#endif